@@ -34,6 +34,7 @@
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <dbus/dbus-shell.h>
 #include <dbus/dbus-spawn.h>
 #include <dbus/dbus-timeout.h>
@@ -55,13 +56,22 @@ struct BusActivation
                               */
   DBusHashTable *directories;
   DBusHashTable *environment;
+  unsigned int lazy : 1; /**< index service files by name, parse on first use */
 };
 
+/* Service directories and their parsed entries are kept across
+ * reloads, so unchanged files are not parsed again. This is only an
+ * in-memory cache: a cache file would need a location that the system
+ * bus can write and trust, and the first scan at startup still reads
+ * every file (unless activation->lazy is set).
+ */
 typedef struct
 {
   int refcount;
   char *dir_c;
   DBusHashTable *entries;
+  unsigned long mtime;   /**< mtime of the directory at the last full scan */
+  long scan_time;        /**< when that scan was, or 0 if it can't be trusted */
 } BusServiceDirectory;
 
 typedef struct
@@ -72,16 +82,22 @@ typedef struct
   char *user;
   char *systemd_service;
   unsigned long mtime;
+  unsigned long size;
   BusServiceDirectory *s_dir;
   char *filename;
 } BusActivationEntry;
 
+/* An entry that has only been indexed by its file name has no exec yet */
+#define ENTRY_IS_LOADED(entry) ((entry)->exec != NULL)
+
+#define SERVICE_FILE_SUFFIX ".service"
+
 typedef struct BusPendingActivationEntry BusPendingActivationEntry;
 
 struct BusPendingActivationEntry
 {
   DBusMessage *activation_message;
-  DBusConnection *connection;
+  DBusConnection *connection; /**< NULL if queued by the bus itself */
 
   dbus_bool_t auto_activation;
 };
@@ -100,7 +116,6 @@ typedef struct
   unsigned int timeout_added : 1;
 } BusPendingActivation;
 
-#if 0
 static BusServiceDirectory *
 bus_service_directory_ref (BusServiceDirectory *dir)
 {
@@ -110,7 +125,6 @@ bus_service_directory_ref (BusServiceDirectory *dir)
 
   return dir;
 }
-#endif
 
 static void
 bus_service_directory_unref (BusServiceDirectory *dir)
@@ -134,6 +148,9 @@ bus_service_directory_unref (BusServiceDirectory *dir)
 static void
 bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
 {
+  if (entry == NULL)
+    return;
+
   if (entry->activation_message)
     dbus_message_unref (entry->activation_message);
 
@@ -143,6 +160,14 @@ bus_pending_activation_entry_free (BusPendingActivationEntry *entry)
   dbus_free (entry);
 }
 
+/* Whether anyone is still around to be told about this entry */
+static dbus_bool_t
+bus_pending_activation_entry_is_live (BusPendingActivationEntry *entry)
+{
+  return entry->connection == NULL ||
+    dbus_connection_get_is_connected (entry->connection);
+}
+
 static BusPendingActivation *
 bus_pending_activation_ref (BusPendingActivation *pending_activation)
 {
@@ -294,6 +319,18 @@ update_desktop_file_entry (BusActivation       *activation,
                                     error))
     goto out;
 
+  /* Entries were indexed under the name taken from the file name */
+  if (activation->lazy &&
+      (_dbus_string_get_length (filename) !=
+         (int) (strlen (name) + strlen (SERVICE_FILE_SUFFIX)) ||
+       strncmp (_dbus_string_get_const_data (filename), name, strlen (name)) != 0))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Service file \"%s\" should be named \"%s" SERVICE_FILE_SUFFIX "\"\n",
+                      _dbus_string_get_const_data (&file_path), name);
+      goto out;
+    }
+
   if (!bus_desktop_file_get_string (desktop_file,
                                     DBUS_SERVICE_SECTION,
                                     DBUS_SERVICE_EXEC,
@@ -394,19 +431,22 @@ update_desktop_file_entry (BusActivation       *activation,
           goto out;
         }
 
-      if (!_dbus_hash_table_insert_string (activation->entries, entry->name, bus_activation_entry_ref (entry)))
+      /* each table holds a reference, taken once the insertion worked */
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name, entry))
         {
           BUS_SET_OOM (error);
           goto out;
         }
+      bus_activation_entry_ref (entry);
 
-      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, bus_activation_entry_ref (entry)))
+      if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, entry))
         {
           /* Revert the insertion in the entries table */
           _dbus_hash_table_remove_string (activation->entries, entry->name);
           BUS_SET_OOM (error);
           goto out;
         }
+      bus_activation_entry_ref (entry);
 
       _dbus_verbose ("Added \"%s\" to list of services\n", entry->name);
     }
@@ -443,18 +483,23 @@ update_desktop_file_entry (BusActivation       *activation,
       systemd_service = NULL;
 
       if (!_dbus_hash_table_insert_string (activation->entries,
-                                           entry->name, bus_activation_entry_ref(entry)))
+                                           entry->name, entry))
         {
           BUS_SET_OOM (error);
           /* Also remove path to entries hash since we want this in sync with
-           * the entries hash table */
+           * the entries hash table; the file is still there, so the
+           * directory has to be scanned again to find it.
+           */
           _dbus_hash_table_remove_string (entry->s_dir->entries,
                                           entry->filename);
+          entry->s_dir->scan_time = 0;
           goto out;
         }
+      bus_activation_entry_ref (entry);
     }
 
   entry->mtime = stat_buf.mtime;
+  entry->size = stat_buf.size;
   retval = TRUE;
 
 out:
@@ -471,6 +516,107 @@ out:
   return retval;
 }
 
+/* Adds an entry for a service file without reading it, using the
+ * name in the file name. The specification requires service files on
+ * the system bus to be named after the service they provide, and the
+ * launch helper relies on it, so the file is only parsed once the
+ * service is activated.
+ */
+static dbus_bool_t
+index_service_file (BusActivation       *activation,
+                    BusServiceDirectory *s_dir,
+                    const DBusString    *filename,
+                    DBusError           *error)
+{
+  BusActivationEntry *entry;
+  int name_len;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  name_len = _dbus_string_get_length (filename) - strlen (SERVICE_FILE_SUFFIX);
+
+  if (!_dbus_validate_bus_name (filename, 0, name_len) ||
+      _dbus_string_get_byte (filename, 0) == ':')
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Service file \"%s\" is not named after a bus name\n",
+                      _dbus_string_get_const_data (filename));
+      return FALSE;
+    }
+
+  entry = dbus_new0 (BusActivationEntry, 1);
+  if (entry == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  entry->refcount = 1;
+  entry->s_dir = s_dir;
+
+  if (!_dbus_string_copy_data (filename, &entry->name) ||
+      !_dbus_string_copy_data (filename, &entry->filename))
+    {
+      bus_activation_entry_unref (entry);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  entry->name[name_len] = '\0';
+
+  if (_dbus_hash_table_lookup_string (activation->entries, entry->name))
+    {
+      dbus_set_error (error, DBUS_ERROR_FAILED,
+                      "Service %s already exists in activation entry list\n",
+                      entry->name);
+      bus_activation_entry_unref (entry);
+      return FALSE;
+    }
+
+  if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                       bus_activation_entry_ref (entry)))
+    {
+      bus_activation_entry_unref (entry);
+      bus_activation_entry_unref (entry);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!_dbus_hash_table_insert_string (s_dir->entries, entry->filename, entry))
+    {
+      _dbus_hash_table_remove_string (activation->entries, entry->name);
+      bus_activation_entry_unref (entry);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  _dbus_verbose ("Indexed \"%s\" in list of services\n", entry->name);
+
+  return TRUE;
+}
+
+/* Drops an entry that turned out not to be usable after it was
+ * indexed. Its file is still there, so the directory has to be
+ * scanned again in case the file is fixed without the directory
+ * changing.
+ */
+static void
+remove_unloaded_entry (BusActivation      *activation,
+                       BusActivationEntry *entry)
+{
+  _dbus_assert (!ENTRY_IS_LOADED (entry));
+
+  if (_dbus_hash_table_lookup_string (activation->entries, entry->name) == entry)
+    _dbus_hash_table_remove_string (activation->entries, entry->name);
+
+  entry->s_dir->scan_time = 0;
+  _dbus_hash_table_remove_string (entry->s_dir->entries, entry->filename);
+}
+
+/* Checks that an entry is still up to date with its file. If
+ * updated_entry is NULL the caller is only refreshing the cache, and
+ * an entry that has only been indexed is left unparsed.
+ */
 static dbus_bool_t
 check_service_file (BusActivation       *activation,
                     BusActivationEntry  *entry,
@@ -514,9 +660,16 @@ check_service_file (BusActivation       *activation,
       retval = TRUE;
       goto out;
     }
+  else if (!ENTRY_IS_LOADED (entry) && activation->lazy &&
+           updated_entry == NULL)
+    {
+      retval = TRUE;
+      goto out;
+    }
   else
     {
-      if (stat_buf.mtime > entry->mtime)
+      if (!ENTRY_IS_LOADED (entry) ||
+          stat_buf.mtime != entry->mtime || stat_buf.size != entry->size)
         {
           BusDesktopFile *desktop_file;
           DBusError tmp_error;
@@ -536,6 +689,11 @@ check_service_file (BusActivation       *activation,
                   goto out;
                 }
               dbus_error_free (&tmp_error);
+              if (!ENTRY_IS_LOADED (entry))
+                {
+                  remove_unloaded_entry (activation, entry);
+                  tmp_entry = NULL;
+                }
               retval = TRUE;
               goto out;
             }
@@ -553,6 +711,11 @@ check_service_file (BusActivation       *activation,
                   goto out;
                 }
               dbus_error_free (&tmp_error);
+              if (!ENTRY_IS_LOADED (entry))
+                {
+                  remove_unloaded_entry (activation, entry);
+                  tmp_entry = NULL;
+                }
               retval = TRUE;
               goto out;
             }
@@ -586,6 +749,9 @@ update_directory (BusActivation       *activation,
   dbus_bool_t retval;
   BusActivationEntry *entry;
   DBusString full_path;
+  DBusStat dir_stat;
+  dbus_bool_t have_dir_stat, complete;
+  long now, usec;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -594,6 +760,27 @@ update_directory (BusActivation       *activation,
 
   _dbus_string_init_const (&dir, s_dir->dir_c);
 
+  /* Adding, removing or renaming a file changes the directory's mtime,
+   * so if it is the same as at the last complete scan, every file in
+   * the directory already has an entry and there is nothing to read.
+   * The mtime only has a resolution of one second, so it is only
+   * trusted if the scan finished in a later second than that.
+   * Changes to the files themselves are caught by check_service_file().
+   */
+  _dbus_get_real_time (&now, &usec);
+  have_dir_stat = _dbus_stat (&dir, &dir_stat, NULL);
+
+  if (have_dir_stat && s_dir->scan_time != 0 &&
+      dir_stat.mtime == s_dir->mtime &&
+      (long) s_dir->mtime < s_dir->scan_time)
+    {
+      _dbus_verbose ("Directory %s unchanged since last scan\n", s_dir->dir_c);
+      return TRUE;
+    }
+
+  s_dir->scan_time = 0;
+  complete = TRUE;
+
   if (!_dbus_string_init (&filename))
     {
       BUS_SET_OOM (error);
@@ -644,6 +831,26 @@ update_directory (BusActivation       *activation,
           continue;
         }
 
+      if (activation->lazy)
+        {
+          if (!index_service_file (activation, s_dir, &filename, &tmp_error))
+            {
+              _dbus_verbose ("Could not index %s: %s\n",
+                             _dbus_string_get_const_data (&filename),
+                             tmp_error.message);
+
+              if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+                {
+                  dbus_move_error (&tmp_error, error);
+                  goto out;
+                }
+
+              dbus_error_free (&tmp_error);
+            }
+
+          continue;
+        }
+
       if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
           !_dbus_concat_dir_and_file (&full_path, &filename))
         {
@@ -665,6 +872,8 @@ update_directory (BusActivation       *activation,
               goto out;
             }
 
+          /* it might be fixed without the directory changing */
+          complete = FALSE;
           dbus_error_free (&tmp_error);
           continue;
         }
@@ -686,6 +895,7 @@ update_directory (BusActivation       *activation,
               goto out;
             }
 
+          complete = FALSE;
           dbus_error_free (&tmp_error);
           continue;
         }
@@ -703,6 +913,12 @@ update_directory (BusActivation       *activation,
       goto out;
     }
 
+  if (have_dir_stat && complete)
+    {
+      s_dir->mtime = dir_stat.mtime;
+      s_dir->scan_time = now;
+    }
+
   retval = TRUE;
 
  out:
@@ -719,6 +935,158 @@ update_directory (BusActivation       *activation,
   return retval;
 }
 
+/**
+ * Checks whether a directory is one of the service directories that
+ * activation entries are loaded from.
+ *
+ * @param activation the activation
+ * @param dir the directory, exactly as given in the configuration
+ * @returns #TRUE if it is a service directory
+ */
+dbus_bool_t
+bus_activation_is_service_dir (BusActivation *activation,
+                               const char    *dir)
+{
+  return _dbus_hash_table_lookup_string (activation->directories, dir) != NULL;
+}
+
+/**
+ * Brings the activation entry for a single .service file up to date
+ * after the file was created, changed, renamed or removed, without
+ * rescanning the rest of its directory or reloading the configuration.
+ * Files that don't end in .service, or aren't in a service directory,
+ * are ignored; so are files that can't be parsed, as in
+ * update_directory().
+ *
+ * @param activation the activation
+ * @param dir the service directory
+ * @param filename the name of the file within dir
+ * @param error return location for errors
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_activation_update_service_file (BusActivation *activation,
+                                    const char    *dir,
+                                    const char    *filename,
+                                    DBusError     *error)
+{
+  BusServiceDirectory *s_dir;
+  BusActivationEntry *entry;
+  BusDesktopFile *desktop_file;
+  DBusString file_str, full_path;
+  DBusStat stat_buf;
+  DBusError tmp_error;
+  dbus_bool_t retval;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  s_dir = _dbus_hash_table_lookup_string (activation->directories, dir);
+  if (s_dir == NULL)
+    return TRUE;
+
+  _dbus_string_init_const (&file_str, filename);
+
+  if (!_dbus_string_ends_with_c_str (&file_str, ".service"))
+    {
+      _dbus_verbose ("Skipping non-.service file %s\n", filename);
+      return TRUE;
+    }
+
+  if (!_dbus_string_init (&full_path))
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  retval = FALSE;
+
+  if (!_dbus_string_append (&full_path, s_dir->dir_c) ||
+      !_dbus_concat_dir_and_file (&full_path, &file_str))
+    {
+      BUS_SET_OOM (error);
+      goto out;
+    }
+
+  if (!_dbus_stat (&full_path, &stat_buf, NULL))
+    {
+      entry = _dbus_hash_table_lookup_string (s_dir->entries, filename);
+      if (entry != NULL)
+        {
+          _dbus_verbose ("Service file %s went away, removing from cache\n",
+                         _dbus_string_get_const_data (&full_path));
+
+          _dbus_hash_table_remove_string (activation->entries, entry->name);
+          _dbus_hash_table_remove_string (s_dir->entries, entry->filename);
+        }
+
+      retval = TRUE;
+      goto out;
+    }
+
+  dbus_error_init (&tmp_error);
+
+  if (activation->lazy)
+    {
+      /* a changed file is noticed by check_service_file() on next use */
+      if (_dbus_hash_table_lookup_string (s_dir->entries, filename) == NULL &&
+          !index_service_file (activation, s_dir, &file_str, &tmp_error))
+        {
+          if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+            {
+              dbus_move_error (&tmp_error, error);
+              goto out;
+            }
+
+          dbus_error_free (&tmp_error);
+        }
+
+      retval = TRUE;
+      goto out;
+    }
+
+  desktop_file = bus_desktop_file_load (&full_path, &tmp_error);
+  if (desktop_file == NULL)
+    {
+      _dbus_verbose ("Could not load %s: %s\n",
+                     _dbus_string_get_const_data (&full_path),
+                     tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      dbus_error_free (&tmp_error);
+      retval = TRUE;
+      goto out;
+    }
+
+  if (!update_desktop_file_entry (activation, s_dir, &file_str, desktop_file,
+                                  &tmp_error))
+    {
+      _dbus_verbose ("Could not update %s in activation entry list: %s\n",
+                     _dbus_string_get_const_data (&full_path),
+                     tmp_error.message);
+
+      if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY))
+        {
+          bus_desktop_file_free (desktop_file);
+          dbus_move_error (&tmp_error, error);
+          goto out;
+        }
+
+      dbus_error_free (&tmp_error);
+    }
+
+  bus_desktop_file_free (desktop_file);
+  retval = TRUE;
+
+ out:
+  _dbus_string_free (&full_path);
+  return retval;
+}
+
 static dbus_bool_t
 populate_environment (BusActivation *activation)
 {
@@ -782,6 +1150,80 @@ out:
   return retval;
 }
 
+/* Puts the entries a directory had before a reload back into the new
+ * activation->entries, then drops the ones whose files have gone away
+ * and re-reads the ones that changed, so that update_directory() only
+ * has to parse files it hasn't seen.
+ */
+static dbus_bool_t
+reuse_directory_entries (BusActivation       *activation,
+                         BusServiceDirectory *s_dir,
+                         DBusError           *error)
+{
+  DBusHashIter iter;
+  DBusList *to_check;
+  BusActivationEntry *entry, *existing;
+  dbus_bool_t retval;
+
+  retval = FALSE;
+  to_check = NULL;
+
+  _dbus_hash_iter_init (s_dir->entries, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      entry = _dbus_hash_iter_get_value (&iter);
+      existing = _dbus_hash_table_lookup_string (activation->entries,
+                                                 entry->name);
+
+      if (existing == entry)
+        continue;
+
+      if (existing != NULL)
+        {
+          /* a directory earlier in the list now provides this name;
+           * if that changes, only a rescan will find this file again
+           */
+          _dbus_hash_iter_remove_entry (&iter);
+          s_dir->scan_time = 0;
+          continue;
+        }
+
+      if (!_dbus_hash_table_insert_string (activation->entries, entry->name,
+                                           bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+
+      if (!_dbus_list_append (&to_check, bus_activation_entry_ref (entry)))
+        {
+          bus_activation_entry_unref (entry);
+          BUS_SET_OOM (error);
+          goto out;
+        }
+    }
+
+  while ((entry = _dbus_list_pop_first (&to_check)) != NULL)
+    {
+      if (!check_service_file (activation, entry, NULL, error))
+        {
+          bus_activation_entry_unref (entry);
+          goto out;
+        }
+
+      bus_activation_entry_unref (entry);
+    }
+
+  retval = TRUE;
+
+ out:
+  while ((entry = _dbus_list_pop_first (&to_check)) != NULL)
+    bus_activation_entry_unref (entry);
+
+  return retval;
+}
+
 dbus_bool_t
 bus_activation_reload (BusActivation     *activation,
                        const DBusString  *address,
@@ -790,6 +1232,19 @@ bus_activation_reload (BusActivation     *activation,
 {
   DBusList      *link;
   char          *dir;
+  DBusHashTable *old_directories;
+
+  /* Directories that are still configured keep their entries, so that
+   * files that haven't changed since the last load aren't parsed again.
+   */
+  old_directories = activation->directories;
+  activation->directories = NULL;
+
+  /* Only the system bus requires service files to be named after the
+   * service, so only there can they be indexed without reading them.
+   */
+  if (activation->context != NULL)
+    activation->lazy = bus_context_get_servicehelper (activation->context) != NULL;
 
   if (activation->server_address != NULL)
     dbus_free (activation->server_address);
@@ -809,8 +1264,6 @@ bus_activation_reload (BusActivation     *activation,
       goto failed;
     }
 
-  if (activation->directories != NULL)
-    _dbus_hash_table_unref (activation->directories);
   activation->directories = _dbus_hash_table_new (DBUS_HASH_STRING, NULL,
                                                   (DBusFreeFunction)bus_service_directory_unref);
 
@@ -825,8 +1278,30 @@ bus_activation_reload (BusActivation     *activation,
     {
       BusServiceDirectory *s_dir;
 
-      dir = _dbus_strdup ((const char *) link->data);
-      if (!dir)
+      s_dir = NULL;
+      if (old_directories != NULL)
+        s_dir = _dbus_hash_table_lookup_string (old_directories, link->data);
+
+      if (s_dir != NULL)
+        {
+          bus_service_directory_ref (s_dir);
+
+          if (!_dbus_hash_table_insert_string (activation->directories,
+                                               s_dir->dir_c, s_dir))
+            {
+              bus_service_directory_unref (s_dir);
+              BUS_SET_OOM (error);
+              goto failed;
+            }
+
+          if (!reuse_directory_entries (activation, s_dir, error))
+            goto failed;
+
+          goto update;
+        }
+
+      dir = _dbus_strdup ((const char *) link->data);
+      if (!dir)
         {
           BUS_SET_OOM (error);
           goto failed;
@@ -860,6 +1335,7 @@ bus_activation_reload (BusActivation     *activation,
           goto failed;
         }
 
+    update:
       /* only fail on OOM, it is ok if we can't read the directory */
       if (!update_directory (activation, s_dir, error))
         {
@@ -872,8 +1348,16 @@ bus_activation_reload (BusActivation     *activation,
       link = _dbus_list_get_next_link (directories, link);
     }
 
+  if (old_directories != NULL)
+    _dbus_hash_table_unref (old_directories);
+
   return TRUE;
  failed:
+  if (activation->directories == NULL)
+    activation->directories = old_directories;
+  else if (old_directories != NULL)
+    _dbus_hash_table_unref (old_directories);
+
   return FALSE;
 }
 
@@ -1106,7 +1590,7 @@ bus_activation_service_created (BusActivation  *activation,
       BusPendingActivationEntry *entry = link->data;
       DBusList *next = _dbus_list_get_next_link (&pending_activation->entries, link);
 
-      if (dbus_connection_get_is_connected (entry->connection))
+      if (bus_pending_activation_entry_is_live (entry))
         {
           /* Only send activation replies to regular activation requests. */
           if (!entry->auto_activation)
@@ -1158,7 +1642,9 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
                                                       DBusError      *error)
 {
   BusPendingActivation *pending_activation;
+  DBusConnection *addressed_recipient;
   DBusList *link;
+  int n_queued, n_delivered;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -1169,29 +1655,67 @@ bus_activation_send_pending_auto_activation_messages (BusActivation  *activation
   if (!pending_activation)
     return TRUE;
 
+  /* Everything queued while the service was starting is delivered as
+   * one batch, in the transaction that made it the owner, so the new
+   * owner sees the messages in the order they were sent. They all go
+   * to the same place, so look that up once.
+   */
+  addressed_recipient = bus_service_get_primary_owners_connection (service);
+  n_queued = 0;
+  n_delivered = 0;
+
   link = _dbus_list_get_first_link (&pending_activation->entries);
   while (link != NULL)
     {
       BusPendingActivationEntry *entry = link->data;
       DBusList *next = _dbus_list_get_next_link (&pending_activation->entries, link);
 
-      if (entry->auto_activation && dbus_connection_get_is_connected (entry->connection))
+      if (entry->auto_activation)
+        n_queued += 1;
+
+      if (entry->auto_activation && bus_pending_activation_entry_is_live (entry))
         {
-          DBusConnection *addressed_recipient;
+          DBusError tmp_error;
 
-          addressed_recipient = bus_service_get_primary_owners_connection (service);
+          dbus_error_init (&tmp_error);
 
           /* Resume dispatching where we left off in bus_dispatch() */
           if (!bus_dispatch_matches (transaction,
                                      entry->connection,
                                      addressed_recipient,
-                                     entry->activation_message, error))
-            goto error;
+                                     entry->activation_message, &tmp_error))
+            {
+              /* One sender's message being refused (by policy, say)
+               * must not stop the others from being delivered, nor
+               * fail the name acquisition that triggered the batch.
+               * Only running out of memory does that.
+               */
+              if (dbus_error_has_name (&tmp_error, DBUS_ERROR_NO_MEMORY) ||
+                  (entry->connection != NULL &&
+                   !bus_transaction_send_error_reply (transaction,
+                                                      entry->connection,
+                                                      &tmp_error,
+                                                      entry->activation_message)))
+                {
+                  dbus_error_free (&tmp_error);
+                  BUS_SET_OOM (error);
+                  goto error;
+                }
+
+              dbus_error_free (&tmp_error);
+            }
+          else
+            {
+              n_delivered += 1;
+            }
         }
 
       link = next;
     }
 
+  _dbus_verbose ("Delivered %d of %d queued messages to %s\n",
+                 n_delivered, n_queued, bus_service_get_name (service));
+
   if (!add_restore_pending_to_transaction (transaction, pending_activation))
     {
       _dbus_verbose ("Could not add cancel hook to transaction to revert removing pending activation\n");
@@ -1233,7 +1757,8 @@ try_send_activation_failure (BusPendingActivation *pending_activation,
       BusPendingActivationEntry *entry = link->data;
       DBusList *next = _dbus_list_get_next_link (&pending_activation->entries, link);
 
-      if (dbus_connection_get_is_connected (entry->connection))
+      if (entry->connection != NULL &&
+          dbus_connection_get_is_connected (entry->connection))
         {
           if (!bus_transaction_send_error_reply (transaction,
                                                  entry->connection,
@@ -1542,6 +2067,7 @@ activation_find_entry (BusActivation *activation,
                        DBusError     *error)
 {
   BusActivationEntry *entry;
+  dbus_bool_t check;
 
   entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
   if (!entry)
@@ -1551,8 +2077,16 @@ activation_find_entry (BusActivation *activation,
 
       entry = _dbus_hash_table_lookup_string (activation->entries,
                                               service_name);
+
+      /* entries found by the rescan have just been read, unless they
+       * were only indexed
+       */
+      check = entry != NULL && !ENTRY_IS_LOADED (entry);
     }
   else
+    check = TRUE;
+
+  if (check)
     {
       BusActivationEntry *updated_entry;
 
@@ -1696,9 +2230,21 @@ bus_activation_activate_service (BusActivation  *activation,
       return FALSE;
     }
 
-  entry = activation_find_entry (activation, service_name, error);
-  if (!entry)
-    return FALSE;
+  /* Requests for a name that is already being activated are coalesced
+   * into the pending activation, which has everything we need; only the
+   * first request pays for finding the service file and spawning.
+   */
+  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
+  was_pending_activation = (pending_activation != NULL);
+
+  if (was_pending_activation)
+    entry = NULL;
+  else
+    {
+      entry = activation_find_entry (activation, service_name, error);
+      if (!entry)
+        return FALSE;
+    }
 
   /* Bypass the registry lookup if we're auto-activating, bus_dispatch would not
    * call us if the service is already active.
@@ -1746,26 +2292,36 @@ bus_activation_activate_service (BusActivation  *activation,
         }
     }
 
-  pending_activation_entry = dbus_new0 (BusPendingActivationEntry, 1);
-  if (!pending_activation_entry)
+  /* A preactivation has no message to deliver and nobody to reply to */
+  if (activation_message != NULL)
     {
-      _dbus_verbose ("Failed to create pending activation entry\n");
-      BUS_SET_OOM (error);
-      return FALSE;
-    }
+      pending_activation_entry = dbus_new0 (BusPendingActivationEntry, 1);
+      if (!pending_activation_entry)
+        {
+          _dbus_verbose ("Failed to create pending activation entry\n");
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
 
-  pending_activation_entry->auto_activation = auto_activation;
+      pending_activation_entry->auto_activation = auto_activation;
 
-  pending_activation_entry->activation_message = activation_message;
-  dbus_message_ref (activation_message);
-  pending_activation_entry->connection = connection;
-  dbus_connection_ref (connection);
+      pending_activation_entry->activation_message = activation_message;
+      dbus_message_ref (activation_message);
+      pending_activation_entry->connection = connection;
+      if (connection != NULL)
+        dbus_connection_ref (connection);
+    }
+  else
+    {
+      _dbus_assert (connection == NULL);
+      pending_activation_entry = NULL;
+    }
 
-  /* Check if the service is being activated */
-  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations, service_name);
-  was_pending_activation = (pending_activation != NULL);
   if (was_pending_activation)
     {
+      if (pending_activation_entry == NULL)
+        return TRUE;
+
       if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
         {
           _dbus_verbose ("Failed to append a new entry to pending activation\n");
@@ -1855,18 +2411,21 @@ bus_activation_activate_service (BusActivation  *activation,
 
       pending_activation->timeout_added = TRUE;
 
-      if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
+      if (pending_activation_entry != NULL)
         {
-          _dbus_verbose ("Failed to add entry to just-created pending activation\n");
+          if (!_dbus_list_append (&pending_activation->entries, pending_activation_entry))
+            {
+              _dbus_verbose ("Failed to add entry to just-created pending activation\n");
 
-          BUS_SET_OOM (error);
-          bus_pending_activation_unref (pending_activation);
-          bus_pending_activation_entry_free (pending_activation_entry);
-          return FALSE;
-        }
+              BUS_SET_OOM (error);
+              bus_pending_activation_unref (pending_activation);
+              bus_pending_activation_entry_free (pending_activation_entry);
+              return FALSE;
+            }
 
-      pending_activation->n_entries += 1;
-      pending_activation->activation->n_pending_activations += 1;
+          pending_activation->n_entries += 1;
+          pending_activation->activation->n_pending_activations += 1;
+        }
 
       if (!_dbus_hash_table_insert_string (activation->pending_activations,
                                            pending_activation->service_name,
@@ -1951,7 +2510,7 @@ bus_activation_activate_service (BusActivation  *activation,
             }
 
           /* Check whether systemd is already connected */
-          registry = bus_connection_get_registry (connection);
+          registry = bus_context_get_registry (activation->context);
           _dbus_string_init_const (&service_string, "org.freedesktop.systemd1");
           service = bus_registry_lookup (registry, &service_string);
 
@@ -2132,6 +2691,45 @@ bus_activation_activate_service (BusActivation  *activation,
   return TRUE;
 }
 
+/**
+ * Starts activating a service on behalf of the bus itself, before
+ * any client has asked for it. Does nothing if the name already has
+ * an owner or is being activated.
+ */
+dbus_bool_t
+bus_activation_preactivate_service (BusActivation *activation,
+                                    const char    *service_name,
+                                    DBusError     *error)
+{
+  BusTransaction *transaction;
+  DBusString service_str;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  _dbus_string_init_const (&service_str, service_name);
+  if (bus_registry_lookup (bus_context_get_registry (activation->context),
+                           &service_str) != NULL)
+    return TRUE;
+
+  transaction = bus_transaction_new (activation->context);
+  if (transaction == NULL)
+    {
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (!bus_activation_activate_service (activation, NULL, transaction, TRUE,
+                                        NULL, service_name, error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      bus_transaction_cancel_and_free (transaction);
+      return FALSE;
+    }
+
+  bus_transaction_execute_and_free (transaction);
+  return TRUE;
+}
+
 dbus_bool_t
 bus_activation_list_services (BusActivation *activation,
 			      char        ***listp,
@@ -2226,6 +2824,7 @@ dbus_activation_systemd_failure (BusActivation *activation,
 #ifdef DBUS_BUILD_TESTS
 
 #include <stdio.h>
+#include <sys/time.h>
 
 #define SERVICE_NAME_1 "MyService1"
 #define SERVICE_NAME_2 "MyService2"
@@ -2235,6 +2834,26 @@ dbus_activation_systemd_failure (BusActivation *activation,
 #define SERVICE_FILE_2 "service-2.service"
 #define SERVICE_FILE_3 "service-3.service"
 
+#define SERVICE_NAME_LAZY     "org.dbus.TestLazy"
+#define SERVICE_NAME_MISNAMED "org.dbus.TestMisnamed"
+
+/* Number of requests queued on the activation of service_name, or
+ * -1 if it is not being activated
+ */
+int
+bus_activation_get_n_pending_entries (BusActivation *activation,
+                                      const char    *service_name)
+{
+  BusPendingActivation *pending_activation;
+
+  pending_activation = _dbus_hash_table_lookup_string (activation->pending_activations,
+                                                       service_name);
+  if (pending_activation == NULL)
+    return -1;
+
+  return pending_activation->n_entries;
+}
+
 static dbus_bool_t
 test_create_service_file (DBusString *dir,
                           const char *filename,
@@ -2273,6 +2892,54 @@ out:
   return ret_val;
 }
 
+/* Sets the mtime of dir, or of filename in it, to seconds_ago seconds
+ * before now, so the tests don't have to wait for the clock to move on
+ */
+static dbus_bool_t
+test_set_mtime (DBusString *dir,
+                const char *filename,
+                long        seconds_ago)
+{
+  DBusString     file_name, full_path;
+  struct timeval times[2];
+  long           now, usec;
+  dbus_bool_t    ret_val;
+
+  ret_val = TRUE;
+
+  if (!_dbus_string_init (&full_path))
+    return FALSE;
+
+  if (!_dbus_string_append (&full_path, _dbus_string_get_const_data (dir)))
+    {
+      ret_val = FALSE;
+      goto out;
+    }
+
+  if (filename != NULL)
+    {
+      _dbus_string_init_const (&file_name, filename);
+
+      if (!_dbus_concat_dir_and_file (&full_path, &file_name))
+        {
+          ret_val = FALSE;
+          goto out;
+        }
+    }
+
+  _dbus_get_real_time (&now, &usec);
+  times[0].tv_sec = now - seconds_ago;
+  times[0].tv_usec = 0;
+  times[1] = times[0];
+
+  if (utimes (_dbus_string_get_const_data (&full_path), times) < 0)
+    ret_val = FALSE;
+
+out:
+  _dbus_string_free (&full_path);
+  return ret_val;
+}
+
 static dbus_bool_t
 test_remove_service_file (DBusString *dir, const char *filename)
 {
@@ -2453,6 +3120,7 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   BusActivation *activation;
   DBusString     address;
   DBusList      *directories;
+  DBusError      error;
   CheckData      d;
 
   directories = NULL;
@@ -2501,13 +3169,20 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Removed service file", oom_test, &d))
     return FALSE;
 
-  /* Check for updated service file */
-
-  _dbus_sleep_milliseconds (1000); /* Sleep a second to make sure the mtime is updated */
-
-  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_3, "exec-3"))
+  /* Check for updated service file. It has the same size as before,
+   * so give it an mtime that can't be the one it was read with.
+   */
+  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_3, "exec-3") ||
+      !test_set_mtime (dir, SERVICE_FILE_1, 3600))
     return FALSE;
 
+  /* Editing a file in place doesn't change the directory, so the
+   * new name is only seen once the entry for the old one is checked
+   */
+  dbus_error_init (&error);
+  activation_find_entry (activation, SERVICE_NAME_1, &error);
+  dbus_error_free (&error);
+
   d.expecting_find = TRUE;
   d.service_name = SERVICE_NAME_3;
 
@@ -2520,6 +3195,335 @@ do_service_reload_test (DBusString *dir, dbus_bool_t oom_test)
   if (!do_test ("Updated service file, part 2", oom_test, &d))
     return FALSE;
 
+  /* Check that a reload keeps unchanged entries and drops stale ones */
+  dbus_error_init (&error);
+  if (!bus_activation_reload (activation, &address, &directories, &error))
+    _dbus_assert_not_reached ("could not reload service directory");
+
+  d.expecting_find = TRUE;
+  d.service_name = SERVICE_NAME_3;
+
+  if (!do_test ("Reloaded service directory", oom_test, &d))
+    return FALSE;
+
+  if (!test_remove_service_file (dir, SERVICE_FILE_1))
+    return FALSE;
+
+  if (!bus_activation_reload (activation, &address, &directories, &error))
+    _dbus_assert_not_reached ("could not reload service directory");
+
+  d.expecting_find = FALSE;
+  d.service_name = SERVICE_NAME_3;
+
+  if (!do_test ("Reloaded without service file", oom_test, &d))
+    return FALSE;
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  return TRUE;
+}
+
+typedef struct
+{
+  BusActivation *activation;
+  const char    *dir;
+  const char    *filename;
+} UpdateData;
+
+static dbus_bool_t
+update_func (void *data)
+{
+  UpdateData *d;
+  DBusError   error;
+
+  d = data;
+  dbus_error_init (&error);
+
+  if (!bus_activation_update_service_file (d->activation, d->dir,
+                                           d->filename, &error))
+    {
+      if (!dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+        return FALSE;
+
+      dbus_error_free (&error);
+    }
+
+  return TRUE;
+}
+
+static void
+do_update (const char *description, dbus_bool_t oom_test, UpdateData *data)
+{
+  dbus_bool_t err;
+
+  if (oom_test)
+    err = !_dbus_test_oom_handling (description, update_func, data);
+  else
+    err = !update_func (data);
+
+  if (err)
+    _dbus_assert_not_reached ("Test failed");
+
+  /* The last run may have failed part way; one that succeeds has to
+   * bring the entry up to date from any state that left behind
+   */
+  if (oom_test && !update_func (data))
+    _dbus_assert_not_reached ("Test failed");
+}
+
+/* Checks the entry table directly, since activation_find_entry()
+ * would rescan the directory and hide a missed update
+ */
+static void
+check_entry (BusActivation *activation,
+             const char    *service_name,
+             const char    *exec)
+{
+  BusActivationEntry *entry;
+
+  entry = _dbus_hash_table_lookup_string (activation->entries, service_name);
+
+  if (exec == NULL)
+    {
+      if (entry != NULL)
+        _dbus_assert_not_reached ("activation entry was not removed");
+    }
+  else
+    {
+      if (entry == NULL || strcmp (entry->exec, exec) != 0)
+        _dbus_assert_not_reached ("activation entry was not updated");
+    }
+}
+
+static dbus_bool_t
+do_update_service_file_test (DBusString *dir, dbus_bool_t oom_test)
+{
+  BusActivation *activation;
+  DBusString     address;
+  DBusList      *directories;
+  UpdateData     d;
+
+  directories = NULL;
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  if (!activation)
+    return FALSE;
+
+  d.activation = activation;
+  d.dir = _dbus_string_get_const_data (dir);
+
+  if (!bus_activation_is_service_dir (activation, d.dir))
+    _dbus_assert_not_reached ("service directory not known");
+
+  check_entry (activation, SERVICE_NAME_1, "exec-1");
+
+  /* Created file */
+  if (!test_create_service_file (dir, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  d.filename = SERVICE_FILE_2;
+  do_update ("Update for created service file", oom_test, &d);
+
+  check_entry (activation, SERVICE_NAME_1, "exec-1");
+  check_entry (activation, SERVICE_NAME_2, "exec-2");
+
+  /* Changed file, now providing a different name */
+  if (!test_create_service_file (dir, SERVICE_FILE_1, SERVICE_NAME_3, "exec-3"))
+    return FALSE;
+
+  d.filename = SERVICE_FILE_1;
+  do_update ("Update for changed service file", oom_test, &d);
+
+  check_entry (activation, SERVICE_NAME_1, NULL);
+  check_entry (activation, SERVICE_NAME_3, "exec-3");
+  check_entry (activation, SERVICE_NAME_2, "exec-2");
+
+  /* Files not ending in .service are left alone */
+  if (!test_create_service_file (dir, "service-4.tmp", SERVICE_NAME_1, "exec-4"))
+    return FALSE;
+
+  d.filename = "service-4.tmp";
+  do_update ("Update for non-service file", oom_test, &d);
+
+  check_entry (activation, SERVICE_NAME_1, NULL);
+
+  if (!test_remove_service_file (dir, "service-4.tmp"))
+    return FALSE;
+
+  /* Removed file */
+  if (!test_remove_service_file (dir, SERVICE_FILE_2))
+    return FALSE;
+
+  d.filename = SERVICE_FILE_2;
+  do_update ("Update for removed service file", oom_test, &d);
+
+  check_entry (activation, SERVICE_NAME_2, NULL);
+  check_entry (activation, SERVICE_NAME_3, "exec-3");
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+do_shadowed_service_test (DBusString *dir, dbus_bool_t oom_test)
+{
+  BusActivation *activation;
+  DBusString     address, dir2;
+  DBusList      *directories;
+  DBusError      error;
+  CheckData      d;
+
+  directories = NULL;
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_string_init (&dir2))
+    return FALSE;
+
+  if (!_dbus_string_copy (dir, 0, &dir2, 0) ||
+      !_dbus_string_append (&dir2, "-shadowed") ||
+      !_dbus_create_directory (&dir2, NULL))
+    return FALSE;
+
+  if (!test_create_service_file (&dir2, SERVICE_FILE_2, SERVICE_NAME_2, "exec-2"))
+    return FALSE;
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)) ||
+      !_dbus_list_append (&directories, _dbus_string_get_data (&dir2)))
+    return FALSE;
+
+  /* Date the second directory back so that its mtime is trusted, and
+   * it isn't scanned again unless something says so
+   */
+  if (!test_set_mtime (&dir2, NULL, 3600))
+    return FALSE;
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  if (!activation)
+    return FALSE;
+
+  d.activation = activation;
+
+  /* The first directory starts providing the name too and wins */
+  if (!test_create_service_file (dir, SERVICE_FILE_3, SERVICE_NAME_2, "exec-3"))
+    return FALSE;
+
+  dbus_error_init (&error);
+  if (!bus_activation_reload (activation, &address, &directories, &error))
+    _dbus_assert_not_reached ("could not reload service directories");
+
+  d.expecting_find = TRUE;
+  d.service_name = SERVICE_NAME_2;
+
+  if (!do_test ("Shadowing service file", oom_test, &d))
+    return FALSE;
+
+  /* Once it stops, the file in the second directory is used again */
+  if (!test_remove_service_file (dir, SERVICE_FILE_3))
+    return FALSE;
+
+  /* the first lookup only finds out that the file is gone */
+  dbus_error_init (&error);
+  activation_find_entry (activation, SERVICE_NAME_2, &error);
+  dbus_error_free (&error);
+
+  if (!do_test ("Shadowed service file", oom_test, &d))
+    return FALSE;
+
+  bus_activation_unref (activation);
+  _dbus_list_clear (&directories);
+
+  if (!test_remove_directory (&dir2))
+    return FALSE;
+
+  _dbus_string_free (&dir2);
+
+  return TRUE;
+}
+
+static dbus_bool_t
+do_lazy_service_test (DBusString *dir, dbus_bool_t oom_test)
+{
+  BusActivation      *activation;
+  BusActivationEntry *entry;
+  DBusString          address;
+  DBusList           *directories;
+  DBusError           error;
+  CheckData           d;
+
+  directories = NULL;
+  _dbus_string_init_const (&address, "");
+
+  if (!_dbus_list_append (&directories, _dbus_string_get_data (dir)))
+    return FALSE;
+
+  activation = bus_activation_new (NULL, &address, &directories, NULL);
+  if (!activation)
+    return FALSE;
+
+  activation->lazy = TRUE;
+  d.activation = activation;
+
+  if (!test_create_service_file (dir, SERVICE_NAME_LAZY ".service",
+                                 SERVICE_NAME_LAZY, "exec-lazy") ||
+      !test_create_service_file (dir, SERVICE_NAME_MISNAMED ".service",
+                                 SERVICE_NAME_2, "exec-misnamed"))
+    return FALSE;
+
+  _dbus_sleep_milliseconds (1000); /* Sleep a second so the directory mtime is trusted */
+
+  dbus_error_init (&error);
+  if (!bus_activation_reload (activation, &address, &directories, &error))
+    _dbus_assert_not_reached ("could not reload service directory");
+
+  /* Both are listed without having been read */
+  entry = _dbus_hash_table_lookup_string (activation->entries,
+                                          SERVICE_NAME_LAZY);
+  if (entry == NULL || ENTRY_IS_LOADED (entry))
+    _dbus_assert_not_reached ("service file was not indexed by name");
+
+  if (_dbus_hash_table_lookup_string (activation->entries,
+                                      SERVICE_NAME_MISNAMED) == NULL)
+    _dbus_assert_not_reached ("service file was not indexed by name");
+
+  d.expecting_find = TRUE;
+  d.service_name = SERVICE_NAME_LAZY;
+
+  if (!do_test ("Lazily loaded service file", oom_test, &d))
+    return FALSE;
+
+  entry = _dbus_hash_table_lookup_string (activation->entries,
+                                          SERVICE_NAME_LAZY);
+  if (entry == NULL || strcmp (entry->exec, "exec-lazy") != 0)
+    _dbus_assert_not_reached ("service file was not loaded on first use");
+
+  /* A file not named after its service is dropped once it is read */
+  d.expecting_find = FALSE;
+  d.service_name = SERVICE_NAME_MISNAMED;
+
+  if (!do_test ("Misnamed service file", oom_test, &d))
+    return FALSE;
+
+  /* Fixing the file doesn't change the directory, but is still seen */
+  if (!test_create_service_file (dir, SERVICE_NAME_MISNAMED ".service",
+                                 SERVICE_NAME_MISNAMED, "exec-misnamed"))
+    return FALSE;
+
+  d.expecting_find = TRUE;
+
+  if (!do_test ("Fixed misnamed service file", oom_test, &d))
+    return FALSE;
+
+  if (!test_remove_service_file (dir, SERVICE_NAME_LAZY ".service") ||
+      !test_remove_service_file (dir, SERVICE_NAME_MISNAMED ".service"))
+    return FALSE;
+
   bus_activation_unref (activation);
   _dbus_list_clear (&directories);
 
@@ -2561,6 +3565,45 @@ bus_activation_service_reload_test (const DBusString *test_data_dir)
       /* Do nothing? */
     }
 
+  /* Do tests of updating single activation entries */
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_update_service_file_test (&directory, FALSE))
+    _dbus_assert_not_reached ("service file update test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_update_service_file_test (&directory, TRUE))
+    _dbus_assert_not_reached ("service file update test failed");
+
+  /* Do tests of a name provided by more than one directory */
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_shadowed_service_test (&directory, FALSE))
+    _dbus_assert_not_reached ("shadowed service file test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_shadowed_service_test (&directory, TRUE))
+    _dbus_assert_not_reached ("shadowed service file test failed");
+
+  /* Do tests of indexing service files by name */
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_lazy_service_test (&directory, FALSE))
+    _dbus_assert_not_reached ("lazy service file test failed");
+
+  if (!init_service_reload_test (&directory))
+    _dbus_assert_not_reached ("could not initiate service reload test");
+
+  if (!do_lazy_service_test (&directory, TRUE))
+    _dbus_assert_not_reached ("lazy service file test failed");
+
   /* Cleanup test directory */
   if (!cleanup_service_reload_test (&directory))
     return FALSE;
@@ -36,6 +36,12 @@ dbus_bool_t bus_activation_reload           (BusActivation     *activation,
 						const DBusString  *address,
 						DBusList         **directories,
 						DBusError         *error);
+dbus_bool_t bus_activation_is_service_dir   (BusActivation     *activation,
+						const char        *dir);
+dbus_bool_t bus_activation_update_service_file (BusActivation  *activation,
+						const char        *dir,
+						const char        *filename,
+						DBusError         *error);
 BusActivation* bus_activation_ref              (BusActivation     *activation);
 void           bus_activation_unref            (BusActivation     *activation);
 
@@ -50,6 +56,9 @@ dbus_bool_t    bus_activation_activate_service (BusActivation     *activation,
 						DBusMessage       *activation_message,
 						const char        *service_name,
 						DBusError         *error);
+dbus_bool_t    bus_activation_preactivate_service (BusActivation  *activation,
+						   const char     *service_name,
+						   DBusError      *error);
 dbus_bool_t    bus_activation_service_created  (BusActivation     *activation,
 						const char        *service_name,
 						BusTransaction    *transaction,
@@ -65,5 +74,10 @@ dbus_bool_t    bus_activation_send_pending_auto_activation_messages (BusActivati
 								     BusTransaction    *transaction,
 								     DBusError         *error);
 
+#ifdef DBUS_BUILD_TESTS
+int            bus_activation_get_n_pending_entries (BusActivation     *activation,
+						     const char        *service_name);
+#endif
+
 
 #endif /* BUS_ACTIVATION_H */
@@ -35,6 +35,7 @@
 #include "signals.h"
 #include "selinux.h"
 #include "dir-watch.h"
+#include "metrics.h"
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-hash.h>
 #include <dbus/dbus-credentials.h>
@@ -64,6 +65,10 @@ struct BusContext
   BusRegistry *registry;
   BusPolicy *policy;
   BusMatchmaker *matchmaker;
+  BusConfigParser *config_parser;
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+  BusMetrics *metrics;
+#endif
   BusLimits limits;
   unsigned int fork : 1;
   unsigned int syslog : 1;
@@ -472,6 +477,25 @@ process_config_first_time_only (BusContext       *context,
         }
     }
 
+  /* Serve statistics to scrapers, if configured */
+
+  if (bus_config_parser_get_metrics_address (parser) != NULL)
+    {
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+      context->metrics =
+        bus_metrics_new (context, bus_config_parser_get_metrics_address (parser),
+                         error);
+      if (context->metrics == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+#else
+      _dbus_warn ("<metrics_listen> ignored: statistics support was not "
+                  "compiled in\n");
+#endif
+    }
+
   context->fork = bus_config_parser_get_fork (parser);
   context->syslog = bus_config_parser_get_syslog (parser);
   context->keep_umask = bus_config_parser_get_keep_umask (parser);
@@ -490,6 +514,94 @@ process_config_first_time_only (BusContext       *context,
   return FALSE;
 }
 
+typedef struct
+{
+  BusPolicyDiff *diff;
+  int n_refreshed;
+  int n_failed;
+} RefreshPolicyData;
+
+static dbus_bool_t
+refresh_policy_foreach (DBusConnection *connection,
+                        void           *data)
+{
+  RefreshPolicyData *d = data;
+  DBusError error;
+
+  if (!bus_policy_diff_affects_connection (d->diff, connection))
+    return TRUE;
+
+  dbus_error_init (&error);
+  if (bus_connection_refresh_policy (connection, &error))
+    d->n_refreshed += 1;
+  else
+    {
+      _dbus_verbose ("Connection %s keeps its old policy: %s\n",
+                     bus_connection_get_name (connection), error.message);
+      dbus_error_free (&error);
+      d->n_failed += 1;
+    }
+
+  return TRUE;
+}
+
+/* Replaces the bus policy. On reload, the new policy is compared with
+ * the old one and only connections whose client policy could differ
+ * have it rebuilt; if nothing changed, the old policy is kept.
+ */
+static dbus_bool_t
+install_policy (BusContext *context,
+                BusPolicy  *policy,
+                DBusError  *error)
+{
+  RefreshPolicyData data;
+
+  _dbus_assert (policy != NULL);
+
+  if (context->policy == NULL || context->connections == NULL)
+    {
+      if (context->policy)
+        bus_policy_unref (context->policy);
+      context->policy = policy;
+      return TRUE;
+    }
+
+  data.diff = bus_policy_diff_new (context->policy, policy);
+  if (data.diff == NULL)
+    {
+      bus_policy_unref (policy);
+      BUS_SET_OOM (error);
+      return FALSE;
+    }
+
+  if (bus_policy_diff_is_empty (data.diff))
+    {
+      _dbus_verbose ("Policy unchanged by reload\n");
+      bus_policy_diff_free (data.diff);
+      bus_policy_unref (policy);
+      return TRUE;
+    }
+
+  bus_policy_unref (context->policy);
+  context->policy = policy;
+
+  data.n_refreshed = 0;
+  data.n_failed = 0;
+  bus_connections_foreach_active (context->connections,
+                                  refresh_policy_foreach, &data);
+  bus_policy_diff_free (data.diff);
+
+  _dbus_verbose ("Policy changed by reload, refreshed %d connections\n",
+                 data.n_refreshed);
+
+  if (data.n_failed > 0)
+    bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                     "%d connections could not be given the reloaded policy "
+                     "and keep the previous one", data.n_failed);
+
+  return TRUE;
+}
+
 /* This code gets executed every time the config files
  * are parsed: both during BusContext construction
  * and on reloads. This function is slightly screwy
@@ -525,10 +637,13 @@ process_config_every_time (BusContext      *context,
   /* get our limits and timeout lengths */
   bus_config_parser_get_limits (parser, &context->limits);
 
-  if (context->policy)
-    bus_policy_unref (context->policy);
-  context->policy = bus_config_parser_steal_policy (parser);
-  _dbus_assert (context->policy != NULL);
+  if (!install_policy (context,
+                       bus_policy_ref (bus_config_parser_get_policy (parser)),
+                       error))
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
 
   /* We have to build the address backward, so that
    * <listen> later in the config file have priority
@@ -674,7 +789,7 @@ process_config_postinit (BusContext      *context,
 
   raise_file_descriptor_limit (context);
 
-  service_context_table = bus_config_parser_steal_service_context_table (parser);
+  service_context_table = bus_config_parser_get_service_context_table (parser);
   if (!bus_registry_set_service_context_table (context->registry,
 					       service_context_table))
     {
@@ -682,8 +797,6 @@ process_config_postinit (BusContext      *context,
       return FALSE;
     }
 
-  _dbus_hash_table_unref (service_context_table);
-
   /* We need to monitor both the configuration directories and directories
    * containing .service files.
    */
@@ -764,6 +877,12 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
+  if (!bus_config_parser_add_source (parser, config_file))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
   if (!process_config_first_time_only (context, parser, address, flags, error))
     {
       _DBUS_ASSERT_ERROR_IS_SET (error);
@@ -923,11 +1042,9 @@ bus_context_new (const DBusString *config_file,
       goto failed;
     }
 
-  if (parser != NULL)
-    {
-      bus_config_parser_unref (parser);
-      parser = NULL;
-    }
+  /* Keep the parser so that a reload can tell whether anything changed */
+  context->config_parser = parser;
+  parser = NULL;
 
   /* Here we change our credentials if required,
    * as soon as we've set up our sockets and pidfile
@@ -975,18 +1092,44 @@ bus_context_reload_config (BusContext *context,
 {
   BusConfigParser *parser;
   DBusString config_file;
-  dbus_bool_t ret;
+  dbus_bool_t ret, reparsed;
 
   /* Flush the user database cache */
   _dbus_flush_caches ();
 
   ret = FALSE;
-  _dbus_string_init_const (&config_file, context->config_file);
-  parser = bus_config_load (&config_file, TRUE, NULL, error);
-  if (parser == NULL)
+  parser = NULL;
+
+  /* If no configuration file changed and every user and group in it
+   * still resolves the same way, parsing the files again would give
+   * the same result, so the parser we have is used again. Everything
+   * else, including the SELinux contexts and the client policies
+   * that depend on group membership, is still redone.
+   */
+  if (context->config_parser != NULL &&
+      !bus_config_parser_sources_changed (context->config_parser) &&
+      !bus_config_parser_names_changed (context->config_parser))
     {
-      _DBUS_ASSERT_ERROR_IS_SET (error);
-      goto failed;
+      parser = bus_config_parser_ref (context->config_parser);
+      reparsed = FALSE;
+    }
+  else
+    {
+      _dbus_string_init_const (&config_file, context->config_file);
+      parser = bus_config_load (&config_file, TRUE, NULL, error);
+      if (parser == NULL)
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          goto failed;
+        }
+
+      if (!bus_config_parser_add_source (parser, &config_file))
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+
+      reparsed = TRUE;
     }
 
   if (!process_config_every_time (context, parser, TRUE, error))
@@ -1001,7 +1144,16 @@ bus_context_reload_config (BusContext *context,
     }
   ret = TRUE;
 
-  bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
+  if (context->config_parser != NULL)
+    bus_config_parser_unref (context->config_parser);
+  context->config_parser = parser;
+  parser = NULL;
+
+  if (reparsed)
+    bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Reloaded configuration");
+  else
+    bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                     "Reloaded configuration (files unchanged, not parsed again)");
  failed:
   if (!ret)
     bus_context_log (context, DBUS_SYSTEM_LOG_INFO, "Unable to reload configuration: %s", error->message);
@@ -1033,6 +1185,43 @@ shutdown_server (BusContext *context,
   dbus_server_disconnect (server);
 }
 
+/**
+ * Starts activating every service named by a <preactivate> element.
+ * All of them are spawned before any is waited for, so they come up
+ * in parallel; clients asking for one of the names meanwhile join
+ * the pending activation. Failures only affect the service concerned
+ * and are logged.
+ */
+void
+bus_context_preactivate_services (BusContext *context)
+{
+  DBusList **names;
+  DBusList *link;
+
+  if (context->config_parser == NULL)
+    return;
+
+  names = bus_config_parser_get_preactivate_names (context->config_parser);
+
+  for (link = _dbus_list_get_first_link (names);
+       link != NULL;
+       link = _dbus_list_get_next_link (names, link))
+    {
+      DBusError error;
+
+      dbus_error_init (&error);
+
+      if (!bus_activation_preactivate_service (context->activation,
+                                               link->data, &error))
+        {
+          bus_context_log (context, DBUS_SYSTEM_LOG_INFO,
+                           "Could not preactivate service '%s': %s",
+                           (const char *) link->data, error.message);
+          dbus_error_free (&error);
+        }
+    }
+}
+
 void
 bus_context_shutdown (BusContext  *context)
 {
@@ -1045,6 +1234,14 @@ bus_context_shutdown (BusContext  *context)
 
       link = _dbus_list_get_next_link (&context->servers, link);
     }
+
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+  if (context->metrics)
+    {
+      bus_metrics_free (context->metrics);
+      context->metrics = NULL;
+    }
+#endif
 }
 
 BusContext *
@@ -1103,6 +1300,12 @@ bus_context_unref (BusContext *context)
           context->policy = NULL;
         }
 
+      if (context->config_parser)
+        {
+          bus_config_parser_unref (context->config_parser);
+          context->config_parser = NULL;
+        }
+
       if (context->loop)
         {
           _dbus_loop_unref (context->loop);
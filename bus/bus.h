@@ -81,6 +81,7 @@ BusContext*       bus_context_new                                (const DBusStri
                                                                   DBusError        *error);
 dbus_bool_t       bus_context_reload_config                      (BusContext       *context,
 								  DBusError        *error);
+void              bus_context_preactivate_services               (BusContext       *context);
 void              bus_context_shutdown                           (BusContext       *context);
 BusContext*       bus_context_ref                                (BusContext       *context);
 void              bus_context_unref                              (BusContext       *context);
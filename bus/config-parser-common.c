@@ -127,6 +127,14 @@ bus_config_parser_element_name_to_type (const char *name)
     {
       return ELEMENT_ALLOW_ANONYMOUS;
     }
+  else if (strcmp (name, "metrics_listen") == 0)
+    {
+      return ELEMENT_METRICS_LISTEN;
+    }
+  else if (strcmp (name, "preactivate") == 0)
+    {
+      return ELEMENT_PREACTIVATE;
+    }
   return ELEMENT_NONE;
 }
 
@@ -181,6 +189,10 @@ bus_config_parser_element_type_to_name (ElementType type)
       return "keep_umask";
     case ELEMENT_ALLOW_ANONYMOUS:
       return "allow_anonymous";
+    case ELEMENT_METRICS_LISTEN:
+      return "metrics_listen";
+    case ELEMENT_PREACTIVATE:
+      return "preactivate";
     }
 
   _dbus_assert_not_reached ("bad element type");
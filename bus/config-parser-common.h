@@ -49,7 +49,9 @@ typedef enum
   ELEMENT_STANDARD_SYSTEM_SERVICEDIRS,
   ELEMENT_KEEP_UMASK,
   ELEMENT_SYSLOG,
-  ELEMENT_ALLOW_ANONYMOUS
+  ELEMENT_ALLOW_ANONYMOUS,
+  ELEMENT_METRICS_LISTEN,
+  ELEMENT_PREACTIVATE
 } ElementType;
 
 ElementType bus_config_parser_element_name_to_type (const char *element_name);
@@ -31,6 +31,7 @@
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-sysdeps.h>
+#include <dbus/dbus-marshal-validate.h>
 #include <string.h>
 
 typedef enum
@@ -77,6 +78,30 @@ typedef struct
 
 } Element;
 
+/**
+ * A file or directory the configuration was read from, with the
+ * stat information it had at the time.
+ */
+typedef struct
+{
+  char *path;            /**< Path as it was read */
+  dbus_bool_t exists;    /**< FALSE if the file was missing */
+  unsigned long mtime;   /**< Modification time */
+  unsigned long size;    /**< Size in bytes */
+} ConfigSource;
+
+/**
+ * A user or group name the configuration refers to, with what it
+ * resolved to at the time.
+ */
+typedef struct
+{
+  char *name;            /**< Name as written in the configuration */
+  dbus_bool_t is_group;  /**< TRUE for a group, FALSE for a user */
+  dbus_bool_t found;     /**< FALSE if there was no such user or group */
+  unsigned long id;      /**< The uid or gid, if found */
+} ConfigName;
+
 /**
  * Parser for bus configuration file. 
  */
@@ -102,16 +127,26 @@ struct BusConfigParser
 
   DBusList *conf_dirs;   /**< Directories to look for policy configuration in */
 
+  DBusList *preactivate; /**< Names to activate when the bus starts */
+
   BusPolicy *policy;     /**< Security policy */
 
   BusLimits limits;      /**< Limits */
 
   char *pidfile;         /**< PID file */
 
+  char *metrics_address; /**< Address to serve statistics on, or NULL */
+
   DBusList *included_files;  /**< Included files stack */
 
   DBusHashTable *service_context_table; /**< Map service names to SELinux contexts */
 
+  DBusList *sources;     /**< ConfigSource for each file and directory read */
+
+  DBusList *names;       /**< ConfigName for each user and group looked up */
+
+  long load_time;        /**< When the toplevel parser was created */
+
   unsigned int fork : 1; /**< TRUE to fork into daemon mode */
 
   unsigned int syslog : 1; /**< TRUE to enable syslog */
@@ -276,6 +311,85 @@ service_dirs_append_link_unique_or_free (DBusList **service_dirs,
     }
 }
 
+static void
+config_source_free (ConfigSource *source)
+{
+  dbus_free (source->path);
+  dbus_free (source);
+}
+
+static void
+config_name_free (ConfigName *config_name)
+{
+  dbus_free (config_name->name);
+  dbus_free (config_name);
+}
+
+static dbus_bool_t
+resolve_config_name (const char    *name,
+                     dbus_bool_t    is_group,
+                     unsigned long *id_p)
+{
+  DBusString str;
+
+  _dbus_string_init_const (&str, name);
+
+  if (is_group)
+    {
+      dbus_gid_t gid;
+
+      if (!_dbus_parse_unix_group_from_config (&str, &gid))
+        return FALSE;
+
+      *id_p = gid;
+    }
+  else
+    {
+      dbus_uid_t uid;
+
+      if (!_dbus_parse_unix_user_from_config (&str, &uid))
+        return FALSE;
+
+      *id_p = uid;
+    }
+
+  return TRUE;
+}
+
+/* Looks up a user or group named in the configuration, and remembers
+ * the answer so that a reload can tell whether it would change.
+ * Returns FALSE if no memory; *found_p says whether the name exists.
+ */
+static dbus_bool_t
+lookup_config_name (BusConfigParser *parser,
+                    const char      *name,
+                    dbus_bool_t      is_group,
+                    unsigned long   *id_p,
+                    dbus_bool_t     *found_p)
+{
+  ConfigName *config_name;
+
+  config_name = dbus_new0 (ConfigName, 1);
+  if (config_name == NULL)
+    return FALSE;
+
+  config_name->name = _dbus_strdup (name);
+  if (config_name->name == NULL ||
+      !_dbus_list_append (&parser->names, config_name))
+    {
+      config_name_free (config_name);
+      return FALSE;
+    }
+
+  config_name->is_group = is_group;
+  config_name->found = resolve_config_name (name, is_group,
+                                            &config_name->id);
+
+  *id_p = config_name->id;
+  *found_p = config_name->found;
+  return TRUE;
+}
+
 static dbus_bool_t
 merge_included (BusConfigParser *parser,
                 BusConfigParser *included,
@@ -323,6 +437,13 @@ merge_included (BusConfigParser *parser,
       parser->pidfile = included->pidfile;
       included->pidfile = NULL;
     }
+
+  if (included->metrics_address != NULL)
+    {
+      dbus_free (parser->metrics_address);
+      parser->metrics_address = included->metrics_address;
+      included->metrics_address = NULL;
+    }
   
   while ((link = _dbus_list_pop_first_link (&included->listen_on)))
     _dbus_list_append_link (&parser->listen_on, link);
@@ -330,11 +451,20 @@ merge_included (BusConfigParser *parser,
   while ((link = _dbus_list_pop_first_link (&included->mechanisms)))
     _dbus_list_append_link (&parser->mechanisms, link);
 
+  while ((link = _dbus_list_pop_first_link (&included->preactivate)))
+    _dbus_list_append_link (&parser->preactivate, link);
+
   while ((link = _dbus_list_pop_first_link (&included->service_dirs)))
     service_dirs_append_link_unique_or_free (&parser->service_dirs, link);
 
   while ((link = _dbus_list_pop_first_link (&included->conf_dirs)))
     _dbus_list_append_link (&parser->conf_dirs, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->sources)))
+    _dbus_list_append_link (&parser->sources, link);
+
+  while ((link = _dbus_list_pop_first_link (&included->names)))
+    _dbus_list_append_link (&parser->names, link);
   
   return TRUE;
 }
@@ -402,6 +532,9 @@ bus_config_parser_new (const DBusString      *basedir,
     }
   else
     {
+      long tv_usec;
+
+      _dbus_get_real_time (&parser->load_time, &tv_usec);
 
       /* Make up some numbers! woot! */
       parser->limits.max_incoming_bytes = _DBUS_ONE_MEGABYTE * 127;
@@ -490,6 +623,7 @@ bus_config_parser_unref (BusConfigParser *parser)
       dbus_free (parser->servicehelper);
       dbus_free (parser->bus_type);
       dbus_free (parser->pidfile);
+      dbus_free (parser->metrics_address);
       
       _dbus_list_foreach (&parser->listen_on,
                           (DBusForeachFunction) dbus_free,
@@ -497,6 +631,12 @@ bus_config_parser_unref (BusConfigParser *parser)
 
       _dbus_list_clear (&parser->listen_on);
 
+      _dbus_list_foreach (&parser->preactivate,
+                          (DBusForeachFunction) dbus_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->preactivate);
+
       _dbus_list_foreach (&parser->service_dirs,
                           (DBusForeachFunction) dbus_free,
                           NULL);
@@ -514,6 +654,18 @@ bus_config_parser_unref (BusConfigParser *parser)
                           NULL);
 
       _dbus_list_clear (&parser->mechanisms);
+
+      _dbus_list_foreach (&parser->sources,
+                          (DBusForeachFunction) config_source_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->sources);
+
+      _dbus_list_foreach (&parser->names,
+                          (DBusForeachFunction) config_name_free,
+                          NULL);
+
+      _dbus_list_clear (&parser->names);
       
       _dbus_string_free (&parser->basedir);
 
@@ -772,6 +924,32 @@ start_busconfig_child (BusConfigParser   *parser,
           return FALSE;
         }
 
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_METRICS_LISTEN)
+    {
+      if (!check_no_attributes (parser, "metrics_listen", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_METRICS_LISTEN) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
+      return TRUE;
+    }
+  else if (element_type == ELEMENT_PREACTIVATE)
+    {
+      if (!check_no_attributes (parser, "preactivate", attribute_names, attribute_values, error))
+        return FALSE;
+
+      if (push_element (parser, ELEMENT_PREACTIVATE) == NULL)
+        {
+          BUS_SET_OOM (error);
+          return FALSE;
+        }
+
       return TRUE;
     }
   else if (element_type == ELEMENT_AUTH)
@@ -1025,11 +1203,17 @@ start_busconfig_child (BusConfigParser   *parser,
         }
       else if (user != NULL)
         {
-          DBusString username;
-          _dbus_string_init_const (&username, user);
+          dbus_bool_t found;
+
+          if (!lookup_config_name (parser, user, FALSE,
+                                   &e->d.policy.gid_uid_or_at_console,
+                                   &found))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
 
-          if (_dbus_parse_unix_user_from_config (&username,
-                                                 &e->d.policy.gid_uid_or_at_console))
+          if (found)
             e->d.policy.type = POLICY_USER;
           else
             _dbus_warn ("Unknown username \"%s\" in message bus configuration file\n",
@@ -1037,11 +1221,17 @@ start_busconfig_child (BusConfigParser   *parser,
         }
       else if (group != NULL)
         {
-          DBusString group_name;
-          _dbus_string_init_const (&group_name, group);
+          dbus_bool_t found;
 
-          if (_dbus_parse_unix_group_from_config (&group_name,
-                                                  &e->d.policy.gid_uid_or_at_console))
+          if (!lookup_config_name (parser, group, TRUE,
+                                   &e->d.policy.gid_uid_or_at_console,
+                                   &found))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
+          if (found)
             e->d.policy.type = POLICY_GROUP;
           else
             _dbus_warn ("Unknown group \"%s\" in message bus configuration file\n",
@@ -1528,12 +1718,13 @@ append_rule_from_element (BusConfigParser   *parser,
         }
       else
         {
-          DBusString username;
-          dbus_uid_t uid;
-          
-          _dbus_string_init_const (&username, user);
-      
-          if (_dbus_parse_unix_user_from_config (&username, &uid))
+          unsigned long uid;
+          dbus_bool_t found;
+
+          if (!lookup_config_name (parser, user, FALSE, &uid, &found))
+            goto nomem;
+
+          if (found)
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_USER, allow); 
               if (rule == NULL)
@@ -1560,12 +1751,13 @@ append_rule_from_element (BusConfigParser   *parser,
         }
       else
         {
-          DBusString groupname;
-          dbus_gid_t gid;
-          
-          _dbus_string_init_const (&groupname, group);
-          
-          if (_dbus_parse_unix_group_from_config (&groupname, &gid))
+          unsigned long gid;
+          dbus_bool_t found;
+
+          if (!lookup_config_name (parser, group, TRUE, &gid, &found))
+            goto nomem;
+
+          if (found)
             {
               rule = bus_policy_rule_new (BUS_POLICY_RULE_GROUP, allow); 
               if (rule == NULL)
@@ -2024,6 +2216,8 @@ bus_config_parser_end_element (BusConfigParser   *parser,
     case ELEMENT_SERVICEHELPER:
     case ELEMENT_INCLUDEDIR:
     case ELEMENT_LIMIT:
+    case ELEMENT_METRICS_LISTEN:
+    case ELEMENT_PREACTIVATE:
       if (!e->had_content)
         {
           dbus_set_error (error, DBUS_ERROR_FAILED,
@@ -2138,6 +2332,14 @@ include_file (BusConfigParser   *parser,
           ignore_missing)
         {
           dbus_error_free (&tmp_error);
+
+          /* If it turns up later, the configuration has changed */
+          if (!bus_config_parser_add_source (parser, filename))
+            {
+              BUS_SET_OOM (error);
+              return FALSE;
+            }
+
           return TRUE;
         }
       else
@@ -2150,6 +2352,13 @@ include_file (BusConfigParser   *parser,
     {
       _DBUS_ASSERT_ERROR_IS_CLEAR (&tmp_error);
 
+      if (!bus_config_parser_add_source (included, filename))
+        {
+          BUS_SET_OOM (error);
+          bus_config_parser_unref (included);
+          return FALSE;
+        }
+
       if (!merge_included (parser, included, error))
         {
           bus_config_parser_unref (included);
@@ -2276,6 +2485,12 @@ include_dir (BusConfigParser   *parser,
       goto failed;
     }
 
+  /* Files being added to or removed from the directory changes its mtime */
+  if (!bus_config_parser_add_source (parser, dirname))
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
 
   if (!_dbus_string_copy_data (dirname, &s))
     {
@@ -2375,6 +2590,47 @@ bus_config_parser_content (BusConfigParser   *parser,
       }
       break;
 
+    case ELEMENT_METRICS_LISTEN:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        dbus_free (parser->metrics_address);
+        parser->metrics_address = s;
+      }
+      break;
+
+    case ELEMENT_PREACTIVATE:
+      {
+        char *s;
+
+        e->had_content = TRUE;
+
+        if (!_dbus_validate_bus_name (content, 0,
+                                      _dbus_string_get_length (content)) ||
+            _dbus_string_get_byte (content, 0) == ':')
+          {
+            dbus_set_error (error, DBUS_ERROR_FAILED,
+                            "<preactivate> must contain a well-known bus name, not \"%s\"",
+                            _dbus_string_get_const_data (content));
+            return FALSE;
+          }
+
+        if (!_dbus_string_copy_data (content, &s))
+          goto nomem;
+
+        if (!_dbus_list_append (&parser->preactivate, s))
+          {
+            dbus_free (s);
+            goto nomem;
+          }
+      }
+      break;
+
     case ELEMENT_INCLUDE:
       {
         DBusString full_path, selinux_policy_root;
@@ -2663,6 +2919,12 @@ bus_config_parser_get_conf_dirs (BusConfigParser *parser)
   return &parser->conf_dirs;
 }
 
+DBusList**
+bus_config_parser_get_preactivate_names (BusConfigParser *parser)
+{
+  return &parser->preactivate;
+}
+
 dbus_bool_t
 bus_config_parser_get_fork (BusConfigParser   *parser)
 {
@@ -2693,24 +2955,25 @@ bus_config_parser_get_pidfile (BusConfigParser   *parser)
   return parser->pidfile;
 }
 
+const char *
+bus_config_parser_get_metrics_address (BusConfigParser   *parser)
+{
+  return parser->metrics_address;
+}
+
 const char *
 bus_config_parser_get_servicehelper (BusConfigParser   *parser)
 {
   return parser->servicehelper;
 }
 
+/* The policy stays with the parser, so that a reload that finds the
+ * configuration unchanged can install it again
+ */
 BusPolicy*
-bus_config_parser_steal_policy (BusConfigParser *parser)
+bus_config_parser_get_policy (BusConfigParser *parser)
 {
-  BusPolicy *policy;
-
-  _dbus_assert (parser->policy != NULL); /* can only steal the policy 1 time */
-  
-  policy = parser->policy;
-
-  parser->policy = NULL;
-
-  return policy;
+  return parser->policy;
 }
 
 /* Overwrite any limits that were set in the configuration file */
@@ -2722,17 +2985,134 @@ bus_config_parser_get_limits (BusConfigParser *parser,
 }
 
 DBusHashTable*
-bus_config_parser_steal_service_context_table (BusConfigParser *parser)
+bus_config_parser_get_service_context_table (BusConfigParser *parser)
 {
-  DBusHashTable *table;
+  return parser->service_context_table;
+}
+
+/**
+ * Records that the configuration was read from the given file or
+ * directory, along with its current modification time and size.
+ * A file that does not exist is recorded as missing.
+ *
+ * @param parser the parser
+ * @param path the file or directory
+ * @returns #FALSE if no memory
+ */
+dbus_bool_t
+bus_config_parser_add_source (BusConfigParser  *parser,
+                              const DBusString *path)
+{
+  ConfigSource *source;
+  DBusStat stat_buf;
+
+  source = dbus_new0 (ConfigSource, 1);
+  if (source == NULL)
+    return FALSE;
 
-  _dbus_assert (parser->service_context_table != NULL); /* can only steal once */
+  if (!_dbus_string_copy_data (path, &source->path))
+    {
+      dbus_free (source);
+      return FALSE;
+    }
 
-  table = parser->service_context_table;
+  if (_dbus_stat (path, &stat_buf, NULL))
+    {
+      source->exists = TRUE;
+      source->mtime = stat_buf.mtime;
+      source->size = stat_buf.size;
+    }
 
-  parser->service_context_table = NULL;
+  if (!_dbus_list_append (&parser->sources, source))
+    {
+      config_source_free (source);
+      return FALSE;
+    }
 
-  return table;
+  return TRUE;
+}
+
+/**
+ * Checks whether any file or directory the configuration was read
+ * from has changed since, so that reloading would give a different
+ * result. Sources modified in the second the configuration was
+ * loaded are always treated as changed, since the modification
+ * time cannot tell whether the change happened before or after
+ * they were read.
+ *
+ * @param parser a toplevel parser
+ * @returns #TRUE if the configuration needs to be read again
+ */
+dbus_bool_t
+bus_config_parser_sources_changed (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  _dbus_assert (parser->is_toplevel);
+
+  if (parser->sources == NULL)
+    return TRUE;
+
+  for (link = _dbus_list_get_first_link (&parser->sources);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->sources, link))
+    {
+      ConfigSource *source = link->data;
+      DBusString path;
+      DBusStat stat_buf;
+      dbus_bool_t exists;
+
+      _dbus_string_init_const (&path, source->path);
+      exists = _dbus_stat (&path, &stat_buf, NULL);
+
+      if (exists != source->exists)
+        return TRUE;
+
+      if (!exists)
+        continue;
+
+      if (stat_buf.mtime != source->mtime ||
+          stat_buf.size != source->size ||
+          (long) stat_buf.mtime >= parser->load_time)
+        return TRUE;
+    }
+
+  return FALSE;
+}
+
+/**
+ * Checks whether any user or group named in the configuration now
+ * resolves differently, or at all, so that parsing it again would
+ * give a different policy even though no file changed. The caller
+ * should flush the user database cache first.
+ *
+ * @param parser a toplevel parser
+ * @returns #TRUE if the configuration needs to be read again
+ */
+dbus_bool_t
+bus_config_parser_names_changed (BusConfigParser *parser)
+{
+  DBusList *link;
+
+  _dbus_assert (parser->is_toplevel);
+
+  for (link = _dbus_list_get_first_link (&parser->names);
+       link != NULL;
+       link = _dbus_list_get_next_link (&parser->names, link))
+    {
+      ConfigName *config_name = link->data;
+      unsigned long id;
+      dbus_bool_t found;
+
+      found = resolve_config_name (config_name->name,
+                                   config_name->is_group, &id);
+
+      if (found != config_name->found ||
+          (found && id != config_name->id))
+        return TRUE;
+    }
+
+  return FALSE;
 }
 
 #ifdef DBUS_BUILD_TESTS
@@ -3128,6 +3508,9 @@ config_parsers_equal (const BusConfigParser *a,
 
   if (!lists_of_c_strings_equal (a->service_dirs, b->service_dirs))
     return FALSE;
+
+  if (!lists_of_c_strings_equal (a->preactivate, b->preactivate))
+    return FALSE;
   
   /* FIXME: compare policy */
 
@@ -3139,6 +3522,9 @@ config_parsers_equal (const BusConfigParser *a,
   if (!strings_equal_or_both_null (a->pidfile, b->pidfile))
     return FALSE;
 
+  if (!strings_equal_or_both_null (a->metrics_address, b->metrics_address))
+    return FALSE;
+
   if (! bools_equal (a->fork, b->fork))
     return FALSE;
 
@@ -3597,6 +3983,194 @@ test_default_system_servicedirs (void)
   return TRUE;
 }
 		   
+static dbus_bool_t
+test_config_sources (const DBusString *test_data_dir)
+{
+  DBusString full_path;
+  DBusString filename;
+  BusConfigParser *parser;
+  ConfigSource *source;
+  ConfigName *config_name;
+  DBusError error;
+  dbus_bool_t retval;
+
+  retval = FALSE;
+  parser = NULL;
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&full_path))
+    _dbus_assert_not_reached ("couldn't allocate full path");
+
+  _dbus_string_init_const (&filename, "valid-config-files/basic.conf");
+
+  if (!_dbus_string_copy (test_data_dir, 0, &full_path, 0) ||
+      !_dbus_concat_dir_and_file (&full_path, &filename))
+    _dbus_assert_not_reached ("couldn't allocate full path");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    {
+      _dbus_warn ("Failed to load %s: %s\n",
+                  _dbus_string_get_const_data (&full_path), error.message);
+      dbus_error_free (&error);
+      goto finish;
+    }
+
+  if (!bus_config_parser_add_source (parser, &full_path))
+    _dbus_assert_not_reached ("couldn't record source");
+
+  /* basic.conf has an includedir, the files in it, a missing include
+   * and itself
+   */
+  if (_dbus_list_get_length (&parser->sources) < 3)
+    {
+      _dbus_warn ("Expected at least 3 sources, got %d\n",
+                  _dbus_list_get_length (&parser->sources));
+      goto finish;
+    }
+
+  if (bus_config_parser_sources_changed (parser))
+    {
+      _dbus_warn ("Unmodified configuration reported as changed\n");
+      goto finish;
+    }
+
+  source = _dbus_list_get_last (&parser->sources);
+  source->mtime += 1;
+
+  if (!bus_config_parser_sources_changed (parser))
+    {
+      _dbus_warn ("Modified configuration not reported as changed\n");
+      goto finish;
+    }
+
+  source->mtime -= 1;
+  source->exists = FALSE;
+
+  if (!bus_config_parser_sources_changed (parser))
+    {
+      _dbus_warn ("Created configuration file not reported as changed\n");
+      goto finish;
+    }
+
+  source->exists = TRUE;
+
+  /* basic.conf has a policy for root */
+  config_name = _dbus_list_get_last (&parser->names);
+  if (config_name == NULL || strcmp (config_name->name, "root") != 0 ||
+      config_name->is_group || !config_name->found)
+    {
+      _dbus_warn ("User name in configuration not recorded\n");
+      goto finish;
+    }
+
+  if (bus_config_parser_names_changed (parser))
+    {
+      _dbus_warn ("Unchanged user reported as changed\n");
+      goto finish;
+    }
+
+  config_name->id += 1;
+
+  if (!bus_config_parser_names_changed (parser))
+    {
+      _dbus_warn ("Renumbered user not reported as changed\n");
+      goto finish;
+    }
+
+  config_name->id -= 1;
+  config_name->found = FALSE;
+
+  if (!bus_config_parser_names_changed (parser))
+    {
+      _dbus_warn ("Created user not reported as changed\n");
+      goto finish;
+    }
+
+  retval = TRUE;
+
+ finish:
+  if (parser != NULL)
+    bus_config_parser_unref (parser);
+  _dbus_string_free (&full_path);
+
+  return retval;
+}
+
+static const char *test_preactivate_names[] =
+{
+  "org.freedesktop.FrobationaryMeasures",
+  "org.freedesktop.BlahBlahBlah",
+  NULL
+};
+
+static dbus_bool_t
+test_preactivate (const DBusString *test_data_dir)
+{
+  DBusString full_path;
+  DBusString filename;
+  BusConfigParser *parser;
+  DBusList **names;
+  DBusList *link;
+  DBusError error;
+  dbus_bool_t retval;
+  int i;
+
+  retval = FALSE;
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&full_path))
+    _dbus_assert_not_reached ("couldn't allocate full path");
+
+  _dbus_string_init_const (&filename, "valid-config-files/preactivate.conf");
+
+  if (!_dbus_string_copy (test_data_dir, 0, &full_path, 0) ||
+      !_dbus_concat_dir_and_file (&full_path, &filename))
+    _dbus_assert_not_reached ("couldn't allocate full path");
+
+  parser = bus_config_load (&full_path, TRUE, NULL, &error);
+  if (parser == NULL)
+    {
+      _dbus_warn ("Failed to load %s: %s\n",
+                  _dbus_string_get_const_data (&full_path), error.message);
+      dbus_error_free (&error);
+      goto finish;
+    }
+
+  /* every name is kept, in the order given */
+  names = bus_config_parser_get_preactivate_names (parser);
+  link = _dbus_list_get_first_link (names);
+
+  for (i = 0; test_preactivate_names[i] != NULL; i++)
+    {
+      if (link == NULL || strcmp (link->data, test_preactivate_names[i]) != 0)
+        {
+          _dbus_warn ("Expected <preactivate> name %s, got %s\n",
+                      test_preactivate_names[i],
+                      link != NULL ? (const char *) link->data : "nothing");
+          goto finish;
+        }
+
+      link = _dbus_list_get_next_link (names, link);
+    }
+
+  if (link != NULL)
+    {
+      _dbus_warn ("Unexpected <preactivate> name %s\n",
+                  (const char *) link->data);
+      goto finish;
+    }
+
+  retval = TRUE;
+
+ finish:
+  if (parser != NULL)
+    bus_config_parser_unref (parser);
+  _dbus_string_free (&full_path);
+
+  return retval;
+}
+
 dbus_bool_t
 bus_config_parser_test (const DBusString *test_data_dir)
 {
@@ -3626,6 +4200,12 @@ bus_config_parser_test (const DBusString *test_data_dir)
   if (!process_test_equiv_subdir (test_data_dir, "equiv-config-files"))
     return FALSE;
 
+  if (!test_config_sources (test_data_dir))
+    return FALSE;
+
+  if (!test_preactivate (test_data_dir))
+    return FALSE;
+
   return TRUE;
 }
 
@@ -67,14 +67,22 @@ dbus_bool_t bus_config_parser_get_allow_anonymous (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_syslog       (BusConfigParser *parser);
 dbus_bool_t bus_config_parser_get_keep_umask   (BusConfigParser *parser);
 const char* bus_config_parser_get_pidfile      (BusConfigParser *parser);
+const char* bus_config_parser_get_metrics_address (BusConfigParser *parser);
 const char* bus_config_parser_get_servicehelper (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_service_dirs (BusConfigParser *parser);
 DBusList**  bus_config_parser_get_conf_dirs    (BusConfigParser *parser);
-BusPolicy*  bus_config_parser_steal_policy     (BusConfigParser *parser);
+DBusList**  bus_config_parser_get_preactivate_names (BusConfigParser *parser);
+BusPolicy*  bus_config_parser_get_policy       (BusConfigParser *parser);
 void        bus_config_parser_get_limits       (BusConfigParser *parser,
                                                 BusLimits       *limits);
 
-DBusHashTable* bus_config_parser_steal_service_context_table (BusConfigParser *parser);
+DBusHashTable* bus_config_parser_get_service_context_table (BusConfigParser *parser);
+
+/* Tracking the files the configuration was read from */
+dbus_bool_t bus_config_parser_add_source      (BusConfigParser  *parser,
+                                               const DBusString *path);
+dbus_bool_t bus_config_parser_sources_changed (BusConfigParser  *parser);
+dbus_bool_t bus_config_parser_names_changed   (BusConfigParser  *parser);
 
 /* Loader functions (backended off one of the XML parsers).  Returns a
  * finished ConfigParser.
@@ -188,7 +188,6 @@ void
 bus_connection_disconnected (DBusConnection *connection)
 {
   BusConnectionData *d;
-  BusService *service;
   BusMatchmaker *matchmaker;
   
   d = BUS_CONNECTION_DATA (connection);
@@ -197,8 +196,10 @@ bus_connection_disconnected (DBusConnection *connection)
   _dbus_verbose ("%s disconnected, dropping all service ownership and releasing\n",
                  d->name ? d->name : "(inactive)");
 
-  /* Delete our match rules */
-  if (d->n_match_rules > 0)
+  /* Delete our match rules, and other connections' rules that refer
+   * to our unique name
+   */
+  if (d->name != NULL)
     {
       matchmaker = bus_context_get_matchmaker (d->connections->context);
       bus_matchmaker_disconnected (matchmaker, connection);
@@ -210,39 +211,57 @@ bus_connection_disconnected (DBusConnection *connection)
    * disconnecting a client, and preallocating a broadcast "service is
    * now gone" message for every client-service pair seems kind of
    * involved.
+   *
+   * All the names go in one transaction, so that other clients see
+   * the NameOwnerChanged signals together; if we run out of memory
+   * part way, the whole thing is undone and tried again. Names are
+   * released newest first, so that the unique name goes last.
    */
-  while ((service = _dbus_list_get_last (&d->services_owned)))
+  while (d->services_owned != NULL)
     {
       BusTransaction *transaction;
-      DBusError error;
+      DBusList *link;
 
-    retry:
-      
-      dbus_error_init (&error);
-        
       while ((transaction = bus_transaction_new (d->connections->context)) == NULL)
         _dbus_wait_for_memory ();
-        
-      if (!bus_service_remove_owner (service, connection,
-                                     transaction, &error))
+
+      link = _dbus_list_get_last_link (&d->services_owned);
+      while (link != NULL)
         {
-          _DBUS_ASSERT_ERROR_IS_SET (&error);
-          
-          if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
-            {
-              dbus_error_free (&error);
-              bus_transaction_cancel_and_free (transaction);
-              _dbus_wait_for_memory ();
-              goto retry;
-            }
-          else
+          /* Dropping a queued ownership frees its link right away */
+          DBusList *prev = _dbus_list_get_prev_link (&d->services_owned, link);
+          DBusError error;
+
+          dbus_error_init (&error);
+
+          if (!bus_service_remove_owner (link->data, connection,
+                                         transaction, &error))
             {
-              _dbus_verbose ("Failed to remove service owner: %s %s\n",
-                             error.name, error.message);
-              _dbus_assert_not_reached ("Removing service owner failed for non-memory-related reason");
+              _DBUS_ASSERT_ERROR_IS_SET (&error);
+
+              if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+                {
+                  dbus_error_free (&error);
+                  break;
+                }
+              else
+                {
+                  _dbus_verbose ("Failed to remove service owner: %s %s\n",
+                                 error.name, error.message);
+                  _dbus_assert_not_reached ("Removing service owner failed for non-memory-related reason");
+                }
             }
+
+          link = prev;
         }
-        
+
+      if (link != NULL)
+        {
+          bus_transaction_cancel_and_free (transaction);
+          _dbus_wait_for_memory ();
+          continue;
+        }
+
       bus_transaction_execute_and_free (transaction);
     }
 
@@ -915,6 +934,39 @@ bus_connection_get_policy (DBusConnection *connection)
   return d->policy;
 }
 
+/**
+ * Rebuilds the connection's client policy from the bus's current
+ * policy. On failure the connection keeps the policy it had.
+ *
+ * @param connection an active connection
+ * @param error return location for an error
+ * @returns #FALSE if the policy could not be rebuilt
+ */
+dbus_bool_t
+bus_connection_refresh_policy (DBusConnection *connection,
+                               DBusError      *error)
+{
+  BusConnectionData *d;
+  BusClientPolicy *policy;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+  _dbus_assert (d->policy != NULL);
+
+  policy = bus_context_create_client_policy (d->connections->context,
+                                             connection, error);
+  if (policy == NULL)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      return FALSE;
+    }
+
+  bus_client_policy_unref (d->policy);
+  d->policy = policy;
+
+  return TRUE;
+}
+
 static dbus_bool_t
 foreach_active (BusConnections               *connections,
                 BusConnectionForeachFunction  function,
@@ -1235,32 +1287,17 @@ bus_connection_add_match_rule_link (DBusConnection *connection,
 #endif
 }
 
-dbus_bool_t
-bus_connection_add_match_rule (DBusConnection *connection,
-                               BusMatchRule   *rule)
-{
-    DBusList *link;
-
-  link = _dbus_list_alloc_link (rule);
-
-  if (link == NULL)
-    return FALSE;
-
-  bus_connection_add_match_rule_link (connection, link);
-
-  return TRUE;
-}
-
+/* The link must be one that was given to bus_connection_add_match_rule_link() */
 void
-bus_connection_remove_match_rule (DBusConnection *connection,
-                                  BusMatchRule   *rule)
+bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                       DBusList       *link)
 {
   BusConnectionData *d;
 
   d = BUS_CONNECTION_DATA (connection);
   _dbus_assert (d != NULL);
 
-  _dbus_list_remove_last (&d->match_rules, rule);
+  _dbus_list_remove_link (&d->match_rules, link);
 
   d->n_match_rules -= 1;
   _dbus_assert (d->n_match_rules >= 0);
@@ -1270,6 +1307,17 @@ bus_connection_remove_match_rule (DBusConnection *connection,
 #endif
 }
 
+BusMatchRule *
+bus_connection_get_last_match_rule (DBusConnection *connection)
+{
+  BusConnectionData *d;
+
+  d = BUS_CONNECTION_DATA (connection);
+  _dbus_assert (d != NULL);
+
+  return _dbus_list_get_last (&d->match_rules);
+}
+
 int
 bus_connection_get_n_match_rules (DBusConnection *connection)
 {
@@ -80,12 +80,11 @@ void        bus_connection_send_oom_error        (DBusConnection *connection,
                                                   DBusMessage    *in_reply_to);
 
 /* called by signals.c */
-dbus_bool_t bus_connection_add_match_rule      (DBusConnection *connection,
-                                                BusMatchRule   *rule);
 void        bus_connection_add_match_rule_link (DBusConnection *connection,
                                                 DBusList       *link);
-void        bus_connection_remove_match_rule   (DBusConnection *connection,
-                                                BusMatchRule   *rule);
+void        bus_connection_remove_match_rule_link (DBusConnection *connection,
+                                                   DBusList       *link);
+BusMatchRule *bus_connection_get_last_match_rule (DBusConnection *connection);
 int         bus_connection_get_n_match_rules   (DBusConnection *connection);
 
 
@@ -113,6 +112,8 @@ dbus_bool_t      bus_connection_get_unix_groups  (DBusConnection       *connecti
                                                   int                  *n_groups,
                                                   DBusError            *error);
 BusClientPolicy* bus_connection_get_policy  (DBusConnection       *connection);
+dbus_bool_t      bus_connection_refresh_policy (DBusConnection    *connection,
+                                                DBusError         *error);
 
 /* transaction API so we can send or not send a block of messages as a whole */
 
@@ -34,13 +34,19 @@
 
 #include <dbus/dbus-internals.h>
 #include <dbus/dbus-list.h>
+#include <dbus/dbus-timeout.h>
 #include <dbus/dbus-watch.h>
+#include "activation.h"
 #include "dir-watch.h"
 
 #define MAX_DIRS_TO_WATCH 128
 #define INOTIFY_EVENT_SIZE (sizeof(struct inotify_event))
 #define INOTIFY_BUF_LEN (1024 * (INOTIFY_EVENT_SIZE + 16))
 
+/* Changes are collected for this long before acting on them, so that a
+ * package upgrade touching many files causes one update, not one each */
+#define CHANGE_DELAY_MILLISECONDS 250
+
 /* use a static array to avoid handling OOM */
 static int wds[MAX_DIRS_TO_WATCH];
 static char *dirs[MAX_DIRS_TO_WATCH];
@@ -48,6 +54,155 @@ static int num_wds = 0;
 static int inotify_fd = -1;
 static DBusWatch *watch = NULL;
 static DBusLoop *loop = NULL;
+static BusContext *watch_context = NULL;
+
+/* Changes seen since the last time we acted on them. Changes to
+ * .service files in service directories only need that one activation
+ * entry updated; anything else (configuration directories, queue
+ * overflow, OOM while recording a change) needs a full reload.
+ */
+typedef struct
+{
+  char *dir;
+  char *filename;
+} ChangedFile;
+
+static DBusList *changed_files = NULL;
+static dbus_bool_t full_reload_pending = FALSE;
+static DBusTimeout *change_timeout = NULL;
+
+static void
+_changed_file_free (ChangedFile *changed)
+{
+  dbus_free (changed->dir);
+  dbus_free (changed->filename);
+  dbus_free (changed);
+}
+
+static void
+_clear_changes (void)
+{
+  ChangedFile *changed;
+
+  while ((changed = _dbus_list_pop_first (&changed_files)) != NULL)
+    _changed_file_free (changed);
+
+  full_reload_pending = FALSE;
+
+  if (change_timeout != NULL)
+    {
+      _dbus_loop_remove_timeout (loop, change_timeout);
+      _dbus_timeout_unref (change_timeout);
+      change_timeout = NULL;
+    }
+}
+
+static void
+_apply_changes (void)
+{
+  BusActivation *activation;
+  ChangedFile *changed;
+  DBusError error;
+
+  if (full_reload_pending)
+    {
+      _clear_changes ();
+      _dbus_verbose ("Sending SIGHUP signal on reception of inotify events\n");
+      (void) kill (_dbus_getpid (), SIGHUP);
+      return;
+    }
+
+  activation = bus_context_get_activation (watch_context);
+  dbus_error_init (&error);
+
+  while ((changed = _dbus_list_pop_first (&changed_files)) != NULL)
+    {
+      _dbus_verbose ("Updating activation entry for %s/%s\n",
+                     changed->dir, changed->filename);
+
+      if (!bus_activation_update_service_file (activation, changed->dir,
+                                               changed->filename, &error))
+        {
+          /* OOM: let the next reload pick the file up instead */
+          _dbus_verbose ("Failed to update %s: %s\n", changed->filename,
+                         error.message);
+          dbus_error_free (&error);
+        }
+
+      _changed_file_free (changed);
+    }
+
+  _clear_changes ();
+}
+
+static dbus_bool_t
+_handle_change_timeout (void *data)
+{
+  _apply_changes ();
+  return TRUE;
+}
+
+static void
+_record_change (const char *dir, const char *filename)
+{
+  ChangedFile *changed;
+  DBusList *link;
+
+  if (full_reload_pending)
+    return;
+
+  if (dir == NULL || filename == NULL || watch_context == NULL ||
+      !bus_activation_is_service_dir (bus_context_get_activation (watch_context),
+                                      dir))
+    {
+      full_reload_pending = TRUE;
+      return;
+    }
+
+  for (link = _dbus_list_get_first_link (&changed_files);
+       link != NULL;
+       link = _dbus_list_get_next_link (&changed_files, link))
+    {
+      changed = link->data;
+
+      if (strcmp (changed->dir, dir) == 0 &&
+          strcmp (changed->filename, filename) == 0)
+        return;
+    }
+
+  changed = dbus_new0 (ChangedFile, 1);
+  if (changed == NULL)
+    goto oom;
+
+  changed->dir = _dbus_strdup (dir);
+  changed->filename = _dbus_strdup (filename);
+
+  if (changed->dir == NULL || changed->filename == NULL ||
+      !_dbus_list_append (&changed_files, changed))
+    {
+      _changed_file_free (changed);
+      goto oom;
+    }
+
+  return;
+
+ oom:
+  full_reload_pending = TRUE;
+}
+
+static const char *
+_dir_for_wd (int wd)
+{
+  int i;
+
+  for (i = 0; i < num_wds; i++)
+    {
+      if (wds[i] == wd)
+        return dirs[i];
+    }
+
+  return NULL;
+}
 
 static dbus_bool_t
 _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
@@ -55,7 +210,6 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   char buffer[INOTIFY_BUF_LEN];
   ssize_t ret = 0;
   int i = 0;
-  pid_t pid;
   dbus_bool_t have_change = FALSE;
 
   ret = read (inotify_fd, buffer, INOTIFY_BUF_LEN);
@@ -67,7 +221,6 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
   while (i < ret)
     {
       struct inotify_event *ev;
-      pid = _dbus_getpid ();
 
       ev = (struct inotify_event *) &buffer[i];
       i += INOTIFY_EVENT_SIZE + ev->len;
@@ -76,11 +229,36 @@ _handle_inotify_watch (DBusWatch *passed_watch, unsigned int flags, void *data)
         _dbus_verbose ("event name: '%s'\n", ev->name);
       _dbus_verbose ("inotify event: wd=%d mask=%u cookie=%u len=%u\n", ev->wd, ev->mask, ev->cookie, ev->len);
 #endif
-      _dbus_verbose ("Sending SIGHUP signal on reception of a inotify event\n");
+      if (ev->mask & IN_Q_OVERFLOW)
+        _record_change (NULL, NULL);
+      else
+        _record_change (_dir_for_wd (ev->wd), ev->len ? ev->name : NULL);
+
       have_change = TRUE;
     }
+
   if (have_change)
-    (void) kill (pid, SIGHUP);
+    {
+      /* Wait for the whole burst to finish: each event starts the
+       * delay again, re-adding the timeout makes the loop count from now
+       */
+      if (change_timeout != NULL)
+        _dbus_loop_remove_timeout (loop, change_timeout);
+      else
+        change_timeout = _dbus_timeout_new (CHANGE_DELAY_MILLISECONDS,
+                                            _handle_change_timeout, NULL, NULL);
+
+      if (change_timeout != NULL &&
+          !_dbus_loop_add_timeout (loop, change_timeout))
+        {
+          _dbus_timeout_unref (change_timeout);
+          change_timeout = NULL;
+        }
+
+      /* if we can't wait, don't */
+      if (change_timeout == NULL)
+        _apply_changes ();
+    }
 
   return TRUE;
 }
@@ -198,6 +376,9 @@ _shutdown_inotify (void *data)
 
   _set_watched_dirs_internal (&empty);
 
+  _clear_changes ();
+  watch_context = NULL;
+
   if (watch != NULL)
     {
       _dbus_loop_remove_watch (loop, watch);
@@ -275,5 +456,7 @@ bus_set_watched_dirs (BusContext *context, DBusList **directories)
   if (!_init_inotify (context))
     return;
 
+  watch_context = context;
+
   _set_watched_dirs_internal (directories);
 }
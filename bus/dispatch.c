@@ -32,6 +32,7 @@
 #include "utils.h"
 #include "bus.h"
 #include "signals.h"
+#include "policy.h"
 #include "test.h"
 #include <dbus/dbus-internals.h>
 #include <string.h>
@@ -291,7 +292,6 @@ bus_dispatch (DBusConnection *connection,
     }
   else if (service_name != NULL) /* route to named service */
     {
-      DBusString service_string;
       BusService *service;
       BusRegistry *registry;
 
@@ -299,8 +299,7 @@ bus_dispatch (DBusConnection *connection,
 
       registry = bus_connection_get_registry (connection);
 
-      _dbus_string_init_const (&service_string, service_name);
-      service = bus_registry_lookup (registry, &service_string);
+      service = bus_registry_lookup_destination (registry, message);
 
       if (service == NULL && dbus_message_get_auto_start (message))
         {
@@ -4757,6 +4756,1219 @@ bus_dispatch_sha1_test (const DBusString *test_data_dir)
   return TRUE;
 }
 
+/* Writes a configuration like debug-allow-all.conf, with extra
+ * elements added
+ */
+static void
+write_test_config (const DBusString *config_file,
+                   const char       *extra)
+{
+  FILE *file;
+
+  file = fopen (_dbus_string_get_const_data (config_file), "w");
+  if (file == NULL)
+    _dbus_assert_not_reached ("could not write config file");
+
+  fprintf (file,
+           "<busconfig>\n"
+           "  <listen>" TEST_DEBUG_PIPE "</listen>\n"
+           "  <policy context=\"default\">\n"
+           "    <allow send_interface=\"*\"/>\n"
+           "    <allow receive_interface=\"*\"/>\n"
+           "    <allow own=\"*\"/>\n"
+           "    <allow user=\"*\"/>\n"
+           "  </policy>\n"
+           "%s"
+           "</busconfig>\n",
+           extra);
+  fclose (file);
+}
+
+static dbus_bool_t
+get_bus_connection_foreach (DBusConnection *connection,
+                            void           *data)
+{
+  DBusConnection **connection_p = data;
+
+  *connection_p = connection;
+  return TRUE;
+}
+
+/* Checks that a reload only gives new client policies to the
+ * connections whose policy could have changed.
+ */
+dbus_bool_t
+bus_policy_reload_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bus_foo;
+  DBusString config_file;
+  DBusError error;
+  BusPolicy *policy, *old_policy, *new_policy;
+  BusPolicyRule *rule;
+  BusPolicyDiff *diff;
+  BusClientPolicy *client_policy;
+  unsigned long uid;
+  char user_policy[128];
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&config_file) ||
+      !_dbus_string_append (&config_file, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&config_file, "/dbus-policy-reload-test-") ||
+      !_dbus_generate_random_ascii (&config_file, 6) ||
+      !_dbus_string_append (&config_file, ".conf"))
+    return FALSE;
+
+  write_test_config (&config_file, "");
+
+  context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, &error);
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not load config file");
+
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  bus_foo = NULL;
+  bus_connections_foreach_active (bus_context_get_connections (context),
+                                  get_bus_connection_foreach, &bus_foo);
+  _dbus_assert (bus_foo != NULL);
+
+  if (!dbus_connection_get_unix_user (bus_foo, &uid))
+    _dbus_assert_not_reached ("connection has no unix user");
+
+  /* Reloading an unchanged configuration changes nothing */
+  policy = bus_context_get_policy (context);
+  client_policy = bus_connection_get_policy (bus_foo);
+
+  if (!bus_context_reload_config (context, &error))
+    _dbus_assert_not_reached ("could not reload config file");
+
+  _dbus_assert (bus_context_get_policy (context) == policy);
+  _dbus_assert (bus_connection_get_policy (bus_foo) == client_policy);
+
+  /* Adding a section for the connection's user affects it */
+  snprintf (user_policy, sizeof (user_policy),
+            "  <policy user=\"%lu\">\n"
+            "    <deny own=\"org.freedesktop.DBus.TestPolicyReload\"/>\n"
+            "  </policy>\n", uid);
+  write_test_config (&config_file, user_policy);
+
+  if (!bus_context_reload_config (context, &error))
+    _dbus_assert_not_reached ("could not reload config file");
+
+  _dbus_assert (bus_context_get_policy (context) != policy);
+  _dbus_assert (bus_connection_get_policy (bus_foo) != client_policy);
+
+  /* So does removing it again */
+  policy = bus_context_get_policy (context);
+  client_policy = bus_connection_get_policy (bus_foo);
+
+  write_test_config (&config_file, "");
+
+  if (!bus_context_reload_config (context, &error))
+    _dbus_assert_not_reached ("could not reload config file");
+
+  _dbus_assert (bus_context_get_policy (context) != policy);
+  _dbus_assert (bus_connection_get_policy (bus_foo) != client_policy);
+
+  /* A section for some other user doesn't; built by hand, since that
+   * user has to exist to be named in a configuration file
+   */
+  old_policy = bus_policy_new ();
+  new_policy = bus_policy_new ();
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_OWN, FALSE);
+  if (old_policy == NULL || new_policy == NULL || rule == NULL ||
+      !bus_policy_append_user_rule (new_policy, uid + 1, rule))
+    _dbus_assert_not_reached ("no memory for policies");
+  bus_policy_rule_unref (rule);
+
+  diff = bus_policy_diff_new (old_policy, new_policy);
+  if (diff == NULL)
+    _dbus_assert_not_reached ("no memory for policy diff");
+  _dbus_assert (!bus_policy_diff_is_empty (diff));
+  _dbus_assert (!bus_policy_diff_affects_connection (diff, bus_foo));
+  bus_policy_diff_free (diff);
+
+  /* while a mandatory rule affects everyone */
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_OWN, FALSE);
+  if (rule == NULL ||
+      !bus_policy_append_mandatory_rule (new_policy, rule))
+    _dbus_assert_not_reached ("no memory for policies");
+  bus_policy_rule_unref (rule);
+
+  diff = bus_policy_diff_new (old_policy, new_policy);
+  if (diff == NULL)
+    _dbus_assert_not_reached ("no memory for policy diff");
+  _dbus_assert (bus_policy_diff_affects_connection (diff, bus_foo));
+  bus_policy_diff_free (diff);
+
+  bus_policy_unref (old_policy);
+  bus_policy_unref (new_policy);
+
+  /* and so does an unchanged group section, since who is in the
+   * group may have changed
+   */
+  old_policy = bus_policy_new ();
+  new_policy = bus_policy_new ();
+  if (old_policy == NULL || new_policy == NULL)
+    _dbus_assert_not_reached ("no memory for policies");
+
+  rule = bus_policy_rule_new (BUS_POLICY_RULE_OWN, FALSE);
+  if (rule == NULL ||
+      !bus_policy_append_group_rule (old_policy, 0, rule) ||
+      !bus_policy_append_group_rule (new_policy, 0, rule))
+    _dbus_assert_not_reached ("no memory for policies");
+  bus_policy_rule_unref (rule);
+
+  diff = bus_policy_diff_new (old_policy, new_policy);
+  if (diff == NULL)
+    _dbus_assert_not_reached ("no memory for policy diff");
+  _dbus_assert (!bus_policy_diff_is_empty (diff));
+  _dbus_assert (bus_policy_diff_affects_connection (diff, bus_foo));
+  bus_policy_diff_free (diff);
+
+  bus_policy_unref (old_policy);
+  bus_policy_unref (new_policy);
+
+  kill_client_connection_unchecked (foo);
+
+  bus_context_unref (context);
+
+  if (!_dbus_delete_file (&config_file, &error))
+    _dbus_assert_not_reached ("could not delete config file");
+
+  _dbus_string_free (&config_file);
+
+  return TRUE;
+}
+
+#define COALESCE_SERVICE_NAME "org.freedesktop.DBus.TestSuiteCoalesce"
+
+static DBusConnection *
+open_test_client (BusContext *context)
+{
+  DBusConnection *connection;
+  DBusError error;
+
+  dbus_error_init (&error);
+
+  connection = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (connection == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (connection))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, connection);
+
+  if (!check_hello_message (context, connection))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, connection))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  return connection;
+}
+
+/* Pops messages until one that is not a signal, since every client
+ * also hears about the name changing owner
+ */
+static DBusMessage *
+pop_non_signal_message (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    {
+      if (dbus_message_get_type (message) != DBUS_MESSAGE_TYPE_SIGNAL)
+        break;
+
+      dbus_message_unref (message);
+    }
+
+  return message;
+}
+
+/* Throws away whatever a client has been sent, so it can be killed */
+static void
+discard_messages (DBusConnection *connection)
+{
+  DBusMessage *message;
+
+  while ((message = pop_message_waiting_for_memory (connection)) != NULL)
+    dbus_message_unref (message);
+}
+
+static dbus_uint32_t
+send_coalesce_test_call (DBusConnection *connection,
+                         const char     *method,
+                         dbus_bool_t     no_reply)
+{
+  DBusMessage *message;
+  dbus_uint32_t serial;
+
+  message = dbus_message_new_method_call (COALESCE_SERVICE_NAME,
+                                          "/org/freedesktop/TestSuite",
+                                          "org.freedesktop.TestSuite",
+                                          method);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no memory for message");
+
+  dbus_message_set_no_reply (message, no_reply);
+
+  if (!dbus_connection_send (connection, message, &serial))
+    _dbus_assert_not_reached ("no memory to send message");
+
+  dbus_message_unref (message);
+
+  return serial;
+}
+
+/* Checks that auto-starts of a name that is already being activated
+ * join that activation, and that when the name is taken each queued
+ * message is delivered or refused on its own.
+ */
+dbus_bool_t
+bus_activation_coalesce_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusActivation *activation;
+  DBusConnection *foo, *bar, *service;
+  DBusString service_dir, service_file, config_file, extra;
+  DBusMessage *message;
+  DBusError error;
+  dbus_uint32_t refused_serial;
+  const char *name;
+  dbus_uint32_t flags;
+  int n_received;
+  FILE *file;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&service_dir) ||
+      !_dbus_string_append (&service_dir, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&service_dir, "/dbus-activation-coalesce-test-") ||
+      !_dbus_generate_random_ascii (&service_dir, 6) ||
+      !_dbus_string_init (&config_file) ||
+      !_dbus_string_copy (&service_dir, 0, &config_file, 0) ||
+      !_dbus_string_append (&config_file, ".conf") ||
+      !_dbus_string_init (&service_file) ||
+      !_dbus_string_copy (&service_dir, 0, &service_file, 0) ||
+      !_dbus_string_append (&service_file,
+                            "/" COALESCE_SERVICE_NAME ".service") ||
+      !_dbus_string_init (&extra) ||
+      !_dbus_string_append_printf (&extra,
+                                   "  <servicedir>%s</servicedir>\n"
+                                   "  <policy context=\"default\">\n"
+                                   "    <deny send_destination=\"%s\"\n"
+                                   "          send_interface=\"org.freedesktop.TestSuite\"\n"
+                                   "          send_member=\"Refused\"/>\n"
+                                   "  </policy>\n",
+                                   _dbus_string_get_const_data (&service_dir),
+                                   COALESCE_SERVICE_NAME))
+    return FALSE;
+
+  if (!_dbus_create_directory (&service_dir, &error))
+    _dbus_assert_not_reached ("could not create service directory");
+
+  /* The spawned process exits at once without taking the name, which
+   * leaves the activation pending; a client takes the name instead.
+   */
+  file = fopen (_dbus_string_get_const_data (&service_file), "w");
+  if (file == NULL)
+    _dbus_assert_not_reached ("could not write service file");
+  fprintf (file, "[D-BUS Service]\nName=%s\nExec=/bin/true\n",
+           COALESCE_SERVICE_NAME);
+  fclose (file);
+
+  write_test_config (&config_file, _dbus_string_get_const_data (&extra));
+
+  context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, &error);
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not load config file");
+
+  activation = bus_context_get_activation (context);
+
+  foo = open_test_client (context);
+  bar = open_test_client (context);
+  service = open_test_client (context);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("messages left over after setting up clients");
+
+  /* Three auto-starts from two clients make one activation */
+  send_coalesce_test_call (foo, "Ping", TRUE);
+  send_coalesce_test_call (bar, "Ping", TRUE);
+  refused_serial = send_coalesce_test_call (bar, "Refused", FALSE);
+
+  bus_test_run_everything (context);
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            COALESCE_SERVICE_NAME) != 3)
+    _dbus_assert_not_reached ("auto-starts were not coalesced");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("reply sent before the name was taken");
+
+  /* Taking the name delivers the batch */
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "RequestName");
+  name = COALESCE_SERVICE_NAME;
+  flags = 0;
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_UINT32, &flags,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (service, message, NULL))
+    _dbus_assert_not_reached ("no memory for RequestName");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            COALESCE_SERVICE_NAME) != -1)
+    _dbus_assert_not_reached ("activation still pending after name was taken");
+
+  /* The new owner gets the two allowed messages, in the order sent */
+  block_connection_until_message_from_bus (context, service, "queued messages");
+
+  n_received = 0;
+  while ((message = pop_non_signal_message (service)) != NULL)
+    {
+      if (dbus_message_get_type (message) == DBUS_MESSAGE_TYPE_METHOD_CALL)
+        {
+          if (!dbus_message_is_method_call (message,
+                                            "org.freedesktop.TestSuite",
+                                            "Ping"))
+            _dbus_assert_not_reached ("refused message was delivered");
+
+          if (strcmp (dbus_message_get_sender (message),
+                      dbus_bus_get_unique_name (n_received == 0 ? foo : bar)) != 0)
+            _dbus_assert_not_reached ("queued messages delivered out of order");
+
+          n_received += 1;
+        }
+
+      dbus_message_unref (message);
+    }
+
+  if (n_received != 2)
+    _dbus_assert_not_reached ("queued messages were not all delivered");
+
+  /* while only the sender of the refused one hears about it */
+  block_connection_until_message_from_bus (context, bar, "refusal");
+
+  message = pop_non_signal_message (bar);
+  if (message == NULL ||
+      !dbus_message_is_error (message, DBUS_ERROR_ACCESS_DENIED) ||
+      dbus_message_get_reply_serial (message) != refused_serial)
+    _dbus_assert_not_reached ("refused message got no error reply");
+  dbus_message_unref (message);
+
+  if (pop_non_signal_message (foo) != NULL ||
+      pop_non_signal_message (bar) != NULL)
+    _dbus_assert_not_reached ("unexpected replies after delivering the batch");
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+  kill_client_connection_unchecked (service);
+
+  bus_context_unref (context);
+
+  if (!_dbus_delete_file (&service_file, &error) ||
+      !_dbus_delete_directory (&service_dir, &error) ||
+      !_dbus_delete_file (&config_file, &error))
+    _dbus_assert_not_reached ("could not clean up test files");
+
+  _dbus_string_free (&service_dir);
+  _dbus_string_free (&service_file);
+  _dbus_string_free (&config_file);
+  _dbus_string_free (&extra);
+
+  return TRUE;
+}
+
+#define OWNER_QUEUE_NAME      "org.freedesktop.DBus.TestSuiteOwnerQueue"
+#define OWNER_QUEUE_N_CLIENTS 12
+
+/* Sends RequestName (with flags) or ReleaseName for a name and
+ * returns the result code from the reply
+ */
+static dbus_uint32_t
+call_name_method (BusContext     *context,
+                  DBusConnection *connection,
+                  const char     *method,
+                  const char     *name,
+                  dbus_uint32_t   flags)
+{
+  DBusMessage *message;
+  dbus_uint32_t result;
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          method);
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID) ||
+      (strcmp (method, "RequestName") == 0 &&
+       !dbus_message_append_args (message,
+                                  DBUS_TYPE_UINT32, &flags,
+                                  DBUS_TYPE_INVALID)) ||
+      !dbus_connection_send (connection, message, NULL))
+    _dbus_assert_not_reached ("no memory for message");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, connection, method);
+
+  message = pop_non_signal_message (connection);
+  if (message == NULL ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_UINT32, &result,
+                              DBUS_TYPE_INVALID))
+    {
+      _dbus_warn ("Bad reply to %s\n", method);
+      _dbus_assert_not_reached ("bad reply");
+    }
+  dbus_message_unref (message);
+
+  return result;
+}
+
+static dbus_uint32_t
+call_owner_queue_method (BusContext     *context,
+                         DBusConnection *connection,
+                         const char     *method,
+                         dbus_uint32_t   flags)
+{
+  return call_name_method (context, connection, method,
+                           OWNER_QUEUE_NAME, flags);
+}
+
+/* Checks that ListQueuedOwners gives the clients in expected, in
+ * that order; client 0 is 'a', client 1 is 'b' and so on
+ */
+static void
+check_owner_queue (BusContext      *context,
+                   DBusConnection  *observer,
+                   DBusConnection **clients,
+                   const char      *expected)
+{
+  DBusMessage *message;
+  const char *name;
+  char **owners;
+  int n_owners, n_expected, i;
+
+  n_expected = strlen (expected);
+
+  message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                          DBUS_PATH_DBUS,
+                                          DBUS_INTERFACE_DBUS,
+                                          "ListQueuedOwners");
+  name = OWNER_QUEUE_NAME;
+  if (message == NULL ||
+      !dbus_message_append_args (message,
+                                 DBUS_TYPE_STRING, &name,
+                                 DBUS_TYPE_INVALID) ||
+      !dbus_connection_send (observer, message, NULL))
+    _dbus_assert_not_reached ("no memory for ListQueuedOwners");
+  dbus_message_unref (message);
+
+  bus_test_run_everything (context);
+  block_connection_until_message_from_bus (context, observer,
+                                           "reply to ListQueuedOwners");
+
+  message = pop_non_signal_message (observer);
+  if (message == NULL)
+    _dbus_assert_not_reached ("no reply to ListQueuedOwners");
+
+  if (n_expected == 0)
+    {
+      if (!dbus_message_is_error (message, DBUS_ERROR_NAME_HAS_NO_OWNER))
+        _dbus_assert_not_reached ("name still has owners");
+      dbus_message_unref (message);
+      return;
+    }
+
+  if (!dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_ARRAY, DBUS_TYPE_STRING,
+                              &owners, &n_owners,
+                              DBUS_TYPE_INVALID))
+    _dbus_assert_not_reached ("bad reply to ListQueuedOwners");
+  dbus_message_unref (message);
+
+  if (n_owners != n_expected)
+    {
+      _dbus_warn ("%d queued owners, expected %d\n", n_owners, n_expected);
+      _dbus_assert_not_reached ("wrong number of queued owners");
+    }
+
+  for (i = 0; i < n_owners; i++)
+    {
+      if (strcmp (owners[i],
+                  dbus_bus_get_unique_name (clients[expected[i] - 'a'])) != 0)
+        {
+          _dbus_warn ("Queued owner %d is %s, expected client %c\n",
+                      i, owners[i], expected[i]);
+          _dbus_assert_not_reached ("queued owners in wrong order");
+        }
+    }
+
+  dbus_free_string_array (owners);
+}
+
+/* Checks that a queue long enough to be indexed by connection stays
+ * in the right order while owners are released, replaced, requeued
+ * and disconnected, from its middle as well as its ends.
+ */
+dbus_bool_t
+bus_owner_queue_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *clients[OWNER_QUEUE_N_CLIENTS];
+  DBusConnection *observer;
+  dbus_uint32_t queue, replace;
+  int i;
+
+  context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not alloc context");
+
+  observer = open_test_client (context);
+  for (i = 0; i < OWNER_QUEUE_N_CLIENTS; i++)
+    clients[i] = open_test_client (context);
+
+  queue = DBUS_NAME_FLAG_ALLOW_REPLACEMENT;
+  replace = DBUS_NAME_FLAG_ALLOW_REPLACEMENT | DBUS_NAME_FLAG_REPLACE_EXISTING;
+
+  /* Queue more owners than it takes for them to be indexed */
+  if (call_owner_queue_method (context, clients[0], "RequestName", queue) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("first owner is not primary");
+  for (i = 1; i < OWNER_QUEUE_N_CLIENTS; i++)
+    {
+      if (call_owner_queue_method (context, clients[i], "RequestName", queue) !=
+          DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+        _dbus_assert_not_reached ("later owner was not queued");
+    }
+  check_owner_queue (context, observer, clients, "abcdefghijkl");
+
+  /* Release from the middle, the tail and the head */
+  if (call_owner_queue_method (context, clients[5], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED ||
+      call_owner_queue_method (context, clients[11], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED ||
+      call_owner_queue_method (context, clients[0], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED)
+    _dbus_assert_not_reached ("could not release name");
+  check_owner_queue (context, observer, clients, "bcdeghijk");
+
+  /* A queued owner replaces the primary, which goes second */
+  if (call_owner_queue_method (context, clients[7], "RequestName", replace) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("queued owner could not replace primary");
+  check_owner_queue (context, observer, clients, "hbcdegijk");
+
+  /* and so does one that was not queued */
+  if (call_owner_queue_method (context, clients[11], "RequestName", replace) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("new owner could not replace primary");
+  check_owner_queue (context, observer, clients, "lhbcdegijk");
+
+  /* Asking again while queued keeps the place, and a released owner
+   * is not found
+   */
+  if (call_owner_queue_method (context, clients[3], "RequestName", queue) !=
+      DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+    _dbus_assert_not_reached ("queued owner was not found");
+  if (call_owner_queue_method (context, clients[5], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_NOT_OWNER)
+    _dbus_assert_not_reached ("released owner was found");
+  check_owner_queue (context, observer, clients, "lhbcdegijk");
+
+  /* Asking not to be queued leaves the queue */
+  if (call_owner_queue_method (context, clients[9], "RequestName",
+                               DBUS_NAME_FLAG_DO_NOT_QUEUE) !=
+      DBUS_REQUEST_NAME_REPLY_EXISTS)
+    _dbus_assert_not_reached ("owner was queued against its wishes");
+  check_owner_queue (context, observer, clients, "lhbcdegik");
+
+  /* Disconnecting drops a connection from the queue */
+  discard_messages (clients[2]);
+  kill_client_connection_unchecked (clients[2]);
+  clients[2] = NULL;
+  bus_test_run_everything (context);
+  check_owner_queue (context, observer, clients, "lhbdegik");
+
+  if (call_owner_queue_method (context, clients[11], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED ||
+      call_owner_queue_method (context, clients[4], "ReleaseName", 0) !=
+      DBUS_RELEASE_NAME_REPLY_RELEASED ||
+      call_owner_queue_method (context, clients[0], "RequestName", queue) !=
+      DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+    _dbus_assert_not_reached ("could not change queue");
+  check_owner_queue (context, observer, clients, "hbdgika");
+
+  /* Emptying the queue in mixed order drops the name, which can
+   * then be taken afresh
+   */
+  for (i = 0; i < 7; i++)
+    {
+      static const char order[] = "kbhagid";
+
+      if (call_owner_queue_method (context, clients[order[i] - 'a'],
+                                   "ReleaseName", 0) !=
+          DBUS_RELEASE_NAME_REPLY_RELEASED)
+        _dbus_assert_not_reached ("could not release name");
+    }
+  check_owner_queue (context, observer, clients, "");
+
+  if (call_owner_queue_method (context, clients[5], "RequestName", queue) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not take released name");
+  check_owner_queue (context, observer, clients, "f");
+
+  discard_messages (observer);
+  kill_client_connection_unchecked (observer);
+  for (i = 0; i < OWNER_QUEUE_N_CLIENTS; i++)
+    {
+      if (clients[i] != NULL)
+        {
+          discard_messages (clients[i]);
+          kill_client_connection_unchecked (clients[i]);
+        }
+    }
+
+  bus_context_unref (context);
+
+  return TRUE;
+}
+
+#define DISCONNECT_N_NAMES 3
+
+static const char *disconnect_names[DISCONNECT_N_NAMES] = {
+  "org.freedesktop.DBus.TestSuiteDisconnect1",
+  "org.freedesktop.DBus.TestSuiteDisconnect2",
+  "org.freedesktop.DBus.TestSuiteDisconnect3"
+};
+
+typedef struct
+{
+  BusContext *context;
+  DBusConnection *observer;
+} DisconnectNamesData;
+
+/* Returns which of the test names a NameOwnerChanged signal
+ * dropping the owner is for, DISCONNECT_N_NAMES for the unique
+ * name, or -1 for anything else
+ */
+static int
+disconnect_name_lost (DBusMessage *message,
+                      const char  *unique_name)
+{
+  const char *name, *old_owner, *new_owner;
+  int i;
+
+  if (!dbus_message_is_signal (message, DBUS_INTERFACE_DBUS,
+                               "NameOwnerChanged") ||
+      !dbus_message_get_args (message, NULL,
+                              DBUS_TYPE_STRING, &name,
+                              DBUS_TYPE_STRING, &old_owner,
+                              DBUS_TYPE_STRING, &new_owner,
+                              DBUS_TYPE_INVALID) ||
+      strcmp (old_owner, unique_name) != 0 ||
+      *new_owner != '\0')
+    return -1;
+
+  if (strcmp (name, unique_name) == 0)
+    return DISCONNECT_N_NAMES;
+
+  for (i = 0; i < DISCONNECT_N_NAMES; i++)
+    {
+      if (strcmp (name, disconnect_names[i]) == 0)
+        return i;
+    }
+
+  return -1;
+}
+
+/* Kills a client owning several names, with mallocs failing only
+ * while it is torn down
+ */
+static dbus_bool_t
+check_disconnect_names_func (void *data)
+{
+  DisconnectNamesData *d = data;
+  DBusConnection *client;
+  DBusMessage *message;
+  char *unique_name;
+  int n_lost[DISCONNECT_N_NAMES + 1];
+  int fail_counter, i;
+
+  fail_counter = _dbus_get_fail_alloc_counter ();
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+
+  client = open_test_client (d->context);
+  for (i = 0; i < DISCONNECT_N_NAMES; i++)
+    {
+      if (call_name_method (d->context, client, "RequestName",
+                            disconnect_names[i], 0) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+        _dbus_assert_not_reached ("could not take test name");
+    }
+
+  /* A queued ownership is dropped on its own, outside the transaction */
+  if (call_name_method (d->context, client, "RequestName",
+                        OWNER_QUEUE_NAME, 0) !=
+      DBUS_REQUEST_NAME_REPLY_IN_QUEUE)
+    _dbus_assert_not_reached ("could not queue for owned name");
+
+  unique_name = _dbus_strdup (dbus_bus_get_unique_name (client));
+  if (unique_name == NULL)
+    _dbus_assert_not_reached ("no memory for unique name");
+
+  discard_messages (d->observer);
+  discard_messages (client);
+
+  _dbus_set_fail_alloc_counter (fail_counter);
+  kill_client_connection_unchecked (client);
+  bus_test_run_everything (d->context);
+  fail_counter = _dbus_get_fail_alloc_counter ();
+  _dbus_set_fail_alloc_counter (_DBUS_INT_MAX);
+
+  /* Each name was dropped exactly once, whether or not earlier
+   * attempts were cancelled
+   */
+  for (i = 0; i <= DISCONNECT_N_NAMES; i++)
+    n_lost[i] = 0;
+
+  bus_test_run_everything (d->context);
+  while ((message = pop_message_waiting_for_memory (d->observer)) != NULL)
+    {
+      i = disconnect_name_lost (message, unique_name);
+      if (i >= 0)
+        n_lost[i] += 1;
+      dbus_message_unref (message);
+    }
+
+  for (i = 0; i <= DISCONNECT_N_NAMES; i++)
+    {
+      if (n_lost[i] != 1)
+        {
+          _dbus_warn ("Name %d of %s dropped %d times\n",
+                      i, unique_name, n_lost[i]);
+          _dbus_assert_not_reached ("wrong NameOwnerChanged signals on disconnect");
+        }
+    }
+
+  dbus_free (unique_name);
+
+  /* The names can be taken again, and the queue is back to its owner */
+  for (i = 0; i < DISCONNECT_N_NAMES; i++)
+    {
+      if (call_name_method (d->context, d->observer, "RequestName",
+                            disconnect_names[i], 0) !=
+          DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER ||
+          call_name_method (d->context, d->observer, "ReleaseName",
+                            disconnect_names[i], 0) !=
+          DBUS_RELEASE_NAME_REPLY_RELEASED)
+        _dbus_assert_not_reached ("name was not released on disconnect");
+    }
+  check_owner_queue (d->context, d->observer, &d->observer, "a");
+  discard_messages (d->observer);
+
+  _dbus_set_fail_alloc_counter (fail_counter);
+
+  return TRUE;
+}
+
+/* Checks that a disconnected client's names are all dropped together,
+ * and that running out of memory part way undoes and redoes the lot.
+ */
+dbus_bool_t
+bus_disconnect_names_test (const DBusString *test_data_dir)
+{
+  DisconnectNamesData d;
+
+  d.context = bus_context_new_test (test_data_dir, "valid-config-files/debug-allow-all.conf");
+  if (d.context == NULL)
+    _dbus_assert_not_reached ("could not alloc context");
+
+  d.observer = open_test_client (d.context);
+  if (call_name_method (d.context, d.observer, "RequestName",
+                        OWNER_QUEUE_NAME, 0) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not take queue name");
+
+  if (!_dbus_test_oom_handling ("disconnecting a client with several names",
+                                check_disconnect_names_func, &d))
+    _dbus_assert_not_reached ("test failed");
+
+  discard_messages (d.observer);
+  kill_client_connection_unchecked (d.observer);
+
+  bus_context_unref (d.context);
+
+  return TRUE;
+}
+
+#define PREACTIVATE_SERVICE_NAME "org.freedesktop.DBus.TestSuitePreactivate"
+
+/* Checks that a <preactivate> name is started as soon as the bus asks
+ * for it, with no client, no message and so nobody to reply to, and
+ * that taking the name delivers nothing.
+ */
+dbus_bool_t
+bus_preactivate_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  BusActivation *activation;
+  DBusConnection *service, *observer;
+  DBusString service_dir, service_file, config_file, marker_file, extra;
+  DBusMessage *message;
+  DBusError error;
+  FILE *file;
+  int i;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&service_dir) ||
+      !_dbus_string_append (&service_dir, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&service_dir, "/dbus-preactivate-test-") ||
+      !_dbus_generate_random_ascii (&service_dir, 6) ||
+      !_dbus_string_init (&config_file) ||
+      !_dbus_string_copy (&service_dir, 0, &config_file, 0) ||
+      !_dbus_string_append (&config_file, ".conf") ||
+      !_dbus_string_init (&marker_file) ||
+      !_dbus_string_copy (&service_dir, 0, &marker_file, 0) ||
+      !_dbus_string_append (&marker_file, ".started") ||
+      !_dbus_string_init (&service_file) ||
+      !_dbus_string_copy (&service_dir, 0, &service_file, 0) ||
+      !_dbus_string_append (&service_file,
+                            "/" PREACTIVATE_SERVICE_NAME ".service") ||
+      !_dbus_string_init (&extra) ||
+      !_dbus_string_append_printf (&extra,
+                                   "  <servicedir>%s</servicedir>\n"
+                                   "  <preactivate>%s</preactivate>\n",
+                                   _dbus_string_get_const_data (&service_dir),
+                                   PREACTIVATE_SERVICE_NAME))
+    return FALSE;
+
+  if (!_dbus_create_directory (&service_dir, &error))
+    _dbus_assert_not_reached ("could not create service directory");
+
+  /* The spawned process only leaves a mark that it ran, without taking
+   * the name, so the activation stays pending until a client takes it
+   */
+  file = fopen (_dbus_string_get_const_data (&service_file), "w");
+  if (file == NULL)
+    _dbus_assert_not_reached ("could not write service file");
+  fprintf (file, "[D-BUS Service]\nName=%s\nExec=/bin/touch %s\n",
+           PREACTIVATE_SERVICE_NAME,
+           _dbus_string_get_const_data (&marker_file));
+  fclose (file);
+
+  write_test_config (&config_file, _dbus_string_get_const_data (&extra));
+
+  context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, &error);
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not load config file");
+
+  activation = bus_context_get_activation (context);
+
+  observer = open_test_client (context);
+  service = open_test_client (context);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("messages left over after setting up clients");
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            PREACTIVATE_SERVICE_NAME) != -1)
+    _dbus_assert_not_reached ("service activated before startup");
+
+  /* What the daemon does once it is set up */
+  bus_context_preactivate_services (context);
+
+  /* The activation has no entry: no message to deliver, no reply owed */
+  if (bus_activation_get_n_pending_entries (activation,
+                                            PREACTIVATE_SERVICE_NAME) != 0)
+    _dbus_assert_not_reached ("service was not preactivated on its own");
+
+  /* Asking again while it is pending doesn't start it twice */
+  bus_context_preactivate_services (context);
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            PREACTIVATE_SERVICE_NAME) != 0)
+    _dbus_assert_not_reached ("preactivation was repeated");
+
+  for (i = 0; i < 100 && !_dbus_file_exists (_dbus_string_get_const_data (&marker_file)); i++)
+    {
+      bus_test_run_everything (context);
+      _dbus_sleep_milliseconds (50);
+    }
+
+  if (!_dbus_file_exists (_dbus_string_get_const_data (&marker_file)))
+    _dbus_assert_not_reached ("preactivated service was not started");
+
+  bus_test_run_everything (context);
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("message sent for a preactivation");
+
+  /* Taking the name ends the activation, and only answers the caller */
+  if (call_name_method (context, service, "RequestName",
+                        PREACTIVATE_SERVICE_NAME, 0) !=
+      DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER)
+    _dbus_assert_not_reached ("could not take preactivated name");
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            PREACTIVATE_SERVICE_NAME) != -1)
+    _dbus_assert_not_reached ("activation still pending after name was taken");
+
+  bus_test_run_everything (context);
+
+  message = pop_non_signal_message (service);
+  if (message == NULL)
+    message = pop_non_signal_message (observer);
+  if (message != NULL)
+    _dbus_assert_not_reached ("message delivered for a preactivation");
+
+  /* Once the name has an owner there is nothing left to start */
+  bus_context_preactivate_services (context);
+
+  if (bus_activation_get_n_pending_entries (activation,
+                                            PREACTIVATE_SERVICE_NAME) != -1)
+    _dbus_assert_not_reached ("owned name was preactivated again");
+
+  kill_client_connection_unchecked (observer);
+  kill_client_connection_unchecked (service);
+
+  bus_context_unref (context);
+
+  if (!_dbus_delete_file (&marker_file, &error) ||
+      !_dbus_delete_file (&service_file, &error) ||
+      !_dbus_delete_directory (&service_dir, &error) ||
+      !_dbus_delete_file (&config_file, &error))
+    _dbus_assert_not_reached ("could not clean up test files");
+
+  _dbus_string_free (&service_dir);
+  _dbus_string_free (&service_file);
+  _dbus_string_free (&marker_file);
+  _dbus_string_free (&config_file);
+  _dbus_string_free (&extra);
+
+  return TRUE;
+}
+
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+#include <dbus/dbus-sysdeps-unix.h>
+
+/* Checks that a metric line "name value" is in the text, and returns
+ * the value
+ */
+static unsigned long
+find_metric (const DBusString *text,
+             const char       *name)
+{
+  DBusString line;
+  unsigned long value;
+  int start, end;
+
+  if (!_dbus_string_init (&line) ||
+      !_dbus_string_append_printf (&line, "\n%s ", name))
+    _dbus_assert_not_reached ("no memory for metric name");
+
+  if (!_dbus_string_find (text, 0, _dbus_string_get_const_data (&line),
+                          &start))
+    {
+      _dbus_warn ("Metric %s not found in:\n%s",
+                  name, _dbus_string_get_const_data (text));
+      _dbus_assert_not_reached ("metric missing");
+    }
+
+  start += _dbus_string_get_length (&line);
+  if (!_dbus_string_parse_uint (text, start, &value, &end) ||
+      _dbus_string_get_byte (text, end) != '\n')
+    _dbus_assert_not_reached ("metric value is not a number");
+
+  _dbus_string_free (&line);
+  return value;
+}
+
+/* Checks that statistics read back from the metrics socket reflect
+ * the traffic on the bus.
+ */
+dbus_bool_t
+bus_metrics_test (const DBusString *test_data_dir)
+{
+  BusContext *context;
+  DBusConnection *foo, *bar;
+  DBusString config_file, socket_path, extra, text, name;
+  DBusError error;
+  int fd, bytes;
+
+  dbus_error_init (&error);
+
+  if (!_dbus_string_init (&config_file) ||
+      !_dbus_string_append (&config_file, _dbus_get_tmpdir ()) ||
+      !_dbus_string_append (&config_file, "/dbus-metrics-test-") ||
+      !_dbus_generate_random_ascii (&config_file, 6) ||
+      !_dbus_string_init (&socket_path) ||
+      !_dbus_string_copy (&config_file, 0, &socket_path, 0) ||
+      !_dbus_string_append (&socket_path, ".socket") ||
+      !_dbus_string_append (&config_file, ".conf") ||
+      !_dbus_string_init (&extra) ||
+      !_dbus_string_append_printf (&extra,
+                                   "  <metrics_listen>unix:path=%s</metrics_listen>\n",
+                                   _dbus_string_get_const_data (&socket_path)) ||
+      !_dbus_string_init (&text) ||
+      !_dbus_string_init (&name))
+    return FALSE;
+
+  write_test_config (&config_file, _dbus_string_get_const_data (&extra));
+
+  context = bus_context_new (&config_file, BUS_CONTEXT_FLAG_NONE,
+                             NULL, NULL, NULL, &error);
+  if (context == NULL)
+    _dbus_assert_not_reached ("could not load config file");
+
+  /* Two clients, one of which also adds a match rule */
+  foo = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (foo == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (foo))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, foo);
+
+  if (!check_hello_message (context, foo))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_add_match_all (context, foo))
+    _dbus_assert_not_reached ("AddMatch message failed");
+
+  bar = dbus_connection_open_private (TEST_DEBUG_PIPE, &error);
+  if (bar == NULL)
+    _dbus_assert_not_reached ("could not alloc connection");
+
+  if (!bus_setup_debug_client (bar))
+    _dbus_assert_not_reached ("could not set up connection");
+
+  spin_connection_until_authenticated (context, bar);
+
+  if (!check_hello_message (context, bar))
+    _dbus_assert_not_reached ("hello message failed");
+
+  if (!check_no_leftovers (context))
+    _dbus_assert_not_reached ("messages left over after setting up clients");
+
+  /* Each client that connects is sent a snapshot, then disconnected */
+  fd = _dbus_connect_unix_socket (_dbus_string_get_const_data (&socket_path),
+                                  FALSE, &error);
+  if (fd < 0)
+    _dbus_assert_not_reached ("could not connect to metrics socket");
+
+  /* The bus only writes from its main loop, so keep it running and
+   * read only when there is something to read
+   */
+  do
+    {
+      DBusPollFD poll_fd;
+
+      bus_test_run_bus_loop (context, FALSE);
+
+      poll_fd.fd = fd;
+      poll_fd.events = _DBUS_POLLIN;
+      poll_fd.revents = 0;
+
+      if (_dbus_poll (&poll_fd, 1, 0) <= 0 ||
+          (poll_fd.revents & (_DBUS_POLLIN | _DBUS_POLLHUP)) == 0)
+        {
+          bytes = -1;
+          continue;
+        }
+
+      bytes = _dbus_read_socket (fd, &text, 4096);
+      if (bytes < 0 && !_dbus_get_is_errno_eagain_or_ewouldblock ())
+        _dbus_assert_not_reached ("could not read metrics");
+    }
+  while (bytes != 0);
+
+  _dbus_close_socket (fd, NULL);
+
+  _dbus_assert (_dbus_string_ends_with_c_str (&text, "\n# EOF\n"));
+  if (find_metric (&text, "dbus_daemon_active_connections") != 2)
+    _dbus_assert_not_reached ("wrong metric value");
+  if (find_metric (&text, "dbus_daemon_match_rules") != 1)
+    _dbus_assert_not_reached ("wrong metric value");
+  if (find_metric (&text, "dbus_daemon_connection_match_rules_count") != 2)
+    _dbus_assert_not_reached ("wrong metric value");
+
+  if (!_dbus_string_append_printf (&name,
+          "dbus_connection_match_rules{unique_name=\"%s\"}",
+          dbus_bus_get_unique_name (foo)))
+    _dbus_assert_not_reached ("no memory for metric name");
+  if (find_metric (&text, _dbus_string_get_const_data (&name)) != 1)
+    _dbus_assert_not_reached ("wrong metric value");
+
+  /* the messages they sent are gone, but were counted on the way */
+  _dbus_string_set_length (&name, 0);
+  if (!_dbus_string_append_printf (&name,
+          "dbus_connection_incoming_messages{unique_name=\"%s\"}",
+          dbus_bus_get_unique_name (foo)))
+    _dbus_assert_not_reached ("no memory for metric name");
+  if (find_metric (&text, _dbus_string_get_const_data (&name)) != 0)
+    _dbus_assert_not_reached ("wrong metric value");
+
+  _dbus_string_set_length (&name, 0);
+  if (!_dbus_string_append_printf (&name,
+          "dbus_connection_peak_incoming_bytes{unique_name=\"%s\"}",
+          dbus_bus_get_unique_name (foo)))
+    _dbus_assert_not_reached ("no memory for metric name");
+  if (find_metric (&text, _dbus_string_get_const_data (&name)) == 0)
+    _dbus_assert_not_reached ("wrong metric value");
+
+  /* one unique name each */
+  if (find_metric (&text, "dbus_daemon_bus_names") != 2)
+    _dbus_assert_not_reached ("wrong metric value");
+
+  kill_client_connection_unchecked (foo);
+  kill_client_connection_unchecked (bar);
+
+  bus_context_unref (context);
+
+  if (!_dbus_delete_file (&config_file, &error))
+    _dbus_assert_not_reached ("could not delete config file");
+
+  _dbus_string_free (&config_file);
+  _dbus_string_free (&socket_path);
+  _dbus_string_free (&extra);
+  _dbus_string_free (&text);
+  _dbus_string_free (&name);
+
+  return TRUE;
+}
+#endif /* DBUS_ENABLE_STATS && DBUS_UNIX */
+
 #ifdef HAVE_UNIX_FD_PASSING
 
 dbus_bool_t
@@ -31,10 +31,13 @@
 #include "selinux.h"
 #include "signals.h"
 #include "stats.h"
+#include "test.h"
 #include "utils.h"
 #include <dbus/dbus-string.h>
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-hash.h>
 #include <dbus/dbus-message.h>
+#include <dbus/dbus-message-internal.h>
 #include <dbus/dbus-marshal-recursive.h>
 #include <string.h>
 
@@ -181,66 +184,6 @@ bus_driver_send_service_acquired (DBusConnection *connection,
     }
 }
 
-static dbus_bool_t
-create_unique_client_name (BusRegistry *registry,
-                           DBusString  *str)
-{
-  /* We never want to use the same unique client name twice, because
-   * we want to guarantee that if you send a message to a given unique
-   * name, you always get the same application. So we use two numbers
-   * for INT_MAX * INT_MAX combinations, should be pretty safe against
-   * wraparound.
-   */
-  /* FIXME these should be in BusRegistry rather than static vars */
-  static int next_major_number = 0;
-  static int next_minor_number = 0;
-  int len;
-
-  len = _dbus_string_get_length (str);
-
-  while (TRUE)
-    {
-      /* start out with 1-0, go to 1-1, 1-2, 1-3,
-       * up to 1-MAXINT, then 2-0, 2-1, etc.
-       */
-      if (next_minor_number <= 0)
-        {
-          next_major_number += 1;
-          next_minor_number = 0;
-          if (next_major_number <= 0)
-            _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
-        }
-
-      _dbus_assert (next_major_number > 0);
-      _dbus_assert (next_minor_number >= 0);
-
-      /* appname:MAJOR-MINOR */
-
-      if (!_dbus_string_append (str, ":"))
-        return FALSE;
-
-      if (!_dbus_string_append_int (str, next_major_number))
-        return FALSE;
-
-      if (!_dbus_string_append (str, "."))
-        return FALSE;
-
-      if (!_dbus_string_append_int (str, next_minor_number))
-        return FALSE;
-
-      next_minor_number += 1;
-
-      /* Check if a client with the name exists */
-      if (bus_registry_lookup (registry, str) == NULL)
-	break;
-
-      /* drop the number again, try the next one. */
-      _dbus_string_set_length (str, len);
-    }
-
-  return TRUE;
-}
-
 static dbus_bool_t
 bus_driver_handle_hello (DBusConnection *connection,
                          BusTransaction *transaction,
@@ -287,7 +230,7 @@ bus_driver_handle_hello (DBusConnection *connection,
 
   registry = bus_connection_get_registry (connection);
 
-  if (!create_unique_client_name (registry, &unique_name))
+  if (!bus_registry_new_unique_name (registry, &unique_name))
     {
       BUS_SET_OOM (error);
       goto out_0;
@@ -1156,20 +1099,17 @@ bus_driver_handle_list_queued_owners (DBusConnection *connection,
 				      DBusError      *error)
 {
   const char *text;
-  DBusList *base_names;
-  DBusList *link;
   DBusString str;
   BusRegistry *registry;
   BusService *service;
   DBusMessage *reply;
   DBusMessageIter iter, array_iter;
-  char *dbus_service_name = DBUS_SERVICE_DBUS;
+  const char *dbus_service_name = DBUS_SERVICE_DBUS;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
   registry = bus_connection_get_registry (connection);
 
-  base_names = NULL;
   text = NULL;
   reply = NULL;
 
@@ -1181,28 +1121,13 @@ bus_driver_handle_list_queued_owners (DBusConnection *connection,
   _dbus_string_init_const (&str, text);
   service = bus_registry_lookup (registry, &str);
   if (service == NULL &&
-      _dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
-    {
-      /* ORG_FREEDESKTOP_DBUS owns itself */
-      if (! _dbus_list_append (&base_names, dbus_service_name))
-        goto oom;
-    }
-  else if (service == NULL)
+      !_dbus_string_equal_c_str (&str, DBUS_SERVICE_DBUS))
     {
       dbus_set_error (error,
                       DBUS_ERROR_NAME_HAS_NO_OWNER,
                       "Could not get owners of name '%s': no such name", text);
       goto failed;
     }
-  else
-    {
-      if (!bus_service_list_queued_owners (service,
-                                           &base_names,
-                                           error))
-        goto failed;
-    }
-
-  _dbus_assert (base_names != NULL);
 
   reply = dbus_message_new_method_return (message);
   if (reply == NULL)
@@ -1215,20 +1140,18 @@ bus_driver_handle_list_queued_owners (DBusConnection *connection,
                                          &array_iter))
     goto oom;
 
-  link = _dbus_list_get_first_link (&base_names);
-  while (link != NULL)
+  if (service == NULL)
     {
-      char *uname;
-
-      _dbus_assert (link->data != NULL);
-      uname = (char *)link->data;
-
+      /* ORG_FREEDESKTOP_DBUS owns itself */
       if (!dbus_message_iter_append_basic (&array_iter,
                                            DBUS_TYPE_STRING,
-                                           &uname))
+                                           &dbus_service_name))
+        goto oom;
+    }
+  else
+    {
+      if (!bus_service_append_queued_owners (service, &array_iter))
         goto oom;
-
-      link = _dbus_list_get_next_link (&base_names, link);
     }
 
   if (! dbus_message_iter_close_container (&iter, &array_iter))
@@ -1250,9 +1173,6 @@ bus_driver_handle_list_queued_owners (DBusConnection *connection,
   if (reply)
     dbus_message_unref (reply);
 
-  if (base_names)
-    _dbus_list_clear (&base_names);
-
   return FALSE;
 }
 
@@ -1659,9 +1579,8 @@ typedef struct
                            DBusError      *error);
 } MessageHandler;
 
-/* For speed it might be useful to sort this in order of
- * frequency of use (but doesn't matter with only a few items
- * anyhow)
+/* Dispatch goes through method_table below, so the order here only
+ * affects introspection output
  */
 static const MessageHandler dbus_message_handlers[] = {
   { "Hello",
@@ -1761,8 +1680,8 @@ typedef struct {
   const char *extra_introspection;
 } InterfaceHandler;
 
-/* These should ideally be sorted by frequency of use, although it
- * probably doesn't matter with this few items */
+/* The order here only affects introspection output, and which
+ * interface wins if a method is called without one */
 static InterfaceHandler interface_handlers[] = {
   { DBUS_INTERFACE_DBUS, dbus_message_handlers,
     "    <signal name=\"NameOwnerChanged\">\n"
@@ -1783,6 +1702,113 @@ static InterfaceHandler interface_handlers[] = {
   { NULL, NULL, NULL }
 };
 
+/* All the handlers above, in an open-addressed table keyed by the hash
+ * of the method name, so that finding the handler for a call is a hash
+ * comparison rather than a strcmp against every method. The hashes are
+ * the ones cached in the message header (see
+ * _dbus_message_get_field_hash()), so in the common case nothing is
+ * hashed at all.
+ */
+#define METHOD_TABLE_SIZE 64
+
+typedef struct
+{
+  unsigned int member_hash;
+  unsigned int interface_hash;
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+} MethodTableEntry;
+
+static MethodTableEntry method_table[METHOD_TABLE_SIZE];
+static dbus_bool_t method_table_initialized = FALSE;
+
+static void
+method_table_init (void)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+  unsigned int hash, i;
+  int n_entries;
+
+  n_entries = 0;
+
+  /* Inserting in interface_handlers order means that when the same
+   * method exists on two interfaces, the first one is also found first
+   * on the probe sequence.
+   */
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          /* the signatures are checked here, once, instead of on
+           * every call; bus_driver_test() checks them in builds
+           * without assertions too */
+          _dbus_assert (_dbus_check_is_valid_signature (mh->in_args));
+          _dbus_assert (_dbus_check_is_valid_signature (mh->out_args));
+
+          n_entries += 1;
+          _dbus_assert (n_entries <= METHOD_TABLE_SIZE / 2);
+
+          hash = _dbus_hash_string (mh->name);
+          i = hash & (METHOD_TABLE_SIZE - 1);
+
+          while (method_table[i].mh != NULL)
+            i = (i + 1) & (METHOD_TABLE_SIZE - 1);
+
+          method_table[i].member_hash = hash;
+          method_table[i].interface_hash = _dbus_hash_string (ih->name);
+          method_table[i].ih = ih;
+          method_table[i].mh = mh;
+        }
+    }
+
+  method_table_initialized = TRUE;
+}
+
+static const MethodTableEntry *
+method_table_lookup (DBusMessage *message,
+                     const char  *interface,
+                     const char  *name)
+{
+  unsigned int member_hash, interface_hash, i;
+
+  if (!method_table_initialized)
+    method_table_init ();
+
+  /* The loader rejects method calls without a member, but this is
+   * what a client sent, so don't rely on that here
+   */
+  if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_MEMBER,
+                                     &member_hash))
+    return NULL;
+
+  interface_hash = 0;
+  if (interface != NULL &&
+      !_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_INTERFACE,
+                                     &interface_hash))
+    return NULL;
+
+  for (i = member_hash & (METHOD_TABLE_SIZE - 1);
+       method_table[i].mh != NULL;
+       i = (i + 1) & (METHOD_TABLE_SIZE - 1))
+    {
+      const MethodTableEntry *entry = &method_table[i];
+
+      if (entry->member_hash != member_hash ||
+          strcmp (entry->mh->name, name) != 0)
+        continue;
+
+      if (interface != NULL &&
+          (entry->interface_hash != interface_hash ||
+           strcmp (entry->ih->name, interface) != 0))
+        continue;
+
+      return entry;
+    }
+
+  return NULL;
+}
+
 static dbus_bool_t
 write_args_for_direction (DBusString *xml,
 			  const char *signature,
@@ -1935,6 +1961,7 @@ bus_driver_handle_message (DBusConnection *connection,
 {
   const char *name, *interface;
   const InterfaceHandler *ih;
+  const MethodTableEntry *entry;
   const MessageHandler *mh;
   dbus_bool_t found_interface = FALSE;
 
@@ -1972,50 +1999,49 @@ bus_driver_handle_message (DBusConnection *connection,
     }
 #endif
 
-  for (ih = interface_handlers; ih->name != NULL; ih++)
+  entry = method_table_lookup (message, interface, name);
+
+  if (entry != NULL)
     {
-      if (interface != NULL && strcmp (interface, ih->name) != 0)
-        continue;
+      mh = entry->mh;
 
-      found_interface = TRUE;
+      _dbus_verbose ("Found driver handler for %s\n", name);
 
-      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+      if (!dbus_message_has_signature (message, mh->in_args))
         {
-          if (strcmp (mh->name, name) != 0)
-            continue;
-
-          _dbus_verbose ("Found driver handler for %s\n", name);
-
-          if (!dbus_message_has_signature (message, mh->in_args))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
-                             name, dbus_message_get_signature (message),
-                             mh->in_args);
-
-              dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
-                              "Call to %s has wrong args (%s, expected %s)\n",
-                              name, dbus_message_get_signature (message),
-                              mh->in_args);
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              return FALSE;
-            }
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Call to %s has wrong args (%s, expected %s)\n",
+                         name, dbus_message_get_signature (message),
+                         mh->in_args);
+
+          dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                          "Call to %s has wrong args (%s, expected %s)\n",
+                          name, dbus_message_get_signature (message),
+                          mh->in_args);
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          return FALSE;
+        }
 
-          if ((* mh->handler) (connection, transaction, message, error))
-            {
-              _DBUS_ASSERT_ERROR_IS_CLEAR (error);
-              _dbus_verbose ("Driver handler succeeded\n");
-              return TRUE;
-            }
-          else
-            {
-              _DBUS_ASSERT_ERROR_IS_SET (error);
-              _dbus_verbose ("Driver handler returned failure\n");
-              return FALSE;
-            }
+      if ((* mh->handler) (connection, transaction, message, error))
+        {
+          _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+          _dbus_verbose ("Driver handler succeeded\n");
+          return TRUE;
+        }
+      else
+        {
+          _DBUS_ASSERT_ERROR_IS_SET (error);
+          _dbus_verbose ("Driver handler returned failure\n");
+          return FALSE;
         }
     }
 
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      if (interface == NULL || strcmp (interface, ih->name) == 0)
+        found_interface = TRUE;
+    }
+
   _dbus_verbose ("No driver handler for message \"%s\"\n",
                  name);
 
@@ -2033,3 +2059,66 @@ bus_driver_remove_connection (DBusConnection *connection)
    * with the bus driver.
    */
 }
+
+#ifdef DBUS_BUILD_TESTS
+
+/* Checks that every handler in the static table has valid signatures
+ * and is what a call to it finds, with or without its interface
+ */
+dbus_bool_t
+bus_driver_test (const DBusString *test_data_dir)
+{
+  const InterfaceHandler *ih;
+  const MessageHandler *mh;
+
+  for (ih = interface_handlers; ih->name != NULL; ih++)
+    {
+      for (mh = ih->message_handlers; mh->name != NULL; mh++)
+        {
+          DBusMessage *message;
+          const MethodTableEntry *entry;
+
+          if (!_dbus_check_is_valid_signature (mh->in_args) ||
+              !_dbus_check_is_valid_signature (mh->out_args))
+            {
+              _dbus_warn ("Bus driver method %s.%s has an invalid signature\n",
+                          ih->name, mh->name);
+              return FALSE;
+            }
+
+          message = dbus_message_new_method_call (DBUS_SERVICE_DBUS,
+                                                  DBUS_PATH_DBUS,
+                                                  ih->name,
+                                                  mh->name);
+          if (message == NULL)
+            _dbus_assert_not_reached ("no memory for method call");
+
+          entry = method_table_lookup (message, ih->name, mh->name);
+          if (entry == NULL || entry->ih != ih || entry->mh != mh)
+            {
+              _dbus_warn ("Bus driver method %s.%s is not in the method table\n",
+                          ih->name, mh->name);
+              dbus_message_unref (message);
+              return FALSE;
+            }
+
+          if (!dbus_message_set_interface (message, NULL))
+            _dbus_assert_not_reached ("no memory to unset interface");
+
+          entry = method_table_lookup (message, NULL, mh->name);
+          if (entry == NULL || strcmp (entry->mh->name, mh->name) != 0)
+            {
+              _dbus_warn ("Bus driver method %s is not found without an interface\n",
+                          mh->name);
+              dbus_message_unref (message);
+              return FALSE;
+            }
+
+          dbus_message_unref (message);
+        }
+    }
+
+  return TRUE;
+}
+
+#endif /* DBUS_BUILD_TESTS */
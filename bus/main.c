@@ -25,6 +25,7 @@
 #include "bus.h"
 #include "driver.h"
 #include <dbus/dbus-internals.h>
+#include <dbus/dbus-spawn.h>
 #include <dbus/dbus-watch.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -615,6 +616,16 @@ main (int argc, char **argv)
    */
 
 #ifdef DBUS_UNIX
+  /* Fork the helper that spawns activated services while we are still
+   * small, and before we install our signal handlers
+   */
+  if (!_dbus_spawn_server_start (&error))
+    {
+      _dbus_warn ("Unable to start spawn server, activation will fork "
+                  "the bus daemon: %s\n", error.message);
+      dbus_error_free (&error);
+    }
+
   setup_reload_pipe (bus_context_get_loop (context));
 
   /* POSIX signals are Unix-specific, and _dbus_set_signal_handler is
@@ -630,12 +641,17 @@ main (int argc, char **argv)
 #endif /* DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX */
 #endif /* DBUS_UNIX */
 
+  bus_context_preactivate_services (context);
+
   _dbus_verbose ("We are on D-Bus...\n");
   _dbus_loop_run (bus_context_get_loop (context));
 
   bus_context_shutdown (context);
   bus_context_unref (context);
   bus_selinux_shutdown ();
+#ifdef DBUS_UNIX
+  _dbus_spawn_server_stop ();
+#endif
 
   return 0;
 }
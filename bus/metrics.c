@@ -0,0 +1,649 @@
+/* metrics.c - serve bus statistics as OpenMetrics text
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#include <config.h>
+#include "metrics.h"
+
+#include <dbus/dbus-internals.h>
+#include <dbus/dbus-connection-internal.h>
+#include <dbus/dbus-list.h>
+#include <dbus/dbus-mainloop.h>
+#include <dbus/dbus-watch.h>
+
+#include "connection.h"
+#include "utils.h"
+
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+
+#include <dbus/dbus-sysdeps-unix.h>
+
+/* The metrics socket is a plain stream socket, not a D-Bus server: each
+ * client that connects is sent one snapshot of the statistics in
+ * OpenMetrics text format, after which the daemon closes the connection.
+ * Everything happens from the bus's own main loop, so collecting the
+ * statistics doesn't need a D-Bus round trip.
+ */
+
+/** Don't buffer replies for more than this many clients at once */
+#define MAX_METRICS_CLIENTS 16
+
+typedef struct
+{
+  BusMetrics *metrics;
+  int fd;
+  DBusWatch *watch;
+  DBusString text;
+  int written;
+} BusMetricsClient;
+
+struct BusMetrics
+{
+  BusContext *context;
+  int listen_fd;
+  char *path;                    /**< socket to unlink, or NULL if abstract */
+  DBusWatch *watch;
+  DBusList *clients;
+};
+
+/* Statistics kept for each active connection, in the order they are
+ * reported; CONNECTION_METRIC_* below index into this
+ */
+static const char * const connection_metrics[] = {
+  "match_rules",
+  "peak_match_rules",
+  "bus_names",
+  "peak_bus_names",
+  "incoming_messages",
+  "incoming_bytes",
+  "incoming_fds",
+  "peak_incoming_bytes",
+  "peak_incoming_fds",
+  "outgoing_messages",
+  "outgoing_bytes",
+  "outgoing_fds",
+  "peak_outgoing_bytes",
+  "peak_outgoing_fds"
+};
+
+enum
+{
+  CONNECTION_METRIC_MATCH_RULES = 0,
+  CONNECTION_METRIC_BUS_NAMES = 2,
+  CONNECTION_METRIC_INCOMING_BYTES = 5,
+  CONNECTION_METRIC_OUTGOING_BYTES = 10,
+  N_CONNECTION_METRICS = _DBUS_N_ELEMENTS (connection_metrics)
+};
+
+typedef struct
+{
+  const char *name;
+  dbus_uint32_t values[N_CONNECTION_METRICS];
+} ConnectionSample;
+
+typedef struct
+{
+  ConnectionSample *samples;
+  int n_samples;
+  int max_samples;
+} SampleCollector;
+
+/* Upper bounds of the histogram buckets; +Inf is implied */
+static const dbus_uint32_t count_buckets[] = {
+  0, 1, 4, 16, 64, 256, 1024
+};
+
+static const dbus_uint32_t byte_buckets[] = {
+  0, 1024, 16384, 262144, 4194304, 67108864
+};
+
+/* libdbus statistics (see dbus_get_statistic()) that only ever go up */
+static const char * const library_counters[] = {
+  "MessageCacheHits",
+  "MessageCacheMisses",
+  "MessageCacheEvictions",
+  "StringReallocations"
+};
+
+static dbus_bool_t
+append_family (DBusString *str,
+               const char *prefix,
+               const char *name,
+               const char *type)
+{
+  return _dbus_string_append_printf (str, "# TYPE %s%s %s\n",
+                                     prefix, name, type);
+}
+
+static dbus_bool_t
+append_gauge (DBusString    *str,
+              const char    *name,
+              dbus_uint32_t  value)
+{
+  return append_family (str, "dbus_daemon_", name, "gauge") &&
+    _dbus_string_append_printf (str, "dbus_daemon_%s %u\n", name, value);
+}
+
+/* "ListMemPoolUsedBytes" -> "list_mem_pool_used_bytes" */
+static dbus_bool_t
+append_snake_case (DBusString *str,
+                   const char *camel)
+{
+  const char *p;
+
+  for (p = camel; *p != '\0'; p++)
+    {
+      if (*p >= 'A' && *p <= 'Z')
+        {
+          if (p > camel && p[-1] >= 'a' && p[-1] <= 'z' &&
+              !_dbus_string_append_byte (str, '_'))
+            return FALSE;
+
+          if (!_dbus_string_append_byte (str, *p - 'A' + 'a'))
+            return FALSE;
+        }
+      else if (!_dbus_string_append_byte (str, *p))
+        {
+          return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_library_statistics (DBusString *str)
+{
+  DBusString name;
+  const char *camel;
+  dbus_uint32_t value;
+  dbus_bool_t is_counter;
+  int i, j;
+
+  if (!_dbus_string_init (&name))
+    return FALSE;
+
+  for (i = 0; dbus_get_statistic (i, &camel, &value); i++)
+    {
+      is_counter = FALSE;
+
+      for (j = 0; j < _DBUS_N_ELEMENTS (library_counters); j++)
+        {
+          if (strcmp (camel, library_counters[j]) == 0)
+            is_counter = TRUE;
+        }
+
+      _dbus_string_set_length (&name, 0);
+
+      if (!append_snake_case (&name, camel) ||
+          !append_family (str, "dbus_libdbus_",
+                          _dbus_string_get_const_data (&name),
+                          is_counter ? "counter" : "gauge") ||
+          !_dbus_string_append_printf (str, "dbus_libdbus_%s%s %u\n",
+                                       _dbus_string_get_const_data (&name),
+                                       is_counter ? "_total" : "",
+                                       value))
+        {
+          _dbus_string_free (&name);
+          return FALSE;
+        }
+    }
+
+  _dbus_string_free (&name);
+  return TRUE;
+}
+
+static dbus_bool_t
+collect_sample (DBusConnection *connection,
+                void           *data)
+{
+  SampleCollector *collector = data;
+  ConnectionSample *sample;
+  dbus_uint32_t *v;
+
+  if (collector->n_samples >= collector->max_samples)
+    return FALSE;
+
+  sample = &collector->samples[collector->n_samples];
+  v = sample->values;
+
+  sample->name = bus_connection_get_name (connection);
+  if (sample->name == NULL)
+    return TRUE;
+
+  v[0] = bus_connection_get_n_match_rules (connection);
+  v[1] = bus_connection_get_peak_match_rules (connection);
+  v[2] = bus_connection_get_n_services_owned (connection);
+  v[3] = bus_connection_get_peak_bus_names (connection);
+
+  _dbus_connection_get_stats (connection,
+                              &v[4], &v[5], &v[6], &v[7], &v[8],
+                              &v[9], &v[10], &v[11], &v[12], &v[13]);
+
+  collector->n_samples += 1;
+  return TRUE;
+}
+
+static dbus_bool_t
+append_connection_statistics (DBusString            *str,
+                              const SampleCollector *collector)
+{
+  int i, j;
+
+  for (i = 0; i < N_CONNECTION_METRICS; i++)
+    {
+      if (!append_family (str, "dbus_connection_", connection_metrics[i],
+                          "gauge"))
+        return FALSE;
+
+      for (j = 0; j < collector->n_samples; j++)
+        {
+          if (!_dbus_string_append_printf (str,
+                  "dbus_connection_%s{unique_name=\"%s\"} %u\n",
+                  connection_metrics[i], collector->samples[j].name,
+                  collector->samples[j].values[i]))
+            return FALSE;
+        }
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+append_histogram (DBusString            *str,
+                  const SampleCollector *collector,
+                  int                    metric,
+                  const dbus_uint32_t   *buckets,
+                  int                    n_buckets)
+{
+  const char *name = connection_metrics[metric];
+  unsigned long sum;
+  int i, j, n;
+
+  if (!append_family (str, "dbus_daemon_connection_", name, "histogram"))
+    return FALSE;
+
+  for (i = 0; i < n_buckets; i++)
+    {
+      n = 0;
+
+      for (j = 0; j < collector->n_samples; j++)
+        {
+          if (collector->samples[j].values[metric] <= buckets[i])
+            n++;
+        }
+
+      if (!_dbus_string_append_printf (str,
+              "dbus_daemon_connection_%s_bucket{le=\"%u\"} %d\n",
+              name, buckets[i], n))
+        return FALSE;
+    }
+
+  sum = 0;
+
+  for (j = 0; j < collector->n_samples; j++)
+    sum += collector->samples[j].values[metric];
+
+  return _dbus_string_append_printf (str,
+      "dbus_daemon_connection_%s_bucket{le=\"+Inf\"} %d\n"
+      "dbus_daemon_connection_%s_count %d\n"
+      "dbus_daemon_connection_%s_sum %lu\n",
+      name, collector->n_samples, name, collector->n_samples, name, sum);
+}
+
+/* Appends a snapshot of the same statistics that GetStats and
+ * GetConnectionStats report, for all active connections, in OpenMetrics
+ * text format. Returns FALSE if not enough memory.
+ */
+static dbus_bool_t
+append_metrics_text (BusContext *context,
+                     DBusString *str)
+{
+  BusConnections *connections;
+  SampleCollector collector;
+  dbus_bool_t retval;
+
+  connections = bus_context_get_connections (context);
+  retval = FALSE;
+
+  collector.n_samples = 0;
+  collector.max_samples = bus_connections_get_n_active (connections);
+  collector.samples = dbus_new (ConnectionSample,
+                                MAX (collector.max_samples, 1));
+
+  if (collector.samples == NULL)
+    return FALSE;
+
+  bus_connections_foreach_active (connections, collect_sample, &collector);
+
+  if (!append_gauge (str, "active_connections",
+        bus_connections_get_n_active (connections)) ||
+      !append_gauge (str, "incomplete_connections",
+        bus_connections_get_n_incomplete (connections)) ||
+      !append_gauge (str, "match_rules",
+        bus_connections_get_total_match_rules (connections)) ||
+      !append_gauge (str, "peak_match_rules",
+        bus_connections_get_peak_match_rules (connections)) ||
+      !append_gauge (str, "peak_match_rules_per_connection",
+        bus_connections_get_peak_match_rules_per_conn (connections)) ||
+      !append_gauge (str, "bus_names",
+        bus_connections_get_total_bus_names (connections)) ||
+      !append_gauge (str, "peak_bus_names",
+        bus_connections_get_peak_bus_names (connections)) ||
+      !append_gauge (str, "peak_bus_names_per_connection",
+        bus_connections_get_peak_bus_names_per_conn (connections)))
+    goto out;
+
+  if (!append_histogram (str, &collector, CONNECTION_METRIC_MATCH_RULES,
+                         count_buckets, _DBUS_N_ELEMENTS (count_buckets)) ||
+      !append_histogram (str, &collector, CONNECTION_METRIC_BUS_NAMES,
+                         count_buckets, _DBUS_N_ELEMENTS (count_buckets)) ||
+      !append_histogram (str, &collector, CONNECTION_METRIC_INCOMING_BYTES,
+                         byte_buckets, _DBUS_N_ELEMENTS (byte_buckets)) ||
+      !append_histogram (str, &collector, CONNECTION_METRIC_OUTGOING_BYTES,
+                         byte_buckets, _DBUS_N_ELEMENTS (byte_buckets)))
+    goto out;
+
+  if (!append_connection_statistics (str, &collector) ||
+      !append_library_statistics (str) ||
+      !_dbus_string_append (str, "# EOF\n"))
+    goto out;
+
+  retval = TRUE;
+
+ out:
+  dbus_free (collector.samples);
+  return retval;
+}
+
+static void
+client_free (BusMetricsClient *client)
+{
+  BusMetrics *metrics = client->metrics;
+
+  _dbus_list_remove (&metrics->clients, client);
+
+  if (client->watch != NULL)
+    {
+      _dbus_loop_remove_watch (bus_context_get_loop (metrics->context),
+                               client->watch);
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+    }
+
+  _dbus_close_socket (client->fd, NULL);
+  _dbus_string_free (&client->text);
+  dbus_free (client);
+}
+
+static dbus_bool_t
+handle_client_watch (DBusWatch    *watch,
+                     unsigned int  flags,
+                     void         *data)
+{
+  BusMetricsClient *client = data;
+  int remaining, bytes;
+
+  remaining = _dbus_string_get_length (&client->text) - client->written;
+
+  bytes = _dbus_write_socket (client->fd, &client->text,
+                              client->written, remaining);
+
+  if (bytes < 0 && _dbus_get_is_errno_eagain_or_ewouldblock ())
+    return TRUE;
+
+  if (bytes < 0)
+    {
+      _dbus_verbose ("Failed to write metrics: %s\n",
+                     _dbus_strerror_from_errno ());
+      client_free (client);
+      return TRUE;
+    }
+
+  client->written += bytes;
+
+  if (client->written == _dbus_string_get_length (&client->text))
+    client_free (client);
+
+  return TRUE;
+}
+
+static void
+accept_client (BusMetrics *metrics,
+               int         fd)
+{
+  BusMetricsClient *client;
+
+  client = dbus_new0 (BusMetricsClient, 1);
+  if (client == NULL)
+    {
+      _dbus_close_socket (fd, NULL);
+      return;
+    }
+
+  client->metrics = metrics;
+  client->fd = fd;
+
+  if (!_dbus_string_init (&client->text))
+    {
+      _dbus_close_socket (fd, NULL);
+      dbus_free (client);
+      return;
+    }
+
+  if (!_dbus_list_append (&metrics->clients, client))
+    {
+      _dbus_string_free (&client->text);
+      _dbus_close_socket (fd, NULL);
+      dbus_free (client);
+      return;
+    }
+
+  if (!_dbus_set_fd_nonblocking (fd, NULL) ||
+      !append_metrics_text (metrics->context, &client->text))
+    {
+      client_free (client);
+      return;
+    }
+
+  client->watch = _dbus_watch_new (fd, DBUS_WATCH_WRITABLE, TRUE,
+                                   handle_client_watch, client, NULL);
+
+  if (client->watch == NULL)
+    {
+      client_free (client);
+      return;
+    }
+
+  if (!_dbus_loop_add_watch (bus_context_get_loop (metrics->context),
+                             client->watch))
+    {
+      _dbus_watch_invalidate (client->watch);
+      _dbus_watch_unref (client->watch);
+      client->watch = NULL;
+      client_free (client);
+      return;
+    }
+}
+
+static dbus_bool_t
+handle_listen_watch (DBusWatch    *watch,
+                     unsigned int  flags,
+                     void         *data)
+{
+  BusMetrics *metrics = data;
+  int fd;
+
+  fd = _dbus_accept (metrics->listen_fd);
+
+  if (fd < 0)
+    {
+      if (!_dbus_get_is_errno_eagain_or_ewouldblock ())
+        _dbus_verbose ("Failed to accept metrics client: %s\n",
+                       _dbus_strerror_from_errno ());
+      return TRUE;
+    }
+
+  if (_dbus_list_get_length (&metrics->clients) >= MAX_METRICS_CLIENTS)
+    {
+      _dbus_verbose ("Too many metrics clients, dropping new one\n");
+      _dbus_close_socket (fd, NULL);
+      return TRUE;
+    }
+
+  accept_client (metrics, fd);
+  return TRUE;
+}
+
+/**
+ * Starts serving statistics on a Unix socket. The address uses D-Bus
+ * address syntax, but only the unix:path=... and unix:abstract=...
+ * forms are accepted.
+ *
+ * @param context the bus context, whose main loop will be used
+ * @param address the address to listen on
+ * @param error return location for errors
+ * @returns the new metrics listener, or #NULL on error
+ */
+BusMetrics *
+bus_metrics_new (BusContext *context,
+                 const char *address,
+                 DBusError  *error)
+{
+  BusMetrics *metrics;
+  DBusAddressEntry **entries;
+  const char *method, *path, *abstract;
+  int n_entries;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (!dbus_parse_address (address, &entries, &n_entries, error))
+    return NULL;
+
+  metrics = NULL;
+  method = NULL;
+  path = NULL;
+  abstract = NULL;
+
+  if (n_entries == 1)
+    {
+      method = dbus_address_entry_get_method (entries[0]);
+      path = dbus_address_entry_get_value (entries[0], "path");
+      abstract = dbus_address_entry_get_value (entries[0], "abstract");
+    }
+
+  if (n_entries != 1 || strcmp (method, "unix") != 0 ||
+      (path == NULL) == (abstract == NULL))
+    {
+      dbus_set_error (error, DBUS_ERROR_BAD_ADDRESS,
+                      "Metrics address \"%s\" must be a single "
+                      "unix:path=... or unix:abstract=... address",
+                      address);
+      goto failed;
+    }
+
+  metrics = dbus_new0 (BusMetrics, 1);
+  if (metrics == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  metrics->context = context;
+  metrics->listen_fd = -1;
+
+  if (path != NULL)
+    {
+      metrics->path = _dbus_strdup (path);
+      if (metrics->path == NULL)
+        {
+          BUS_SET_OOM (error);
+          goto failed;
+        }
+    }
+
+  metrics->listen_fd = _dbus_listen_unix_socket (path != NULL ? path : abstract,
+                                                 path == NULL, error);
+  if (metrics->listen_fd < 0)
+    {
+      _DBUS_ASSERT_ERROR_IS_SET (error);
+      goto failed;
+    }
+
+  metrics->watch = _dbus_watch_new (metrics->listen_fd, DBUS_WATCH_READABLE,
+                                    TRUE, handle_listen_watch, metrics, NULL);
+  if (metrics->watch == NULL)
+    {
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  if (!_dbus_loop_add_watch (bus_context_get_loop (context), metrics->watch))
+    {
+      _dbus_watch_invalidate (metrics->watch);
+      _dbus_watch_unref (metrics->watch);
+      metrics->watch = NULL;
+      BUS_SET_OOM (error);
+      goto failed;
+    }
+
+  dbus_address_entries_free (entries);
+  return metrics;
+
+ failed:
+  dbus_address_entries_free (entries);
+
+  if (metrics != NULL)
+    bus_metrics_free (metrics);
+
+  return NULL;
+}
+
+void
+bus_metrics_free (BusMetrics *metrics)
+{
+  while (metrics->clients != NULL)
+    client_free (metrics->clients->data);
+
+  if (metrics->watch != NULL)
+    {
+      _dbus_loop_remove_watch (bus_context_get_loop (metrics->context),
+                               metrics->watch);
+      _dbus_watch_invalidate (metrics->watch);
+      _dbus_watch_unref (metrics->watch);
+    }
+
+  if (metrics->listen_fd >= 0)
+    {
+      _dbus_close_socket (metrics->listen_fd, NULL);
+
+      if (metrics->path != NULL)
+        {
+          DBusString path;
+
+          _dbus_string_init_const (&path, metrics->path);
+          _dbus_delete_file (&path, NULL);
+        }
+    }
+
+  dbus_free (metrics->path);
+  dbus_free (metrics);
+}
+
+#endif /* DBUS_ENABLE_STATS && DBUS_UNIX */
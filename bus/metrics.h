@@ -0,0 +1,34 @@
+/* metrics.h - serve bus statistics as OpenMetrics text
+ *
+ * Licensed under the Academic Free License version 2.1
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ */
+
+#ifndef BUS_METRICS_H
+#define BUS_METRICS_H
+
+#include "bus.h"
+
+typedef struct BusMetrics BusMetrics;
+
+/* only present if DBUS_ENABLE_STATS, and only on Unix */
+BusMetrics  *bus_metrics_new         (BusContext       *context,
+                                      const char       *address,
+                                      DBusError        *error);
+void         bus_metrics_free        (BusMetrics       *metrics);
+
+#endif /* multiple-inclusion guard */
@@ -688,6 +688,309 @@ bus_policy_merge (BusPolicy *policy,
   return TRUE;
 }
 
+/**
+ * What changed between two policies, in terms of which connections
+ * it concerns.
+ */
+struct BusPolicyDiff
+{
+  unsigned int all : 1;     /**< default or mandatory rules changed */
+  unsigned int console : 1; /**< at_console rules changed */
+  DBusHashTable *uids;      /**< uids whose <policy user=""> changed */
+  DBusHashTable *gids;      /**< gids whose <policy group=""> changed */
+};
+
+static dbus_bool_t
+strings_equal_or_both_null (const char *a,
+                            const char *b)
+{
+  if (a == NULL || b == NULL)
+    return a == b;
+
+  return strcmp (a, b) == 0;
+}
+
+static dbus_bool_t
+rules_equal (const BusPolicyRule *a,
+             const BusPolicyRule *b)
+{
+  if (a == b)
+    return TRUE;
+
+  if (a->type != b->type || a->allow != b->allow)
+    return FALSE;
+
+  switch (a->type)
+    {
+    case BUS_POLICY_RULE_SEND:
+      return a->d.send.message_type == b->d.send.message_type &&
+        strings_equal_or_both_null (a->d.send.path, b->d.send.path) &&
+        strings_equal_or_both_null (a->d.send.interface, b->d.send.interface) &&
+        strings_equal_or_both_null (a->d.send.member, b->d.send.member) &&
+        strings_equal_or_both_null (a->d.send.error, b->d.send.error) &&
+        strings_equal_or_both_null (a->d.send.destination, b->d.send.destination) &&
+        a->d.send.eavesdrop == b->d.send.eavesdrop &&
+        a->d.send.requested_reply == b->d.send.requested_reply &&
+        a->d.send.log == b->d.send.log;
+
+    case BUS_POLICY_RULE_RECEIVE:
+      return a->d.receive.message_type == b->d.receive.message_type &&
+        strings_equal_or_both_null (a->d.receive.path, b->d.receive.path) &&
+        strings_equal_or_both_null (a->d.receive.interface, b->d.receive.interface) &&
+        strings_equal_or_both_null (a->d.receive.member, b->d.receive.member) &&
+        strings_equal_or_both_null (a->d.receive.error, b->d.receive.error) &&
+        strings_equal_or_both_null (a->d.receive.origin, b->d.receive.origin) &&
+        a->d.receive.eavesdrop == b->d.receive.eavesdrop &&
+        a->d.receive.requested_reply == b->d.receive.requested_reply;
+
+    case BUS_POLICY_RULE_OWN:
+      return strings_equal_or_both_null (a->d.own.service_name,
+                                         b->d.own.service_name) &&
+        a->d.own.prefix == b->d.own.prefix;
+
+    case BUS_POLICY_RULE_USER:
+      return a->d.user.uid == b->d.user.uid;
+
+    case BUS_POLICY_RULE_GROUP:
+      return a->d.group.gid == b->d.group.gid;
+    }
+
+  _dbus_assert_not_reached ("unknown policy rule type");
+  return FALSE;
+}
+
+/* If the lists hold equal rules in the same order, make the new one
+ * share the old one's rule objects and return #TRUE. Clients built
+ * from the old policy already hold references to those.
+ */
+static dbus_bool_t
+share_equal_rule_list (DBusList **old_list,
+                       DBusList **new_list)
+{
+  DBusList *old_link;
+  DBusList *new_link;
+
+  old_link = _dbus_list_get_first_link (old_list);
+  new_link = _dbus_list_get_first_link (new_list);
+  while (old_link != NULL && new_link != NULL)
+    {
+      if (!rules_equal (old_link->data, new_link->data))
+        return FALSE;
+
+      old_link = _dbus_list_get_next_link (old_list, old_link);
+      new_link = _dbus_list_get_next_link (new_list, new_link);
+    }
+
+  if (old_link != NULL || new_link != NULL)
+    return FALSE;
+
+  old_link = _dbus_list_get_first_link (old_list);
+  new_link = _dbus_list_get_first_link (new_list);
+  while (old_link != NULL)
+    {
+      if (old_link->data != new_link->data)
+        {
+          bus_policy_rule_ref (old_link->data);
+          bus_policy_rule_unref (new_link->data);
+          new_link->data = old_link->data;
+        }
+
+      old_link = _dbus_list_get_next_link (old_list, old_link);
+      new_link = _dbus_list_get_next_link (new_list, new_link);
+    }
+
+  return TRUE;
+}
+
+static dbus_bool_t
+diff_id_hash (DBusHashTable *old_hash,
+              DBusHashTable *new_hash,
+              DBusHashTable *changed)
+{
+  DBusHashIter iter;
+
+  _dbus_hash_iter_init (old_hash, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      uintptr_t id = _dbus_hash_iter_get_uintptr_key (&iter);
+      DBusList **old_list = _dbus_hash_iter_get_value (&iter);
+      DBusList **new_list = _dbus_hash_table_lookup_uintptr (new_hash, id);
+
+      if (new_list == NULL ||
+          !share_equal_rule_list (old_list, new_list))
+        {
+          if (!_dbus_hash_table_insert_uintptr (changed, id, changed))
+            return FALSE;
+        }
+    }
+
+  _dbus_hash_iter_init (new_hash, &iter);
+  while (_dbus_hash_iter_next (&iter))
+    {
+      uintptr_t id = _dbus_hash_iter_get_uintptr_key (&iter);
+
+      if (_dbus_hash_table_lookup_uintptr (old_hash, id) == NULL &&
+          !_dbus_hash_table_insert_uintptr (changed, id, changed))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/**
+ * Compares the policy that was in force with one that is replacing
+ * it, section by section. Sections of the new policy that are equal
+ * to the old ones are made to share the old rule objects, so that
+ * clients that are not affected by the change can keep their
+ * #BusClientPolicy.
+ *
+ * @param old_policy the policy being replaced
+ * @param new_policy the replacement, which may be modified as above
+ * @returns the differences, or #NULL if out of memory
+ */
+BusPolicyDiff *
+bus_policy_diff_new (BusPolicy *old_policy,
+                     BusPolicy *new_policy)
+{
+  BusPolicyDiff *diff;
+
+  diff = dbus_new0 (BusPolicyDiff, 1);
+  if (diff == NULL)
+    return NULL;
+
+  diff->uids = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (diff->uids == NULL)
+    goto nomem;
+
+  diff->gids = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (diff->gids == NULL)
+    goto nomem;
+
+  /* Evaluate both, so that both get to share */
+  if (!share_equal_rule_list (&old_policy->default_rules,
+                              &new_policy->default_rules))
+    diff->all = TRUE;
+
+  if (!share_equal_rule_list (&old_policy->mandatory_rules,
+                              &new_policy->mandatory_rules))
+    diff->all = TRUE;
+
+  if (!share_equal_rule_list (&old_policy->at_console_true_rules,
+                              &new_policy->at_console_true_rules))
+    diff->console = TRUE;
+
+  if (!share_equal_rule_list (&old_policy->at_console_false_rules,
+                              &new_policy->at_console_false_rules))
+    diff->console = TRUE;
+
+  if (!diff_id_hash (old_policy->rules_by_uid, new_policy->rules_by_uid,
+                     diff->uids))
+    goto nomem;
+
+  if (!diff_id_hash (old_policy->rules_by_gid, new_policy->rules_by_gid,
+                     diff->gids))
+    goto nomem;
+
+  /* Which connections group and at_console sections apply to can
+   * change without the policy changing, when a user is added to a
+   * group or logs in; a reload is how that gets picked up, so it
+   * has to rebuild every client policy.
+   */
+  if (_dbus_hash_table_get_n_entries (old_policy->rules_by_gid) > 0 ||
+      _dbus_hash_table_get_n_entries (new_policy->rules_by_gid) > 0 ||
+      old_policy->at_console_true_rules != NULL ||
+      old_policy->at_console_false_rules != NULL ||
+      new_policy->at_console_true_rules != NULL ||
+      new_policy->at_console_false_rules != NULL)
+    diff->all = TRUE;
+
+  return diff;
+
+ nomem:
+  bus_policy_diff_free (diff);
+  return NULL;
+}
+
+void
+bus_policy_diff_free (BusPolicyDiff *diff)
+{
+  if (diff->uids != NULL)
+    _dbus_hash_table_unref (diff->uids);
+
+  if (diff->gids != NULL)
+    _dbus_hash_table_unref (diff->gids);
+
+  dbus_free (diff);
+}
+
+/**
+ * @returns #TRUE if the two policies compared were equal, and no
+ * client policy needs rebuilding
+ */
+dbus_bool_t
+bus_policy_diff_is_empty (BusPolicyDiff *diff)
+{
+  return !diff->all && !diff->console &&
+    _dbus_hash_table_get_n_entries (diff->uids) == 0 &&
+    _dbus_hash_table_get_n_entries (diff->gids) == 0;
+}
+
+/**
+ * Checks whether a client policy built for the connection under the
+ * old policy could differ from one built under the new policy. If the
+ * connection's groups can't be determined, it is assumed to be
+ * affected.
+ */
+dbus_bool_t
+bus_policy_diff_affects_connection (BusPolicyDiff  *diff,
+                                    DBusConnection *connection)
+{
+  unsigned long uid;
+  dbus_bool_t affected;
+
+  if (diff->all)
+    return TRUE;
+
+  if (dbus_connection_get_unix_user (connection, &uid))
+    {
+      /* Every connection with a uid gets one of the console lists */
+      if (diff->console)
+        return TRUE;
+
+      if (_dbus_hash_table_lookup_uintptr (diff->uids, uid) != NULL)
+        return TRUE;
+    }
+
+  affected = FALSE;
+
+  if (_dbus_hash_table_get_n_entries (diff->gids) > 0)
+    {
+      unsigned long *groups;
+      int n_groups;
+      int i;
+      DBusError error;
+
+      dbus_error_init (&error);
+
+      if (!bus_connection_get_unix_groups (connection, &groups, &n_groups,
+                                           &error))
+        {
+          dbus_error_free (&error);
+          return TRUE;
+        }
+
+      for (i = 0; i < n_groups && !affected; i++)
+        {
+          if (_dbus_hash_table_lookup_uintptr (diff->gids, groups[i]) != NULL)
+            affected = TRUE;
+        }
+
+      dbus_free (groups);
+    }
+
+  return affected;
+}
+
 struct BusClientPolicy
 {
   int refcount;
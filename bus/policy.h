@@ -137,6 +137,15 @@ dbus_bool_t      bus_policy_append_console_rule   (BusPolicy        *policy,
 dbus_bool_t      bus_policy_merge                 (BusPolicy        *policy,
                                                    BusPolicy        *to_absorb);
 
+typedef struct BusPolicyDiff BusPolicyDiff;
+
+BusPolicyDiff*   bus_policy_diff_new                (BusPolicy      *old_policy,
+                                                     BusPolicy      *new_policy);
+void             bus_policy_diff_free               (BusPolicyDiff  *diff);
+dbus_bool_t      bus_policy_diff_is_empty           (BusPolicyDiff  *diff);
+dbus_bool_t      bus_policy_diff_affects_connection (BusPolicyDiff  *diff,
+                                                     DBusConnection *connection);
+
 BusClientPolicy* bus_client_policy_new               (void);
 BusClientPolicy* bus_client_policy_ref               (BusClientPolicy  *policy);
 void             bus_client_policy_unref             (BusClientPolicy  *policy);
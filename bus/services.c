@@ -27,6 +27,7 @@
 #include <dbus/dbus-list.h>
 #include <dbus/dbus-mempool.h>
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
 
 #include "driver.h"
 #include "services.h"
@@ -44,8 +45,19 @@ struct BusService
   BusRegistry *registry;
   char *name;
   DBusList *owners;
+  int n_owners;
+
+  /* Maps each queued DBusConnection to its link in owners, once the
+   * queue is long enough for walking it to matter. Like
+   * unique_name_table this is only a cache: if it is NULL, or an
+   * insertion ran out of memory (which drops it), owners is searched.
+   */
+  DBusHashTable *owner_index;
 };
 
+/* Queues shorter than this are cheaper to walk than to index */
+#define OWNER_INDEX_MIN_OWNERS 8
+
 struct BusOwner
 {
   int refcount;
@@ -68,6 +80,15 @@ struct BusRegistry
   DBusMemPool   *owner_pool;
 
   DBusHashTable *service_sid_table;
+
+  /* Unique names are by far the most common message destinations, so
+   * the ones with the current major number are also indexed by their
+   * minor number. This is only a cache: anything missing from it is
+   * still found in service_hash.
+   */
+  DBusHashTable *unique_name_table;
+  int next_major_number;
+  int next_minor_number;
 };
 
 BusRegistry*
@@ -99,6 +120,11 @@ bus_registry_new (BusContext *context)
   if (registry->owner_pool == NULL)
     goto failed;
 
+  registry->unique_name_table = _dbus_hash_table_new (DBUS_HASH_INT,
+                                                      NULL, NULL);
+  if (registry->unique_name_table == NULL)
+    goto failed;
+
   registry->service_sid_table = NULL;
   
   return registry;
@@ -133,29 +159,314 @@ bus_registry_unref  (BusRegistry *registry)
         _dbus_mem_pool_free (registry->owner_pool);
       if (registry->service_sid_table)
         _dbus_hash_table_unref (registry->service_sid_table);
+      if (registry->unique_name_table)
+        _dbus_hash_table_unref (registry->unique_name_table);
       
       dbus_free (registry);
     }
 }
 
+/* Parses a decimal number with no sign or leading zeroes, as written
+ * by _dbus_string_append_int(); returns -1 if there isn't one.
+ */
+static int
+parse_unique_name_number (const char **p_inout)
+{
+  const char *p = *p_inout;
+  int n;
+
+  if (*p < '0' || *p > '9' || (*p == '0' && p[1] >= '0' && p[1] <= '9'))
+    return -1;
+
+  n = 0;
+  while (*p >= '0' && *p <= '9')
+    {
+      if (n > (_DBUS_INT_MAX - (*p - '0')) / 10)
+        return -1;
+
+      n = n * 10 + (*p - '0');
+      p++;
+    }
+
+  *p_inout = p;
+  return n;
+}
+
+/* Splits a name of the form created by bus_registry_new_unique_name()
+ * into its numbers; any other name, even one that would compare as the
+ * same numbers, is rejected.
+ */
+static dbus_bool_t
+parse_unique_name (const char *name,
+                   int        *major_p,
+                   int        *minor_p)
+{
+  const char *p = name;
+
+  if (*p != ':')
+    return FALSE;
+  p++;
+
+  *major_p = parse_unique_name_number (&p);
+  if (*major_p < 0 || *p != '.')
+    return FALSE;
+  p++;
+
+  *minor_p = parse_unique_name_number (&p);
+  if (*minor_p < 0 || *p != '\0')
+    return FALSE;
+
+  return TRUE;
+}
+
+static void
+unique_name_table_add (BusRegistry *registry,
+                       BusService  *service)
+{
+  int major, minor;
+
+  if (parse_unique_name (service->name, &major, &minor) &&
+      major == registry->next_major_number)
+    {
+      /* Ignore OOM; bus_registry_lookup() falls back to service_hash */
+      _dbus_hash_table_insert_int (registry->unique_name_table, minor,
+                                   service);
+    }
+}
+
+static void
+unique_name_table_remove (BusRegistry *registry,
+                          BusService  *service)
+{
+  int major, minor;
+
+  if (parse_unique_name (service->name, &major, &minor) &&
+      major == registry->next_major_number &&
+      _dbus_hash_table_lookup_int (registry->unique_name_table,
+                                   minor) == service)
+    _dbus_hash_table_remove_int (registry->unique_name_table, minor);
+}
+
+static BusService*
+unique_name_table_lookup (BusRegistry *registry,
+                          const char  *name)
+{
+  int major, minor;
+
+  if (parse_unique_name (name, &major, &minor) &&
+      major == registry->next_major_number)
+    return _dbus_hash_table_lookup_int (registry->unique_name_table, minor);
+
+  return NULL;
+}
+
 BusService*
 bus_registry_lookup (BusRegistry      *registry,
                      const DBusString *service_name)
 {
   BusService *service;
+  const char *name;
 
-  service = _dbus_hash_table_lookup_string (registry->service_hash,
-                                            _dbus_string_get_const_data (service_name));
+  name = _dbus_string_get_const_data (service_name);
+
+  service = unique_name_table_lookup (registry, name);
+  if (service != NULL)
+    return service;
+
+  service = _dbus_hash_table_lookup_string (registry->service_hash, name);
+
+  return service;
+}
+
+/**
+ * Like bus_registry_lookup(), but looks up the destination of a
+ * message. Well-known names are looked up with the hash cached in the
+ * message header by _dbus_message_get_field_hash(); unique names are
+ * found without hashing them at all.
+ *
+ * @param registry the registry
+ * @param message a message with a destination
+ * @returns the service, or #NULL if the name has no owner
+ */
+BusService*
+bus_registry_lookup_destination (BusRegistry *registry,
+                                 DBusMessage *message)
+{
+  BusService *service;
+  const char *name;
+  unsigned int hash;
+
+  name = dbus_message_get_destination (message);
+  _dbus_assert (name != NULL);
+
+  service = unique_name_table_lookup (registry, name);
+  if (service != NULL)
+    return service;
+
+  if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_DESTINATION,
+                                     &hash))
+    _dbus_assert_not_reached ("message has a destination but no destination field");
+
+  service = _dbus_hash_table_lookup_string_with_hash (registry->service_hash,
+                                                      name, hash);
 
   return service;
 }
 
+/**
+ * Appends a unique name that has never been given to any connection on
+ * this bus to the string.
+ *
+ * @param registry the registry
+ * @param str the string to append to
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+bus_registry_new_unique_name (BusRegistry *registry,
+                              DBusString  *str)
+{
+  /* We never want to use the same unique client name twice, because
+   * we want to guarantee that if you send a message to a given unique
+   * name, you always get the same application. So we use two numbers
+   * for INT_MAX * INT_MAX combinations, should be pretty safe against
+   * wraparound.
+   */
+  int len;
+
+  len = _dbus_string_get_length (str);
+
+  while (TRUE)
+    {
+      /* start out with 1-0, go to 1-1, 1-2, 1-3,
+       * up to 1-MAXINT, then 2-0, 2-1, etc.
+       */
+      if (registry->next_minor_number <= 0)
+        {
+          registry->next_major_number += 1;
+          registry->next_minor_number = 0;
+          if (registry->next_major_number <= 0)
+            _dbus_assert_not_reached ("INT_MAX * INT_MAX clients were added");
+
+          /* the minor numbers start again, so the index only covers
+           * names created from now on
+           */
+          _dbus_hash_table_remove_all (registry->unique_name_table);
+        }
+
+      _dbus_assert (registry->next_major_number > 0);
+      _dbus_assert (registry->next_minor_number >= 0);
+
+      /* appname:MAJOR-MINOR */
+
+      if (!_dbus_string_append (str, ":"))
+        return FALSE;
+
+      if (!_dbus_string_append_int (str, registry->next_major_number))
+        return FALSE;
+
+      if (!_dbus_string_append (str, "."))
+        return FALSE;
+
+      if (!_dbus_string_append_int (str, registry->next_minor_number))
+        return FALSE;
+
+      registry->next_minor_number += 1;
+
+      /* Check if a client with the name exists */
+      if (bus_registry_lookup (registry, str) == NULL)
+        break;
+
+      /* drop the number again, try the next one. */
+      _dbus_string_set_length (str, len);
+    }
+
+  return TRUE;
+}
+
+static void
+owner_index_drop (BusService *service)
+{
+  if (service->owner_index != NULL)
+    {
+      _dbus_hash_table_unref (service->owner_index);
+      service->owner_index = NULL;
+    }
+}
+
+static void
+owner_index_build (BusService *service)
+{
+  DBusList *link;
+
+  _dbus_assert (service->owner_index == NULL);
+
+  service->owner_index = _dbus_hash_table_new (DBUS_HASH_UINTPTR, NULL, NULL);
+  if (service->owner_index == NULL)
+    return;
+
+  link = _dbus_list_get_first_link (&service->owners);
+  while (link != NULL)
+    {
+      BusOwner *owner = link->data;
+
+      if (!_dbus_hash_table_insert_uintptr (service->owner_index,
+                                            (uintptr_t) owner->conn, link))
+        {
+          owner_index_drop (service);
+          return;
+        }
+
+      link = _dbus_list_get_next_link (&service->owners, link);
+    }
+}
+
+/* Call after link has been put in service->owners */
+static void
+owner_queue_link_added (BusService *service,
+                        DBusList   *link)
+{
+  BusOwner *owner = link->data;
+
+  service->n_owners += 1;
+
+  if (service->owner_index != NULL)
+    {
+      /* Ignore OOM; lookups fall back to walking the queue */
+      if (!_dbus_hash_table_insert_uintptr (service->owner_index,
+                                            (uintptr_t) owner->conn, link))
+        owner_index_drop (service);
+    }
+  else if (service->n_owners >= OWNER_INDEX_MIN_OWNERS)
+    {
+      owner_index_build (service);
+    }
+}
+
+/* Call after link has been taken out of service->owners */
+static void
+owner_queue_link_removed (BusService *service,
+                          DBusList   *link)
+{
+  BusOwner *owner = link->data;
+
+  _dbus_assert (service->n_owners > 0);
+  service->n_owners -= 1;
+
+  if (service->owner_index != NULL)
+    _dbus_hash_table_remove_uintptr (service->owner_index,
+                                     (uintptr_t) owner->conn);
+}
+
 static DBusList *
 _bus_service_find_owner_link (BusService *service,
                               DBusConnection *connection)
 {
   DBusList *link;
-  
+
+  if (service->owner_index != NULL)
+    return _dbus_hash_table_lookup_uintptr (service->owner_index,
+                                            (uintptr_t) connection);
+
   link = _dbus_list_get_first_link (&service->owners);
 
   while (link != NULL)
@@ -310,6 +621,8 @@ bus_registry_ensure (BusRegistry               *registry,
       BUS_SET_OOM (error);
       return NULL;
     }
+
+  unique_name_table_add (registry, service);
   
   return service;
 }
@@ -534,6 +847,7 @@ bus_registry_acquire_service (BusRegistry      *registry,
       if (link != NULL)
         {
           _dbus_list_unlink (&service->owners, link);
+          owner_queue_link_removed (service, link);
           temp_owner = (BusOwner *)link->data;
           bus_owner_unref (temp_owner); 
           _dbus_list_free_link (link);
@@ -705,7 +1019,15 @@ static void
 bus_service_unlink_owner (BusService      *service,
                           BusOwner        *owner)
 {
-  _dbus_list_remove_last (&service->owners, owner);
+  DBusList *link;
+
+  /* A connection is only ever queued once */
+  link = _bus_service_find_owner_link (service, owner->conn);
+  _dbus_assert (link != NULL && link->data == owner);
+
+  _dbus_list_unlink (&service->owners, link);
+  owner_queue_link_removed (service, link);
+  _dbus_list_free_link (link);
   bus_owner_unref (owner);
 }
 
@@ -720,6 +1042,7 @@ bus_service_unlink (BusService *service)
    */
   _dbus_hash_table_remove_string (service->registry->service_hash,
                                   service->name);
+  unique_name_table_remove (service->registry, service);
   
   bus_service_unref (service);
 }
@@ -735,6 +1058,7 @@ bus_service_relink (BusService           *service,
                                                preallocated,
                                                service->name,
                                                service);
+  unique_name_table_add (service->registry, service);
   
   bus_service_ref (service);
 }
@@ -838,27 +1162,23 @@ bus_service_add_owner (BusService     *service,
         }
 
       bus_owner_set_flags (bus_owner, flags);
-      if (!(flags & DBUS_NAME_FLAG_REPLACE_EXISTING) || service->owners == NULL)
+
+      bus_owner_link = _dbus_list_alloc_link (bus_owner);
+      if (bus_owner_link == NULL)
         {
-          if (!_dbus_list_append (&service->owners,
-                                  bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
+          bus_owner_unref (bus_owner);
+          BUS_SET_OOM (error);
+          return FALSE;
         }
+
+      if (!(flags & DBUS_NAME_FLAG_REPLACE_EXISTING) || service->owners == NULL)
+        _dbus_list_append_link (&service->owners, bus_owner_link);
       else
-        {
-          if (!_dbus_list_insert_after (&service->owners,
-                                         _dbus_list_get_first_link (&service->owners),
-                                         bus_owner))
-            {
-              bus_owner_unref (bus_owner);
-              BUS_SET_OOM (error);
-              return FALSE;
-            }
-        }      
+        _dbus_list_insert_after_link (&service->owners,
+                                      _dbus_list_get_first_link (&service->owners),
+                                      bus_owner_link);
+
+      owner_queue_link_added (service, bus_owner_link);
     } 
   else 
     {
@@ -899,7 +1219,6 @@ typedef struct
   BusService     *service;
   BusOwner       *before_owner; /* restore to position before this connection in owners list */
   DBusList       *owner_link;
-  DBusList       *service_link;
   DBusPreallocatedHash *hash_entry;
 } OwnershipRestoreData;
 
@@ -909,8 +1228,13 @@ restore_ownership (void *data)
   OwnershipRestoreData *d = data;
   DBusList *link;
 
-  _dbus_assert (d->service_link != NULL);
   _dbus_assert (d->owner_link != NULL);
+
+  /* A swapped owner is still in the queue, behind the new primary
+   * owner; take it out so it can go back where it was.
+   */
+  if (_bus_service_find_owner_link (d->service, d->owner->conn) != NULL)
+    bus_service_unlink_owner (d->service, d->owner);
   
   if (d->service->owners == NULL)
     {
@@ -926,27 +1250,24 @@ restore_ownership (void *data)
    * changes, since we're reverting something that was
    * cancelled (effectively never really happened)
    */
-  link = _dbus_list_get_first_link (&d->service->owners);
-  while (link != NULL)
-    {
-      if (link->data == d->before_owner)
-        break;
+  if (d->before_owner != NULL)
+    link = _bus_service_find_owner_link (d->service, d->before_owner->conn);
+  else
+    link = NULL;
 
-      link = _dbus_list_get_next_link (&d->service->owners, link);
-    }
-  
-  _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  if (link != NULL && link->data != d->before_owner)
+    link = NULL;
 
-  /* Note that removing then restoring this changes the order in which
-   * ServiceDeleted messages are sent on destruction of the
-   * connection.  This should be OK as the only guarantee there is
-   * that the base service is destroyed last, and we never even
-   * tentatively remove the base service.
+  /* The queue holds a reference to each owner it lists. The owner
+   * itself never went away, since we hold a reference too, so it is
+   * still in its connection's list of owned services and must not be
+   * added there again.
    */
-  bus_connection_add_owned_service_link (d->owner->conn, d->service_link);
+  bus_owner_ref (d->owner);
+  _dbus_list_insert_before_link (&d->service->owners, link, d->owner_link);
+  owner_queue_link_added (d->service, d->owner_link);
   
   d->hash_entry = NULL;
-  d->service_link = NULL;
   d->owner_link = NULL;
 }
 
@@ -955,8 +1276,6 @@ free_ownership_restore_data (void *data)
 {
   OwnershipRestoreData *d = data;
 
-  if (d->service_link)
-    _dbus_list_free_link (d->service_link);
   if (d->owner_link)
     _dbus_list_free_link (d->owner_link);
   if (d->hash_entry)
@@ -984,7 +1303,6 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   
   d->service = service;
   d->owner = owner;
-  d->service_link = _dbus_list_alloc_link (service);
   d->owner_link = _dbus_list_alloc_link (owner);
   d->hash_entry = _dbus_hash_table_preallocate_entry (service->registry->service_hash);
   
@@ -993,24 +1311,16 @@ add_restore_ownership_to_transaction (BusTransaction *transaction,
   dbus_connection_ref (d->owner->conn);
 
   d->before_owner = NULL;
-  link = _dbus_list_get_first_link (&service->owners);
-  while (link != NULL)
+  link = _bus_service_find_owner_link (service, owner->conn);
+  if (link != NULL)
     {
-      if (link->data == owner)
-        {
-          link = _dbus_list_get_next_link (&service->owners, link);
-
-          if (link)
-            d->before_owner = link->data;
-
-          break;
-        }
-      
       link = _dbus_list_get_next_link (&service->owners, link);
+
+      if (link)
+        d->before_owner = link->data;
     }
   
-  if (d->service_link == NULL ||
-      d->owner_link == NULL ||
+  if (d->owner_link == NULL ||
       d->hash_entry == NULL ||
       !bus_transaction_add_cancel_hook (transaction, restore_ownership, d,
                                         free_ownership_restore_data))
@@ -1130,6 +1440,7 @@ bus_service_remove_owner (BusService     *service,
 
       link = _bus_service_find_owner_link (service, connection);
       _dbus_list_unlink (&service->owners, link);
+      owner_queue_link_removed (service, link);
       temp_owner = (BusOwner *)link->data;
       bus_owner_unref (temp_owner); 
       _dbus_list_free_link (link);
@@ -1210,7 +1521,9 @@ bus_service_unref (BusService *service)
   if (service->refcount == 0)
     {
       _dbus_assert (service->owners == NULL);
-      
+      _dbus_assert (service->n_owners == 0);
+
+      owner_index_drop (service);
       dbus_free (service->name);
       _dbus_mem_pool_dealloc (service->registry->service_pool, service);
     }
@@ -1269,18 +1582,23 @@ bus_service_has_owner (BusService     *service,
     return TRUE;
 }
 
-dbus_bool_t 
-bus_service_list_queued_owners (BusService *service,
-                                DBusList  **return_list,
-                                DBusError  *error)
+/**
+ * Appends the unique names of the service's owners, primary owner
+ * first, to an open array of strings. The names are written straight
+ * into the message rather than collected in a list first, since a
+ * contended name can have a long queue.
+ *
+ * @returns #FALSE if out of memory
+ */
+dbus_bool_t
+bus_service_append_queued_owners (BusService      *service,
+                                  DBusMessageIter *array_iter)
 {
   DBusList *link;
 
-  _dbus_assert (*return_list == NULL);
-
   link = _dbus_list_get_first_link (&service->owners);
   _dbus_assert (link != NULL);
-  
+
   while (link != NULL)
     {
       BusOwner *owner;
@@ -1289,16 +1607,12 @@ bus_service_list_queued_owners (BusService *service,
       owner = (BusOwner *) link->data;
       uname = bus_connection_get_name (owner->conn);
 
-      if (!_dbus_list_append (return_list, (char *)uname))
-        goto oom;
+      if (!dbus_message_iter_append_basic (array_iter, DBUS_TYPE_STRING,
+                                           &uname))
+        return FALSE;
 
       link = _dbus_list_get_next_link (&service->owners, link);
     }
-  
+
   return TRUE;
-  
- oom:
-  _dbus_list_clear (return_list);
-  BUS_SET_OOM (error);
-  return FALSE;
 }
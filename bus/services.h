@@ -38,12 +38,16 @@ BusRegistry* bus_registry_ref             (BusRegistry                 *registry
 void         bus_registry_unref           (BusRegistry                 *registry);
 BusService*  bus_registry_lookup          (BusRegistry                 *registry,
                                            const DBusString            *service_name);
+BusService*  bus_registry_lookup_destination (BusRegistry               *registry,
+                                           DBusMessage                 *message);
 BusService*  bus_registry_ensure          (BusRegistry                 *registry,
                                            const DBusString            *service_name,
                                            DBusConnection              *owner_connection_if_created,
 					   dbus_uint32_t                flags,
                                            BusTransaction              *transaction,
                                            DBusError                   *error);
+dbus_bool_t  bus_registry_new_unique_name (BusRegistry                *registry,
+                                           DBusString                  *str);
 void         bus_registry_foreach         (BusRegistry                 *registry,
                                            BusServiceForeachFunction    function,
                                            void                        *data);
@@ -86,9 +90,8 @@ dbus_bool_t     bus_service_has_owner                 (BusService     *service,
 BusOwner*       bus_service_get_primary_owner         (BusService     *service);
 dbus_bool_t     bus_service_get_allow_replacement     (BusService     *service);
 const char*     bus_service_get_name                  (BusService     *service);
-dbus_bool_t     bus_service_list_queued_owners        (BusService *service,
-                                                       DBusList  **return_list,
-                                                       DBusError  *error);
+dbus_bool_t     bus_service_append_queued_owners      (BusService      *service,
+                                                       DBusMessageIter *array_iter);
 
 DBusConnection* bus_service_get_primary_owners_connection (BusService     *service);
 #endif /* BUS_SERVICES_H */
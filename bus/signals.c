@@ -26,6 +26,7 @@
 #include "services.h"
 #include "utils.h"
 #include <dbus/dbus-marshal-validate.h>
+#include <dbus/dbus-message-internal.h>
 
 struct BusMatchRule
 {
@@ -45,6 +46,14 @@ struct BusMatchRule
   unsigned int *arg_lens;
   char **args;
   int args_len;
+
+  /* Only set while the rule is in a matchmaker, so that it can be
+   * removed without searching for it.
+   */
+  DBusList *link_in_pool;        /**< Our link in the RulePool's list */
+  DBusList *link_in_connection;  /**< Our link in matches_go_to's list */
+  DBusList *link_in_sender;      /**< Our link in rules_by_unique_name[sender] */
+  DBusList *link_in_destination; /**< Our link in rules_by_unique_name[destination] */
 };
 
 #define BUS_MATCH_ARG_NAMESPACE   0x4000000u
@@ -1139,6 +1148,12 @@ struct BusMatchmaker
    * type.
    */
   RulePool rules_by_type[DBUS_NUM_MESSAGE_TYPES];
+
+  /* Maps each unique name that is some rule's sender or destination to
+   * a (DBusList **) of those rules, which holds no references. Unique
+   * names are never reused, so these rules go away with the connection.
+   */
+  DBusHashTable *rules_by_unique_name;
 };
 
 static void
@@ -1167,6 +1182,17 @@ rule_list_ptr_free (DBusList **list)
     }
 }
 
+static void
+rule_index_ptr_free (DBusList **list)
+{
+  /* The index doesn't own the rules, the RulePools do */
+  if (list != NULL)
+    {
+      _dbus_list_clear (list);
+      dbus_free (list);
+    }
+}
+
 BusMatchmaker*
 bus_matchmaker_new (void)
 {
@@ -1179,6 +1205,15 @@ bus_matchmaker_new (void)
 
   matchmaker->refcount = 1;
 
+  matchmaker->rules_by_unique_name = _dbus_hash_table_new (DBUS_HASH_STRING,
+      dbus_free, (DBusFreeFunction) rule_index_ptr_free);
+
+  if (matchmaker->rules_by_unique_name == NULL)
+    {
+      dbus_free (matchmaker);
+      return NULL;
+    }
+
   for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
     {
       RulePool *p = matchmaker->rules_by_type + i;
@@ -1202,6 +1237,7 @@ bus_matchmaker_new (void)
       else
         _dbus_hash_table_unref (p->rules_by_iface);
     }
+  _dbus_hash_table_unref (matchmaker->rules_by_unique_name);
   dbus_free (matchmaker);
 
   return NULL;
@@ -1265,6 +1301,27 @@ bus_matchmaker_get_rules (BusMatchmaker *matchmaker,
     }
 }
 
+/* Read-only variant of bus_matchmaker_get_rules() for routing, where
+ * the interface's hash is already cached in the message header
+ */
+static DBusList **
+bus_matchmaker_lookup_rules (BusMatchmaker *matchmaker,
+                             int            message_type,
+                             const char    *interface,
+                             unsigned int   interface_hash)
+{
+  RulePool *p;
+
+  _dbus_assert (message_type >= 0);
+  _dbus_assert (message_type < DBUS_NUM_MESSAGE_TYPES);
+  _dbus_assert (interface != NULL);
+
+  p = matchmaker->rules_by_type + message_type;
+
+  return _dbus_hash_table_lookup_string_with_hash (p->rules_by_iface,
+                                                   interface, interface_hash);
+}
+
 static void
 bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
                          int            message_type,
@@ -1290,6 +1347,110 @@ bus_matchmaker_gc_rules (BusMatchmaker *matchmaker,
   _dbus_hash_table_remove_string (p->rules_by_iface, interface);
 }
 
+static dbus_bool_t
+unique_name_index_add (BusMatchmaker *matchmaker,
+                       const char    *name,
+                       BusMatchRule  *rule,
+                       DBusList     **link_p)
+{
+  DBusList **list;
+  DBusList *link;
+
+  _dbus_assert (*link_p == NULL);
+
+  link = _dbus_list_alloc_link (rule);
+  if (link == NULL)
+    return FALSE;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                         name);
+
+  if (list == NULL)
+    {
+      char *dupped_name;
+
+      list = dbus_new0 (DBusList *, 1);
+      if (list == NULL)
+        {
+          _dbus_list_free_link (link);
+          return FALSE;
+        }
+
+      dupped_name = _dbus_strdup (name);
+      if (dupped_name == NULL)
+        {
+          dbus_free (list);
+          _dbus_list_free_link (link);
+          return FALSE;
+        }
+
+      if (!_dbus_hash_table_insert_string (matchmaker->rules_by_unique_name,
+                                           dupped_name, list))
+        {
+          dbus_free (list);
+          dbus_free (dupped_name);
+          _dbus_list_free_link (link);
+          return FALSE;
+        }
+    }
+
+  _dbus_list_append_link (list, link);
+  *link_p = link;
+
+  return TRUE;
+}
+
+static void
+unique_name_index_remove (BusMatchmaker *matchmaker,
+                          const char    *name,
+                          DBusList     **link_p)
+{
+  DBusList **list;
+
+  if (*link_p == NULL)
+    return;
+
+  list = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                         name);
+  _dbus_assert (list != NULL);
+
+  _dbus_list_remove_link (list, *link_p);
+  *link_p = NULL;
+
+  if (*list == NULL)
+    _dbus_hash_table_remove_string (matchmaker->rules_by_unique_name, name);
+}
+
+static void
+bus_matchmaker_unindex_rule (BusMatchmaker *matchmaker,
+                             BusMatchRule  *rule)
+{
+  unique_name_index_remove (matchmaker, rule->sender,
+                            &rule->link_in_sender);
+  unique_name_index_remove (matchmaker, rule->destination,
+                            &rule->link_in_destination);
+}
+
+static dbus_bool_t
+bus_matchmaker_index_rule (BusMatchmaker *matchmaker,
+                           BusMatchRule  *rule)
+{
+  if ((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':' &&
+      !unique_name_index_add (matchmaker, rule->sender, rule,
+                              &rule->link_in_sender))
+    return FALSE;
+
+  if ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':' &&
+      !unique_name_index_add (matchmaker, rule->destination, rule,
+                              &rule->link_in_destination))
+    {
+      bus_matchmaker_unindex_rule (matchmaker, rule);
+      return FALSE;
+    }
+
+  return TRUE;
+}
+
 BusMatchmaker *
 bus_matchmaker_ref (BusMatchmaker *matchmaker)
 {
@@ -1318,6 +1479,7 @@ bus_matchmaker_unref (BusMatchmaker *matchmaker)
           rule_list_free (&p->rules_without_iface);
         }
 
+      _dbus_hash_table_unref (matchmaker->rules_by_unique_name);
       dbus_free (matchmaker);
     }
 }
@@ -1341,17 +1503,34 @@ bus_matchmaker_add_rule (BusMatchmaker   *matchmaker,
   if (rules == NULL)
     return FALSE;
 
+  _dbus_assert (rule->link_in_pool == NULL);
+
   if (!_dbus_list_append (rules, rule))
-    return FALSE;
+    {
+      bus_matchmaker_gc_rules (matchmaker, rule->message_type,
+                               rule->interface, rules);
+      return FALSE;
+    }
 
-  if (!bus_connection_add_match_rule (rule->matches_go_to, rule))
+  rule->link_in_pool = _dbus_list_get_last_link (rules);
+  rule->link_in_connection = _dbus_list_alloc_link (rule);
+
+  if (rule->link_in_connection == NULL ||
+      !bus_matchmaker_index_rule (matchmaker, rule))
     {
-      _dbus_list_remove_last (rules, rule);
+      if (rule->link_in_connection != NULL)
+        _dbus_list_free_link (rule->link_in_connection);
+      rule->link_in_connection = NULL;
+      _dbus_list_remove_link (rules, rule->link_in_pool);
+      rule->link_in_pool = NULL;
       bus_matchmaker_gc_rules (matchmaker, rule->message_type,
                                rule->interface, rules);
       return FALSE;
     }
 
+  bus_connection_add_match_rule_link (rule->matches_go_to,
+                                      rule->link_in_connection);
+
   bus_match_rule_ref (rule);
 
 #ifdef DBUS_ENABLE_VERBOSE_MODE
@@ -1438,28 +1617,6 @@ match_rule_equal (BusMatchRule *a,
   return TRUE;
 }
 
-static void
-bus_matchmaker_remove_rule_link (DBusList       **rules,
-                                 DBusList        *link)
-{
-  BusMatchRule *rule = link->data;
-  
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
-  _dbus_list_remove_link (rules, link);
-
-#ifdef DBUS_ENABLE_VERBOSE_MODE
-  {
-    char *s = match_rule_to_string (rule);
-
-    _dbus_verbose ("Removed match rule %s for connection %p\n",
-                   s, rule->matches_go_to);
-    dbus_free (s);
-  }
-#endif
-  
-  bus_match_rule_unref (rule);  
-}
-
 void
 bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                             BusMatchRule    *rule)
@@ -1470,17 +1627,21 @@ bus_matchmaker_remove_rule (BusMatchmaker   *matchmaker,
                  rule->message_type,
                  rule->interface != NULL ? rule->interface : "<null>");
 
-  bus_connection_remove_match_rule (rule->matches_go_to, rule);
+  _dbus_assert (rule->link_in_connection != NULL);
+  bus_connection_remove_match_rule_link (rule->matches_go_to,
+                                         rule->link_in_connection);
+  rule->link_in_connection = NULL;
+  bus_matchmaker_unindex_rule (matchmaker, rule);
 
   rules = bus_matchmaker_get_rules (matchmaker, rule->message_type,
                                     rule->interface, FALSE);
 
-  /* We should only be asked to remove a rule by identity right after it was
-   * added, so there should be a list for it.
-   */
+  /* The rule is in the matchmaker, so there is a list for it */
   _dbus_assert (rules != NULL);
+  _dbus_assert (rule->link_in_pool != NULL);
 
-  _dbus_list_remove (rules, rule);
+  _dbus_list_remove_link (rules, rule->link_in_pool);
+  rule->link_in_pool = NULL;
   bus_matchmaker_gc_rules (matchmaker, rule->message_type, rule->interface,
       rules);
 
@@ -1515,8 +1676,8 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
 
   if (rules != NULL)
     {
-      /* we traverse backward because bus_connection_remove_match_rule()
-       * removes the most-recently-added rule
+      /* we traverse backward so that, of several equal rules, the
+       * most-recently-added one is removed
        */
       link = _dbus_list_get_last_link (rules);
       while (link != NULL)
@@ -1529,7 +1690,8 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
 
           if (match_rule_equal (rule, value))
             {
-              bus_matchmaker_remove_rule_link (rules, link);
+              /* This may free rules */
+              bus_matchmaker_remove_rule (matchmaker, rule);
               break;
             }
 
@@ -1544,91 +1706,39 @@ bus_matchmaker_remove_rule_by_value (BusMatchmaker   *matchmaker,
       return FALSE;
     }
 
-  bus_matchmaker_gc_rules (matchmaker, value->message_type, value->interface,
-      rules);
-
   return TRUE;
 }
 
-static void
-rule_list_remove_by_connection (DBusList       **rules,
-                                DBusConnection  *connection)
-{
-  DBusList *link;
-
-  link = _dbus_list_get_first_link (rules);
-  while (link != NULL)
-    {
-      BusMatchRule *rule;
-      DBusList *next;
-
-      rule = link->data;
-      next = _dbus_list_get_next_link (rules, link);
-
-      if (rule->matches_go_to == connection)
-        {
-          bus_matchmaker_remove_rule_link (rules, link);
-        }
-      else if (((rule->flags & BUS_MATCH_SENDER) && *rule->sender == ':') ||
-               ((rule->flags & BUS_MATCH_DESTINATION) && *rule->destination == ':'))
-        {
-          /* The rule matches to/from a base service, see if it's the
-           * one being disconnected, since we know this service name
-           * will never be recycled.
-           */
-          const char *name;
-
-          name = bus_connection_get_name (connection);
-          _dbus_assert (name != NULL); /* because we're an active connection */
-
-          if (((rule->flags & BUS_MATCH_SENDER) &&
-               strcmp (rule->sender, name) == 0) ||
-              ((rule->flags & BUS_MATCH_DESTINATION) &&
-               strcmp (rule->destination, name) == 0))
-            {
-              bus_matchmaker_remove_rule_link (rules, link);
-            }
-        }
-
-      link = next;
-    }
-}
-
 void
 bus_matchmaker_disconnected (BusMatchmaker   *matchmaker,
                              DBusConnection  *connection)
 {
-  int i;
-
-  /* FIXME
-   *
-   * This scans all match rules on the bus. We could avoid that
-   * for the rules belonging to the connection, since we keep
-   * a list of those; but for the rules that just refer to
-   * the connection we'd need to do something more elaborate.
-   */
+  BusMatchRule *rule;
+  DBusList **referring;
+  const char *name;
 
   _dbus_assert (bus_connection_is_active (connection));
 
   _dbus_verbose ("Removing all rules for connection %p\n", connection);
 
-  for (i = DBUS_MESSAGE_TYPE_INVALID; i < DBUS_NUM_MESSAGE_TYPES; i++)
-    {
-      RulePool *p = matchmaker->rules_by_type + i;
-      DBusHashIter iter;
-
-      rule_list_remove_by_connection (&p->rules_without_iface, connection);
-
-      _dbus_hash_iter_init (p->rules_by_iface, &iter);
-      while (_dbus_hash_iter_next (&iter))
-        {
-          DBusList **items = _dbus_hash_iter_get_value (&iter);
+  /* The connection's own rules. Each one knows where it is in its
+   * pool, and taking the most recently added first means the
+   * connection doesn't have to search its list either.
+   */
+  while ((rule = bus_connection_get_last_match_rule (connection)) != NULL)
+    bus_matchmaker_remove_rule (matchmaker, rule);
 
-          rule_list_remove_by_connection (items, connection);
+  /* Rules that refer to the connection's unique name, which will
+   * never be recycled, so they can never match again.
+   */
+  name = bus_connection_get_name (connection);
+  _dbus_assert (name != NULL); /* because we're an active connection */
 
-          if (*items == NULL)
-            _dbus_hash_iter_remove_entry (&iter);
-        }
+  while ((referring = _dbus_hash_table_lookup_string (matchmaker->rules_by_unique_name,
+                                                      name)) != NULL)
+    {
+      /* Removing the last one drops the index entry */
+      bus_matchmaker_remove_rule (matchmaker, _dbus_list_get_first (referring));
     }
 }
 
@@ -2004,6 +2114,7 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
 {
   int type;
   const char *interface;
+  unsigned int interface_hash;
   DBusList **neither, **just_type, **just_iface, **both;
 
   _dbus_assert (*recipients_p == NULL);
@@ -2029,15 +2140,22 @@ bus_matchmaker_get_recipients (BusMatchmaker   *matchmaker,
   just_type = just_iface = both = NULL;
 
   if (interface != NULL)
-    just_iface = bus_matchmaker_get_rules (matchmaker,
-        DBUS_MESSAGE_TYPE_INVALID, interface, FALSE);
+    {
+      if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_INTERFACE,
+                                         &interface_hash))
+        _dbus_assert_not_reached ("message has an interface but no interface field");
+
+      just_iface = bus_matchmaker_lookup_rules (matchmaker,
+          DBUS_MESSAGE_TYPE_INVALID, interface, interface_hash);
+    }
 
   if (type > DBUS_MESSAGE_TYPE_INVALID && type < DBUS_NUM_MESSAGE_TYPES)
     {
       just_type = bus_matchmaker_get_rules (matchmaker, type, NULL, FALSE);
 
       if (interface != NULL)
-        both = bus_matchmaker_get_rules (matchmaker, type, interface, FALSE);
+        both = bus_matchmaker_lookup_rules (matchmaker, type, interface,
+                                            interface_hash);
     }
 
   if (!(get_recipients_from_list (neither, sender, addressed_recipient,
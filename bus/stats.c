@@ -187,7 +187,9 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   DBusMessage *reply = NULL;
   DBusMessageIter iter, arr_iter;
   static dbus_uint32_t stats_serial = 0;
-  dbus_uint32_t in_use, in_free_list, allocated;
+  const char *name;
+  dbus_uint32_t value;
+  int i;
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
 
@@ -203,13 +205,13 @@ bus_stats_handle_get_stats (DBusConnection *connection,
   if (!asv_add_uint32 (&iter, &arr_iter, "Serial", stats_serial++))
     goto oom;
 
-  _dbus_list_get_stats (&in_use, &in_free_list, &allocated);
-  if (!asv_add_uint32 (&iter, &arr_iter, "ListMemPoolUsedBytes", in_use) ||
-      !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolCachedBytes",
-                       in_free_list) ||
-      !asv_add_uint32 (&iter, &arr_iter, "ListMemPoolAllocatedBytes",
-                       allocated))
-    goto oom;
+  /* libdbus allocator statistics: memory pools, message cache etc. */
+
+  for (i = 0; dbus_get_statistic (i, &name, &value); i++)
+    {
+      if (!asv_add_uint32 (&iter, &arr_iter, name, value))
+        goto oom;
+    }
 
   /* Connections */
 
@@ -121,6 +121,15 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "driver") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running driver test\n", argv[0]);
+      if (!bus_driver_test (&test_data_dir))
+        die ("driver");
+      test_post_hook ();
+    }
+
   if (only == NULL || strcmp (only, "config-parser") == 0)
     {
       test_pre_hook ();
@@ -166,6 +175,62 @@ main (int argc, char **argv)
       test_post_hook ();
     }
 
+  if (only == NULL || strcmp (only, "policy-reload") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running policy reloading test\n", argv[0]);
+      if (!bus_policy_reload_test (&test_data_dir))
+        die ("policy reload");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "activation-coalesce") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running activation coalescing test\n", argv[0]);
+      if (!bus_activation_coalesce_test (&test_data_dir))
+        die ("activation coalescing");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "owner-queue") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running owner queue test\n", argv[0]);
+      if (!bus_owner_queue_test (&test_data_dir))
+        die ("owner queue");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "disconnect-names") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running disconnect names test\n", argv[0]);
+      if (!bus_disconnect_names_test (&test_data_dir))
+        die ("disconnect names");
+      test_post_hook ();
+    }
+
+  if (only == NULL || strcmp (only, "preactivate") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running preactivation test\n", argv[0]);
+      if (!bus_preactivate_test (&test_data_dir))
+        die ("preactivation");
+      test_post_hook ();
+    }
+
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+  if (only == NULL || strcmp (only, "metrics") == 0)
+    {
+      test_pre_hook ();
+      printf ("%s: Running metrics test\n", argv[0]);
+      if (!bus_metrics_test (&test_data_dir))
+        die ("metrics");
+      test_post_hook ();
+    }
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
   if (only == NULL || strcmp (only, "unix-fds-passing") == 0)
     {
@@ -32,11 +32,17 @@
 
 dbus_bool_t bus_dispatch_test         (const DBusString             *test_data_dir);
 dbus_bool_t bus_dispatch_sha1_test    (const DBusString             *test_data_dir);
+dbus_bool_t bus_driver_test           (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_test    (const DBusString             *test_data_dir);
 dbus_bool_t bus_config_parser_trivial_test (const DBusString        *test_data_dir);
 dbus_bool_t bus_signals_test          (const DBusString             *test_data_dir);
 dbus_bool_t bus_expire_list_test      (const DBusString             *test_data_dir);
 dbus_bool_t bus_activation_service_reload_test (const DBusString    *test_data_dir);
+dbus_bool_t bus_policy_reload_test    (const DBusString             *test_data_dir);
+dbus_bool_t bus_activation_coalesce_test (const DBusString          *test_data_dir);
+dbus_bool_t bus_owner_queue_test      (const DBusString             *test_data_dir);
+dbus_bool_t bus_disconnect_names_test (const DBusString             *test_data_dir);
+dbus_bool_t bus_preactivate_test      (const DBusString             *test_data_dir);
 dbus_bool_t bus_setup_debug_client    (DBusConnection               *connection);
 void        bus_test_clients_foreach  (BusConnectionForeachFunction  function,
                                        void                         *data);
@@ -48,6 +54,10 @@ void        bus_test_run_everything   (BusContext                   *context);
 BusContext* bus_context_new_test      (const DBusString             *test_data_dir,
                                        const char                   *filename);
 
+#if defined(DBUS_ENABLE_STATS) && defined(DBUS_UNIX)
+dbus_bool_t bus_metrics_test          (const DBusString             *test_data_dir);
+#endif
+
 #ifdef HAVE_UNIX_FD_PASSING
 dbus_bool_t bus_unix_fds_passing_test (const DBusString             *test_data_dir);
 #endif
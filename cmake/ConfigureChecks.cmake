@@ -20,6 +20,7 @@ check_include_file(signal.h     HAVE_SIGNAL_H)
 check_include_file(locale.h     HAVE_LOCALE_H)
 check_include_file(inttypes.h     HAVE_INTTYPES_H)   # dbus-pipe.h
 check_include_file(stdint.h     HAVE_STDINT_H)   # dbus-pipe.h
+check_include_file(sys/inotify.h HAVE_SYS_INOTIFY_H) # bus/dir-watch-inotify.c
 
 check_symbol_exists(backtrace    "execinfo.h"       HAVE_BACKTRACE)          #  dbus-sysdeps.c, dbus-sysdeps-win.c
 check_symbol_exists(getgrouplist "grp.h"            HAVE_GETGROUPLIST)       #  dbus-sysdeps.c
@@ -37,6 +38,11 @@ check_symbol_exists(setlocale    "locale.h"         HAVE_SETLOCALE)          #
 check_symbol_exists(localeconv   "locale.h"         HAVE_LOCALECONV)         #  dbus-sysdeps.c
 check_symbol_exists(strtoll      "stdlib.h"         HAVE_STRTOLL)            #  dbus-send.c
 check_symbol_exists(strtoull     "stdlib.h"         HAVE_STRTOULL)           #  dbus-send.c
+check_symbol_exists(posix_spawn  "spawn.h"          HAVE_POSIX_SPAWN)        #  dbus-spawn.c
+check_symbol_exists(inotify_init1 "sys/inotify.h"   HAVE_INOTIFY_INIT1)      #  bus/dir-watch-inotify.c
+set(CMAKE_REQUIRED_DEFINITIONS -D_GNU_SOURCE)
+check_symbol_exists(memfd_create "sys/mman.h"       HAVE_MEMFD_CREATE)       #  dbus-sysdeps-unix.c
+unset(CMAKE_REQUIRED_DEFINITIONS)
 
 check_struct_member(cmsgcred cmcred_pid "sys/types.h sys/socket.h" HAVE_CMSGCRED)   #  dbus-sysdeps.c
 
@@ -64,6 +64,8 @@
 
 /* selinux */
 #cmakedefine DBUS_BUS_ENABLE_DNOTIFY_ON_LINUX 1
+#cmakedefine DBUS_BUS_ENABLE_INOTIFY 1
+#cmakedefine HAVE_INOTIFY_INIT1 1
 /* kqueue */
 #cmakedefine HAVE_CONSOLE_OWNER_FILE 1
 #define DBUS_CONSOLE_OWNER_FILE "@DBUS_CONSOLE_OWNER_FILE@"
@@ -166,6 +168,12 @@
 /* Define to 1 if you have socketpair */
 #cmakedefine   HAVE_SOCKETPAIR 1
 
+/* Define to 1 if you have posix_spawn */
+#cmakedefine   HAVE_POSIX_SPAWN 1
+
+/* Define to 1 if you have memfd_create */
+#cmakedefine   HAVE_MEMFD_CREATE 1
+
 /* Define to 1 if you have setenv */
 #cmakedefine   HAVE_SETENV 1
 
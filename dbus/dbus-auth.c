@@ -126,7 +126,9 @@ typedef enum {
   DBUS_AUTH_COMMAND_ERROR,
   DBUS_AUTH_COMMAND_UNKNOWN,
   DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD,
-  DBUS_AUTH_COMMAND_AGREE_UNIX_FD
+  DBUS_AUTH_COMMAND_AGREE_UNIX_FD,
+  DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY,
+  DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY
 } DBusAuthCommand;
 
 /**
@@ -191,6 +193,9 @@ struct DBusAuth
 
   unsigned int unix_fd_possible : 1;  /**< This side could do unix fd passing */
   unsigned int unix_fd_negotiated : 1; /**< Unix fd was successfully negotiated */
+
+  unsigned int memfd_body_possible : 1;  /**< This side could pass bodies in sealed memfds */
+  unsigned int memfd_body_negotiated : 1; /**< Memfd bodies were successfully negotiated */
 };
 
 /**
@@ -234,6 +239,8 @@ static dbus_bool_t send_begin                (DBusAuth *auth);
 static dbus_bool_t send_cancel               (DBusAuth *auth);
 static dbus_bool_t send_negotiate_unix_fd    (DBusAuth *auth);
 static dbus_bool_t send_agree_unix_fd        (DBusAuth *auth);
+static dbus_bool_t send_negotiate_memfd_body (DBusAuth *auth);
+static dbus_bool_t send_agree_memfd_body     (DBusAuth *auth);
 
 /**
  * Client states
@@ -275,6 +282,9 @@ static dbus_bool_t handle_client_state_waiting_for_reject (DBusAuth         *aut
 static dbus_bool_t handle_client_state_waiting_for_agree_unix_fd (DBusAuth         *auth,
                                                            DBusAuthCommand   command,
                                                            const DBusString *args);
+static dbus_bool_t handle_client_state_waiting_for_agree_memfd_body (DBusAuth         *auth,
+                                                           DBusAuthCommand   command,
+                                                           const DBusString *args);
 
 static const DBusAuthStateData client_state_need_send_auth = {
   "NeedSendAuth", NULL
@@ -291,6 +301,9 @@ static const DBusAuthStateData client_state_waiting_for_reject = {
 static const DBusAuthStateData client_state_waiting_for_agree_unix_fd = {
   "WaitingForAgreeUnixFD", handle_client_state_waiting_for_agree_unix_fd
 };
+static const DBusAuthStateData client_state_waiting_for_agree_memfd_body = {
+  "WaitingForAgreeMemfdBody", handle_client_state_waiting_for_agree_memfd_body
+};
 
 /**
  * Common terminal states.  Terminal states have handler == NULL.
@@ -1661,6 +1674,34 @@ send_agree_unix_fd (DBusAuth *auth)
   return TRUE;
 }
 
+static dbus_bool_t
+send_negotiate_memfd_body (DBusAuth *auth)
+{
+  if (!_dbus_string_append (&auth->outgoing,
+                            "NEGOTIATE_MEMFD_BODY\r\n"))
+    return FALSE;
+
+  goto_state (auth, &client_state_waiting_for_agree_memfd_body);
+  return TRUE;
+}
+
+static dbus_bool_t
+send_agree_memfd_body (DBusAuth *auth)
+{
+  _dbus_assert (auth->memfd_body_possible);
+  _dbus_assert (auth->unix_fd_negotiated);
+
+  auth->memfd_body_negotiated = TRUE;
+  _dbus_verbose ("Agreed to passing bodies in memfds\n");
+
+  if (!_dbus_string_append (&auth->outgoing,
+                            "AGREE_MEMFD_BODY\r\n"))
+    return FALSE;
+
+  goto_state (auth, &server_state_waiting_for_begin);
+  return TRUE;
+}
+
 static dbus_bool_t
 handle_auth (DBusAuth *auth, const DBusString *args)
 {
@@ -1753,12 +1794,14 @@ handle_server_state_waiting_for_auth  (DBusAuth         *auth,
       return send_rejected (auth);
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1786,12 +1829,14 @@ handle_server_state_waiting_for_data  (DBusAuth         *auth,
       return TRUE;
 
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
       return send_error (auth, "Need to authenticate first");
 
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -1820,10 +1865,17 @@ handle_server_state_waiting_for_begin (DBusAuth         *auth,
       else
         return send_error(auth, "Unix FD passing not supported, not authenticated or otherwise not possible");
 
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
+      if (auth->memfd_body_possible && auth->unix_fd_negotiated)
+        return send_agree_memfd_body (auth);
+      else
+        return send_error (auth, "Memfd bodies not supported, or Unix FD passing not negotiated");
+
     case DBUS_AUTH_COMMAND_REJECTED:
     case DBUS_AUTH_COMMAND_OK:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
 
@@ -1999,6 +2051,8 @@ handle_client_state_waiting_for_data (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2027,6 +2081,8 @@ handle_client_state_waiting_for_ok (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2051,6 +2107,8 @@ handle_client_state_waiting_for_reject (DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
     case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
     default:
       goto_state (auth, &common_state_need_disconnect);
       return TRUE;
@@ -2068,6 +2126,10 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
       _dbus_assert(auth->unix_fd_possible);
       auth->unix_fd_negotiated = TRUE;
       _dbus_verbose("Successfully negotiated UNIX FD passing\n");
+
+      if (auth->memfd_body_possible)
+        return send_negotiate_memfd_body (auth);
+
       return send_begin (auth);
 
     case DBUS_AUTH_COMMAND_ERROR:
@@ -2084,6 +2146,42 @@ handle_client_state_waiting_for_agree_unix_fd(DBusAuth         *auth,
     case DBUS_AUTH_COMMAND_BEGIN:
     case DBUS_AUTH_COMMAND_UNKNOWN:
     case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
+    default:
+      return send_error (auth, "Unknown command");
+    }
+}
+
+static dbus_bool_t
+handle_client_state_waiting_for_agree_memfd_body (DBusAuth         *auth,
+                                                  DBusAuthCommand   command,
+                                                  const DBusString *args)
+{
+  switch (command)
+    {
+    case DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY:
+      _dbus_assert (auth->memfd_body_possible);
+      auth->memfd_body_negotiated = TRUE;
+      _dbus_verbose ("Successfully negotiated passing bodies in memfds\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_ERROR:
+      /* older servers don't know the command */
+      auth->memfd_body_negotiated = FALSE;
+      _dbus_verbose ("Failed to negotiate passing bodies in memfds\n");
+      return send_begin (auth);
+
+    case DBUS_AUTH_COMMAND_OK:
+    case DBUS_AUTH_COMMAND_DATA:
+    case DBUS_AUTH_COMMAND_REJECTED:
+    case DBUS_AUTH_COMMAND_AUTH:
+    case DBUS_AUTH_COMMAND_CANCEL:
+    case DBUS_AUTH_COMMAND_BEGIN:
+    case DBUS_AUTH_COMMAND_UNKNOWN:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_AGREE_UNIX_FD:
+    case DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY:
     default:
       return send_error (auth, "Unknown command");
     }
@@ -2106,7 +2204,9 @@ static const DBusAuthCommandName auth_command_names[] = {
   { "OK",                DBUS_AUTH_COMMAND_OK },
   { "ERROR",             DBUS_AUTH_COMMAND_ERROR },
   { "NEGOTIATE_UNIX_FD", DBUS_AUTH_COMMAND_NEGOTIATE_UNIX_FD },
-  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD }
+  { "AGREE_UNIX_FD",     DBUS_AUTH_COMMAND_AGREE_UNIX_FD },
+  { "NEGOTIATE_MEMFD_BODY", DBUS_AUTH_COMMAND_NEGOTIATE_MEMFD_BODY },
+  { "AGREE_MEMFD_BODY",  DBUS_AUTH_COMMAND_AGREE_MEMFD_BODY }
 };
 
 static DBusAuthCommand
@@ -2805,6 +2905,33 @@ _dbus_auth_get_unix_fd_negotiated(DBusAuth *auth)
   return auth->unix_fd_negotiated;
 }
 
+/**
+ * Sets whether message bodies could be passed in sealed memfds on
+ * the transport, and hence shall be negotiated after unix fd passing.
+ *
+ * @param auth the auth conversation
+ * @param b #TRUE when memfd bodies shall be negotiated
+ */
+void
+_dbus_auth_set_memfd_body_possible (DBusAuth    *auth,
+                                    dbus_bool_t  b)
+{
+  auth->memfd_body_possible = b;
+}
+
+/**
+ * Queries whether passing message bodies in sealed memfds was
+ * successfully negotiated.
+ *
+ * @param auth the auth conversation
+ * @returns #TRUE when memfd bodies were negotiated
+ */
+dbus_bool_t
+_dbus_auth_get_memfd_body_negotiated (DBusAuth *auth)
+{
+  return auth->memfd_body_negotiated;
+}
+
 /** @} */
 
 /* tests in dbus-auth-util.c */
@@ -621,6 +621,39 @@ _dbus_connection_get_message_to_send (DBusConnection *connection)
   return _dbus_list_get_last (&connection->outgoing_messages);
 }
 
+/**
+ * Gets up to the given number of outgoing messages, starting with
+ * the next one, so that they can be written together. The messages
+ * remain in the queue, and the caller does not own references to
+ * them.
+ *
+ * @param connection the connection.
+ * @param messages array to store the messages in
+ * @param n_messages size of the array
+ * @returns the number of messages stored
+ */
+int
+_dbus_connection_get_messages_to_send (DBusConnection  *connection,
+                                       DBusMessage    **messages,
+                                       int              n_messages)
+{
+  DBusList *link;
+  int n;
+
+  HAVE_LOCK_CHECK (connection);
+
+  n = 0;
+  link = _dbus_list_get_last_link (&connection->outgoing_messages);
+  while (link != NULL && n < n_messages)
+    {
+      messages[n] = link->data;
+      n += 1;
+      link = _dbus_list_get_prev_link (&connection->outgoing_messages, link);
+    }
+
+  return n;
+}
+
 /**
  * Notifies the connection that a message has been sent, so the
  * message can be removed from the outgoing queue.
@@ -1973,27 +2006,25 @@ _dbus_connection_preallocate_send_unlocked (DBusConnection *connection)
   return NULL;
 }
 
-/* Called with lock held, does not update dispatch status */
+/* Called with lock held, queues the message without writing it */
 static void
-_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
-                                                       DBusPreallocatedSend *preallocated,
-                                                       DBusMessage          *message,
-                                                       dbus_uint32_t        *client_serial)
+_dbus_connection_queue_message_unlocked (DBusConnection *connection,
+                                         DBusList       *queue_link,
+                                         DBusList       *counter_link,
+                                         DBusMessage    *message,
+                                         dbus_uint32_t  *client_serial)
 {
   dbus_uint32_t serial;
 
-  preallocated->queue_link->data = message;
+  queue_link->data = message;
   _dbus_list_prepend_link (&connection->outgoing_messages,
-                           preallocated->queue_link);
+                           queue_link);
 
   /* It's OK that we'll never call the notify function, because for the
    * outgoing limit, there isn't one */
   _dbus_message_add_counter_link (message,
-                                  preallocated->counter_link);
+                                  counter_link);
 
-  dbus_free (preallocated);
-  preallocated = NULL;
-  
   dbus_message_ref (message);
   
   connection->n_outgoing += 1;
@@ -2034,6 +2065,22 @@ _dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *con
                  message, dbus_message_get_serial (message));
   
   dbus_message_lock (message);
+}
+
+/* Called with lock held, does not update dispatch status */
+static void
+_dbus_connection_send_preallocated_unlocked_no_update (DBusConnection       *connection,
+                                                       DBusPreallocatedSend *preallocated,
+                                                       DBusMessage          *message,
+                                                       dbus_uint32_t        *client_serial)
+{
+  _dbus_connection_queue_message_unlocked (connection,
+                                           preallocated->queue_link,
+                                           preallocated->counter_link,
+                                           message, client_serial);
+
+  dbus_free (preallocated);
+  preallocated = NULL;
 
   /* Now we need to run an iteration to hopefully just write the messages
    * out immediately, and otherwise get them queued up
@@ -3283,6 +3330,122 @@ dbus_connection_send (DBusConnection *connection,
 					   serial);
 }
 
+/**
+ * Adds several messages to the outgoing message queue at once, as
+ * with dbus_connection_send(), and then tries to write them out
+ * together. This is much cheaper than sending each message on its
+ * own when emitting many small signals, because the connection is
+ * locked once and the transport can write all of them with a single
+ * system call.
+ *
+ * Either all of the messages are queued, or none of them are; the
+ * only reason this can fail is lack of memory, or one of the messages
+ * having unix fds the connection can't pass.
+ *
+ * @param connection the connection.
+ * @param messages the messages to write, in order
+ * @param n_messages number of messages
+ * @param client_serials array of @p n_messages to return the message serials in, or #NULL if you don't care
+ * @returns #TRUE on success.
+ */
+dbus_bool_t
+dbus_connection_send_batch (DBusConnection  *connection,
+                            DBusMessage    **messages,
+                            int              n_messages,
+                            dbus_uint32_t   *client_serials)
+{
+  DBusList *queue_links;
+  DBusList *counter_links;
+  DBusList *link;
+  DBusDispatchStatus status;
+  int i;
+
+  _dbus_return_val_if_fail (connection != NULL, FALSE);
+  _dbus_return_val_if_fail (n_messages >= 0, FALSE);
+  _dbus_return_val_if_fail (messages != NULL || n_messages == 0, FALSE);
+
+  for (i = 0; i < n_messages; i++)
+    _dbus_return_val_if_fail (messages[i] != NULL, FALSE);
+
+  CONNECTION_LOCK (connection);
+
+#ifdef HAVE_UNIX_FD_PASSING
+
+  if (!_dbus_transport_can_pass_unix_fd(connection->transport))
+    {
+      for (i = 0; i < n_messages; i++)
+        {
+          if (messages[i]->n_unix_fds > 0)
+            {
+              CONNECTION_UNLOCK (connection);
+              return FALSE;
+            }
+        }
+    }
+
+#endif
+
+  /* Allocate everything up front so the batch can't be half-queued */
+  queue_links = NULL;
+  counter_links = NULL;
+
+  for (i = 0; i < n_messages; i++)
+    {
+      link = _dbus_list_alloc_link (NULL);
+      if (link == NULL)
+        goto failed;
+      _dbus_list_append_link (&queue_links, link);
+
+      link = _dbus_list_alloc_link (connection->outgoing_counter);
+      if (link == NULL)
+        goto failed;
+      _dbus_counter_ref (connection->outgoing_counter);
+      _dbus_list_append_link (&counter_links, link);
+    }
+
+  for (i = 0; i < n_messages; i++)
+    _dbus_connection_queue_message_unlocked (connection,
+                                             _dbus_list_pop_first_link (&queue_links),
+                                             _dbus_list_pop_first_link (&counter_links),
+                                             messages[i],
+                                             client_serials ? &client_serials[i] : NULL);
+
+  _dbus_assert (queue_links == NULL);
+  _dbus_assert (counter_links == NULL);
+
+  if (n_messages > 0)
+    {
+      _dbus_connection_do_iteration_unlocked (connection,
+                                              NULL,
+                                              DBUS_ITERATION_DO_WRITING,
+                                              -1);
+
+      /* If stuff is still queued up, be sure we wake up the main loop */
+      if (connection->n_outgoing > 0)
+        _dbus_connection_wakeup_mainloop (connection);
+    }
+
+  status = _dbus_connection_get_dispatch_status_unlocked (connection);
+
+  /* this calls out to user code */
+  _dbus_connection_update_dispatch_status_and_unlock (connection, status);
+
+  return TRUE;
+
+ failed:
+  while ((link = _dbus_list_pop_first_link (&queue_links)) != NULL)
+    _dbus_list_free_link (link);
+
+  while ((link = _dbus_list_pop_first_link (&counter_links)) != NULL)
+    {
+      _dbus_counter_unref (link->data);
+      _dbus_list_free_link (link);
+    }
+
+  CONNECTION_UNLOCK (connection);
+  return FALSE;
+}
+
 static dbus_bool_t
 reply_handler_timeout (void *data)
 {
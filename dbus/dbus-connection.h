@@ -225,6 +225,11 @@ dbus_bool_t        dbus_connection_send                         (DBusConnection
                                                                  DBusMessage                *message,
                                                                  dbus_uint32_t              *client_serial);
 DBUS_EXPORT
+dbus_bool_t        dbus_connection_send_batch                   (DBusConnection             *connection,
+                                                                 DBusMessage               **messages,
+                                                                 int                         n_messages,
+                                                                 dbus_uint32_t              *client_serials);
+DBUS_EXPORT
 dbus_bool_t        dbus_connection_send_with_reply              (DBusConnection             *connection,
                                                                  DBusMessage                *message,
                                                                  DBusPendingCall           **pending_return,
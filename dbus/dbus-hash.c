@@ -204,6 +204,14 @@ struct DBusHashTable {
   DBusFreeFunction free_value_function; /**< Function to free values */
 
   DBusMemPool *entry_pool;              /**< Memory pool for hash entries */
+
+#ifdef DBUS_ENABLE_STATS
+  int n_pool_entries;                   /**< Entries currently allocated
+                                         * from entry_pool, including
+                                         * preallocated ones
+                                         */
+  int peak_pool_entries;                /**< Largest ever n_pool_entries */
+#endif
 };
 
 /** 
@@ -244,6 +252,70 @@ static void           free_entry                (DBusHashTable          *table,
                                                  DBusHashEntry          *entry);
 static void           free_entry_data           (DBusHashTable          *table,
                                                  DBusHashEntry          *entry);
+static void           dealloc_entry             (DBusHashTable          *table,
+                                                 DBusHashEntry          *entry);
+
+#ifdef DBUS_ENABLE_STATS
+/* Totals over all live tables, protected by the stats lock. Each table's
+ * pool is assumed to hold as many elements as its peak usage, since
+ * memory pools never give blocks back until they are freed.
+ */
+static dbus_uint32_t hash_pool_entries_in_use = 0;
+static dbus_uint32_t hash_pool_entries_allocated = 0;
+
+static void
+update_pool_stats (DBusHashTable *table,
+                   int            delta)
+{
+  table->n_pool_entries += delta;
+
+  _DBUS_LOCK (stats);
+
+  hash_pool_entries_in_use += delta;
+
+  if (table->n_pool_entries > table->peak_pool_entries)
+    {
+      hash_pool_entries_allocated +=
+        table->n_pool_entries - table->peak_pool_entries;
+      table->peak_pool_entries = table->n_pool_entries;
+    }
+
+  _DBUS_UNLOCK (stats);
+}
+
+static void
+forget_pool_stats (DBusHashTable *table)
+{
+  _DBUS_LOCK (stats);
+  hash_pool_entries_in_use -= table->n_pool_entries;
+  hash_pool_entries_allocated -= table->peak_pool_entries;
+  _DBUS_UNLOCK (stats);
+}
+
+void
+_dbus_hash_get_stats (dbus_uint32_t *in_use_p,
+                      dbus_uint32_t *in_free_list_p,
+                      dbus_uint32_t *allocated_p)
+{
+  dbus_uint32_t in_use, allocated;
+
+  _DBUS_LOCK (stats);
+  in_use = hash_pool_entries_in_use;
+  allocated = hash_pool_entries_allocated;
+  _DBUS_UNLOCK (stats);
+
+  _dbus_assert (allocated >= in_use);
+
+  if (in_use_p != NULL)
+    *in_use_p = in_use * sizeof (DBusHashEntry);
+
+  if (in_free_list_p != NULL)
+    *in_free_list_p = (allocated - in_use) * sizeof (DBusHashEntry);
+
+  if (allocated_p != NULL)
+    *allocated_p = allocated * sizeof (DBusHashEntry);
+}
+#endif /* DBUS_ENABLE_STATS */
 
 
 /** @} */
@@ -399,6 +471,9 @@ _dbus_hash_table_unref (DBusHashTable *table)
         }
       /* We can do this very quickly with memory pools ;-) */
       _dbus_mem_pool_free (table->entry_pool);
+#ifdef DBUS_ENABLE_STATS
+      forget_pool_stats (table);
+#endif
 #endif
       
       /* Free the bucket array, if it was dynamically allocated. */
@@ -431,10 +506,26 @@ alloc_entry (DBusHashTable *table)
   DBusHashEntry *entry;
 
   entry = _dbus_mem_pool_alloc (table->entry_pool);
-  
+
+#ifdef DBUS_ENABLE_STATS
+  if (entry != NULL)
+    update_pool_stats (table, 1);
+#endif
+
   return entry;
 }
 
+static void
+dealloc_entry (DBusHashTable *table,
+               DBusHashEntry *entry)
+{
+  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+
+#ifdef DBUS_ENABLE_STATS
+  update_pool_stats (table, -1);
+#endif
+}
+
 static void
 free_entry_data (DBusHashTable  *table,
 		 DBusHashEntry  *entry)
@@ -450,7 +541,7 @@ free_entry (DBusHashTable  *table,
             DBusHashEntry  *entry)
 {
   free_entry_data (table, entry);
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  dealloc_entry (table, entry);
 }
 
 static void
@@ -1061,6 +1152,50 @@ _dbus_hash_table_lookup_string (DBusHashTable *table,
     return NULL;
 }
 
+/**
+ * Like _dbus_hash_table_lookup_string(), but uses a hash value
+ * that the caller computed earlier with _dbus_hash_string(),
+ * for instance one cached alongside the string, instead of
+ * hashing the key again.
+ *
+ * @param table the hash table.
+ * @param key the string to look up.
+ * @param hash _dbus_hash_string() of key
+ * @returns the value of the hash entry.
+ */
+void*
+_dbus_hash_table_lookup_string_with_hash (DBusHashTable *table,
+                                          const char    *key,
+                                          unsigned int   hash)
+{
+  DBusHashEntry *entry;
+
+  _dbus_assert (table->key_type == DBUS_HASH_STRING);
+  _dbus_assert (hash == string_hash (key));
+
+  entry = find_generic_function (table, (char*) key, hash & table->mask,
+                                 (KeyCompareFunc) strcmp, FALSE, NULL, NULL);
+
+  if (entry)
+    return entry->value;
+  else
+    return NULL;
+}
+
+/**
+ * Computes the hash value that tables of type #DBUS_HASH_STRING
+ * use for a key, so that it can be computed once and passed to
+ * _dbus_hash_table_lookup_string_with_hash() many times.
+ *
+ * @param str the string
+ * @returns its hash value
+ */
+unsigned int
+_dbus_hash_string (const char *str)
+{
+  return string_hash (str);
+}
+
 /**
  * Looks up the value for a given integer in a hash table
  * of type #DBUS_HASH_INT. Returns %NULL if the value
@@ -1346,7 +1481,7 @@ _dbus_hash_table_free_preallocated_entry (DBusHashTable        *table,
   entry = (DBusHashEntry*) preallocated;
   
   /* Don't use free_entry(), since this entry has no key/data */
-  _dbus_mem_pool_dealloc (table->entry_pool, entry);
+  dealloc_entry (table, entry);
 }
 
 /**
@@ -1525,6 +1660,11 @@ _dbus_hash_test (void)
       _dbus_assert (value != NULL);
       _dbus_assert (strcmp (value, "Value!") == 0);
 
+      value = _dbus_hash_table_lookup_string_with_hash (table1, keys[i],
+          _dbus_hash_string (keys[i]));
+      _dbus_assert (value != NULL);
+      _dbus_assert (strcmp (value, "Value!") == 0);
+
       value = _dbus_hash_table_lookup_int (table2, i);
       _dbus_assert (value != NULL);
       _dbus_assert (strcmp (value, keys[i]) == 0);
@@ -93,6 +93,10 @@ dbus_bool_t    _dbus_hash_iter_lookup              (DBusHashTable    *table,
                                                     DBusHashIter     *iter);
 void*          _dbus_hash_table_lookup_string      (DBusHashTable    *table,
                                                     const char       *key);
+void*          _dbus_hash_table_lookup_string_with_hash (DBusHashTable *table,
+                                                         const char    *key,
+                                                         unsigned int   hash);
+unsigned int   _dbus_hash_string                   (const char       *str);
 void*          _dbus_hash_table_lookup_int         (DBusHashTable    *table,
                                                     int               key);
 void*          _dbus_hash_table_lookup_uintptr     (DBusHashTable    *table,
@@ -127,6 +131,11 @@ void                  _dbus_hash_table_insert_string_preallocated (DBusHashTable
                                                                    char                 *key,
                                                                    void                 *value);
 
+/* if DBUS_ENABLE_STATS */
+void                  _dbus_hash_get_stats                        (dbus_uint32_t        *in_use_p,
+                                                                   dbus_uint32_t        *in_free_list_p,
+                                                                   dbus_uint32_t        *allocated_p);
+
 /** @} */
 
 DBUS_END_DECLS
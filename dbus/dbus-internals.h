@@ -320,20 +320,35 @@ _DBUS_DECLARE_GLOBAL_LOCK (bus);
 _DBUS_DECLARE_GLOBAL_LOCK (bus_datas);
 _DBUS_DECLARE_GLOBAL_LOCK (shutdown_funcs);
 _DBUS_DECLARE_GLOBAL_LOCK (system_users);
-_DBUS_DECLARE_GLOBAL_LOCK (message_cache);
+_DBUS_DECLARE_GLOBAL_LOCK (message_cache_0);
 /* 10-14 */
 _DBUS_DECLARE_GLOBAL_LOCK (shared_connections);
 _DBUS_DECLARE_GLOBAL_LOCK (win_fds);
 _DBUS_DECLARE_GLOBAL_LOCK (sid_atom_cache);
 _DBUS_DECLARE_GLOBAL_LOCK (machine_uuid);
+/* 14-17, one per message cache shard */
+_DBUS_DECLARE_GLOBAL_LOCK (message_cache_1);
+_DBUS_DECLARE_GLOBAL_LOCK (message_cache_2);
+_DBUS_DECLARE_GLOBAL_LOCK (message_cache_3);
+/* 18 */
+_DBUS_DECLARE_GLOBAL_LOCK (message_body_fd);
 
 #if !DBUS_USE_SYNC
 _DBUS_DECLARE_GLOBAL_LOCK (atomic);
-#define _DBUS_N_GLOBAL_LOCKS (15)
+#define _DBUS_N_ATOMIC_LOCKS (1)
 #else
-#define _DBUS_N_GLOBAL_LOCKS (14)
+#define _DBUS_N_ATOMIC_LOCKS (0)
 #endif
 
+#ifdef DBUS_ENABLE_STATS
+_DBUS_DECLARE_GLOBAL_LOCK (stats);
+#define _DBUS_N_STATS_LOCKS (1)
+#else
+#define _DBUS_N_STATS_LOCKS (0)
+#endif
+
+#define _DBUS_N_GLOBAL_LOCKS (18 + _DBUS_N_ATOMIC_LOCKS + _DBUS_N_STATS_LOCKS)
+
 dbus_bool_t _dbus_threads_init_debug (void);
 
 dbus_bool_t   _dbus_address_append_escaped (DBusString       *escaped,
@@ -26,6 +26,8 @@
 #include "dbus-marshal-header.h"
 #include "dbus-marshal-recursive.h"
 #include "dbus-marshal-byteswap.h"
+#include "dbus-hash.h"
+#include <string.h>
 
 /**
  * @addtogroup DBusMarshal
@@ -83,7 +85,8 @@ _dbus_header_field_types[DBUS_HEADER_FIELD_LAST+1] = {
   { DBUS_HEADER_FIELD_DESTINATION, DBUS_TYPE_STRING },
   { DBUS_HEADER_FIELD_SENDER, DBUS_TYPE_STRING },
   { DBUS_HEADER_FIELD_SIGNATURE, DBUS_TYPE_SIGNATURE },
-  { DBUS_HEADER_FIELD_UNIX_FDS, DBUS_TYPE_UINT32 }
+  { DBUS_HEADER_FIELD_UNIX_FDS, DBUS_TYPE_UINT32 },
+  { DBUS_HEADER_FIELD_BODY_MEMFD, DBUS_TYPE_UINT32 }
 };
 
 /** Macro to look up the correct type for a field */
@@ -139,12 +142,15 @@ _dbus_header_cache_invalidate_all (DBusHeader *header)
   while (i <= DBUS_HEADER_FIELD_LAST)
     {
       header->fields[i].value_pos = _DBUS_HEADER_FIELD_VALUE_UNKNOWN;
+      header->fields[i].have_hash = FALSE;
       ++i;
     }
 }
 
 /**
- * Caches one field
+ * Caches one field, decoding its value so that getting it later
+ * doesn't need to demarshal anything. The field must have the
+ * expected type.
  *
  * @param header the header
  * @param field_code the field
@@ -155,8 +161,31 @@ _dbus_header_cache_one (DBusHeader     *header,
                         int             field_code,
                         DBusTypeReader *variant_reader)
 {
-  header->fields[field_code].value_pos =
-    _dbus_type_reader_get_value_pos (variant_reader);
+  DBusHeaderField *field = &header->fields[field_code];
+  const char *s;
+
+  _dbus_assert (variant_reader->value_str == &header->data);
+
+  field->value_pos = _dbus_type_reader_get_value_pos (variant_reader);
+  field->have_hash = FALSE;
+
+  switch (_dbus_type_reader_get_current_type (variant_reader))
+    {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+    case DBUS_TYPE_SIGNATURE:
+      _dbus_type_reader_read_basic (variant_reader, &s);
+      field->value.str_pos = s - _dbus_string_get_const_data (&header->data);
+      break;
+
+    case DBUS_TYPE_UINT32:
+      _dbus_type_reader_read_basic (variant_reader, &field->value.u32);
+      break;
+
+    default:
+      _dbus_assert_not_reached ("header field of unexpected type");
+      break;
+    }
 
 #if 0
   _dbus_verbose ("cached value_pos %d for field %d\n",
@@ -194,6 +223,7 @@ _dbus_header_cache_revalidate (DBusHeader *header)
   while (i <= DBUS_HEADER_FIELD_LAST)
     {
       header->fields[i].value_pos = _DBUS_HEADER_FIELD_VALUE_NONEXISTENT;
+      header->fields[i].have_hash = FALSE;
       ++i;
     }
 
@@ -507,6 +537,31 @@ _dbus_header_copy (const DBusHeader *header,
   return TRUE;
 }
 
+/**
+ * Makes an initialized header a copy of another one, reusing the
+ * memory it already has. Unlike _dbus_header_copy(), the serial is
+ * copied as well.
+ *
+ * @param header the header to copy
+ * @param dest the header to overwrite
+ * @returns #FALSE if not enough memory, leaving dest empty
+ */
+dbus_bool_t
+_dbus_header_assign (const DBusHeader *header,
+                     DBusHeader       *dest)
+{
+  _dbus_string_set_length (&dest->data, 0);
+
+  if (!_dbus_string_copy (&header->data, 0, &dest->data, 0))
+    return FALSE;
+
+  memcpy (dest->fields, header->fields, sizeof (dest->fields));
+  dest->padding = header->padding;
+  dest->byte_order = header->byte_order;
+
+  return TRUE;
+}
+
 /**
  * Fills in the primary fields of the header, so the header is ready
  * for use. #NULL may be specified for some or all of the fields to
@@ -663,7 +718,7 @@ _dbus_header_create (DBusHeader  *header,
  * @param header_len return location for claimed header length
  * @param body_len return location for claimed body length
  * @param str the data
- * @param start start of data, 8-aligned
+ * @param start start of data, need not be aligned
  * @param len length of data
  * @returns #TRUE if the data is long enough for the claimed length, and the lengths were valid
  */
@@ -682,14 +737,25 @@ _dbus_header_have_message_untrusted (int                max_message_length,
   dbus_uint32_t header_len_unsigned;
   dbus_uint32_t fields_array_len_unsigned;
   dbus_uint32_t body_len_unsigned;
+  union
+  {
+    dbus_uint32_t align;
+    unsigned char bytes[FIRST_FIELD_OFFSET];
+  } fixed;
 
   _dbus_assert (start >= 0);
   _dbus_assert (start < _DBUS_INT32_MAX / 2);
-  _dbus_assert (len >= 0);
+  _dbus_assert (len >= FIRST_FIELD_OFFSET);
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
+  /* The loader parses messages where they land in its buffer, which
+   * is not 8-aligned past the first message; the fixed part is small
+   * enough to copy out to somewhere aligned.
+   */
+  memcpy (fixed.bytes, _dbus_string_get_const_data_len (str, start,
+                                                        FIRST_FIELD_OFFSET),
+          FIRST_FIELD_OFFSET);
 
-  *byte_order = _dbus_string_get_byte (str, start + BYTE_ORDER_OFFSET);
+  *byte_order = fixed.bytes[BYTE_ORDER_OFFSET];
 
   if (*byte_order != DBUS_LITTLE_ENDIAN && *byte_order != DBUS_BIG_ENDIAN)
     {
@@ -697,9 +763,9 @@ _dbus_header_have_message_untrusted (int                max_message_length,
       return FALSE;
     }
 
-  _dbus_assert (FIELDS_ARRAY_LENGTH_OFFSET + 4 <= len);
-  fields_array_len_unsigned = _dbus_marshal_read_uint32 (str, start + FIELDS_ARRAY_LENGTH_OFFSET,
-                                                         *byte_order, NULL);
+  fields_array_len_unsigned =
+    _dbus_unpack_uint32 (*byte_order,
+                         fixed.bytes + FIELDS_ARRAY_LENGTH_OFFSET);
 
   if (fields_array_len_unsigned > (unsigned) max_message_length)
     {
@@ -707,9 +773,8 @@ _dbus_header_have_message_untrusted (int                max_message_length,
       return FALSE;
     }
 
-  _dbus_assert (BODY_LENGTH_OFFSET + 4 < len);
-  body_len_unsigned = _dbus_marshal_read_uint32 (str, start + BODY_LENGTH_OFFSET,
-                                                 *byte_order, NULL);
+  body_len_unsigned = _dbus_unpack_uint32 (*byte_order,
+                                           fixed.bytes + BODY_LENGTH_OFFSET);
 
   if (body_len_unsigned > (unsigned) max_message_length)
     {
@@ -907,6 +972,10 @@ load_and_validate_field (DBusHeader     *header,
       /* Every value makes sense */
       break;
 
+    case DBUS_HEADER_FIELD_BODY_MEMFD:
+      /* Checked against the unix fds when loading the body */
+      break;
+
     case DBUS_HEADER_FIELD_SIGNATURE:
       /* SIGNATURE validated generically due to its type */
       string_validation_func = NULL;
@@ -960,7 +1029,7 @@ load_and_validate_field (DBusHeader     *header,
  * @param body_len claimed length of body
  * @param header_len claimed length of header
  * @param str a string
- * @param start start of header, 8-aligned
+ * @param start start of header, need not be aligned
  * @param len length of string to look at
  * @returns #FALSE if no memory or data was invalid, #TRUE otherwise
  */
@@ -987,7 +1056,6 @@ _dbus_header_load (DBusHeader        *header,
   int padding_len;
   int i;
 
-  _dbus_assert (start == (int) _DBUS_ALIGN_VALUE (start, 8));
   _dbus_assert (header_len <= len);
   _dbus_assert (_dbus_string_get_length (&header->data) == 0);
 
@@ -998,16 +1066,22 @@ _dbus_header_load (DBusHeader        *header,
       return FALSE;
     }
 
+  /* Everything from here on looks at our own copy, which is aligned
+   * and is what the field offsets we record refer to.
+   */
+  str = &header->data;
+  len = header_len;
+
   if (mode == DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
-      leftover = len - header_len - body_len - start;
+      leftover = header_len - (FIRST_FIELD_OFFSET + fields_array_len);
     }
   else
     {
       v = _dbus_validate_body_with_reason (&_dbus_header_signature_str, 0,
                                            byte_order,
                                            &leftover,
-                                           str, start, len);
+                                           str, 0, len);
       
       if (v != DBUS_VALID)
         {
@@ -1019,9 +1093,9 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_assert (leftover < len);
 
   padding_len = header_len - (FIRST_FIELD_OFFSET + fields_array_len);
-  padding_start = start + FIRST_FIELD_OFFSET + fields_array_len;
-  _dbus_assert (start + header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
-  _dbus_assert (start + header_len == padding_start + padding_len);
+  padding_start = FIRST_FIELD_OFFSET + fields_array_len;
+  _dbus_assert (header_len == (int) _DBUS_ALIGN_VALUE (padding_start, 8));
+  _dbus_assert (header_len == padding_start + padding_len);
 
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
@@ -1047,7 +1121,7 @@ _dbus_header_load (DBusHeader        *header,
   _dbus_type_reader_init (&reader,
                           byte_order,
                           &_dbus_header_signature_str, 0,
-                          str, start);
+                          str, 0);
 
   /* BYTE ORDER */
   _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_BYTE);
@@ -1256,11 +1330,108 @@ find_field_for_modification (DBusHeader     *header,
   return retval;
 }
 
+/**
+ * Overwrites the value of an existing field if the new value has the
+ * same marshaled size as the old one, so nothing after it moves and
+ * the cached positions stay valid. This is the common case when the
+ * bus rewrites the sender of a message it forwards.
+ *
+ * @param header the header
+ * @param field the field to set, which must be present in the cache
+ * @param type the type of the value
+ * @param value the value as for _dbus_marshal_set_basic()
+ * @returns #TRUE if the value was set, #FALSE if it has a different size
+ */
+static dbus_bool_t
+set_field_in_place (DBusHeader       *header,
+                    int               field,
+                    int               type,
+                    const void       *value)
+{
+  DBusHeaderField *f = &header->fields[field];
+  const DBusBasicValue *vp = value;
+
+  _dbus_assert (f->value_pos >= 0);
+
+  switch (type)
+    {
+    case DBUS_TYPE_STRING:
+    case DBUS_TYPE_OBJECT_PATH:
+    case DBUS_TYPE_SIGNATURE:
+      if (strlen (vp->str) !=
+          strlen (_dbus_string_get_const_data (&header->data) + f->value.str_pos))
+        return FALSE;
+      break;
+
+    case DBUS_TYPE_UINT32:
+      f->value.u32 = vp->u32;
+      break;
+
+    default:
+      return FALSE;
+    }
+
+  if (!_dbus_marshal_set_basic (&header->data, f->value_pos, type, value,
+                                _dbus_header_get_byte_order (header),
+                                NULL, NULL))
+    _dbus_assert_not_reached ("same-length set should not have used memory");
+
+  f->have_hash = FALSE;
+
+  return TRUE;
+}
+
+/**
+ * Caches a field that was just appended at the given position, so
+ * appending doesn't throw away the cache of the fields before it.
+ *
+ * @param header the header
+ * @param field the field
+ * @param struct_pos where the field's struct was written (may be unaligned)
+ */
+static void
+cache_appended_field (DBusHeader *header,
+                      int         field,
+                      int         struct_pos)
+{
+  DBusTypeReader reader;
+  DBusTypeReader sub;
+  DBusTypeReader variant;
+#ifndef DBUS_DISABLE_ASSERT
+  unsigned char field_code;
+#endif
+
+  _dbus_type_reader_init (&reader,
+                          _dbus_header_get_byte_order (header),
+                          &_dbus_header_signature_str,
+                          FIELDS_ARRAY_ELEMENT_SIGNATURE_OFFSET,
+                          &header->data,
+                          struct_pos);
+
+  _dbus_assert (_dbus_type_reader_get_current_type (&reader) == DBUS_TYPE_STRUCT);
+  _dbus_type_reader_recurse (&reader, &sub);
+
+#ifndef DBUS_DISABLE_ASSERT
+  _dbus_type_reader_read_basic (&sub, &field_code);
+  _dbus_assert (field_code == (unsigned) field);
+#endif
+
+  _dbus_type_reader_next (&sub);
+  _dbus_assert (_dbus_type_reader_get_current_type (&sub) == DBUS_TYPE_VARIANT);
+  _dbus_type_reader_recurse (&sub, &variant);
+
+  _dbus_header_cache_one (header, field, &variant);
+}
+
 /**
  * Sets the value of a field with basic type. If the value is a string
  * value, it isn't allowed to be #NULL. If the field doesn't exist,
  * it will be created.
  *
+ * Replacing a value with one of the same size is done in place, and
+ * appending a new field only moves the trailing padding; in both
+ * cases the rest of the header stays where it is and remains cached.
+ *
  * @param header the header
  * @param field the field to set
  * @param type the type of the value
@@ -1273,17 +1444,26 @@ _dbus_header_set_field_basic (DBusHeader       *header,
                               int               type,
                               const void       *value)
 {
-  _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
+  dbus_bool_t appended;
+  int struct_pos;
 
-  if (!reserve_header_padding (header))
-    return FALSE;
+  _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
 
   /* If the field exists we set, otherwise we append */
+  appended = FALSE;
+  struct_pos = -1;
+
   if (_dbus_header_cache_check (header, field))
     {
       DBusTypeReader reader;
       DBusTypeReader realign_root;
 
+      if (set_field_in_place (header, field, type, value))
+        return TRUE;
+
+      if (!reserve_header_padding (header))
+        return FALSE;
+
       if (!find_field_for_modification (header, field,
                                         &reader, &realign_root))
         _dbus_assert_not_reached ("field was marked present in cache but wasn't found");
@@ -1296,6 +1476,9 @@ _dbus_header_set_field_basic (DBusHeader       *header,
       DBusTypeWriter writer;
       DBusTypeWriter array;
 
+      if (!reserve_header_padding (header))
+        return FALSE;
+
       _dbus_type_writer_init_values_only (&writer,
                                           _dbus_header_get_byte_order (header),
                                           &_dbus_header_signature_str,
@@ -1316,21 +1499,27 @@ _dbus_header_set_field_basic (DBusHeader       *header,
       _dbus_assert (array.u.array.start_pos == FIRST_FIELD_OFFSET);
       _dbus_assert (array.value_pos == HEADER_END_BEFORE_PADDING (header));
 
+      struct_pos = array.value_pos;
+
       if (!write_basic_field (&array,
                               field, type, value))
         return FALSE;
 
       if (!_dbus_type_writer_unrecurse (&writer, &array))
         _dbus_assert_not_reached ("unrecurse from ARRAY should not have used memory");
+
+      appended = TRUE;
     }
 
   correct_header_padding (header);
 
-  /* We could be smarter about this (only invalidate fields after the
-   * one we modified, or even only if the one we modified changed
-   * length). But this hack is a start.
+  /* Appending left every earlier field where it was; a resized value
+   * shifted everything after it, so the whole cache has to go.
    */
-  _dbus_header_cache_invalidate_all (header);
+  if (appended)
+    cache_appended_field (header, field, struct_pos);
+  else
+    _dbus_header_cache_invalidate_all (header);
 
   return TRUE;
 }
@@ -1365,11 +1554,54 @@ _dbus_header_get_field_basic (DBusHeader    *header,
 
   _dbus_assert (header->fields[field].value_pos >= 0);
 
-  _dbus_marshal_read_basic (&header->data,
-                            header->fields[field].value_pos,
-                            type, value, _dbus_header_get_byte_order (header),
-                            NULL);
+  /* The value was decoded when the field was cached */
+  if (type == DBUS_TYPE_UINT32)
+    *(dbus_uint32_t *) value = header->fields[field].value.u32;
+  else
+    *(const char **) value = _dbus_string_get_const_data (&header->data) +
+      header->fields[field].value.str_pos;
+
+  return TRUE;
+}
+
+/**
+ * Gets the _dbus_hash_string() hash of a string-typed field, such as
+ * the destination or interface, for use with
+ * _dbus_hash_table_lookup_string_with_hash(). The hash is computed
+ * the first time it is asked for and kept until the header is
+ * modified, so routing a message through several hash tables only
+ * hashes each field once.
+ *
+ * @param header the header
+ * @param field the field to get
+ * @param hash return location for the hash
+ * @returns #FALSE if the field doesn't exist
+ */
+dbus_bool_t
+_dbus_header_get_field_hash (DBusHeader   *header,
+                             int           field,
+                             unsigned int *hash)
+{
+  const char *value;
+
+  _dbus_assert (field != DBUS_HEADER_FIELD_INVALID);
+  _dbus_assert (field <= DBUS_HEADER_FIELD_LAST);
+  _dbus_assert (EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_STRING ||
+                EXPECTED_TYPE_OF_FIELD (field) == DBUS_TYPE_OBJECT_PATH);
+
+  if (!_dbus_header_cache_check (header, field))
+    return FALSE;
+
+  if (!header->fields[field].have_hash)
+    {
+      value = _dbus_string_get_const_data (&header->data) +
+        header->fields[field].value.str_pos;
+
+      header->fields[field].value_hash = _dbus_hash_string (value);
+      header->fields[field].have_hash = TRUE;
+    }
 
+  *hash = header->fields[field].value_hash;
   return TRUE;
 }
 
@@ -39,6 +39,13 @@ typedef struct DBusHeaderField DBusHeaderField;
 struct DBusHeaderField
 {
   int            value_pos; /**< Position of field value, or -1/-2 */
+  union
+  {
+    int           str_pos;  /**< Position of the first byte of a string value */
+    dbus_uint32_t u32;      /**< A uint32 value, in host byte order */
+  } value;                  /**< The value, decoded when it was cached, if value_pos >= 0 */
+  unsigned int   value_hash; /**< _dbus_hash_string() of a string value */
+  dbus_bool_t    have_hash;  /**< #TRUE if value_hash is up to date */
 };
 
 /**
@@ -72,6 +79,8 @@ dbus_bool_t   _dbus_header_create                 (DBusHeader        *header,
                                                    const char        *error_name);
 dbus_bool_t   _dbus_header_copy                   (const DBusHeader  *header,
                                                    DBusHeader        *dest);
+dbus_bool_t   _dbus_header_assign                 (const DBusHeader  *header,
+                                                   DBusHeader        *dest);
 int           _dbus_header_get_message_type       (DBusHeader        *header);
 void          _dbus_header_set_serial             (DBusHeader        *header,
                                                    dbus_uint32_t      serial);
@@ -86,6 +95,9 @@ dbus_bool_t   _dbus_header_get_field_basic        (DBusHeader        *header,
                                                    int                field,
                                                    int                type,
                                                    void              *value);
+dbus_bool_t   _dbus_header_get_field_hash         (DBusHeader        *header,
+                                                   int                field,
+                                                   unsigned int      *hash);
 dbus_bool_t   _dbus_header_get_field_raw          (DBusHeader        *header,
                                                    int                field,
                                                    const DBusString **str,
@@ -113,6 +113,7 @@ typedef enum
   DBUS_INVALID_DICT_KEY_MUST_BE_BASIC_TYPE = 55,
   DBUS_INVALID_MISSING_UNIX_FDS = 56,
   DBUS_INVALID_NESTED_TOO_DEEPLY = 57,
+  DBUS_INVALID_BAD_BODY_MEMFD = 58,
   DBUS_VALIDITY_LAST
 } DBusValidity;
 
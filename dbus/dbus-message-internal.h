@@ -50,9 +50,18 @@ typedef struct DBusMessageLoader DBusMessageLoader;
 void _dbus_message_get_network_data  (DBusMessage       *message,
 				      const DBusString **header,
 				      const DBusString **body);
+void _dbus_message_get_external_data (DBusMessage       *message,
+                                      const DBusString **external);
+dbus_bool_t _dbus_message_get_body_fd_network_data (DBusMessage *message,
+                                                    long         max_unix_fds,
+                                                    DBusString  *header,
+                                                    int         *body_fd);
 void _dbus_message_get_unix_fds      (DBusMessage *message,
                                       const int **fds,
                                       unsigned *n_fds);
+dbus_bool_t _dbus_message_get_field_hash (DBusMessage  *message,
+                                          int           field,
+                                          unsigned int *hash_p);
 
 void        _dbus_message_lock                  (DBusMessage  *message);
 void        _dbus_message_unlock                (DBusMessage  *message);
@@ -69,6 +78,9 @@ void               _dbus_message_loader_unref                 (DBusMessageLoader
 
 void               _dbus_message_loader_get_buffer            (DBusMessageLoader  *loader,
                                                                DBusString        **buffer);
+void               _dbus_message_loader_get_read_buffer       (DBusMessageLoader  *loader,
+                                                               DBusString        **buffer,
+                                                               int                *max_to_read);
 void               _dbus_message_loader_return_buffer         (DBusMessageLoader  *loader,
                                                                DBusString         *buffer,
                                                                int                 bytes_read);
@@ -96,8 +108,17 @@ long               _dbus_message_loader_get_max_message_size  (DBusMessageLoader
 
 void               _dbus_message_loader_set_max_message_unix_fds(DBusMessageLoader  *loader,
                                                                  long                n);
+void               _dbus_message_loader_set_accept_body_memfds (DBusMessageLoader  *loader,
+                                                                dbus_bool_t         accept);
 long               _dbus_message_loader_get_max_message_unix_fds(DBusMessageLoader  *loader);
 
+dbus_bool_t        _dbus_message_cache_set_sizes              (const char         *sizes);
+
+/* if DBUS_ENABLE_STATS */
+void               _dbus_message_get_cache_stats              (dbus_uint32_t      *hits_p,
+                                                               dbus_uint32_t      *misses_p,
+                                                               dbus_uint32_t      *evictions_p);
+
 typedef struct DBusInitialFDs DBusInitialFDs;
 DBusInitialFDs *_dbus_check_fdleaks_enter (void);
 void            _dbus_check_fdleaks_leave (DBusInitialFDs *fds);
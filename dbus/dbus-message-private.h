@@ -63,6 +63,10 @@ struct DBusMessageLoader
 
   DBusString data;     /**< Buffered data */
 
+  DBusString body;     /**< Body of a large message being read directly, see body_direct */
+  int partial_header_len; /**< Header length of incomplete message at start of data, or 0 */
+  int partial_body_len;   /**< Body length of incomplete message at start of data */
+
   DBusList *messages;  /**< Complete messages. */
 
   long max_message_size; /**< Maximum size of a message */
@@ -74,6 +78,10 @@ struct DBusMessageLoader
 
   unsigned int buffer_outstanding : 1; /**< Someone is using the buffer to read */
 
+  unsigned int body_direct : 1; /**< data holds just the header of the incomplete message, and its body is being read into body */
+
+  unsigned int accept_body_memfds : 1; /**< Bodies may come in sealed memfds, see DBUS_HEADER_FIELD_BODY_MEMFD */
+
 #ifdef HAVE_UNIX_FD_PASSING
   unsigned int unix_fds_outstanding : 1; /**< Someone is using the unix fd array to read */
 
@@ -102,14 +110,25 @@ struct DBusMessage
 
   DBusString body;   /**< Body network data. */
 
+  DBusString external; /**< Caller-owned bytes sent after the body, if have_external */
+  DBusFreeFunction external_free_func; /**< Called with external_free_data to release external */
+  void *external_free_data; /**< Data for external_free_func */
+
   unsigned int locked : 1; /**< Message being sent, no modifications allowed. */
 
+  unsigned int have_external : 1; /**< Body continues in caller-owned memory, see dbus_message_append_external_bytes() */
+
+  unsigned int signature_preset : 1; /**< Header already has the final signature from a template, and the body is still being appended */
+  unsigned int preset_signature_len : 8; /**< How much of the preset signature the body has so far */
+
 #ifndef DBUS_DISABLE_CHECKS
   unsigned int in_cache : 1; /**< Has been "freed" since it's in the cache (this is a debug feature) */
 #endif
 
   DBusList *counters;   /**< 0-N DBusCounter used to track message size/unix fds. */
   long size_counter_delta;   /**< Size we incremented the size counters by.   */
+  DBusList counter_link;     /**< Link for a counter added without one of its own */
+  unsigned int counter_link_in_use : 1; /**< counter_link is in counters */
 
   dbus_uint32_t changed_stamp : CHANGED_STAMP_BITS; /**< Incremented when iterators are invalidated. */
 
@@ -126,8 +145,12 @@ struct DBusMessage
      them when adding or removing them here. */
   unsigned n_unix_fds; /**< Number of valid fds in the array */
   unsigned n_unix_fds_allocated; /**< Allocated size of the array */
+  unsigned int unix_fds_borrowed : 1; /**< The array is part of the message's own block, not allocated by itself */
 
   long unix_fd_counter_delta; /**< Size we incremented the unix fd counter by */
+
+  int body_fd; /**< Sealed memfd holding the body (and any external bytes), or -1 */
+  unsigned int body_mapped : 1; /**< body is a read-only mapping of body_fd rather than our own string, so the message can't be cached */
 #endif
 };
 
@@ -83,6 +83,7 @@ dbus_message_iter_get_args (DBusMessageIter *iter,
 #ifdef DBUS_BUILD_TESTS
 #include "dbus-test.h"
 #include "dbus-message-factory.h"
+#include "dbus-hash.h"
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -1003,6 +1004,81 @@ verify_test_message (DBusMessage *message)
     _dbus_assert_not_reached ("Didn't reach end of arguments");
 }
 
+/* Starts reading the large first message of a stream directly, then
+ * has the rest of the stream appended at once; if there's no memory
+ * to put the body back in front of it then, it has to be done later
+ */
+static dbus_bool_t
+check_direct_body_interrupted (void *data)
+{
+  const DBusString *stream = data;
+  DBusMessageLoader *loader;
+  DBusMessage *message;
+  DBusString *buffer;
+  int pos;
+  int n;
+
+  loader = _dbus_message_loader_new ();
+  if (loader == NULL)
+    return TRUE;
+
+  pos = 0;
+  while (pos < _dbus_string_get_length (stream) / 2)
+    {
+      int max_to_read = 4096;
+
+      _dbus_message_loader_get_read_buffer (loader, &buffer, &max_to_read);
+
+      n = MIN (max_to_read, 4096);
+      if (!_dbus_string_copy_len (stream, pos, n, buffer,
+                                  _dbus_string_get_length (buffer)))
+        n = 0;
+      _dbus_message_loader_return_buffer (loader, buffer, n);
+      pos += n;
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        goto out;
+    }
+
+  _dbus_message_loader_get_buffer (loader, &buffer);
+  n = _dbus_string_get_length (stream) - pos;
+  if (!_dbus_string_copy_len (stream, pos, n, buffer,
+                              _dbus_string_get_length (buffer)))
+    n = 0;
+  _dbus_message_loader_return_buffer (loader, buffer, n);
+
+  if (n == 0 || !_dbus_message_loader_queue_messages (loader))
+    goto out;
+
+  _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_get_serial (message) == 1);
+  dbus_message_unref (message);
+
+  message = _dbus_message_loader_pop_message (loader);
+  _dbus_assert (message != NULL);
+  _dbus_assert (dbus_message_get_serial (message) == 2);
+  dbus_message_unref (message);
+
+  if (_dbus_message_loader_pop_message (loader) != NULL)
+    _dbus_assert_not_reached ("loader has an unexpected message");
+
+ out:
+  _dbus_message_loader_unref (loader);
+
+  return TRUE;
+}
+
+static void
+count_external_release (void *data)
+{
+  int *n_released = data;
+
+  *n_released += 1;
+}
+
 /**
  * @ingroup DBusMessageInternals
  * Unit test for DBusMessage.
@@ -1019,6 +1095,7 @@ _dbus_message_test (const char *test_data_dir)
   DBusMessage *copy;
   const char *name1;
   const char *name2;
+  unsigned int hash;
   const dbus_uint32_t our_uint32_array[] =
     { 0x12345678, 0x23456781, 0x34567812, 0x45678123 };
   const dbus_int32_t our_int32_array[] =
@@ -1065,6 +1142,26 @@ _dbus_message_test (const char *test_data_dir)
 
   initial_fds = _dbus_check_fdleaks_enter ();
 
+  /* Message cache sizes */
+  if (!_dbus_message_cache_set_sizes (""))
+    _dbus_assert_not_reached ("valid message cache sizes rejected");
+  if (!_dbus_message_cache_set_sizes ("8"))
+    _dbus_assert_not_reached ("valid message cache sizes rejected");
+  if (!_dbus_message_cache_set_sizes ("0,0,0"))
+    _dbus_assert_not_reached ("valid message cache sizes rejected");
+  if (!_dbus_message_cache_set_sizes ("1000,1,0"))
+    _dbus_assert_not_reached ("valid message cache sizes rejected");
+  if (_dbus_message_cache_set_sizes ("x"))
+    _dbus_assert_not_reached ("invalid message cache sizes accepted");
+  if (_dbus_message_cache_set_sizes ("1,,2"))
+    _dbus_assert_not_reached ("invalid message cache sizes accepted");
+  if (_dbus_message_cache_set_sizes ("1,-2"))
+    _dbus_assert_not_reached ("invalid message cache sizes accepted");
+  if (_dbus_message_cache_set_sizes ("1,2,3,4"))
+    _dbus_assert_not_reached ("invalid message cache sizes accepted");
+  if (!_dbus_message_cache_set_sizes ("4,2,1"))
+    _dbus_assert_not_reached ("valid message cache sizes rejected");
+
   message = dbus_message_new_method_call ("org.freedesktop.DBus.TestService",
                                           "/org/freedesktop/TestPath",
                                           "Foo.TestInterface",
@@ -1120,11 +1217,18 @@ _dbus_message_test (const char *test_data_dir)
     _dbus_assert_not_reached ("out of memory");
   _dbus_assert (strcmp (dbus_message_get_interface (message),
                         "org.Foo") == 0);
+  if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_INTERFACE,
+                                     &hash))
+    _dbus_assert_not_reached ("no interface field hash");
+  _dbus_assert (hash == _dbus_hash_string ("org.Foo"));
 
   if (!dbus_message_set_member (message, "Bar"))
     _dbus_assert_not_reached ("out of memory");
   _dbus_assert (strcmp (dbus_message_get_member (message),
                         "Bar") == 0);
+  if (_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_ERROR_NAME,
+                                    &hash))
+    _dbus_assert_not_reached ("hash of a field the message doesn't have");
 
   /* Set/get them with longer values */
   if (!dbus_message_set_path (message, "/foo/bar"))
@@ -1136,6 +1240,11 @@ _dbus_message_test (const char *test_data_dir)
     _dbus_assert_not_reached ("out of memory");
   _dbus_assert (strcmp (dbus_message_get_interface (message),
                         "org.Foo.Bar") == 0);
+  /* the cached hash must not survive modification */
+  if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_INTERFACE,
+                                     &hash))
+    _dbus_assert_not_reached ("no interface field hash");
+  _dbus_assert (hash == _dbus_hash_string ("org.Foo.Bar"));
 
   if (!dbus_message_set_member (message, "BarFoo"))
     _dbus_assert_not_reached ("out of memory");
@@ -1159,6 +1268,38 @@ _dbus_message_test (const char *test_data_dir)
   _dbus_assert (strcmp (dbus_message_get_member (message),
                         "Bar") == 0);
 
+  /* Same length is overwritten in place; the fields around it
+   * must be unaffected and the hash must not go stale
+   */
+  if (!dbus_message_set_sender (message, ":1.1"))
+    _dbus_assert_not_reached ("out of memory");
+  if (!dbus_message_set_interface (message, "org.Baz"))
+    _dbus_assert_not_reached ("out of memory");
+  if (!_dbus_message_get_field_hash (message, DBUS_HEADER_FIELD_INTERFACE,
+                                     &hash))
+    _dbus_assert_not_reached ("no interface field hash");
+  _dbus_assert (hash == _dbus_hash_string ("org.Baz"));
+  if (!dbus_message_set_sender (message, ":1.2"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_sender (message),
+                        ":1.2") == 0);
+  _dbus_assert (strcmp (dbus_message_get_path (message),
+                        "/foo") == 0);
+  _dbus_assert (strcmp (dbus_message_get_interface (message),
+                        "org.Baz") == 0);
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "Bar") == 0);
+  if (!dbus_message_set_sender (message, ":1.200"))
+    _dbus_assert_not_reached ("out of memory");
+  _dbus_assert (strcmp (dbus_message_get_sender (message),
+                        ":1.200") == 0);
+  _dbus_assert (strcmp (dbus_message_get_member (message),
+                        "Bar") == 0);
+  if (!dbus_message_set_sender (message, NULL))
+    _dbus_assert_not_reached ("out of memory");
+  if (!dbus_message_set_interface (message, "org.Foo"))
+    _dbus_assert_not_reached ("out of memory");
+
   /* Path decomposing */
   dbus_message_set_path (message, NULL);
   dbus_message_get_path_decomposed (message, &decomposed);
@@ -1457,6 +1598,427 @@ _dbus_message_test (const char *test_data_dir)
   dbus_message_unref (message_without_unix_fds);
   _dbus_message_loader_unref (loader);
 
+  /* Queue several messages read in one go; with odd body lengths,
+   * all but the first start unaligned in the loader's buffer.
+   */
+  loader = _dbus_message_loader_new ();
+  {
+    static const char *const args[] = { "a", "bc", "def", "ghij" };
+    DBusString *buffer;
+
+    _dbus_message_loader_get_buffer (loader, &buffer);
+    for (i = 0; i < (int) _DBUS_N_ELEMENTS (args); i++)
+      {
+        message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                           "Foo.TestInterface",
+                                           "TestSignal");
+        _dbus_assert (message != NULL);
+        dbus_message_set_serial (message, 1 + i);
+        if (!dbus_message_append_args (message,
+                                       DBUS_TYPE_STRING, &args[i],
+                                       DBUS_TYPE_INVALID))
+          _dbus_assert_not_reached ("no memory to append args");
+        dbus_message_lock (message);
+
+        if (!_dbus_string_copy (&message->header.data, 0, buffer,
+                                _dbus_string_get_length (buffer)) ||
+            !_dbus_string_copy (&message->body, 0, buffer,
+                                _dbus_string_get_length (buffer)))
+          _dbus_assert_not_reached ("no memory to fill loader buffer");
+
+        dbus_message_unref (message);
+      }
+    _dbus_message_loader_return_buffer (loader, buffer,
+                                        _dbus_string_get_length (buffer));
+
+    if (!_dbus_message_loader_queue_messages (loader))
+      _dbus_assert_not_reached ("no memory to queue messages");
+
+    if (_dbus_message_loader_get_is_corrupted (loader))
+      _dbus_assert_not_reached ("message loader corrupted");
+
+    for (i = 0; i < (int) _DBUS_N_ELEMENTS (args); i++)
+      {
+        const char *arg;
+
+        message = _dbus_message_loader_pop_message (loader);
+        _dbus_assert (message != NULL);
+        _dbus_assert (dbus_message_get_serial (message) == (dbus_uint32_t) (1 + i));
+
+        if (!dbus_message_get_args (message, NULL,
+                                    DBUS_TYPE_STRING, &arg,
+                                    DBUS_TYPE_INVALID))
+          _dbus_assert_not_reached ("could not read pipelined message");
+        _dbus_assert (strcmp (arg, args[i]) == 0);
+
+        dbus_message_unref (message);
+      }
+
+    if (_dbus_message_loader_pop_message (loader) != NULL)
+      _dbus_assert_not_reached ("loader has an unexpected message");
+  }
+  _dbus_message_loader_unref (loader);
+
+  /* Read a large message followed by a small one the way a transport
+   * does, a chunk at a time; the large body should be handed out in
+   * one piece once its length is known.
+   */
+  loader = _dbus_message_loader_new ();
+  {
+    DBusString stream;
+    unsigned char *bytes;
+    const char *arg = "after";
+    int n_bytes = 200 * 1024;
+    int pos;
+    dbus_bool_t read_directly = FALSE;
+
+    if (!_dbus_string_init (&stream))
+      _dbus_assert_not_reached ("no memory for stream");
+
+    bytes = dbus_malloc (n_bytes);
+    _dbus_assert (bytes != NULL);
+    for (i = 0; i < n_bytes; i++)
+      bytes[i] = i % 251;
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    _dbus_assert (message != NULL);
+    dbus_message_set_serial (message, 1);
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &bytes, n_bytes,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("no memory to append args");
+    dbus_message_lock (message);
+    if (!_dbus_string_copy (&message->header.data, 0, &stream, 0) ||
+        !_dbus_string_copy (&message->body, 0, &stream,
+                            _dbus_string_get_length (&stream)))
+      _dbus_assert_not_reached ("no memory to build stream");
+    dbus_message_unref (message);
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    _dbus_assert (message != NULL);
+    dbus_message_set_serial (message, 2);
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &arg,
+                                   DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("no memory to append args");
+    dbus_message_lock (message);
+    if (!_dbus_string_copy (&message->header.data, 0, &stream,
+                            _dbus_string_get_length (&stream)) ||
+        !_dbus_string_copy (&message->body, 0, &stream,
+                            _dbus_string_get_length (&stream)))
+      _dbus_assert_not_reached ("no memory to build stream");
+    dbus_message_unref (message);
+
+    pos = 0;
+    while (pos < _dbus_string_get_length (&stream))
+      {
+        DBusString *buffer;
+        int max_to_read = 4096;
+        int n;
+
+        _dbus_message_loader_get_read_buffer (loader, &buffer, &max_to_read);
+        if (max_to_read > 4096)
+          read_directly = TRUE;
+
+        /* never all of the body before any of it has arrived */
+        _dbus_assert (max_to_read < n_bytes);
+
+        n = MIN (max_to_read, _dbus_string_get_length (&stream) - pos);
+        if (!_dbus_string_copy_len (&stream, pos, n, buffer,
+                                    _dbus_string_get_length (buffer)))
+          _dbus_assert_not_reached ("no memory to fill loader buffer");
+        _dbus_message_loader_return_buffer (loader, buffer, n);
+        pos += n;
+
+        if (!_dbus_message_loader_queue_messages (loader))
+          _dbus_assert_not_reached ("no memory to queue messages");
+        _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+      }
+
+    _dbus_assert (read_directly);
+
+    message = _dbus_message_loader_pop_message (loader);
+    _dbus_assert (message != NULL);
+    {
+      unsigned char *got;
+      int n_got;
+
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &got, &n_got,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("could not read large message");
+      _dbus_assert (n_got == n_bytes);
+      _dbus_assert (memcmp (got, bytes, n_bytes) == 0);
+    }
+    dbus_message_unref (message);
+
+    message = _dbus_message_loader_pop_message (loader);
+    _dbus_assert (message != NULL);
+    _dbus_assert (dbus_message_get_serial (message) == 2);
+    dbus_message_unref (message);
+
+    if (_dbus_message_loader_pop_message (loader) != NULL)
+      _dbus_assert_not_reached ("loader has an unexpected message");
+
+    if (!_dbus_test_oom_handling ("reading a body directly",
+                                  check_direct_body_interrupted,
+                                  &stream))
+      _dbus_assert_not_reached ("direct body test failed");
+
+    dbus_free (bytes);
+    _dbus_string_free (&stream);
+  }
+  _dbus_message_loader_unref (loader);
+
+  /* Bytes appended by reference follow the body on the wire, and are
+   * only released along with the message
+   */
+  {
+    unsigned char bytes[1000];
+    const char *arg = "before";
+    const DBusString *header;
+    const DBusString *body;
+    const DBusString *external;
+    int n_released = 0;
+    char *marshalled;
+    int len;
+    DBusMessage *message2;
+    const char *got_arg;
+    unsigned char *got;
+    int n_got;
+
+    for (i = 0; i < (int) sizeof (bytes); i++)
+      bytes[i] = i % 251;
+
+    message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                       "Foo.TestInterface",
+                                       "TestSignal");
+    _dbus_assert (message != NULL);
+    if (!dbus_message_append_args (message,
+                                   DBUS_TYPE_STRING, &arg,
+                                   DBUS_TYPE_INVALID) ||
+        !dbus_message_append_external_bytes (message, bytes, sizeof (bytes),
+                                             count_external_release,
+                                             &n_released))
+      _dbus_assert_not_reached ("no memory to append args");
+    _dbus_assert (strcmp (dbus_message_get_signature (message), "say") == 0);
+
+    dbus_message_set_serial (message, 1);
+    dbus_message_lock (message);
+    _dbus_message_get_network_data (message, &header, &body);
+    _dbus_message_get_external_data (message, &external);
+    _dbus_assert (external != NULL);
+    _dbus_assert (_dbus_string_get_const_data (external) == (const char *) bytes);
+    _dbus_assert (_dbus_string_get_length (external) == sizeof (bytes));
+
+    if (!dbus_message_marshal (message, &marshalled, &len))
+      _dbus_assert_not_reached ("no memory to marshal");
+    _dbus_assert (len == _dbus_string_get_length (header) +
+                  _dbus_string_get_length (body) + (int) sizeof (bytes));
+
+    message2 = dbus_message_demarshal (marshalled, len, NULL);
+    _dbus_assert (message2 != NULL);
+    dbus_free (marshalled);
+
+    copy = dbus_message_copy (message);
+    _dbus_assert (copy != NULL);
+
+    if (!dbus_message_get_args (message2, NULL,
+                                DBUS_TYPE_STRING, &got_arg,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &got, &n_got,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not read demarshaled message");
+    _dbus_assert (strcmp (got_arg, arg) == 0);
+    _dbus_assert (n_got == sizeof (bytes));
+    _dbus_assert (memcmp (got, bytes, sizeof (bytes)) == 0);
+
+    if (!dbus_message_get_args (copy, NULL,
+                                DBUS_TYPE_STRING, &got_arg,
+                                DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &got, &n_got,
+                                DBUS_TYPE_INVALID))
+      _dbus_assert_not_reached ("could not read copied message");
+    _dbus_assert (n_got == sizeof (bytes));
+    _dbus_assert (memcmp (got, bytes, sizeof (bytes)) == 0);
+
+    dbus_message_unref (message2);
+    dbus_message_unref (copy);
+    _dbus_assert (n_released == 0);
+    dbus_message_unref (message);
+    _dbus_assert (n_released == 1);
+  }
+
+  /* Messages made from a template marshal exactly like ones built
+   * from scratch, whether or not the template has the signature
+   */
+  {
+    DBusMessageTemplate *tmpl;
+    dbus_int32_t v_INT32 = 42;
+    const char *v_STRING = "Hello";
+    const DBusString *header;
+    const DBusString *body;
+    const DBusString *header2;
+    const DBusString *body2;
+    DBusMessage *message2;
+    const char *signatures[] = { "is", NULL };
+
+    for (i = 0; i < (int) _DBUS_N_ELEMENTS (signatures); i++)
+      {
+        message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                           "Foo.TestInterface",
+                                           "TestSignal");
+        _dbus_assert (message != NULL);
+        if (!dbus_message_set_destination (message, "org.freedesktop.DBus.TestService"))
+          _dbus_assert_not_reached ("no memory to set destination");
+
+        tmpl = dbus_message_template_new (message, signatures[i]);
+        _dbus_assert (tmpl != NULL);
+
+        message2 = dbus_message_template_new_message (tmpl,
+                                                      DBUS_TYPE_INT32, &v_INT32,
+                                                      DBUS_TYPE_STRING, &v_STRING,
+                                                      DBUS_TYPE_INVALID);
+        _dbus_assert (message2 != NULL);
+        dbus_message_template_unref (tmpl);
+
+        if (!dbus_message_append_args (message,
+                                       DBUS_TYPE_INT32, &v_INT32,
+                                       DBUS_TYPE_STRING, &v_STRING,
+                                       DBUS_TYPE_INVALID))
+          _dbus_assert_not_reached ("no memory to append args");
+
+        _dbus_assert (strcmp (dbus_message_get_signature (message2), "is") == 0);
+        _dbus_assert (strcmp (dbus_message_get_member (message2), "TestSignal") == 0);
+
+        dbus_message_set_serial (message, 7);
+        dbus_message_set_serial (message2, 7);
+        dbus_message_lock (message);
+        dbus_message_lock (message2);
+        _dbus_message_get_network_data (message, &header, &body);
+        _dbus_message_get_network_data (message2, &header2, &body2);
+        _dbus_assert (_dbus_string_equal (header, header2));
+        _dbus_assert (_dbus_string_equal (body, body2));
+
+        dbus_message_unref (message);
+        dbus_message_unref (message2);
+      }
+  }
+
+#ifdef HAVE_UNIX_FD_PASSING
+  /* Check that a large body can be passed in a sealed memfd and is
+   * read in place from the mapping
+   */
+  if (_dbus_sealed_memfd_is_supported ())
+    {
+      const int n_big = 1024 * 1024;
+      unsigned char *big;
+      const unsigned char *big_p;
+      DBusString memfd_header;
+      DBusString *buffer;
+      int body_fd;
+      int *unix_fds;
+      unsigned n_unix_fds;
+      unsigned char *got;
+      int n_got;
+
+      big = dbus_malloc (n_big);
+      _dbus_assert (big != NULL);
+      for (i = 0; i < n_big; i++)
+        big[i] = i % 253;
+      big_p = big;
+
+      message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                         "Foo.TestInterface",
+                                         "TestSignal");
+      _dbus_assert (message != NULL);
+      if (!dbus_message_append_args (message,
+                                     DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &big_p, n_big,
+                                     DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("no memory to append args");
+      dbus_message_set_serial (message, 1);
+      dbus_message_lock (message);
+
+      if (!_dbus_string_init (&memfd_header))
+        _dbus_assert_not_reached ("no memory for header");
+      /* not if the memfd would take the message over the fd limit */
+      if (_dbus_message_get_body_fd_network_data (message, 0, &memfd_header,
+                                                  &body_fd))
+        _dbus_assert_not_reached ("body put in a memfd over the fd limit");
+      _dbus_assert (message->body_fd < 0);
+      _dbus_assert (_dbus_string_get_length (&memfd_header) == 0);
+
+      if (!_dbus_message_get_body_fd_network_data (message, 1, &memfd_header,
+                                                   &body_fd))
+        _dbus_assert_not_reached ("could not put the body in a memfd");
+      _dbus_assert (body_fd >= 0);
+      _dbus_assert (_dbus_string_get_length (&memfd_header) < 1024);
+
+      loader = _dbus_message_loader_new ();
+      _dbus_assert (loader != NULL);
+
+      /* Refused unless negotiated */
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      _dbus_string_copy (&memfd_header, 0, buffer, _dbus_string_get_length (buffer));
+      _dbus_message_loader_return_buffer (loader, buffer,
+                                          _dbus_string_get_length (&memfd_header));
+      _dbus_message_loader_get_unix_fds (loader, &unix_fds, &n_unix_fds);
+      unix_fds[0] = _dbus_dup (body_fd, NULL);
+      _dbus_assert (unix_fds[0] >= 0);
+      _dbus_message_loader_return_unix_fds (loader, unix_fds, 1);
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+      _dbus_assert (_dbus_message_loader_get_is_corrupted (loader));
+      _dbus_assert (_dbus_message_loader_get_corruption_reason (loader) ==
+                    DBUS_INVALID_BAD_BODY_MEMFD);
+      _dbus_message_loader_unref (loader);
+
+      loader = _dbus_message_loader_new ();
+      _dbus_assert (loader != NULL);
+      _dbus_message_loader_set_accept_body_memfds (loader, TRUE);
+
+      _dbus_message_loader_get_buffer (loader, &buffer);
+      _dbus_string_copy (&memfd_header, 0, buffer, _dbus_string_get_length (buffer));
+      _dbus_message_loader_return_buffer (loader, buffer,
+                                          _dbus_string_get_length (&memfd_header));
+      _dbus_message_loader_get_unix_fds (loader, &unix_fds, &n_unix_fds);
+      unix_fds[0] = _dbus_dup (body_fd, NULL);
+      _dbus_assert (unix_fds[0] >= 0);
+      _dbus_message_loader_return_unix_fds (loader, unix_fds, 1);
+      _dbus_string_free (&memfd_header);
+      dbus_message_unref (message);
+
+      if (!_dbus_message_loader_queue_messages (loader))
+        _dbus_assert_not_reached ("no memory to queue messages");
+      _dbus_assert (!_dbus_message_loader_get_is_corrupted (loader));
+
+      message = _dbus_message_loader_pop_message (loader);
+      _dbus_assert (message != NULL);
+      _dbus_assert (message->body_mapped);
+      _dbus_assert (message->n_unix_fds == 0);
+      _dbus_assert (!_dbus_header_get_field_raw (&message->header,
+                                                 DBUS_HEADER_FIELD_BODY_MEMFD,
+                                                 NULL, NULL));
+
+      if (!dbus_message_get_args (message, NULL,
+                                  DBUS_TYPE_ARRAY, DBUS_TYPE_BYTE, &got, &n_got,
+                                  DBUS_TYPE_INVALID))
+        _dbus_assert_not_reached ("could not read memfd body");
+      _dbus_assert (n_got == n_big);
+      _dbus_assert (memcmp (got, big, n_big) == 0);
+      /* read in place */
+      _dbus_assert ((const char *) got > _dbus_string_get_const_data (&message->body));
+      _dbus_assert ((const char *) got < _dbus_string_get_const_data (&message->body) +
+                    _dbus_string_get_length (&message->body));
+
+      dbus_message_unref (message);
+      _dbus_message_loader_unref (loader);
+      dbus_free (big);
+    }
+#endif
+
   check_memleaks ();
   _dbus_check_fdleaks_leave (initial_fds);
   initial_fds = _dbus_check_fdleaks_enter ();
@@ -214,6 +214,168 @@ _dbus_message_get_network_data (DBusMessage          *message,
   *body = &message->body;
 }
 
+/**
+ * Gets the caller-owned bytes that follow the body on the wire, as
+ * appended with dbus_message_append_external_bytes(). They should be
+ * written out after the data from _dbus_message_get_network_data().
+ *
+ * @param message the message.
+ * @param external return location for the bytes, or #NULL if there are none
+ */
+void
+_dbus_message_get_external_data (DBusMessage       *message,
+                                 const DBusString **external)
+{
+  _dbus_assert (message->locked);
+
+  if (message->have_external)
+    *external = &message->external;
+  else
+    *external = NULL;
+}
+
+/**
+ * Gets the number of caller-owned bytes that follow the body.
+ *
+ * @param message the message
+ * @returns the length, or 0 if there are none
+ */
+static int
+get_external_len (const DBusMessage *message)
+{
+  if (message->have_external)
+    return _dbus_string_get_length (&message->external);
+  else
+    return 0;
+}
+
+/**
+ * Gives the caller-owned bytes back to their owner. This calls
+ * application code.
+ *
+ * @param message the message
+ */
+static void
+release_external (DBusMessage *message)
+{
+  if (message->have_external)
+    {
+      DBusFreeFunction free_func = message->external_free_func;
+      void *free_data = message->external_free_data;
+
+      message->have_external = FALSE;
+      message->external_free_func = NULL;
+      message->external_free_data = NULL;
+
+      if (free_func != NULL)
+        (* free_func) (free_data);
+    }
+}
+
+/**
+ * Bodies at least this large are passed in a sealed memfd on
+ * connections that negotiated it, rather than written to the socket.
+ */
+#define MEMFD_BODY_MIN_LEN (512 * 1024)
+
+/* Protects DBusMessage::body_fd, which is created on a locked message
+ * that may be going out on several connections from several threads.
+ */
+_DBUS_DEFINE_GLOBAL_LOCK (message_body_fd);
+
+/**
+ * Gets the data to be sent over the network for this message when
+ * its body goes in a sealed memfd instead of after the header. That
+ * is only worth it for large bodies, and only allowed on connections
+ * that negotiated it. The memfd is created the first time and shared
+ * by every connection the message goes out on, including ones the bus
+ * forwards a received memfd body to.
+ *
+ * The header written to @p header has a body length of 0 and the
+ * #DBUS_HEADER_FIELD_BODY_MEMFD field, and counts the memfd as one
+ * more unix fd, to be passed after the message's own. The receiver
+ * can't take more fds than its limit, which is taken to be the same
+ * as ours, so a message already carrying that many goes out normally.
+ *
+ * @param message the message.
+ * @param max_unix_fds the most unix fds a message may carry
+ * @param header an empty string to store the header in
+ * @param body_fd return location for the memfd
+ * @returns #FALSE if the body should be sent normally
+ */
+dbus_bool_t
+_dbus_message_get_body_fd_network_data (DBusMessage *message,
+                                        long         max_unix_fds,
+                                        DBusString  *header,
+                                        int         *body_fd)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  DBusHeader copy;
+  dbus_uint32_t n_fds;
+  dbus_uint32_t fd_index;
+  int fd;
+
+  _dbus_assert (message->locked);
+  _dbus_assert (_dbus_string_get_length (header) == 0);
+
+  if (_dbus_string_get_length (&message->body) +
+      get_external_len (message) < MEMFD_BODY_MIN_LEN)
+    return FALSE;
+
+  /* the receiver reads it in place, so can't byteswap it */
+  if (_dbus_header_get_byte_order (&message->header) != DBUS_COMPILER_BYTE_ORDER)
+    return FALSE;
+
+  if ((long) message->n_unix_fds + 1 > max_unix_fds)
+    return FALSE;
+
+  _DBUS_LOCK (message_body_fd);
+  if (message->body_fd < 0)
+    message->body_fd =
+      _dbus_sealed_memfd_new (&message->body,
+                              message->have_external ? &message->external : NULL,
+                              NULL);
+  fd = message->body_fd;
+  _DBUS_UNLOCK (message_body_fd);
+
+  if (fd < 0)
+    return FALSE;
+
+  if (!_dbus_header_copy (&message->header, &copy))
+    return FALSE;
+
+  /* copying resets it */
+  _dbus_header_set_serial (&copy, _dbus_header_get_serial (&message->header));
+
+  fd_index = message->n_unix_fds;
+  n_fds = fd_index + 1;
+
+  if (!_dbus_header_set_field_basic (&copy, DBUS_HEADER_FIELD_UNIX_FDS,
+                                     DBUS_TYPE_UINT32, &n_fds) ||
+      !_dbus_header_set_field_basic (&copy, DBUS_HEADER_FIELD_BODY_MEMFD,
+                                     DBUS_TYPE_UINT32, &fd_index))
+    {
+      _dbus_header_free (&copy);
+      return FALSE;
+    }
+
+  _dbus_header_update_lengths (&copy, 0);
+
+  if (!_dbus_string_copy (&copy.data, 0, header, 0))
+    {
+      _dbus_header_free (&copy);
+      return FALSE;
+    }
+
+  _dbus_header_free (&copy);
+
+  *body_fd = fd;
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
 /**
  * Gets the unix fds to be sent over the network for this message.
  * This function is guaranteed to always return the same data once a
@@ -238,6 +400,27 @@ void _dbus_message_get_unix_fds(DBusMessage *message,
 #endif
 }
 
+/**
+ * Gets the _dbus_hash_string() hash of one of the message's string
+ * header fields, such as #DBUS_HEADER_FIELD_DESTINATION or
+ * #DBUS_HEADER_FIELD_INTERFACE, so that it can be looked up with
+ * _dbus_hash_table_lookup_string_with_hash(). The hash is cached in
+ * the header, so each field is hashed at most once however many
+ * tables the message is routed through.
+ *
+ * @param message the message
+ * @param field the header field
+ * @param hash_p return location for the hash
+ * @returns #FALSE if the message has no such field
+ */
+dbus_bool_t
+_dbus_message_get_field_hash (DBusMessage  *message,
+                              int           field,
+                              unsigned int *hash_p)
+{
+  return _dbus_header_get_field_hash (&message->header, field, hash_p);
+}
+
 /**
  * Sets the serial number of a message.
  * This can only be done once on a message.
@@ -289,7 +472,8 @@ _dbus_message_add_counter_link (DBusMessage  *message,
     {
       message->size_counter_delta =
         _dbus_string_get_length (&message->header.data) +
-        _dbus_string_get_length (&message->body);
+        _dbus_string_get_length (&message->body) +
+        get_external_len (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
       message->unix_fd_counter_delta = message->n_unix_fds;
@@ -310,6 +494,17 @@ _dbus_message_add_counter_link (DBusMessage  *message,
 #endif
 }
 
+/* Frees a link that has been taken out of message->counters */
+static void
+free_counter_link (DBusMessage *message,
+                   DBusList    *link)
+{
+  if (link == &message->counter_link)
+    message->counter_link_in_use = FALSE;
+  else
+    _dbus_list_free_link (link);
+}
+
 /**
  * Adds a counter to be incremented immediately with the size/unix fds
  * of this message, and decremented by the size/unix fds of this
@@ -330,9 +525,18 @@ _dbus_message_add_counter (DBusMessage *message,
 {
   DBusList *link;
 
-  link = _dbus_list_alloc_link (counter);
-  if (link == NULL)
-    return FALSE;
+  if (!message->counter_link_in_use)
+    {
+      link = &message->counter_link;
+      link->data = counter;
+      message->counter_link_in_use = TRUE;
+    }
+  else
+    {
+      link = _dbus_list_alloc_link (counter);
+      if (link == NULL)
+        return FALSE;
+    }
 
   _dbus_counter_ref (counter);
   _dbus_message_add_counter_link (message, link);
@@ -357,7 +561,8 @@ _dbus_message_remove_counter (DBusMessage  *message,
                                counter);
   _dbus_assert (link != NULL);
 
-  _dbus_list_remove_link (&message->counters, link);
+  _dbus_list_unlink (&message->counters, link);
+  free_counter_link (message, link);
 
   _dbus_counter_adjust_size (counter, - message->size_counter_delta);
 
@@ -385,7 +590,8 @@ dbus_message_lock (DBusMessage  *message)
   if (!message->locked)
     {
       _dbus_header_update_lengths (&message->header,
-                                   _dbus_string_get_length (&message->body));
+                                   _dbus_string_get_length (&message->body) +
+                                   get_external_len (message));
 
       /* must have a signature if you have a body */
       _dbus_assert (_dbus_string_get_length (&message->body) == 0 ||
@@ -500,96 +706,319 @@ _dbus_message_set_signature (DBusMessage *message,
  * mempool).
  */
 
-/** Avoid caching huge messages */
-#define MAX_MESSAGE_SIZE_TO_CACHE 10 * _DBUS_ONE_KILOBYTE
+/* The cache is split into shards, each with its own lock, and a
+ * thread always uses the same shard, so threads that allocate and
+ * free messages concurrently rarely contend. Within a shard, cached
+ * messages are kept by size class, so that larger messages can be
+ * cached too without a small message holding on to a large buffer
+ * where a large one is needed.
+ */
+
+/** Number of message cache shards; each has a global lock */
+#define MESSAGE_CACHE_N_SHARDS    4
+
+/** Number of size classes in each shard */
+#define MESSAGE_CACHE_N_CLASSES   3
+
+/** Most messages a size class can be tuned to cache, per shard */
+#define MESSAGE_CACHE_MAX_SLOTS   16
+
+/** Room left for the header to grow in a newly allocated message */
+#define MESSAGE_ARENA_HEADER_SLACK  128
+
+/** Room for appending arguments to a newly allocated message */
+#define MESSAGE_ARENA_BODY_SIZE     256
+
+/** Most unix fds there is room for in a newly allocated message */
+#define MESSAGE_ARENA_MAX_UNIX_FDS  16
+
+/** Largest message (header plus body) cached in each size class */
+static const int message_cache_class_size[MESSAGE_CACHE_N_CLASSES] = {
+  1 * _DBUS_ONE_KILOBYTE,
+  10 * _DBUS_ONE_KILOBYTE,
+  64 * _DBUS_ONE_KILOBYTE
+};
+
+/** How many messages each size class caches, per shard */
+static int message_cache_class_slots[MESSAGE_CACHE_N_CLASSES] = {
+  4, 2, 1
+};
+
+typedef struct
+{
+  DBusMessage *messages[MESSAGE_CACHE_N_CLASSES][MESSAGE_CACHE_MAX_SLOTS];
+  int n_messages[MESSAGE_CACHE_N_CLASSES];
+  dbus_bool_t shutdown_registered;
+
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint32_t hits;
+  dbus_uint32_t misses;
+  dbus_uint32_t evictions;
+#endif
+} MessageCacheShard;
+
+_DBUS_DEFINE_GLOBAL_LOCK (message_cache_0);
+_DBUS_DEFINE_GLOBAL_LOCK (message_cache_1);
+_DBUS_DEFINE_GLOBAL_LOCK (message_cache_2);
+_DBUS_DEFINE_GLOBAL_LOCK (message_cache_3);
+
+static DBusRMutex **const message_cache_locks[MESSAGE_CACHE_N_SHARDS] = {
+  &_DBUS_LOCK_NAME (message_cache_0),
+  &_DBUS_LOCK_NAME (message_cache_1),
+  &_DBUS_LOCK_NAME (message_cache_2),
+  &_DBUS_LOCK_NAME (message_cache_3)
+};
+
+static MessageCacheShard message_cache[MESSAGE_CACHE_N_SHARDS];
+
+/* Picks the calling thread's shard. Thread identifiers tend to have
+ * patterns in their low bits, so mix before reducing.
+ */
+static int
+message_cache_shard_for_thread (void)
+{
+  dbus_uint32_t hash;
+
+  hash = _dbus_current_thread_hash ();
+  hash *= 2654435761u;
+
+  return (hash >> 16) % MESSAGE_CACHE_N_SHARDS;
+}
+
+static int
+message_cache_class_for_size (int size)
+{
+  int i;
+
+  for (i = 0; i < MESSAGE_CACHE_N_CLASSES; i++)
+    {
+      if (size <= message_cache_class_size[i])
+        return i;
+    }
+
+  return -1;
+}
 
-/** Avoid caching too many messages */
-#define MAX_MESSAGE_CACHE_SIZE    5
+/**
+ * Sets how many messages of each size class the message cache may
+ * hold per shard, from a comma-separated list such as "4,2,1"
+ * (smallest class first). Missing entries are left as they are;
+ * values are clamped to what the cache has room for. Messages
+ * already cached beyond a lowered limit are only dropped as they
+ * are reused.
+ *
+ * The initial sizes are taken from the DBUS_MESSAGE_CACHE_SIZES
+ * environment variable, if set.
+ *
+ * @param sizes the list of sizes
+ * @returns #FALSE if the list could not be parsed
+ */
+dbus_bool_t
+_dbus_message_cache_set_sizes (const char *sizes)
+{
+  DBusString str;
+  int slots[MESSAGE_CACHE_N_CLASSES];
+  int pos;
+  int i;
 
-_DBUS_DEFINE_GLOBAL_LOCK (message_cache);
-static DBusMessage *message_cache[MAX_MESSAGE_CACHE_SIZE];
-static int message_cache_count = 0;
-static dbus_bool_t message_cache_shutdown_registered = FALSE;
+  _dbus_string_init_const (&str, sizes);
+
+  for (i = 0; i < MESSAGE_CACHE_N_CLASSES; i++)
+    slots[i] = message_cache_class_slots[i];
+
+  pos = 0;
+  for (i = 0; i < MESSAGE_CACHE_N_CLASSES &&
+         pos < _dbus_string_get_length (&str); i++)
+    {
+      long value;
+
+      if (!_dbus_string_parse_int (&str, pos, &value, &pos) ||
+          value < 0)
+        return FALSE;
+
+      slots[i] = MIN (value, MESSAGE_CACHE_MAX_SLOTS);
+
+      if (pos < _dbus_string_get_length (&str))
+        {
+          if (_dbus_string_get_byte (&str, pos) != ',')
+            return FALSE;
+          pos += 1;
+        }
+    }
+
+  if (pos < _dbus_string_get_length (&str))
+    return FALSE;
+
+  /* Plain int stores; a thread racing with this sees either value */
+  for (i = 0; i < MESSAGE_CACHE_N_CLASSES; i++)
+    message_cache_class_slots[i] = slots[i];
+
+  return TRUE;
+}
+
+static void
+message_cache_init_sizes (void)
+{
+  static dbus_bool_t initialized = FALSE;
+  const char *s;
+
+  if (initialized)
+    return;
+
+  initialized = TRUE;
+
+  s = _dbus_getenv ("DBUS_MESSAGE_CACHE_SIZES");
+  if (s != NULL && *s != '\0' && !_dbus_message_cache_set_sizes (s))
+    _dbus_warn ("DBUS_MESSAGE_CACHE_SIZES should be a comma-separated "
+                "list of numbers, not '%s'\n", s);
+}
 
 static void
 dbus_message_cache_shutdown (void *data)
 {
-  int i;
+  MessageCacheShard *shard = data;
+  int shard_index = shard - message_cache;
+  int i, j;
 
-  _DBUS_LOCK (message_cache);
+  _dbus_rmutex_lock (*message_cache_locks[shard_index]);
 
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  for (i = 0; i < MESSAGE_CACHE_N_CLASSES; i++)
     {
-      if (message_cache[i])
-        dbus_message_finalize (message_cache[i]);
+      for (j = 0; j < shard->n_messages[i]; j++)
+        dbus_message_finalize (shard->messages[i][j]);
 
-      ++i;
+      shard->n_messages[i] = 0;
     }
 
-  message_cache_count = 0;
-  message_cache_shutdown_registered = FALSE;
+  shard->shutdown_registered = FALSE;
 
-  _DBUS_UNLOCK (message_cache);
+  _dbus_rmutex_unlock (*message_cache_locks[shard_index]);
 }
 
 /**
- * Tries to get a message from the message cache.  The retrieved
- * message will have junk in it, so it still needs to be cleared out
- * in dbus_message_new_empty_header()
+ * Tries to get a message from the calling thread's shard of the
+ * message cache, preferring one of the size class for the given
+ * size, then larger ones. The retrieved message will have junk in
+ * it, so it still needs to be cleared out in
+ * dbus_message_new_empty_header()
  *
+ * @param size_hint expected header plus body length, or 0
  * @returns the message, or #NULL if none cached
  */
 static DBusMessage*
-dbus_message_get_cached (void)
+dbus_message_get_cached (int size_hint)
 {
   DBusMessage *message;
+  MessageCacheShard *shard;
+  int shard_index;
   int i;
 
   message = NULL;
 
-  _DBUS_LOCK (message_cache);
+  i = message_cache_class_for_size (size_hint);
+  if (i < 0)
+    return NULL;
 
-  _dbus_assert (message_cache_count >= 0);
+  shard_index = message_cache_shard_for_thread ();
+  shard = &message_cache[shard_index];
 
-  if (message_cache_count == 0)
-    {
-      _DBUS_UNLOCK (message_cache);
-      return NULL;
-    }
+  _dbus_rmutex_lock (*message_cache_locks[shard_index]);
 
-  /* This is not necessarily true unless count > 0, and
-   * message_cache is uninitialized until the shutdown is
-   * registered
-   */
-  _dbus_assert (message_cache_shutdown_registered);
-
-  i = 0;
-  while (i < MAX_MESSAGE_CACHE_SIZE)
+  for (; i < MESSAGE_CACHE_N_CLASSES; i++)
     {
-      if (message_cache[i])
+      _dbus_assert (shard->n_messages[i] >= 0);
+
+      if (shard->n_messages[i] > 0)
         {
-          message = message_cache[i];
-          message_cache[i] = NULL;
-          message_cache_count -= 1;
+          /* This is not necessarily true unless there are messages,
+           * and the cache is uninitialized until the shutdown is
+           * registered
+           */
+          _dbus_assert (shard->shutdown_registered);
+
+          shard->n_messages[i] -= 1;
+          message = shard->messages[i][shard->n_messages[i]];
+          shard->messages[i][shard->n_messages[i]] = NULL;
           break;
         }
-      ++i;
     }
-  _dbus_assert (message_cache_count >= 0);
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
-  _dbus_assert (message != NULL);
+
+  if (message == NULL)
+    {
+#ifdef DBUS_ENABLE_STATS
+      shard->misses += 1;
+#endif
+      _dbus_rmutex_unlock (*message_cache_locks[shard_index]);
+      return NULL;
+    }
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
   _dbus_assert (message->counters == NULL);
-  
-  _DBUS_UNLOCK (message_cache);
+
+#ifdef DBUS_ENABLE_STATS
+  shard->hits += 1;
+#endif
+
+  _dbus_rmutex_unlock (*message_cache_locks[shard_index]);
 
   return message;
 }
 
+#ifdef DBUS_ENABLE_STATS
+void
+_dbus_message_get_cache_stats (dbus_uint32_t *hits_p,
+                               dbus_uint32_t *misses_p,
+                               dbus_uint32_t *evictions_p)
+{
+  dbus_uint32_t hits = 0, misses = 0, evictions = 0;
+  int i;
+
+  for (i = 0; i < MESSAGE_CACHE_N_SHARDS; i++)
+    {
+      _dbus_rmutex_lock (*message_cache_locks[i]);
+      hits += message_cache[i].hits;
+      misses += message_cache[i].misses;
+      evictions += message_cache[i].evictions;
+      _dbus_rmutex_unlock (*message_cache_locks[i]);
+    }
+
+  if (hits_p != NULL)
+    *hits_p = hits;
+
+  if (misses_p != NULL)
+    *misses_p = misses;
+
+  if (evictions_p != NULL)
+    *evictions_p = evictions;
+}
+#endif /* DBUS_ENABLE_STATS */
+
 #ifdef HAVE_UNIX_FD_PASSING
+/**
+ * Closes the memfd holding the body, and unmaps the body if it was
+ * received in one.
+ *
+ * @param message the message
+ */
+static void
+release_body_fd (DBusMessage *message)
+{
+  if (message->body_mapped &&
+      _dbus_string_get_length (&message->body) > 0)
+    {
+      _dbus_sealed_memfd_unmap (_dbus_string_get_const_data (&message->body),
+                                _dbus_string_get_length (&message->body));
+      _dbus_string_init_const (&message->body, "");
+    }
+
+  if (message->body_fd >= 0)
+    {
+      _dbus_close (message->body_fd, NULL);
+      message->body_fd = -1;
+    }
+}
+
 static void
 close_unix_fds(int *fds, unsigned *n_fds)
 {
@@ -614,6 +1043,17 @@ close_unix_fds(int *fds, unsigned *n_fds)
 
   /* We don't free the array here, in case we can recycle it later */
 }
+
+static void
+free_unix_fd_array (DBusMessage *message)
+{
+  if (!message->unix_fds_borrowed)
+    dbus_free (message->unix_fds);
+
+  message->unix_fds = NULL;
+  message->n_unix_fds_allocated = 0;
+  message->unix_fds_borrowed = FALSE;
+}
 #endif
 
 static void
@@ -632,6 +1072,18 @@ free_counter (void *element,
   _dbus_counter_unref (counter);
 }
 
+static void
+clear_counters (DBusMessage *message)
+{
+  DBusList *link;
+
+  while ((link = _dbus_list_pop_first_link (&message->counters)) != NULL)
+    {
+      free_counter (link->data, message);
+      free_counter_link (message, link);
+    }
+}
+
 /**
  * Tries to cache a message, otherwise finalize it.
  *
@@ -641,7 +1093,9 @@ static void
 dbus_message_cache_or_finalize (DBusMessage *message)
 {
   dbus_bool_t was_cached;
-  int i;
+  MessageCacheShard *shard;
+  int shard_index;
+  int size_class;
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
@@ -650,58 +1104,62 @@ dbus_message_cache_or_finalize (DBusMessage *message)
    */
   _dbus_data_slot_list_clear (&message->slot_list);
 
-  _dbus_list_foreach (&message->counters,
-                      free_counter, message);
-  _dbus_list_clear (&message->counters);
+  release_external (message);
+
+  clear_counters (message);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
+  release_body_fd (message);
 #endif
 
   was_cached = FALSE;
 
-  _DBUS_LOCK (message_cache);
+  size_class = message_cache_class_for_size
+    (_dbus_string_get_length (&message->header.data) +
+     _dbus_string_get_length (&message->body));
 
-  if (!message_cache_shutdown_registered)
-    {
-      _dbus_assert (message_cache_count == 0);
+  shard_index = message_cache_shard_for_thread ();
+  shard = &message_cache[shard_index];
+
+  _dbus_rmutex_lock (*message_cache_locks[shard_index]);
 
-      if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, NULL))
+  if (!shard->shutdown_registered)
+    {
+      if (!_dbus_register_shutdown_func (dbus_message_cache_shutdown, shard))
         goto out;
 
-      i = 0;
-      while (i < MAX_MESSAGE_CACHE_SIZE)
-        {
-          message_cache[i] = NULL;
-          ++i;
-        }
+      message_cache_init_sizes ();
 
-      message_cache_shutdown_registered = TRUE;
+      shard->shutdown_registered = TRUE;
     }
 
-  _dbus_assert (message_cache_count >= 0);
-
   if (!_dbus_enable_message_cache ())
     goto out;
 
-  if ((_dbus_string_get_length (&message->header.data) +
-       _dbus_string_get_length (&message->body)) >
-      MAX_MESSAGE_SIZE_TO_CACHE)
+  /* Avoid caching huge messages */
+  if (size_class < 0)
     goto out;
 
-  if (message_cache_count >= MAX_MESSAGE_CACHE_SIZE)
+#ifdef HAVE_UNIX_FD_PASSING
+  /* The body string isn't ours to reuse */
+  if (message->body_mapped)
     goto out;
+#endif
 
-  /* Find empty slot */
-  i = 0;
-  while (message_cache[i] != NULL)
-    ++i;
+  _dbus_assert (shard->n_messages[size_class] >= 0);
 
-  _dbus_assert (i < MAX_MESSAGE_CACHE_SIZE);
+  /* Avoid caching too many messages */
+  if (shard->n_messages[size_class] >= message_cache_class_slots[size_class])
+    {
+#ifdef DBUS_ENABLE_STATS
+      shard->evictions += 1;
+#endif
+      goto out;
+    }
 
-  _dbus_assert (message_cache[i] == NULL);
-  message_cache[i] = message;
-  message_cache_count += 1;
+  shard->messages[size_class][shard->n_messages[size_class]] = message;
+  shard->n_messages[size_class] += 1;
   was_cached = TRUE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = TRUE;
@@ -710,7 +1168,7 @@ dbus_message_cache_or_finalize (DBusMessage *message)
  out:
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
-  _DBUS_UNLOCK (message_cache);
+  _dbus_rmutex_unlock (*message_cache_locks[shard_index]);
   
   if (!was_cached)
     dbus_message_finalize (message);
@@ -1104,50 +1562,128 @@ dbus_message_finalize (DBusMessage *message)
 
   /* This calls application callbacks! */
   _dbus_data_slot_list_free (&message->slot_list);
+  release_external (message);
 
-  _dbus_list_foreach (&message->counters,
-                      free_counter, message);
-  _dbus_list_clear (&message->counters);
+  clear_counters (message);
 
   _dbus_header_free (&message->header);
+
+#ifdef HAVE_UNIX_FD_PASSING
+  release_body_fd (message);
+#endif
+
   _dbus_string_free (&message->body);
 
 #ifdef HAVE_UNIX_FD_PASSING
   close_unix_fds(message->unix_fds, &message->n_unix_fds);
-  dbus_free(message->unix_fds);
+  free_unix_fd_array (message);
 #endif
 
   _dbus_assert (_dbus_atomic_get (&message->refcount) == 0);
 
+  /* along with anything else in its block */
   dbus_free (message);
 }
 
+/* Allocates a message together with buffers for its header and body
+ * and space for its unix fds, so that it takes one allocation, and
+ * freeing the message frees them all. Any of them that has to grow
+ * beyond its space later moves to an allocation of its own.
+ */
+static DBusMessage*
+dbus_message_new_arena (int header_size,
+                        int body_size,
+                        int n_unix_fds)
+{
+  DBusMessage *message;
+  char *p;
+  int message_size;
+
+  message_size = _DBUS_ALIGN_VALUE (sizeof (DBusMessage), 8);
+  header_size = _DBUS_ALIGN_VALUE (header_size + _DBUS_STRING_ALLOCATION_PADDING, 8);
+  body_size = _DBUS_ALIGN_VALUE (body_size + _DBUS_STRING_ALLOCATION_PADDING, 8);
+#ifndef HAVE_UNIX_FD_PASSING
+  n_unix_fds = 0;
+#endif
+
+  message = dbus_malloc0 (message_size + header_size + body_size +
+                          n_unix_fds * sizeof (int));
+  if (message == NULL)
+    return NULL;
+
+  p = (char *) message + message_size;
+
+  _dbus_string_init_borrowed (&message->header.data, p, header_size);
+  _dbus_header_reinit (&message->header);
+  p += header_size;
+
+  _dbus_string_init_borrowed (&message->body, p, body_size);
+  p += body_size;
+
+#ifdef HAVE_UNIX_FD_PASSING
+  if (n_unix_fds > 0)
+    {
+      message->unix_fds = (int *) p;
+      message->n_unix_fds_allocated = n_unix_fds;
+      message->unix_fds_borrowed = TRUE;
+    }
+#endif
+
+  return message;
+}
+
+/**
+ * Creates a message with no header fields or body, reusing a cached
+ * one if possible. Otherwise, if the sizes are small enough to cache
+ * the message later, it's allocated in one block with room for the
+ * given header and body lengths (plus some room for the header to
+ * grow, such as by the sender the bus adds to messages it routes)
+ * and number of unix fds.
+ *
+ * @param header_size expected header length
+ * @param body_size expected body length, or 0 to leave room for appending
+ * @param n_unix_fds number of unix fds the message may get
+ * @returns the message, or #NULL if no memory
+ */
 static DBusMessage*
-dbus_message_new_empty_header (void)
+dbus_message_new_empty_header (int header_size,
+                               int body_size,
+                               int n_unix_fds)
 {
   DBusMessage *message;
   dbus_bool_t from_cache;
+  dbus_bool_t in_arena;
 
-  message = dbus_message_get_cached ();
+  message = dbus_message_get_cached (header_size + body_size);
 
   if (message != NULL)
     {
       from_cache = TRUE;
+      in_arena = FALSE;
     }
   else
     {
       from_cache = FALSE;
-      message = dbus_new0 (DBusMessage, 1);
+
+      /* Only worth it for messages that will get reused, which
+       * also keeps the body out of the way of a loader reading
+       * large bodies directly.
+       */
+      in_arena = header_size + body_size <=
+        message_cache_class_size[MESSAGE_CACHE_N_CLASSES - 1];
+
+      if (in_arena)
+        message = dbus_message_new_arena (header_size + MESSAGE_ARENA_HEADER_SLACK,
+                                          body_size > 0 ? body_size : MESSAGE_ARENA_BODY_SIZE,
+                                          MIN (n_unix_fds, MESSAGE_ARENA_MAX_UNIX_FDS));
+      else
+        message = dbus_new0 (DBusMessage, 1);
+
       if (message == NULL)
         return NULL;
 #ifndef DBUS_DISABLE_CHECKS
       message->generation = _dbus_current_generation;
 #endif
-
-#ifdef HAVE_UNIX_FD_PASSING
-      message->unix_fds = NULL;
-      message->n_unix_fds_allocated = 0;
-#endif
     }
 
   _dbus_atomic_inc (&message->refcount);
@@ -1155,17 +1691,21 @@ dbus_message_new_empty_header (void)
   _dbus_message_trace_ref (message, 0, 1, "new_empty_header");
 
   message->locked = FALSE;
+  message->have_external = FALSE;
+  message->signature_preset = FALSE;
 #ifndef DBUS_DISABLE_CHECKS
   message->in_cache = FALSE;
 #endif
   message->counters = NULL;
   message->size_counter_delta = 0;
+  message->counter_link_in_use = FALSE;
   message->changed_stamp = 0;
 
 #ifdef HAVE_UNIX_FD_PASSING
   message->n_unix_fds = 0;
-  message->n_unix_fds_allocated = 0;
   message->unix_fd_counter_delta = 0;
+  message->body_fd = -1;
+  message->body_mapped = FALSE;
 #endif
 
   if (!from_cache)
@@ -1176,7 +1716,7 @@ dbus_message_new_empty_header (void)
       _dbus_header_reinit (&message->header);
       _dbus_string_set_length (&message->body, 0);
     }
-  else
+  else if (!in_arena)
     {
       if (!_dbus_header_init (&message->header))
         {
@@ -1214,7 +1754,7 @@ dbus_message_new (int message_type)
 
   _dbus_return_val_if_fail (message_type != DBUS_MESSAGE_TYPE_INVALID, NULL);
 
-  message = dbus_message_new_empty_header ();
+  message = dbus_message_new_empty_header (0, 0, 0);
   if (message == NULL)
     return NULL;
 
@@ -1268,7 +1808,7 @@ dbus_message_new_method_call (const char *destination,
                             _dbus_check_is_valid_interface (interface), NULL);
   _dbus_return_val_if_fail (_dbus_check_is_valid_member (method), NULL);
 
-  message = dbus_message_new_empty_header ();
+  message = dbus_message_new_empty_header (0, 0, 0);
   if (message == NULL)
     return NULL;
 
@@ -1303,7 +1843,7 @@ dbus_message_new_method_return (DBusMessage *method_call)
 
   /* sender is allowed to be null here in peer-to-peer case */
 
-  message = dbus_message_new_empty_header ();
+  message = dbus_message_new_empty_header (0, 0, 0);
   if (message == NULL)
     return NULL;
 
@@ -1356,7 +1896,7 @@ dbus_message_new_signal (const char *path,
   _dbus_return_val_if_fail (_dbus_check_is_valid_interface (interface), NULL);
   _dbus_return_val_if_fail (_dbus_check_is_valid_member (name), NULL);
 
-  message = dbus_message_new_empty_header ();
+  message = dbus_message_new_empty_header (0, 0, 0);
   if (message == NULL)
     return NULL;
 
@@ -1407,7 +1947,7 @@ dbus_message_new_error (DBusMessage *reply_to,
    * when the message bus is dealing with an unregistered
    * connection.
    */
-  message = dbus_message_new_empty_header ();
+  message = dbus_message_new_empty_header (0, 0, 0);
   if (message == NULL)
     return NULL;
 
@@ -1474,25 +2014,212 @@ dbus_message_new_error_printf (DBusMessage *reply_to,
   _dbus_return_val_if_fail (error_name != NULL, NULL);
   _dbus_return_val_if_fail (_dbus_check_is_valid_error_name (error_name), NULL);
 
-  if (!_dbus_string_init (&str))
+  if (!_dbus_string_init (&str))
+    return NULL;
+
+  va_start (args, error_format);
+
+  if (_dbus_string_append_printf_valist (&str, error_format, args))
+    message = dbus_message_new_error (reply_to, error_name,
+				      _dbus_string_get_const_data (&str));
+  else
+    message = NULL;
+
+  _dbus_string_free (&str);
+
+  va_end (args);
+
+  return message;
+}
+
+
+/**
+ * Internals of DBusMessageTemplate
+ */
+struct DBusMessageTemplate
+{
+  DBusAtomic refcount;  /**< Reference count */
+  DBusHeader header;    /**< Prebuilt header, with serial 0 */
+  int signature_len;    /**< Length of the preset signature, or -1 if none */
+};
+
+/**
+ * Creates a template for sending many messages with the same header:
+ * the same type, flags, path, interface, member, destination and so
+ * on, and optionally the same signature. Messages created from it
+ * with dbus_message_template_new_message() get a copy of the
+ * already marshalled header, and only differ in their body and
+ * serial, which is much cheaper than building each one with
+ * dbus_message_new_signal() or dbus_message_new_method_call().
+ *
+ * The template is made from a message that has everything but the
+ * arguments set up, which is not modified and can be unreffed
+ * afterwards.
+ *
+ * @param message a message without arguments to copy the header of
+ * @param signature the signature of the arguments every message will have, or #NULL
+ * @returns the new template, or #NULL if no memory
+ */
+DBusMessageTemplate*
+dbus_message_template_new (DBusMessage *message,
+                           const char  *signature)
+{
+  DBusMessageTemplate *tmpl;
+
+  _dbus_return_val_if_fail (message != NULL, NULL);
+  _dbus_return_val_if_fail (_dbus_string_get_length (&message->body) == 0, NULL);
+  _dbus_return_val_if_fail (!message->have_external, NULL);
+  _dbus_return_val_if_fail (signature == NULL ||
+                            dbus_signature_validate (signature, NULL), NULL);
+
+  tmpl = dbus_new (DBusMessageTemplate, 1);
+  if (tmpl == NULL)
+    return NULL;
+
+  if (!_dbus_header_copy (&message->header, &tmpl->header))
+    {
+      dbus_free (tmpl);
+      return NULL;
+    }
+
+  if (signature != NULL)
+    {
+      if (!_dbus_header_set_field_basic (&tmpl->header,
+                                         DBUS_HEADER_FIELD_SIGNATURE,
+                                         DBUS_TYPE_SIGNATURE,
+                                         &signature))
+        {
+          _dbus_header_free (&tmpl->header);
+          dbus_free (tmpl);
+          return NULL;
+        }
+
+      tmpl->signature_len = strlen (signature);
+    }
+  else
+    {
+      if (!_dbus_header_delete_field (&tmpl->header,
+                                      DBUS_HEADER_FIELD_SIGNATURE))
+        {
+          _dbus_header_free (&tmpl->header);
+          dbus_free (tmpl);
+          return NULL;
+        }
+
+      tmpl->signature_len = -1;
+    }
+
+  tmpl->refcount.value = 1;
+
+  return tmpl;
+}
+
+/**
+ * Increments the reference count of a message template.
+ *
+ * @param tmpl the template
+ * @returns the template
+ */
+DBusMessageTemplate*
+dbus_message_template_ref (DBusMessageTemplate *tmpl)
+{
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  _dbus_atomic_inc (&tmpl->refcount);
+
+  return tmpl;
+}
+
+/**
+ * Decrements the reference count of a message template, freeing it
+ * if the count reaches 0. Messages created from it are not affected.
+ *
+ * @param tmpl the template
+ */
+void
+dbus_message_template_unref (DBusMessageTemplate *tmpl)
+{
+  _dbus_return_if_fail (tmpl != NULL);
+
+  if (_dbus_atomic_dec (&tmpl->refcount) == 1)
+    {
+      _dbus_header_free (&tmpl->header);
+      dbus_free (tmpl);
+    }
+}
+
+/**
+ * Creates a message from a template, and appends the given arguments
+ * to it as with dbus_message_append_args(). If the template has a
+ * signature, the arguments must match it exactly, and the header
+ * isn't touched at all while they are appended; otherwise the
+ * signature is built up from the arguments as usual.
+ *
+ * More arguments can be appended to the message afterwards, although
+ * then the signature has to be rewritten.
+ *
+ * @param tmpl the template
+ * @param first_arg_type type of the first argument, or #DBUS_TYPE_INVALID
+ * @param ... value of first argument, list of additional type-value pairs
+ * @returns a new DBusMessage, or #NULL if no memory or the arguments don't match the signature
+ */
+DBusMessage*
+dbus_message_template_new_message (DBusMessageTemplate *tmpl,
+                                   int                  first_arg_type,
+                                   ...)
+{
+  DBusMessage *message;
+  dbus_bool_t retval;
+  va_list var_args;
+
+  _dbus_return_val_if_fail (tmpl != NULL, NULL);
+
+  message = dbus_message_new_empty_header (_dbus_string_get_length (&tmpl->header.data),
+                                           0, 0);
+  if (message == NULL)
     return NULL;
 
-  va_start (args, error_format);
+  if (!_dbus_header_assign (&tmpl->header, &message->header))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
 
-  if (_dbus_string_append_printf_valist (&str, error_format, args))
-    message = dbus_message_new_error (reply_to, error_name,
-				      _dbus_string_get_const_data (&str));
-  else
-    message = NULL;
+  if (tmpl->signature_len >= 0)
+    {
+      message->signature_preset = TRUE;
+      message->preset_signature_len = 0;
+    }
 
-  _dbus_string_free (&str);
+  va_start (var_args, first_arg_type);
+  retval = dbus_message_append_args_valist (message,
+                                            first_arg_type,
+                                            var_args);
+  va_end (var_args);
 
-  va_end (args);
+  if (!retval)
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  if (tmpl->signature_len >= 0)
+    {
+      if (!message->signature_preset ||
+          message->preset_signature_len != tmpl->signature_len)
+        {
+          _dbus_warn_check_failed ("Arguments don't match the message template's signature \"%s\"\n",
+                                   dbus_message_get_signature (message));
+          dbus_message_unref (message);
+          return NULL;
+        }
+
+      message->signature_preset = FALSE;
+    }
 
   return message;
 }
 
-
 /**
  * Creates a new message that is an exact replica of the message
  * specified, except that its refcount is set to 1, its message serial
@@ -1530,7 +2257,8 @@ dbus_message_copy (const DBusMessage *message)
     }
 
   if (!_dbus_string_init_preallocated (&retval->body,
-                                       _dbus_string_get_length (&message->body)))
+                                       _dbus_string_get_length (&message->body) +
+                                       get_external_len (message)))
     {
       _dbus_header_free (&retval->header);
       dbus_free (retval);
@@ -1541,7 +2269,16 @@ dbus_message_copy (const DBusMessage *message)
 			  &retval->body, 0))
     goto failed_copy;
 
+  /* the copy owns all of its body, so it can be read back */
+  if (message->have_external &&
+      !_dbus_string_copy (&message->external, 0,
+                          &retval->body,
+                          _dbus_string_get_length (&retval->body)))
+    goto failed_copy;
+
 #ifdef HAVE_UNIX_FD_PASSING
+  retval->body_fd = -1;
+
   retval->unix_fds = dbus_new(int, message->n_unix_fds);
   if (retval->unix_fds == NULL && message->n_unix_fds > 0)
     goto failed_copy;
@@ -1854,6 +2591,80 @@ dbus_message_append_args_valist (DBusMessage *message,
   return FALSE;
 }
 
+/**
+ * Appends an array of bytes as the last argument of the message
+ * without copying them. The message refers to the caller's memory
+ * until it has been sent and freed, and the socket transport writes
+ * the bytes to the socket straight from there; this avoids copying
+ * large buffers such as file chunks or audio frames into the message
+ * first.
+ *
+ * The memory must stay valid and unchanged until @p free_data_func
+ * is called with @p user_data, which happens when the last reference
+ * to the message goes away. If appending fails, @p free_data_func is
+ * not called and the memory still belongs to the caller.
+ *
+ * Nothing can be appended after the bytes, and the message's
+ * arguments can't be read with dbus_message_iter_init() or
+ * dbus_message_get_args(); the message is meant to be sent.
+ * dbus_message_copy() and dbus_message_marshal() do copy the bytes,
+ * and the copy can be read normally.
+ *
+ * @param message the message
+ * @param data the bytes
+ * @param n_bytes the number of bytes
+ * @param free_data_func function to release the bytes, or #NULL
+ * @param user_data data to pass to @p free_data_func
+ * @returns #FALSE if not enough memory
+ */
+dbus_bool_t
+dbus_message_append_external_bytes (DBusMessage      *message,
+                                    const void       *data,
+                                    int               n_bytes,
+                                    DBusFreeFunction  free_data_func,
+                                    void             *user_data)
+{
+  DBusMessageIter iter;
+  DBusMessageIter array;
+  int body_len;
+
+  _dbus_return_val_if_fail (message != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->locked, FALSE);
+  _dbus_return_val_if_fail (!message->have_external, FALSE);
+  _dbus_return_val_if_fail (data != NULL || n_bytes == 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes >= 0, FALSE);
+  _dbus_return_val_if_fail (n_bytes <= DBUS_MAXIMUM_ARRAY_LENGTH, FALSE);
+
+  /* Write an empty byte array, then fix up its length to cover the
+   * bytes that will follow it on the wire. Byte arrays have no
+   * padding after the length, so the length is the last thing in the
+   * body.
+   */
+  dbus_message_iter_init_append (message, &iter);
+
+  if (!dbus_message_iter_open_container (&iter, DBUS_TYPE_ARRAY,
+                                         DBUS_TYPE_BYTE_AS_STRING,
+                                         &array))
+    return FALSE;
+
+  if (!dbus_message_iter_close_container (&iter, &array))
+    return FALSE;
+
+  body_len = _dbus_string_get_length (&message->body);
+  _dbus_assert (body_len >= 4);
+  _dbus_assert (_DBUS_ALIGN_VALUE (body_len, 4) == (unsigned) body_len);
+
+  _dbus_marshal_set_uint32 (&message->body, body_len - 4, n_bytes,
+                            _dbus_header_get_byte_order (&message->header));
+
+  _dbus_string_init_const_len (&message->external, data, n_bytes);
+  message->external_free_func = free_data_func;
+  message->external_free_data = user_data;
+  message->have_external = TRUE;
+
+  return TRUE;
+}
+
 /**
  * Gets arguments from a message given a variable argument list.  The
  * supported types include those supported by
@@ -1992,6 +2803,7 @@ dbus_message_iter_init (DBusMessage     *message,
 
   _dbus_return_val_if_fail (message != NULL, FALSE);
   _dbus_return_val_if_fail (iter != NULL, FALSE);
+  _dbus_return_val_if_fail (!message->have_external, FALSE);
 
   get_const_signature (&message->header, &type_str, &type_pos);
 
@@ -2347,6 +3159,10 @@ dbus_message_iter_init_append (DBusMessage     *message,
 
   _dbus_return_if_fail (message != NULL);
   _dbus_return_if_fail (iter != NULL);
+  _dbus_return_if_fail (!message->have_external);
+#ifdef HAVE_UNIX_FD_PASSING
+  _dbus_return_if_fail (!message->body_mapped);
+#endif
 
   _dbus_message_iter_init_common (message, real,
                                   DBUS_MESSAGE_ITER_TYPE_WRITER);
@@ -2398,7 +3214,11 @@ _dbus_message_iter_open_signature (DBusMessageRealIter *real)
     {
       int current_len;
 
-      current_len = _dbus_string_get_byte (current_sig, current_sig_pos);
+      /* with a preset signature, only what's been appended so far */
+      if (real->message->signature_preset)
+        current_len = real->message->preset_signature_len;
+      else
+        current_len = _dbus_string_get_byte (current_sig, current_sig_pos);
       current_sig_pos += 1; /* move on to sig data */
 
       if (!_dbus_string_init_preallocated (str, current_len + 4))
@@ -2461,6 +3281,30 @@ _dbus_message_iter_close_signature (DBusMessageRealIter *real)
 
   str = real->u.writer.type_str;
 
+  if (real->message->signature_preset)
+    {
+      const DBusString *preset;
+      int preset_pos;
+      int len;
+
+      _dbus_header_get_field_raw (&real->message->header,
+                                  DBUS_HEADER_FIELD_SIGNATURE,
+                                  &preset, &preset_pos);
+      len = _dbus_string_get_length (str);
+
+      /* Nothing to do while the body is still heading for the
+       * signature that's in the header already
+       */
+      if (len <= _dbus_string_get_byte (preset, preset_pos) &&
+          _dbus_string_equal_substring (str, 0, len, preset, preset_pos + 1))
+        {
+          real->message->preset_signature_len = len;
+          goto out;
+        }
+
+      real->message->signature_preset = FALSE;
+    }
+
   v_STRING = _dbus_string_get_const_data (str);
   if (!_dbus_header_set_field_basic (&real->message->header,
                                      DBUS_HEADER_FIELD_SIGNATURE,
@@ -2468,6 +3312,8 @@ _dbus_message_iter_close_signature (DBusMessageRealIter *real)
                                      &v_STRING))
     retval = FALSE;
 
+ out:
+
   _dbus_type_writer_remove_types (&real->u.writer);
   _dbus_string_free (str);
   dbus_free (str);
@@ -2543,9 +3389,22 @@ expand_fd_array(DBusMessage *m,
       if (k < 4)
         k = 4;
 
-      p = dbus_realloc(m->unix_fds, k * sizeof(int));
-      if (p == NULL)
-        return NULL;
+      if (m->unix_fds_borrowed)
+        {
+          /* outgrown the space in the message's block */
+          p = dbus_new (int, k);
+          if (p == NULL)
+            return NULL;
+
+          memcpy (p, m->unix_fds, m->n_unix_fds * sizeof (int));
+          m->unix_fds_borrowed = FALSE;
+        }
+      else
+        {
+          p = dbus_realloc(m->unix_fds, k * sizeof(int));
+          if (p == NULL)
+            return NULL;
+        }
 
       m->unix_fds = p;
       m->n_unix_fds_allocated = k;
@@ -3775,6 +4634,15 @@ dbus_message_contains_unix_fds(DBusMessage *message)
  */
 #define INITIAL_LOADER_DATA_LEN 32
 
+/**
+ * Bodies at least this long are read into a buffer of their own with
+ * large reads, instead of growing the loader's buffer a read at a
+ * time and then being copied out of it. The buffer grows with the
+ * data that arrives rather than being allocated at the length the
+ * header claims, which costs a peer nothing to send.
+ */
+#define LOADER_DIRECT_BODY_MIN_LEN (64 * 1024)
+
 /**
  * Creates a new message loader. Returns #NULL if memory can't
  * be allocated.
@@ -3810,6 +4678,13 @@ _dbus_message_loader_new (void)
       return NULL;
     }
 
+  if (!_dbus_string_init (&loader->body))
+    {
+      _dbus_string_free (&loader->data);
+      dbus_free (loader);
+      return NULL;
+    }
+
   /* preallocate the buffer for speed, ignore failure */
   _dbus_string_set_length (&loader->data, INITIAL_LOADER_DATA_LEN);
   _dbus_string_set_length (&loader->data, 0);
@@ -3858,10 +4733,49 @@ _dbus_message_loader_unref (DBusMessageLoader *loader)
                           NULL);
       _dbus_list_clear (&loader->messages);
       _dbus_string_free (&loader->data);
+      _dbus_string_free (&loader->body);
       dbus_free (loader);
     }
 }
 
+/* Puts a body being read directly back into loader->data after its
+ * header, ahead of anything read since.
+ */
+static dbus_bool_t
+loader_end_direct_body (DBusMessageLoader *loader)
+{
+  _dbus_assert (loader->body_direct);
+
+  if (!_dbus_string_move (&loader->body, 0, &loader->data,
+                          loader->partial_header_len))
+    return FALSE;
+
+  loader->body_direct = FALSE;
+
+  return TRUE;
+}
+
+/* Returns how much of a body being read directly to read next, and
+ * makes room for it: up to as much as has arrived so far, so that
+ * memory is only committed as fast as the peer actually sends.
+ */
+static int
+loader_direct_body_room (DBusMessageLoader *loader)
+{
+  int len;
+  int room;
+
+  len = _dbus_string_get_length (&loader->body);
+  room = MIN (loader->partial_body_len - len,
+              MAX (len, LOADER_DIRECT_BODY_MIN_LEN));
+
+  /* ignore failure, reading grows the buffer anyway */
+  if (_dbus_string_set_length (&loader->body, len + room))
+    _dbus_string_set_length (&loader->body, len);
+
+  return room;
+}
+
 /**
  * Gets the buffer to use for reading data from the network.  Network
  * data is read directly into an allocated buffer, which is then used
@@ -3886,11 +4800,90 @@ _dbus_message_loader_get_buffer (DBusMessageLoader  *loader,
 {
   _dbus_assert (!loader->buffer_outstanding);
 
+  /* The caller may append any amount, so the body being read
+   * directly has to go back where the rest of the data follows it.
+   * If there's no memory for that, what gets appended is kept after
+   * the header and the body is put in between later.
+   */
+  if (loader->body_direct)
+    loader_end_direct_body (loader);
+
   *buffer = &loader->data;
 
   loader->buffer_outstanding = TRUE;
 }
 
+/* Starts reading the body of the incomplete message at the start of
+ * loader->data into loader->body, if it's worth it and the header is
+ * all there.
+ */
+static void
+loader_start_direct_body (DBusMessageLoader *loader)
+{
+  int len;
+
+  len = _dbus_string_get_length (&loader->data);
+
+  if (loader->partial_body_len < LOADER_DIRECT_BODY_MIN_LEN ||
+      len < loader->partial_header_len ||
+      len >= loader->partial_header_len + loader->partial_body_len)
+    return;
+
+  _dbus_assert (_dbus_string_get_length (&loader->body) == 0);
+
+  /* ignore failure, we'll just read it the usual way */
+  if (!_dbus_string_copy_len (&loader->data, loader->partial_header_len,
+                              len - loader->partial_header_len,
+                              &loader->body, 0))
+    return;
+
+  _dbus_string_set_length (&loader->data, loader->partial_header_len);
+  loader->body_direct = TRUE;
+
+  _dbus_verbose ("Reading %d byte body directly\n", loader->partial_body_len);
+}
+
+/**
+ * Like _dbus_message_loader_get_buffer(), but the caller agrees to
+ * read no more than *max_to_read bytes into the buffer. On entry,
+ * *max_to_read is how much the caller would like to read; once the
+ * loader knows the length of a large message, it hands out a buffer
+ * of its own for the body, and sets *max_to_read to how much of it
+ * to read next, so that the body is read with a few large reads and
+ * never copied. Each read may be as large as all of the body read
+ * so far, so the buffer only grows as the data arrives.
+ *
+ * @param loader the message loader.
+ * @param buffer the buffer
+ * @param max_to_read how many bytes may be read into the buffer
+ */
+void
+_dbus_message_loader_get_read_buffer (DBusMessageLoader  *loader,
+                                      DBusString        **buffer,
+                                      int                *max_to_read)
+{
+  _dbus_assert (!loader->buffer_outstanding);
+  _dbus_assert (*max_to_read > 0);
+
+  if (!loader->body_direct && loader->partial_header_len > 0)
+    loader_start_direct_body (loader);
+
+  /* Data read after the body has to stay where it is, see
+   * _dbus_message_loader_get_buffer()
+   */
+  if (loader->body_direct &&
+      _dbus_string_get_length (&loader->data) == loader->partial_header_len)
+    {
+      *buffer = &loader->body;
+      *max_to_read = loader_direct_body_room (loader);
+      _dbus_assert (*max_to_read > 0);
+    }
+  else
+    *buffer = &loader->data;
+
+  loader->buffer_outstanding = TRUE;
+}
+
 /**
  * Returns a buffer obtained from _dbus_message_loader_get_buffer(),
  * indicating to the loader how many bytes of the buffer were filled
@@ -3907,7 +4900,8 @@ _dbus_message_loader_return_buffer (DBusMessageLoader  *loader,
                                     int                 bytes_read)
 {
   _dbus_assert (loader->buffer_outstanding);
-  _dbus_assert (buffer == &loader->data);
+  _dbus_assert (buffer == &loader->data ||
+                (loader->body_direct && buffer == &loader->body));
 
   loader->buffer_outstanding = FALSE;
 }
@@ -3989,15 +4983,19 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
 }
 
 /*
- * FIXME when we move the header out of the buffer, that memmoves all
- * buffered messages. Kind of crappy.
- *
- * Also we copy the header and body, which is kind of crappy.  To
- * avoid this, we have to allow header and body to be in a single
- * memory block, which is good for messages we read and bad for
- * messages we are creating. But we could move_len() the buffer into
- * this single memory block, and move_len() will just swap the buffers
- * if you're moving the entire buffer replacing the dest string.
+ * The message is loaded from loader->data at @p start, which is
+ * wherever the previous message in the buffer ended and so need not
+ * be aligned. The header and body are each copied once, into the
+ * message's own strings, and validated there; the loader only
+ * deletes what it has consumed once per batch, in
+ * _dbus_message_loader_queue_messages(), rather than memmoving every
+ * buffered byte after each message.
+ *
+ * We still copy the header and body. To avoid this, we have to allow
+ * header and body to be in a single memory block, which is good for
+ * messages we read and bad for messages we are creating; and the bus
+ * rewrites the header of every message it routes, so it can't be a
+ * slice of a buffer that other messages share.
  *
  * We could also have the message loader tell the transport how many
  * bytes to read; so it would first ask for some arbitrary number like
@@ -4008,15 +5006,12 @@ _dbus_message_loader_return_unix_fds(DBusMessageLoader  *loader,
  * memmoved. Though I suppose we also don't have a chance of reading a
  * bunch of small messages at once, so the optimization may be stupid.
  *
- * Another approach would be to keep a "start" index into
- * loader->data and only delete it occasionally, instead of after
- * each message is loaded.
- *
  * load_message() returns FALSE if not enough memory OR the loader was corrupted
  */
 static dbus_bool_t
 load_message (DBusMessageLoader *loader,
               DBusMessage       *message,
+              int                start,
               int                byte_order,
               int                fields_array_len,
               int                header_len,
@@ -4028,18 +5023,22 @@ load_message (DBusMessageLoader *loader,
   int type_pos;
   DBusValidationMode mode;
   dbus_uint32_t n_unix_fds = 0;
+  dbus_uint32_t body_fd_index;
+  dbus_bool_t body_in_memfd = FALSE;
 
   mode = DBUS_VALIDATION_MODE_DATA_IS_UNTRUSTED;
   
   oom = FALSE;
 
 #if 0
-  _dbus_verbose_bytes_of_string (&loader->data, 0, header_len /* + body_len */);
+  _dbus_verbose_bytes_of_string (&loader->data, start, header_len /* + body_len */);
 #endif
 
-  /* 1. VALIDATE AND COPY OVER HEADER */
+  /* 1. COPY OVER, THEN VALIDATE HEADER */
   _dbus_assert (_dbus_string_get_length (&message->header.data) == 0);
-  _dbus_assert ((header_len + body_len) <= _dbus_string_get_length (&loader->data));
+  _dbus_assert (start + header_len +
+                (loader->body_direct ? 0 : body_len) <=
+                _dbus_string_get_length (&loader->data));
 
   if (!_dbus_header_load (&message->header,
                           mode,
@@ -4048,8 +5047,8 @@ load_message (DBusMessageLoader *loader,
                           fields_array_len,
                           header_len,
                           body_len,
-                          &loader->data, 0,
-                          _dbus_string_get_length (&loader->data)))
+                          &loader->data, start,
+                          header_len + body_len))
     {
       _dbus_verbose ("Failed to load header for new message code %d\n", validity);
 
@@ -4069,7 +5068,85 @@ load_message (DBusMessageLoader *loader,
 
   _dbus_assert (validity == DBUS_VALID);
 
-  /* 2. VALIDATE BODY */
+  /* 2. COPY OVER, THEN VALIDATE BODY */
+  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
+
+  if (_dbus_header_get_field_basic (&message->header,
+                                    DBUS_HEADER_FIELD_BODY_MEMFD,
+                                    DBUS_TYPE_UINT32,
+                                    &body_fd_index))
+    {
+#ifdef HAVE_UNIX_FD_PASSING
+      const char *data;
+      int len;
+
+      _dbus_header_get_field_basic (&message->header,
+                                    DBUS_HEADER_FIELD_UNIX_FDS,
+                                    DBUS_TYPE_UINT32,
+                                    &n_unix_fds);
+
+      /* The memfd must be the last of the message's fds, nothing may
+       * follow the header, and we read the body in place so it has
+       * to be in our byte order already.
+       */
+      if (!loader->accept_body_memfds ||
+          body_len != 0 ||
+          byte_order != DBUS_COMPILER_BYTE_ORDER ||
+          n_unix_fds == 0 ||
+          body_fd_index != n_unix_fds - 1 ||
+          n_unix_fds > loader->n_unix_fds ||
+          !_dbus_sealed_memfd_map (loader->unix_fds[body_fd_index],
+                                   loader->max_message_size - header_len,
+                                   &data, &len, NULL))
+        {
+          _dbus_verbose ("Bad memfd body, index %u of %u fds\n",
+                         body_fd_index, n_unix_fds);
+
+          loader->corrupted = TRUE;
+          loader->corruption_reason = DBUS_INVALID_BAD_BODY_MEMFD;
+          goto failed;
+        }
+
+      _dbus_string_free (&message->body);
+      _dbus_string_init_const_len (&message->body, data, len);
+      message->body_mapped = TRUE;
+      body_in_memfd = TRUE;
+      body_len = len;
+
+      /* From here on it is like any other message, so the bus can
+       * forward it to peers that didn't negotiate memfd bodies
+       */
+      if (!_dbus_header_delete_field (&message->header,
+                                      DBUS_HEADER_FIELD_BODY_MEMFD))
+        {
+          oom = TRUE;
+          goto failed;
+        }
+
+      _dbus_header_update_lengths (&message->header, body_len);
+#else
+      loader->corrupted = TRUE;
+      loader->corruption_reason = DBUS_INVALID_BAD_BODY_MEMFD;
+      goto failed;
+#endif
+    }
+  else if (loader->body_direct)
+    {
+      /* Already on its own, so this just swaps the buffers */
+      _dbus_assert (start == 0);
+      _dbus_assert (_dbus_string_get_length (&loader->body) == body_len);
+
+      if (!_dbus_string_move (&loader->body, 0, &message->body, 0))
+        _dbus_assert_not_reached ("moving a whole string to an empty one can't fail");
+    }
+  else if (!_dbus_string_copy_len (&loader->data, start + header_len, body_len,
+                                   &message->body, 0))
+    {
+      _dbus_verbose ("Failed to copy body into new message\n");
+      oom = TRUE;
+      goto failed;
+    }
+
   if (mode != DBUS_VALIDATION_MODE_WE_TRUST_THIS_DATA_ABSOLUTELY)
     {
       get_const_signature (&message->header, &type_str, &type_pos);
@@ -4081,8 +5158,8 @@ load_message (DBusMessageLoader *loader,
                                                   type_pos,
                                                   byte_order,
                                                   NULL,
-                                                  &loader->data,
-                                                  header_len,
+                                                  &message->body,
+                                                  0,
                                                   body_len);
       if (validity != DBUS_VALID)
         {
@@ -4113,26 +5190,49 @@ load_message (DBusMessageLoader *loader,
       goto failed;
     }
 
-  /* If this was a recycled message there might still be
-     some memory allocated for the fds */
-  dbus_free(message->unix_fds);
-
-  if (n_unix_fds > 0)
+  /* A new message may have space for them already, and a recycled
+   * one may still have an array from before
+   */
+  if (n_unix_fds > message->n_unix_fds_allocated)
     {
-      message->unix_fds = _dbus_memdup(loader->unix_fds, n_unix_fds * sizeof(message->unix_fds[0]));
-      if (message->unix_fds == NULL)
+      int *unix_fds;
+
+      unix_fds = dbus_new (int, n_unix_fds);
+      if (unix_fds == NULL)
         {
           _dbus_verbose ("Failed to allocate file descriptor array\n");
           oom = TRUE;
           goto failed;
         }
 
-      message->n_unix_fds_allocated = message->n_unix_fds = n_unix_fds;
+      free_unix_fd_array (message);
+      message->unix_fds = unix_fds;
+      message->n_unix_fds_allocated = n_unix_fds;
+    }
+
+  if (n_unix_fds > 0)
+    {
+      memcpy (message->unix_fds, loader->unix_fds,
+              n_unix_fds * sizeof (message->unix_fds[0]));
+      message->n_unix_fds = n_unix_fds;
       loader->n_unix_fds -= n_unix_fds;
-      memmove(loader->unix_fds + n_unix_fds, loader->unix_fds, loader->n_unix_fds);
+      memmove (loader->unix_fds, loader->unix_fds + n_unix_fds,
+               loader->n_unix_fds * sizeof (loader->unix_fds[0]));
+    }
+
+  if (body_in_memfd)
+    {
+      /* The memfd belongs to the body, not to the application */
+      message->n_unix_fds -= 1;
+      message->body_fd = message->unix_fds[message->n_unix_fds];
+
+      n_unix_fds = message->n_unix_fds;
+      if (!_dbus_header_set_field_basic (&message->header,
+                                         DBUS_HEADER_FIELD_UNIX_FDS,
+                                         DBUS_TYPE_UINT32,
+                                         &n_unix_fds))
+        _dbus_assert_not_reached ("setting a field to a value of the same size can't fail");
     }
-  else
-    message->unix_fds = NULL;
 
 #else
 
@@ -4148,7 +5248,7 @@ load_message (DBusMessageLoader *loader,
 
 #endif
 
-  /* 3. COPY OVER BODY AND QUEUE MESSAGE */
+  /* 4. QUEUE MESSAGE */
 
   if (!_dbus_list_append (&loader->messages, message))
     {
@@ -4157,23 +5257,8 @@ load_message (DBusMessageLoader *loader,
       goto failed;
     }
 
-  _dbus_assert (_dbus_string_get_length (&message->body) == 0);
-  _dbus_assert (_dbus_string_get_length (&loader->data) >=
-                (header_len + body_len));
-
-  if (!_dbus_string_copy_len (&loader->data, header_len, body_len, &message->body, 0))
-    {
-      _dbus_verbose ("Failed to move body into new message\n");
-      oom = TRUE;
-      goto failed;
-    }
-
-  _dbus_string_delete (&loader->data, 0, header_len + body_len);
-
-  /* don't waste more than 2k of memory */
-  _dbus_string_compact (&loader->data, 2048);
-
-  _dbus_assert (_dbus_string_get_length (&message->header.data) == header_len);
+  _dbus_assert (body_in_memfd ||
+                _dbus_string_get_length (&message->header.data) == header_len);
   _dbus_assert (_dbus_string_get_length (&message->body) == body_len);
 
   _dbus_verbose ("Loaded message %p\n", message);
@@ -4191,17 +5276,42 @@ load_message (DBusMessageLoader *loader,
 
   /* does nothing if the message isn't in the list */
   _dbus_list_remove_last (&loader->messages, message);
+
+  /* give a directly-read body back, so we can try again after OOM */
+  if (loader->body_direct &&
+      _dbus_string_get_length (&loader->body) == 0)
+    _dbus_string_move (&message->body, 0, &loader->body, 0);
   
   if (oom)
     _dbus_assert (!loader->corrupted);
   else
     _dbus_assert (loader->corrupted);
 
-  _dbus_verbose_bytes_of_string (&loader->data, 0, _dbus_string_get_length (&loader->data));
+  _dbus_verbose_bytes_of_string (&loader->data, start,
+                                 _dbus_string_get_length (&loader->data) - start);
 
   return FALSE;
 }
 
+/* Drops the first n_bytes of buffered data, which have been loaded
+ * into messages.
+ */
+static void
+loader_consume (DBusMessageLoader *loader,
+                int                n_bytes)
+{
+  if (n_bytes == 0)
+    return;
+
+  if (n_bytes == _dbus_string_get_length (&loader->data))
+    _dbus_string_set_length (&loader->data, 0);
+  else
+    _dbus_string_delete (&loader->data, 0, n_bytes);
+
+  /* don't waste more than 2k of memory */
+  _dbus_string_compact (&loader->data, 2048);
+}
+
 /**
  * Converts buffered data into messages, if we have enough data.  If
  * we don't have enough data, does nothing.
@@ -4219,30 +5329,70 @@ load_message (DBusMessageLoader *loader,
 dbus_bool_t
 _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
 {
+  dbus_bool_t retval;
+  int start;
+
+  /* Something was read after a body being read directly, without
+   * the memory to put the body back in front of it at the time
+   */
+  if (loader->body_direct &&
+      _dbus_string_get_length (&loader->data) > loader->partial_header_len &&
+      !loader_end_direct_body (loader))
+    return FALSE;
+
+  retval = TRUE;
+  start = 0;
+  loader->partial_header_len = 0;
+  loader->partial_body_len = 0;
+
   while (!loader->corrupted &&
-         _dbus_string_get_length (&loader->data) >= DBUS_MINIMUM_HEADER_SIZE)
+         _dbus_string_get_length (&loader->data) - start >= DBUS_MINIMUM_HEADER_SIZE)
     {
       DBusValidity validity;
       int byte_order, fields_array_len, header_len, body_len;
+      dbus_bool_t have_message;
+
+      have_message =
+        _dbus_header_have_message_untrusted (loader->max_message_size,
+                                             &validity,
+                                             &byte_order,
+                                             &fields_array_len,
+                                             &header_len,
+                                             &body_len,
+                                             &loader->data, start,
+                                             _dbus_string_get_length (&loader->data) - start);
+
+      /* If the body is being read directly, data is just the header */
+      if (loader->body_direct && validity == DBUS_VALID)
+        {
+          _dbus_assert (start == 0);
+          _dbus_assert (!have_message);
+          _dbus_assert (header_len == _dbus_string_get_length (&loader->data));
+          _dbus_assert (body_len >= _dbus_string_get_length (&loader->body));
 
-      if (_dbus_header_have_message_untrusted (loader->max_message_size,
-                                               &validity,
-                                               &byte_order,
-                                               &fields_array_len,
-                                               &header_len,
-                                               &body_len,
-                                               &loader->data, 0,
-                                               _dbus_string_get_length (&loader->data)))
+          have_message = (body_len == _dbus_string_get_length (&loader->body));
+        }
+
+      if (have_message)
         {
           DBusMessage *message;
 
           _dbus_assert (validity == DBUS_VALID);
 
-          message = dbus_message_new_empty_header ();
+          message = dbus_message_new_empty_header (header_len, body_len,
+#ifdef HAVE_UNIX_FD_PASSING
+                                                   loader->n_unix_fds
+#else
+                                                   0
+#endif
+                                                   );
           if (message == NULL)
-            return FALSE;
+            {
+              retval = FALSE;
+              break;
+            }
 
-          if (!load_message (loader, message,
+          if (!load_message (loader, message, start,
                              byte_order, fields_array_len,
                              header_len, body_len))
             {
@@ -4250,11 +5400,20 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               /* load_message() returns false if corrupted or OOM; if
                * corrupted then return TRUE for not OOM
                */
-              return loader->corrupted;
+              retval = loader->corrupted;
+              break;
             }
 
           _dbus_assert (loader->messages != NULL);
           _dbus_assert (_dbus_list_find_last (&loader->messages, message) != NULL);
+
+          if (loader->body_direct)
+            {
+              loader->body_direct = FALSE;
+              start += header_len;
+            }
+          else
+            start += header_len + body_len;
 	}
       else
         {
@@ -4265,11 +5424,21 @@ _dbus_message_loader_queue_messages (DBusMessageLoader *loader)
               loader->corrupted = TRUE;
               loader->corruption_reason = validity;
             }
-          return TRUE;
+          else
+            {
+              /* remember what we're waiting for, so the rest of a
+               * large body can be read straight into place
+               */
+              loader->partial_header_len = header_len;
+              loader->partial_body_len = body_len;
+            }
+          break;
         }
     }
 
-  return TRUE;
+  loader_consume (loader, start);
+
+  return retval;
 }
 
 /**
@@ -4392,6 +5561,20 @@ _dbus_message_loader_get_max_message_size (DBusMessageLoader  *loader)
   return loader->max_message_size;
 }
 
+/**
+ * Sets whether message bodies may be received in sealed memfds. This
+ * should only be allowed once it has been negotiated with the peer.
+ *
+ * @param loader the loader
+ * @param accept #TRUE to accept memfd bodies
+ */
+void
+_dbus_message_loader_set_accept_body_memfds (DBusMessageLoader *loader,
+                                             dbus_bool_t        accept)
+{
+  loader->accept_body_memfds = accept != FALSE;
+}
+
 /**
  * Sets the maximum unix fds per message we allow.
  *
@@ -4633,6 +5816,12 @@ dbus_message_marshal (DBusMessage  *msg,
 
   *len_p = _dbus_string_get_length (&tmp);
 
+  if (msg->have_external &&
+      !_dbus_string_copy (&(msg->external), 0, &tmp, *len_p))
+    goto fail;
+
+  *len_p = _dbus_string_get_length (&tmp);
+
   if (!_dbus_string_steal_data (&tmp, marshalled_data_p))
     goto fail;
 
@@ -42,6 +42,8 @@ DBUS_BEGIN_DECLS
  */
 
 typedef struct DBusMessage DBusMessage;
+/** Opaque type holding a prebuilt header to create messages from, see dbus_message_template_new() */
+typedef struct DBusMessageTemplate DBusMessageTemplate;
 /** Opaque type representing a message iterator. Can be copied by value, and contains no allocated memory so never needs to be freed and can be allocated on the stack. */
 typedef struct DBusMessageIter DBusMessageIter;
 
@@ -92,6 +94,18 @@ DBusMessage* dbus_message_new_error_printf  (DBusMessage *reply_to,
 DBUS_EXPORT
 DBusMessage* dbus_message_copy              (const DBusMessage *message);
 
+DBUS_EXPORT
+DBusMessageTemplate* dbus_message_template_new         (DBusMessage         *message,
+                                                        const char          *signature);
+DBUS_EXPORT
+DBusMessageTemplate* dbus_message_template_ref         (DBusMessageTemplate *tmpl);
+DBUS_EXPORT
+void                 dbus_message_template_unref       (DBusMessageTemplate *tmpl);
+DBUS_EXPORT
+DBusMessage*         dbus_message_template_new_message (DBusMessageTemplate *tmpl,
+                                                        int                  first_arg_type,
+                                                        ...);
+
 DBUS_EXPORT
 DBusMessage*  dbus_message_ref              (DBusMessage   *message);
 DBUS_EXPORT
@@ -194,6 +208,12 @@ dbus_bool_t dbus_message_append_args_valist   (DBusMessage     *message,
 					       int              first_arg_type,
 					       va_list          var_args);
 DBUS_EXPORT
+dbus_bool_t dbus_message_append_external_bytes (DBusMessage      *message,
+                                                const void       *data,
+                                                int               n_bytes,
+                                                DBusFreeFunction  free_data_func,
+                                                void             *user_data);
+DBUS_EXPORT
 dbus_bool_t dbus_message_get_args             (DBusMessage     *message,
 					       DBusError       *error,
 					       int              first_arg_type,
@@ -25,6 +25,10 @@
 #include "dbus-misc.h"
 #include "dbus-internals.h"
 #include "dbus-string.h"
+#include "dbus-hash.h"
+#include "dbus-list.h"
+#include "dbus-message-internal.h"
+#include "dbus-resources.h"
 
 /**
  * @defgroup DBusMisc Miscellaneous
@@ -171,6 +175,101 @@ dbus_get_version (int *major_version_p,
 }
 
 
+#ifdef DBUS_ENABLE_STATS
+_DBUS_DEFINE_GLOBAL_LOCK (stats);
+
+static const char * const statistic_names[] = {
+  "ListMemPoolUsedBytes",
+  "ListMemPoolCachedBytes",
+  "ListMemPoolAllocatedBytes",
+  "HashMemPoolUsedBytes",
+  "HashMemPoolCachedBytes",
+  "HashMemPoolAllocatedBytes",
+  "MessageCacheHits",
+  "MessageCacheMisses",
+  "MessageCacheEvictions",
+  "StringReallocations",
+  "PeakCounterBytes",
+  "PeakCounterFDs"
+};
+#endif
+
+/**
+ * Obtains one of libdbus' internal allocator statistics, such as the
+ * memory used by its memory pools, message cache hits and misses,
+ * or the largest number of bytes ever queued on a connection. The
+ * statistics are process-wide and are intended for tuning and
+ * debugging; the same names are used in the bus daemon's
+ * org.freedesktop.DBus.Debug.Stats.GetStats reply.
+ *
+ * Statistics are numbered from 0. To list all of them, call this
+ * function with increasing indexes until it returns #FALSE.
+ *
+ * Statistics are only collected if libdbus was built with
+ * --enable-stats; otherwise this function always returns #FALSE.
+ *
+ * @param index which statistic to obtain
+ * @param name_p pointer to return the name of the statistic, or #NULL
+ * @param value_p pointer to return its current value, or #NULL
+ * @returns #FALSE if there is no statistic with that index
+ */
+dbus_bool_t
+dbus_get_statistic (int            index,
+                    const char   **name_p,
+                    dbus_uint32_t *value_p)
+{
+#ifdef DBUS_ENABLE_STATS
+  dbus_uint32_t values[3] = { 0, 0, 0 };
+  dbus_uint32_t value;
+
+  if (index < 0 || index >= (int) _DBUS_N_ELEMENTS (statistic_names))
+    return FALSE;
+
+  switch (index)
+    {
+    case 0:
+    case 1:
+    case 2:
+      _dbus_list_get_stats (&values[0], &values[1], &values[2]);
+      value = values[index];
+      break;
+    case 3:
+    case 4:
+    case 5:
+      _dbus_hash_get_stats (&values[0], &values[1], &values[2]);
+      value = values[index - 3];
+      break;
+    case 6:
+    case 7:
+    case 8:
+      _dbus_message_get_cache_stats (&values[0], &values[1], &values[2]);
+      value = values[index - 6];
+      break;
+    case 9:
+      value = _dbus_string_get_n_reallocations ();
+      break;
+    case 10:
+    case 11:
+      _dbus_counter_get_global_peaks (&values[0], &values[1]);
+      value = values[index - 10];
+      break;
+    default:
+      _dbus_assert_not_reached ("statistic_names out of sync");
+      return FALSE;
+    }
+
+  if (name_p != NULL)
+    *name_p = statistic_names[index];
+
+  if (value_p != NULL)
+    *value_p = value;
+
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
 /** @} */ /* End of public API */
 
 #ifdef DBUS_BUILD_TESTS
@@ -239,6 +338,40 @@ _dbus_misc_test (void)
   _dbus_assert (_dbus_string_equal_c_str (&str, DBUS_VERSION_STRING));
 
   _dbus_string_free (&str);
+
+  /* Check that statistics can be enumerated */
+
+  _dbus_assert (!dbus_get_statistic (-1, NULL, NULL));
+
+#ifdef DBUS_ENABLE_STATS
+  {
+    DBusMessage *message;
+    const char *name;
+    dbus_uint32_t value, hits, misses;
+    int i;
+
+    for (i = 0; dbus_get_statistic (i, &name, &value); i++)
+      {
+        _dbus_assert (name != NULL);
+        _dbus_assert (*name != '\0');
+      }
+
+    _dbus_assert (i > 0);
+    _dbus_assert (!dbus_get_statistic (i, NULL, NULL));
+
+    /* every new message is either a cache hit or a cache miss */
+    _dbus_message_get_cache_stats (&hits, &misses, NULL);
+    message = dbus_message_new (DBUS_MESSAGE_TYPE_SIGNAL);
+    if (message == NULL)
+      _dbus_assert_not_reached ("no memory");
+    dbus_message_unref (message);
+    value = hits + misses + 1;
+    _dbus_message_get_cache_stats (&hits, &misses, NULL);
+    _dbus_assert (hits + misses == value);
+  }
+#else
+  _dbus_assert (!dbus_get_statistic (0, NULL, NULL));
+#endif
    
   return TRUE;
 }
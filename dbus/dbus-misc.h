@@ -44,6 +44,11 @@ void        dbus_get_version           (int *major_version_p,
                                         int *minor_version_p,
                                         int *micro_version_p);
 
+DBUS_EXPORT
+dbus_bool_t dbus_get_statistic         (int            index,
+                                        const char   **name_p,
+                                        dbus_uint32_t *value_p);
+
 /** @} */
 
 DBUS_END_DECLS
@@ -295,6 +295,12 @@ extern "C" {
  * with this message.
  */
 #define DBUS_HEADER_FIELD_UNIX_FDS       9
+/**
+ * Header field code for the index of the unix file descriptor holding
+ * the message body in a sealed memfd. Only sent on connections that
+ * negotiated it during authentication; see NEGOTIATE_MEMFD_BODY.
+ */
+#define DBUS_HEADER_FIELD_BODY_MEMFD     10
 
 
 /**
@@ -303,7 +309,7 @@ extern "C" {
  * that unknown codes must be ignored, so check for that before
  * indexing the array.
  */
-#define DBUS_HEADER_FIELD_LAST DBUS_HEADER_FIELD_UNIX_FDS
+#define DBUS_HEADER_FIELD_LAST DBUS_HEADER_FIELD_BODY_MEMFD
 
 /** Header format is defined as a signature:
  *   byte                            byte order
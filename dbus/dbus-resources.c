@@ -71,6 +71,14 @@ struct DBusCounter
   dbus_bool_t notify_pending : 1; /**< TRUE if the guard value has been crossed */
 };
 
+#ifdef DBUS_ENABLE_STATS
+/* Largest values ever reached by any counter in this process, protected
+ * by the stats lock
+ */
+static long global_peak_size_value = 0;
+static long global_peak_unix_fd_value = 0;
+#endif
+
 /** @} */  /* end of resource limits internals docs */
 
 /**
@@ -154,7 +162,14 @@ _dbus_counter_adjust_size (DBusCounter *counter,
 
 #ifdef DBUS_ENABLE_STATS
   if (counter->peak_size_value < counter->size_value)
-    counter->peak_size_value = counter->size_value;
+    {
+      counter->peak_size_value = counter->size_value;
+
+      _DBUS_LOCK (stats);
+      if (global_peak_size_value < counter->size_value)
+        global_peak_size_value = counter->size_value;
+      _DBUS_UNLOCK (stats);
+    }
 #endif
 
 #if 0
@@ -208,7 +223,14 @@ _dbus_counter_adjust_unix_fd (DBusCounter *counter,
 
 #ifdef DBUS_ENABLE_STATS
   if (counter->peak_unix_fd_value < counter->unix_fd_value)
-    counter->peak_unix_fd_value = counter->unix_fd_value;
+    {
+      counter->peak_unix_fd_value = counter->unix_fd_value;
+
+      _DBUS_LOCK (stats);
+      if (global_peak_unix_fd_value < counter->unix_fd_value)
+        global_peak_unix_fd_value = counter->unix_fd_value;
+      _DBUS_UNLOCK (stats);
+    }
 #endif
 
 #if 0
@@ -285,6 +307,21 @@ _dbus_counter_get_peak_unix_fd_value (DBusCounter *counter)
 {
   return counter->peak_unix_fd_value;
 }
+
+void
+_dbus_counter_get_global_peaks (dbus_uint32_t *peak_size_p,
+                                dbus_uint32_t *peak_unix_fd_p)
+{
+  _DBUS_LOCK (stats);
+
+  if (peak_size_p != NULL)
+    *peak_size_p = global_peak_size_value;
+
+  if (peak_unix_fd_p != NULL)
+    *peak_unix_fd_p = global_peak_unix_fd_value;
+
+  _DBUS_UNLOCK (stats);
+}
 #endif
 
 /** @} */  /* end of resource limits exported API */
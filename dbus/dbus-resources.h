@@ -55,6 +55,8 @@ void _dbus_counter_set_notify    (DBusCounter               *counter,
 /* if DBUS_ENABLE_STATS */
 long _dbus_counter_get_peak_size_value    (DBusCounter *counter);
 long _dbus_counter_get_peak_unix_fd_value (DBusCounter *counter);
+void _dbus_counter_get_global_peaks       (dbus_uint32_t *peak_size_p,
+                                           dbus_uint32_t *peak_unix_fd_p);
 
 DBUS_END_DECLS
 
@@ -753,6 +753,18 @@ _dbus_babysitter_set_result_function  (DBusBabysitter             *sitter,
   sitter->finished_data = user_data;
 }
 
+/* Babysitters are threads here, so there is no fork() to avoid */
+dbus_bool_t
+_dbus_spawn_server_start (DBusError *error)
+{
+  return TRUE;
+}
+
+void
+_dbus_spawn_server_stop (void)
+{
+}
+
 #ifdef DBUS_BUILD_TESTS
 
 static char *
@@ -27,6 +27,7 @@
 #include "dbus-spawn.h"
 #include "dbus-sysdeps-unix.h"
 #include "dbus-internals.h"
+#include "dbus-list.h"
 #include "dbus-test.h"
 #include "dbus-protocol.h"
 
@@ -35,6 +36,10 @@
 #include <signal.h>
 #include <sys/wait.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_POSIX_SPAWN
+#include <spawn.h>
+#endif
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -185,6 +190,8 @@ enum
   CHILD_PID                /* Followed by pid_t */
 };
 
+typedef struct SpawnRequest SpawnRequest;
+
 /**
  * Babysitter implementation details
  */
@@ -205,6 +212,8 @@ struct DBusBabysitter
   DBusWatch *error_watch; /**< Error pipe watch */
   DBusWatch *sitter_watch; /**< Sitter pipe watch */
 
+  SpawnRequest *request; /**< Request to the spawn server not yet sent in full */
+
   DBusBabysitterFinishedFunc finished_cb;
   void *finished_data;
 
@@ -262,6 +271,12 @@ _dbus_babysitter_ref (DBusBabysitter *sitter)
 
 static void close_socket_to_babysitter  (DBusBabysitter *sitter);
 static void close_error_pipe_from_child (DBusBabysitter *sitter);
+static void flush_spawn_requests        (void);
+static void abandon_spawn_request       (SpawnRequest   *request);
+
+/* The spawn server, see spawn_server_main() */
+static int spawn_server_socket = -1;
+static pid_t spawn_server_pid = -1;
 
 /**
  * Decrement the reference count on the babysitter object.
@@ -340,6 +355,9 @@ _dbus_babysitter_unref (DBusBabysitter *sitter)
           sitter->sitter_pid = -1;
         }
 
+      if (sitter->request != NULL)
+        abandon_spawn_request (sitter->request);
+
       if (sitter->watches)
         _dbus_watch_list_free (sitter->watches);
 
@@ -539,7 +557,7 @@ static dbus_bool_t
 babysitter_iteration (DBusBabysitter *sitter,
                       dbus_bool_t     block)
 {
-  DBusPollFD fds[2];
+  DBusPollFD fds[3];
   int i;
   dbus_bool_t descriptors_ready;
 
@@ -563,6 +581,15 @@ babysitter_iteration (DBusBabysitter *sitter,
       ++i;
     }
 
+  /* Nothing will come back until the spawn server has the request */
+  if (sitter->request != NULL)
+    {
+      fds[i].fd = spawn_server_socket;
+      fds[i].events = _DBUS_POLLOUT;
+      fds[i].revents = 0;
+      ++i;
+    }
+
   if (i > 0)
     {
       int ret;
@@ -593,6 +620,8 @@ babysitter_iteration (DBusBabysitter *sitter,
                 handle_error_pipe (sitter, fds[i].revents);
               else if (fds[i].fd == sitter->socket_to_babysitter)
                 handle_babysitter_socket (sitter, fds[i].revents);
+              else if (fds[i].revents != 0)
+                flush_spawn_requests ();
             }
         }
     }
@@ -899,12 +928,18 @@ do_write (int fd, const void *buf, size_t count)
 }
 
 static void
-write_err_and_exit (int fd, int msg)
+write_err (int fd, int msg)
 {
   int en = errno;
 
   do_write (fd, &msg, sizeof (msg));
   do_write (fd, &en, sizeof (en));
+}
+
+static void
+write_err_and_exit (int fd, int msg)
+{
+  write_err (fd, msg);
   
   exit (1);
 }
@@ -1114,6 +1149,690 @@ babysit (pid_t grandchild_pid,
   exit (1);
 }
 
+/* Runs in the babysitter process: forks the grandchild that will
+ * exec(), then watches it until it exits.
+ */
+static void
+do_babysitter (int                       babysitter_fd,
+               int                       child_err_report_fd,
+               char                    **argv,
+               char                    **envp,
+               DBusSpawnChildSetupFunc   child_setup,
+               void                     *user_data)
+{
+  pid_t grandchild_pid;
+
+  /* Be sure we crash if the parent exits
+   * and we write to the err_report_pipe
+   */
+  signal (SIGPIPE, SIG_DFL);
+
+#ifdef HAVE_POSIX_SPAWN
+  /* Without a setup function to run in between, the fork and exec can
+   * be done by posix_spawn(), which does not copy our address space.
+   * It reports exec failures itself, so pass those on as do_exec()
+   * would have.
+   */
+  if (child_setup == NULL)
+    {
+      int ret;
+
+      ret = posix_spawn (&grandchild_pid, argv[0], NULL, NULL, argv,
+                         envp != NULL ? envp : environ);
+
+      if (ret != 0)
+        {
+          errno = ret;
+
+          if (ret == EAGAIN || ret == ENOMEM)
+            write_err_and_exit (babysitter_fd, CHILD_FORK_FAILED);
+          else
+            write_err_and_exit (child_err_report_fd, CHILD_EXEC_FAILED);
+
+          _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
+        }
+
+      babysit (grandchild_pid, babysitter_fd);
+      _dbus_assert_not_reached ("Got to code after babysit()");
+    }
+#endif
+
+  /* Create the child that will exec () */
+  grandchild_pid = fork ();
+
+  if (grandchild_pid < 0)
+    {
+      write_err_and_exit (babysitter_fd,
+                          CHILD_FORK_FAILED);
+      _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
+    }
+  else if (grandchild_pid == 0)
+    {
+      do_exec (child_err_report_fd,
+               argv,
+               envp,
+               child_setup, user_data);
+      _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
+    }
+  else
+    {
+      babysit (grandchild_pid, babysitter_fd);
+      _dbus_assert_not_reached ("Got to code after babysit()");
+    }
+}
+
+/*
+ * The spawn server is a process forked from the bus daemon early on,
+ * while the daemon is still small. Once it is running, babysitters
+ * are forked from the server instead of from the daemon, so the
+ * daemon does not have to duplicate its whole address space (and
+ * then take copy-on-write faults) for every activation. The daemon
+ * sends each request over a socket: the babysitter's two pipe ends
+ * as SCM_RIGHTS, then a length-prefixed block with argv and the
+ * environment. The babysitter talks to the daemon directly over those
+ * pipes exactly as if the daemon had forked it, so nothing else about
+ * babysitters changes.
+ *
+ * Only the bus daemon uses this, and it is single-threaded.
+ */
+static dbus_bool_t
+append_string_array (DBusString  *str,
+                     char       **array)
+{
+  int n;
+
+  if (array == NULL)
+    n = -1;
+  else
+    for (n = 0; array[n] != NULL; n++)
+      ;
+
+  if (!_dbus_string_append_len (str, (const char *) &n, sizeof (n)))
+    return FALSE;
+
+  for (n = 0; array != NULL && array[n] != NULL; n++)
+    {
+      if (!_dbus_string_append_len (str, array[n], strlen (array[n]) + 1))
+        return FALSE;
+    }
+
+  return TRUE;
+}
+
+/*
+ * A request that the server would not take in full without blocking
+ * waits in this queue, in order, and is sent from a watch on the
+ * server socket in its babysitter's watch list. The babysitter's pipe
+ * ends go with the first byte, so until then the request holds them.
+ */
+struct SpawnRequest
+{
+  DBusString data;          /**< the request, header included */
+  int written;              /**< how much of data the server has */
+  int fds[2];               /**< babysitter's pipe ends, until written */
+  DBusBabysitter *sitter;   /**< babysitter waiting on this, or NULL */
+  DBusWatch *watch;         /**< watch on the server socket */
+};
+
+static DBusList *spawn_requests = NULL;
+
+static void
+free_spawn_request (SpawnRequest *request)
+{
+  if (request->watch != NULL)
+    {
+      _dbus_watch_list_remove_watch (request->sitter->watches,
+                                     request->watch);
+      _dbus_watch_invalidate (request->watch);
+      _dbus_watch_unref (request->watch);
+    }
+
+  if (request->sitter != NULL)
+    request->sitter->request = NULL;
+
+  close_and_invalidate (&request->fds[0]);
+  close_and_invalidate (&request->fds[1]);
+  _dbus_string_free (&request->data);
+  dbus_free (request);
+}
+
+/* Called when the babysitter goes away. A request the server hasn't
+ * started on is dropped; one it has must still be finished, so that
+ * the next request is read from the right place.
+ */
+static void
+abandon_spawn_request (SpawnRequest *request)
+{
+  if (request->written == 0)
+    {
+      _dbus_list_remove (&spawn_requests, request);
+      free_spawn_request (request);
+      return;
+    }
+
+  _dbus_watch_list_remove_watch (request->sitter->watches, request->watch);
+  _dbus_watch_invalidate (request->watch);
+  _dbus_watch_unref (request->watch);
+  request->watch = NULL;
+
+  request->sitter->request = NULL;
+  request->sitter = NULL;
+}
+
+/* Sends what the server will take without blocking, and returns -1
+ * if the server has gone away
+ */
+static int
+write_spawn_request (SpawnRequest *request)
+{
+  int len, n;
+
+  len = _dbus_string_get_length (&request->data);
+
+  /* The descriptors go with the first byte; the server reads the
+   * header on its own, so they can't be merged into another request.
+   */
+  if (request->written == 0)
+    n = _dbus_write_socket_with_unix_fds (spawn_server_socket,
+                                          &request->data, 0, len,
+                                          request->fds, 2);
+  else
+    n = _dbus_write_socket (spawn_server_socket, &request->data,
+                            request->written, len - request->written);
+
+  if (n < 0)
+    return _dbus_get_is_errno_eagain_or_ewouldblock () ? 0 : -1;
+
+  if (n > 0 && request->written == 0)
+    {
+      close_and_invalidate (&request->fds[0]);
+      close_and_invalidate (&request->fds[1]);
+    }
+
+  request->written += n;
+  return n;
+}
+
+static void
+flush_spawn_requests (void)
+{
+  while (spawn_requests != NULL)
+    {
+      SpawnRequest *request = spawn_requests->data;
+
+      if (write_spawn_request (request) < 0)
+        {
+          _dbus_warn ("Lost the spawn server (%s)\n",
+                      _dbus_strerror (errno));
+          _dbus_spawn_server_stop ();
+          return;
+        }
+
+      if (request->written < _dbus_string_get_length (&request->data))
+        return;
+
+      _dbus_list_pop_first (&spawn_requests);
+      free_spawn_request (request);
+    }
+}
+
+static dbus_bool_t
+handle_spawn_request_watch (DBusWatch    *watch,
+                            unsigned int  condition,
+                            void         *data)
+{
+  flush_spawn_requests ();
+
+  return TRUE;
+}
+
+/* Returns FALSE if there was no memory. Otherwise *sent says whether
+ * the server has or will get the request; if it hasn't, the server is
+ * stopped and the caller should fork the babysitter itself. A request
+ * that can't be sent at once is queued, and takes the babysitter's
+ * pipe ends if none of it could be sent.
+ */
+static dbus_bool_t
+send_spawn_request (DBusBabysitter *sitter,
+                    int            *babysitter_fd,
+                    int            *child_err_report_fd,
+                    char          **argv,
+                    char          **envp,
+                    dbus_bool_t    *sent,
+                    DBusError      *error)
+{
+  SpawnRequest *request;
+  DBusList *link;
+  int len, n;
+
+  *sent = FALSE;
+
+  if (spawn_server_socket < 0)
+    return TRUE;
+
+  /* Everything that could fail for lack of memory is done up front,
+   * before any of the request reaches the server
+   */
+  request = dbus_new0 (SpawnRequest, 1);
+  if (request == NULL)
+    goto oom;
+
+  request->fds[0] = -1;
+  request->fds[1] = -1;
+
+  if (!_dbus_string_init (&request->data))
+    {
+      dbus_free (request);
+      goto oom;
+    }
+
+  link = _dbus_list_alloc_link (request);
+  request->watch = _dbus_watch_new (spawn_server_socket,
+                                    DBUS_WATCH_WRITABLE, TRUE,
+                                    handle_spawn_request_watch,
+                                    NULL, NULL);
+  len = 0;
+  if (link == NULL || request->watch == NULL ||
+      !_dbus_string_append_len (&request->data, (const char *) &len,
+                                sizeof (len)) ||
+      !append_string_array (&request->data, argv) ||
+      !append_string_array (&request->data, envp) ||
+      !_dbus_watch_list_add_watch (sitter->watches, request->watch))
+    {
+      if (request->watch != NULL)
+        {
+          _dbus_watch_invalidate (request->watch);
+          _dbus_watch_unref (request->watch);
+          request->watch = NULL;
+        }
+      if (link != NULL)
+        _dbus_list_free_link (link);
+      free_spawn_request (request);
+      goto oom;
+    }
+
+  request->sitter = sitter;
+  sitter->request = request;
+
+  len = _dbus_string_get_length (&request->data);
+  n = len - sizeof (len);
+  memcpy (_dbus_string_get_data (&request->data), &n, sizeof (n));
+
+  /* The request owns the pipe ends until they have been sent */
+  request->fds[0] = *babysitter_fd;
+  request->fds[1] = *child_err_report_fd;
+  *babysitter_fd = -1;
+  *child_err_report_fd = -1;
+
+  /* Unless others are waiting, try to send it straight away */
+  if (spawn_requests == NULL)
+    {
+      if (write_spawn_request (request) < 0)
+        {
+          _dbus_warn ("Lost the spawn server (%s), forking directly\n",
+                      _dbus_strerror (errno));
+
+          /* nothing was sent, so the caller can have them back */
+          *babysitter_fd = request->fds[0];
+          *child_err_report_fd = request->fds[1];
+          request->fds[0] = -1;
+          request->fds[1] = -1;
+
+          _dbus_list_free_link (link);
+          free_spawn_request (request);
+          _dbus_spawn_server_stop ();
+          return TRUE;
+        }
+
+      if (request->written == len)
+        {
+          _dbus_list_free_link (link);
+          free_spawn_request (request);
+          *sent = TRUE;
+          return TRUE;
+        }
+    }
+
+  _dbus_list_append_link (&spawn_requests, link);
+
+  *sent = TRUE;
+  return TRUE;
+
+ oom:
+  dbus_set_error (error, DBUS_ERROR_NO_MEMORY, NULL);
+  return FALSE;
+}
+
+#ifdef HAVE_UNIX_FD_PASSING
+/* Reads exactly count bytes, appending them to str */
+static dbus_bool_t
+read_exactly (int         fd,
+              DBusString *str,
+              int         count)
+{
+  int n;
+
+  while (count > 0)
+    {
+      n = _dbus_read_socket (fd, str, count);
+      if (n <= 0)
+        return FALSE;
+
+      count -= n;
+    }
+
+  return TRUE;
+}
+
+/* Reads and throws away exactly count bytes, without allocating */
+static dbus_bool_t
+skip_exactly (int fd,
+              int count)
+{
+  char buf[1024];
+  int n;
+
+  while (count > 0)
+    {
+      n = read (fd, buf, count < (int) sizeof (buf) ? count : (int) sizeof (buf));
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return FALSE;
+
+      count -= n;
+    }
+
+  return TRUE;
+}
+
+/* Returns FALSE if str doesn't hold a string array at *pos. Otherwise
+ * *array_p is set to the array, or to NULL if there was no memory.
+ */
+static dbus_bool_t
+parse_string_array (const DBusString   *str,
+                    int                *pos,
+                    char             ***array_p)
+{
+  const char *data;
+  char **array;
+  int len, n, i, start;
+
+  *array_p = NULL;
+
+  data = _dbus_string_get_const_data (str);
+  len = _dbus_string_get_length (str);
+
+  if (*pos + (int) sizeof (n) > len)
+    return FALSE;
+
+  memcpy (&n, data + *pos, sizeof (n));
+  *pos += sizeof (n);
+
+  if (n < -1 || n > len)
+    return FALSE;
+
+  start = *pos;
+  for (i = 0; i < n; i++)
+    {
+      const char *end;
+
+      end = memchr (data + *pos, '\0', len - *pos);
+      if (end == NULL)
+        return FALSE;
+
+      *pos = end - data + 1;
+    }
+
+  /* an empty array stands for "inherit the environment" */
+  array = dbus_new0 (char *, (n < 0 ? 0 : n) + 1);
+  if (array == NULL)
+    return TRUE;
+
+  for (i = 0; i < n; i++)
+    {
+      array[i] = (char *) data + start;
+      start += strlen (array[i]) + 1;
+    }
+
+  *array_p = array;
+  return TRUE;
+}
+
+static void
+spawn_server_main (int fd)
+{
+  DBusString header;
+  int max_open, i;
+
+  _dbus_verbose_reset ();
+
+  /* The server is sent SIGHUP along with the daemon by anything that
+   * signals the process group; only losing the socket stops it.
+   * Babysitters are reaped automatically.
+   */
+  signal (SIGHUP, SIG_IGN);
+  signal (SIGPIPE, SIG_IGN);
+  signal (SIGCHLD, SIG_IGN);
+
+  /* Don't keep the daemon's sockets open, or clients would not see
+   * them close when the daemon goes away
+   */
+  max_open = sysconf (_SC_OPEN_MAX);
+  for (i = 3; i < max_open; i++)
+    {
+      if (i != fd)
+        close (i);
+    }
+
+  /* Reading the headers never needs more memory than this */
+  if (!_dbus_string_init_preallocated (&header, sizeof (int)))
+    _exit (1);
+
+  while (TRUE)
+    {
+      DBusString request;
+      int fds[2] = { -1, -1 };
+      int n_fds = 2;
+      int len, pos;
+      char **argv, **envp;
+      pid_t pid;
+
+      _dbus_string_set_length (&header, 0);
+
+      /* the descriptors come with the first byte of the header */
+      if (_dbus_read_socket_with_unix_fds (fd, &header, sizeof (len),
+                                           fds, &n_fds) <= 0)
+        _exit (0);
+
+      if (!read_exactly (fd, &header,
+                         sizeof (len) - _dbus_string_get_length (&header)))
+        _exit (0);
+
+      memcpy (&len, _dbus_string_get_const_data (&header), sizeof (len));
+
+      if (n_fds != 2 || len < 0)
+        _exit (1);
+
+      /* Running out of memory fails this request alone: the rest of it
+       * is skipped, and its babysitter's owner is told, as if the fork
+       * had failed.
+       */
+      argv = NULL;
+      envp = NULL;
+
+      if (!_dbus_string_init (&request))
+        {
+          if (!skip_exactly (fd, len))
+            _exit (0);
+
+          errno = ENOMEM;
+          write_err (fds[0], CHILD_FORK_FAILED);
+          close (fds[0]);
+          close (fds[1]);
+          continue;
+        }
+
+      if (!read_exactly (fd, &request, len))
+        {
+          if (errno != ENOMEM ||
+              !skip_exactly (fd, len - _dbus_string_get_length (&request)))
+            _exit (0);
+        }
+      else
+        {
+          pos = 0;
+          if (!parse_string_array (&request, &pos, &argv) ||
+              !parse_string_array (&request, &pos, &envp) ||
+              (argv != NULL && argv[0] == NULL))
+            _exit (1);
+        }
+
+      if (argv == NULL || envp == NULL)
+        {
+          errno = ENOMEM;
+          write_err (fds[0], CHILD_FORK_FAILED);
+          close (fds[0]);
+          close (fds[1]);
+          dbus_free (argv);
+          dbus_free (envp);
+          _dbus_string_free (&request);
+          continue;
+        }
+
+      pid = fork ();
+
+      if (pid == 0)
+        {
+          /* babysit() relies on SIGCHLD to find out about the grandchild,
+           * and the service must not inherit the signals we ignore,
+           * since ignored signals stay ignored across exec().
+           * do_babysitter() takes care of SIGPIPE.
+           */
+          signal (SIGCHLD, SIG_DFL);
+          signal (SIGHUP, SIG_DFL);
+          close (fd);
+
+          do_babysitter (fds[0], fds[1], argv,
+                         envp[0] == NULL ? NULL : envp,
+                         NULL, NULL);
+          _dbus_assert_not_reached ("Got to code after do_babysitter()");
+        }
+      else if (pid < 0)
+        {
+          write_err (fds[0], CHILD_FORK_FAILED);
+        }
+
+      close (fds[0]);
+      close (fds[1]);
+      dbus_free (argv);
+      dbus_free (envp);
+      _dbus_string_free (&request);
+    }
+}
+#endif /* HAVE_UNIX_FD_PASSING */
+
+/**
+ * Starts a helper process that forks babysitters on behalf of this
+ * one, so that _dbus_spawn_async_with_babysitter() does not need to
+ * fork the calling process. Meant to be called by the bus daemon
+ * before it grows large, and after it has dropped privileges, since
+ * everything spawned afterwards inherits the helper's credentials.
+ * Does nothing if the helper is already running, or if file
+ * descriptors can't be passed over sockets on this platform.
+ *
+ * @param error return location for errors
+ * @returns #FALSE if the helper could not be started
+ */
+dbus_bool_t
+_dbus_spawn_server_start (DBusError *error)
+{
+#ifdef HAVE_UNIX_FD_PASSING
+  int fds[2];
+  pid_t pid;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  if (spawn_server_socket >= 0)
+    return TRUE;
+
+  if (!_dbus_full_duplex_pipe (&fds[0], &fds[1], TRUE, error))
+    return FALSE;
+
+  pid = fork ();
+
+  if (pid < 0)
+    {
+      dbus_set_error (error,
+                      DBUS_ERROR_SPAWN_FORK_FAILED,
+                      "Failed to fork spawn server (%s)",
+                      _dbus_strerror (errno));
+      close_and_invalidate (&fds[0]);
+      close_and_invalidate (&fds[1]);
+      return FALSE;
+    }
+  else if (pid == 0)
+    {
+      spawn_server_main (fds[1]);
+      _dbus_assert_not_reached ("Got to code after spawn_server_main()");
+    }
+
+  close_and_invalidate (&fds[1]);
+  spawn_server_socket = fds[0];
+  spawn_server_pid = pid;
+
+  /* Requests are queued rather than block the caller, see
+   * send_spawn_request(); the server itself reads blocking.
+   */
+  if (!_dbus_set_fd_nonblocking (spawn_server_socket, error))
+    {
+      _dbus_spawn_server_stop ();
+      return FALSE;
+    }
+
+  _dbus_verbose ("Started spawn server %ld\n", (long) pid);
+#endif
+
+  return TRUE;
+}
+
+/**
+ * Stops the helper started by _dbus_spawn_server_start(), if it is
+ * running. Children spawned through it are not affected.
+ */
+void
+_dbus_spawn_server_stop (void)
+{
+  SpawnRequest *request;
+
+  if (spawn_server_socket < 0)
+    return;
+
+  /* Requests the server never got fail as if their babysitters could
+   * not be forked. The server's copies of the pipe ends of one it was
+   * part way through close when it exits, which the babysitter's owner
+   * sees as the babysitter going away.
+   */
+  while ((request = _dbus_list_pop_first (&spawn_requests)) != NULL)
+    {
+      if (request->fds[0] >= 0)
+        {
+          errno = EPIPE;
+          write_err (request->fds[0], CHILD_FORK_FAILED);
+        }
+
+      free_spawn_request (request);
+    }
+
+  /* the server exits when it sees the socket close */
+  close_and_invalidate (&spawn_server_socket);
+
+  while (waitpid (spawn_server_pid, NULL, 0) < 0 && errno == EINTR)
+    ;
+
+  spawn_server_pid = -1;
+}
+
 /**
  * Spawns a new process. The executable name and argv[0]
  * are the same, both are provided in argv[0]. The child_setup
@@ -1122,7 +1841,9 @@ babysit (pid_t grandchild_pid,
  *
  * Also creates a "babysitter" which tracks the status of the
  * child process, advising the parent if the child exits.
- * If the spawn fails, no babysitter is created.
+ * If the spawn fails, no babysitter is created. If the spawn
+ * server is running and there is no child_setup function, the
+ * babysitter is forked from the server rather than from this process.
  * If sitter_p is #NULL, no babysitter is kept.
  *
  * @param sitter_p return location for babysitter or #NULL
@@ -1144,6 +1865,7 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
   DBusBabysitter *sitter;
   int child_err_report_pipe[2] = { -1, -1 };
   int babysitter_pipe[2] = { -1, -1 };
+  dbus_bool_t sent;
   pid_t pid;
   
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
@@ -1221,10 +1943,23 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
     }
 
   _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  sent = FALSE;
+  if (child_setup == NULL &&
+      !send_spawn_request (sitter, &babysitter_pipe[1],
+                           &child_err_report_pipe[WRITE_END],
+                           argv, env, &sent, error))
+    goto cleanup_and_fail;
+
+  /* the babysitter is the server's child, not ours, so there's
+   * nothing for us to reap
+   */
+  if (sent)
+    pid = -1;
+  else
+    pid = fork ();
   
-  pid = fork ();
-  
-  if (pid < 0)
+  if (pid < 0 && !sent)
     {
       dbus_set_error (error,
 		      DBUS_ERROR_SPAWN_FORK_FAILED,
@@ -1235,39 +1970,14 @@ _dbus_spawn_async_with_babysitter (DBusBabysitter          **sitter_p,
   else if (pid == 0)
     {
       /* Immediate child, this is the babysitter process. */
-      int grandchild_pid;
-      
-      /* Be sure we crash if the parent exits
-       * and we write to the err_report_pipe
-       */
-      signal (SIGPIPE, SIG_DFL);
 
       /* Close the parent's end of the pipes. */
       close_and_invalidate (&child_err_report_pipe[READ_END]);
       close_and_invalidate (&babysitter_pipe[0]);
-      
-      /* Create the child that will exec () */
-      grandchild_pid = fork ();
-      
-      if (grandchild_pid < 0)
-	{
-	  write_err_and_exit (babysitter_pipe[1],
-			      CHILD_FORK_FAILED);
-          _dbus_assert_not_reached ("Got to code after write_err_and_exit()");
-	}
-      else if (grandchild_pid == 0)
-	{
-	  do_exec (child_err_report_pipe[WRITE_END],
-		   argv,
-		   env,
-		   child_setup, user_data);
-          _dbus_assert_not_reached ("Got to code after exec() - should have exited on error");
-	}
-      else
-	{
-          babysit (grandchild_pid, babysitter_pipe[1]);
-          _dbus_assert_not_reached ("Got to code after babysit()");
-	}
+
+      do_babysitter (babysitter_pipe[1], child_err_report_pipe[WRITE_END],
+                     argv, env, child_setup, user_data);
+      _dbus_assert_not_reached ("Got to code after do_babysitter()");
     }
   else
     {      
@@ -1497,6 +2207,75 @@ check_spawn_exit (void *data)
   return TRUE;
 }
 
+static dbus_bool_t
+check_spawn_signals (void *data)
+{
+  char *argv[4] = { NULL, NULL, NULL, NULL };
+  DBusBabysitter *sitter = NULL;
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString argv0;
+  int status;
+
+  /*** Test that the child starts with default signal handling */
+
+  argv[0] = get_test_exec ("test-signals", &argv0);
+
+  if (argv[0] == NULL)
+    {
+      /* OOM was simulated, never mind */
+      return TRUE;
+    }
+
+  if (!_dbus_spawn_async_with_babysitter (&sitter, argv,
+                                          NULL, NULL, NULL,
+                                          &error))
+    {
+      _dbus_string_free (&argv0);
+
+      if (sitter)
+        _dbus_babysitter_unref (sitter);
+
+      if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+        {
+          dbus_error_free (&error);
+          return TRUE;
+        }
+
+      _dbus_warn ("Failed to launch signal checking binary: %s: %s\n",
+                  error.name, error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  _dbus_babysitter_block_for_child_exit (sitter);
+  _dbus_babysitter_set_child_exit_error (sitter, &error);
+
+  _dbus_string_free (&argv0);
+
+  /* The babysitter might not have been able to fork, under OOM */
+  if (dbus_error_has_name (&error, DBUS_ERROR_NO_MEMORY))
+    {
+      _dbus_babysitter_unref (sitter);
+      dbus_error_free (&error);
+      return TRUE;
+    }
+
+  if (!_dbus_babysitter_get_child_exit_status (sitter, &status) ||
+      status != 0)
+    {
+      _dbus_warn ("Child did not start with default signal handling: %s\n",
+                  error.message);
+      _dbus_babysitter_unref (sitter);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  _dbus_babysitter_unref (sitter);
+  dbus_error_free (&error);
+
+  return TRUE;
+}
+
 static dbus_bool_t
 check_spawn_and_kill (void *data)
 {
@@ -1551,9 +2330,106 @@ check_spawn_and_kill (void *data)
   return TRUE;
 }
 
+#define N_QUEUED_SPAWNS 4
+#define N_PADDING_VARS  4
+
+static dbus_bool_t
+check_spawn_queued (void *data)
+{
+  char *argv[4] = { NULL, NULL, NULL, NULL };
+  char **envp;
+  DBusBabysitter *sitters[N_QUEUED_SPAWNS];
+  DBusError error = DBUS_ERROR_INIT;
+  DBusString argv0, padding;
+  dbus_bool_t queued;
+  int i, j;
+
+  /*** Test spawning through the server faster than it can read */
+
+  /* there's no server without descriptor passing */
+  if (spawn_server_socket < 0)
+    return TRUE;
+
+  argv[0] = get_test_exec ("test-exit", &argv0);
+  if (argv[0] == NULL)
+    return FALSE;
+
+  /* Enough that no request fits in the socket buffer on its own;
+   * each variable is kept under the kernel's limit for one string
+   */
+  if (!_dbus_string_init (&padding) ||
+      !_dbus_string_append (&padding, "DBUS_TEST_PADDING0=") ||
+      !_dbus_string_lengthen (&padding, 100 * 1024))
+    return FALSE;
+  memset (_dbus_string_get_data (&padding) + strlen ("DBUS_TEST_PADDING0="),
+          'x', 100 * 1024);
+
+  queued = FALSE;
+  for (i = 0; i < N_QUEUED_SPAWNS; i++)
+    {
+      /* the environment is freed once the child is spawned */
+      envp = dbus_new0 (char *, N_PADDING_VARS + 1);
+      if (envp == NULL)
+        return FALSE;
+
+      for (j = 0; j < N_PADDING_VARS; j++)
+        {
+          _dbus_string_set_byte (&padding, strlen ("DBUS_TEST_PADDING"),
+                                 '0' + j);
+          if (!_dbus_string_copy_data (&padding, &envp[j]))
+            return FALSE;
+        }
+
+      if (!_dbus_spawn_async_with_babysitter (&sitters[i], argv,
+                                              envp, NULL, NULL,
+                                              &error))
+        {
+          _dbus_warn ("Could not spawn through the server: %s\n",
+                      error.message);
+          return FALSE;
+        }
+
+      if (spawn_requests != NULL)
+        queued = TRUE;
+    }
+
+  _dbus_string_free (&padding);
+  _dbus_string_free (&argv0);
+
+  if (!queued)
+    {
+      _dbus_warn ("Spawn requests were never queued\n");
+      return FALSE;
+    }
+
+  /* Each one is sent in turn, and runs */
+  for (i = 0; i < N_QUEUED_SPAWNS; i++)
+    {
+      _dbus_babysitter_block_for_child_exit (sitters[i]);
+      _dbus_babysitter_set_child_exit_error (sitters[i], &error);
+      _dbus_babysitter_unref (sitters[i]);
+
+      if (!dbus_error_has_name (&error, DBUS_ERROR_SPAWN_CHILD_EXITED))
+        {
+          _dbus_warn ("Not expecting error for queued spawn %d: %s: %s\n",
+                      i, error.name, error.message);
+          dbus_error_free (&error);
+          return FALSE;
+        }
+
+      dbus_error_free (&error);
+    }
+
+  _dbus_assert (spawn_requests == NULL);
+
+  return TRUE;
+}
+
 dbus_bool_t
 _dbus_spawn_test (const char *test_data_dir)
 {
+  DBusError error = DBUS_ERROR_INIT;
+
   if (!_dbus_test_oom_handling ("spawn_nonexistent",
                                 check_spawn_nonexistent,
                                 NULL))
@@ -1573,6 +2449,42 @@ _dbus_spawn_test (const char *test_data_dir)
                                 check_spawn_and_kill,
                                 NULL))
     return FALSE;
+
+  if (!_dbus_test_oom_handling ("spawn_signals",
+                                check_spawn_signals,
+                                NULL))
+    return FALSE;
+
+  /* Same again, with the babysitters forked by the spawn server */
+  if (!_dbus_spawn_server_start (&error))
+    {
+      _dbus_warn ("Could not start spawn server: %s\n", error.message);
+      dbus_error_free (&error);
+      return FALSE;
+    }
+
+  if (!_dbus_test_oom_handling ("spawn_nonexistent via server",
+                                check_spawn_nonexistent,
+                                NULL) ||
+      !_dbus_test_oom_handling ("spawn_segfault via server",
+                                check_spawn_segfault,
+                                NULL) ||
+      !_dbus_test_oom_handling ("spawn_exit via server",
+                                check_spawn_exit,
+                                NULL) ||
+      !_dbus_test_oom_handling ("spawn_and_kill via server",
+                                check_spawn_and_kill,
+                                NULL) ||
+      !_dbus_test_oom_handling ("spawn_signals via server",
+                                check_spawn_signals,
+                                NULL) ||
+      !check_spawn_queued (NULL))
+    {
+      _dbus_spawn_server_stop ();
+      return FALSE;
+    }
+
+  _dbus_spawn_server_stop ();
   
   return TRUE;
 }
@@ -62,6 +62,9 @@ dbus_bool_t _dbus_babysitter_set_watch_functions  (DBusBabysitter            *si
                                                    void                      *data,
                                                    DBusFreeFunction           free_data_function);
 
+dbus_bool_t _dbus_spawn_server_start              (DBusError                 *error);
+void        _dbus_spawn_server_stop               (void);
+
 DBUS_END_DECLS
 
 #endif /* DBUS_SPAWN_H */
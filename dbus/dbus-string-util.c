@@ -932,6 +932,53 @@ _dbus_string_test (void)
     _dbus_string_free (&str);
   }
 
+  /* Check strings using a buffer they don't own */
+  {
+    dbus_uint64_t buffer[4];
+
+    _dbus_string_init_borrowed (&str, buffer, sizeof (buffer));
+
+    if (!_dbus_string_append (&str, "Hello"))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_assert (_dbus_string_get_const_data (&str) == (const char *) buffer);
+
+    /* grows out of it */
+    i = sizeof (buffer);
+    if (!_dbus_string_lengthen (&str, i))
+      _dbus_assert_not_reached ("no memory");
+    _dbus_assert (_dbus_string_get_const_data (&str) != (const char *) buffer);
+    _dbus_assert (strncmp (_dbus_string_get_const_data (&str), "Hello", 5) == 0);
+    _dbus_assert (_dbus_string_get_length (&str) == i + 5);
+
+    _dbus_string_free (&str);
+
+    _dbus_string_init_borrowed (&str, buffer, sizeof (buffer));
+    if (!_dbus_string_append (&str, "Hello World"))
+      _dbus_assert_not_reached ("no memory");
+
+    if (!_dbus_string_init (&other))
+      _dbus_assert_not_reached ("no memory");
+
+    /* has to copy, leaving the buffer where it was */
+    if (!_dbus_string_move (&str, 0, &other, 0))
+      _dbus_assert_not_reached ("could not move");
+    _dbus_assert (_dbus_string_equal_c_str (&other, "Hello World"));
+    _dbus_assert (_dbus_string_get_length (&str) == 0);
+    _dbus_assert (_dbus_string_get_const_data (&str) == (const char *) buffer);
+
+    if (!_dbus_string_append (&str, "Hello World"))
+      _dbus_assert_not_reached ("no memory");
+
+    if (!_dbus_string_steal_data (&str, &s))
+      _dbus_assert_not_reached ("failed to steal data");
+    _dbus_assert (s != (char *) buffer);
+    _dbus_assert (strcmp (s, "Hello World") == 0);
+    dbus_free (s);
+
+    _dbus_string_free (&other);
+    _dbus_string_free (&str);
+  }
+
   return TRUE;
 }
 
@@ -158,12 +158,55 @@ _dbus_string_init_preallocated (DBusString *str,
   real->locked = FALSE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->borrowed = FALSE;
   
   fixup_alignment (real);
   
   return TRUE;
 }
 
+/**
+ * Initializes an empty string whose data starts out in a buffer owned
+ * by the caller, such as part of a larger block holding several
+ * strings. Otherwise it is an ordinary modifiable string: if it has
+ * to grow beyond the buffer, its contents move to a block of their
+ * own. The buffer must be 8-byte aligned and stay valid until the
+ * string is freed with _dbus_string_free(), which doesn't free it.
+ *
+ * The string never gives the buffer away, so it can't be the source
+ * of _dbus_string_steal_data() without copying, and
+ * _dbus_string_move() of the whole string copies it.
+ *
+ * @param str memory to hold the string
+ * @param buffer memory for the string data
+ * @param buffer_size size of buffer, at least #_DBUS_STRING_ALLOCATION_PADDING
+ */
+void
+_dbus_string_init_borrowed (DBusString *str,
+                            void       *buffer,
+                            int         buffer_size)
+{
+  DBusRealString *real;
+
+  _dbus_assert (str != NULL);
+  _dbus_assert (buffer != NULL);
+  _dbus_assert (_DBUS_ALIGN_ADDRESS (buffer, 8) == buffer);
+  _dbus_assert (buffer_size >= _DBUS_STRING_ALLOCATION_PADDING);
+
+  real = (DBusRealString*) str;
+
+  real->str = buffer;
+  real->allocated = buffer_size;
+  real->len = 0;
+  real->str[real->len] = '\0';
+
+  real->constant = FALSE;
+  real->locked = FALSE;
+  real->invalid = FALSE;
+  real->align_offset = 0;
+  real->borrowed = TRUE;
+}
+
 /**
  * Initializes a string. The string starts life with zero length.  The
  * string must eventually be freed with _dbus_string_free().
@@ -227,6 +270,7 @@ _dbus_string_init_const_len (DBusString *str,
   real->locked = TRUE;
   real->invalid = FALSE;
   real->align_offset = 0;
+  real->borrowed = FALSE;
 
   /* We don't require const strings to be 8-byte aligned as the
    * memory is coming from elsewhere.
@@ -246,7 +290,8 @@ _dbus_string_free (DBusString *str)
   
   if (real->constant)
     return;
-  dbus_free (real->str - real->align_offset);
+  if (!real->borrowed)
+    dbus_free (real->str - real->align_offset);
 
   real->invalid = TRUE;
 }
@@ -264,6 +309,10 @@ compact (DBusRealString *real,
   if (waste <= max_waste)
     return TRUE;
 
+  /* Nothing to give back */
+  if (real->borrowed)
+    return TRUE;
+
   new_allocated = real->len + _DBUS_STRING_ALLOCATION_PADDING;
 
   new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
@@ -305,6 +354,19 @@ _dbus_string_lock (DBusString *str)
 }
 #endif /* DBUS_BUILD_TESTS */
 
+#ifdef DBUS_ENABLE_STATS
+/* Number of times a string had to grow its buffer. Strings grow all
+ * the time, so this is atomic rather than protected by the stats lock.
+ */
+static DBusAtomic string_reallocations = {0};
+
+dbus_uint32_t
+_dbus_string_get_n_reallocations (void)
+{
+  return (dbus_uint32_t) _dbus_atomic_get (&string_reallocations);
+}
+#endif /* DBUS_ENABLE_STATS */
+
 static dbus_bool_t
 reallocate_for_length (DBusRealString *real,
                        int             new_length)
@@ -341,9 +403,26 @@ reallocate_for_length (DBusRealString *real,
                        new_length + _DBUS_STRING_ALLOCATION_PADDING);
 
   _dbus_assert (new_allocated >= real->allocated); /* code relies on this */
-  new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
-  if (_DBUS_UNLIKELY (new_str == NULL))
-    return FALSE;
+  if (real->borrowed)
+    {
+      /* Outgrown the buffer it was given, move to our own */
+      new_str = dbus_malloc (new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+
+      memcpy (new_str, real->str - real->align_offset, real->allocated);
+      real->borrowed = FALSE;
+    }
+  else
+    {
+      new_str = dbus_realloc (real->str - real->align_offset, new_allocated);
+      if (_DBUS_UNLIKELY (new_str == NULL))
+        return FALSE;
+    }
+
+#ifdef DBUS_ENABLE_STATS
+  _dbus_atomic_inc (&string_reallocations);
+#endif
 
   real->str = new_str + real->align_offset;
   real->allocated = new_allocated;
@@ -622,6 +701,22 @@ _dbus_string_steal_data (DBusString        *str,
   DBUS_STRING_PREAMBLE (str);
   _dbus_assert (data_return != NULL);
 
+  /* The caller has to be able to free it, so copy it and keep the
+   * buffer for the empty string
+   */
+  if (real->borrowed)
+    {
+      *data_return = dbus_malloc (real->len + 1);
+      if (*data_return == NULL)
+        return FALSE;
+
+      memcpy (*data_return, real->str, real->len + 1);
+      real->len = 0;
+      real->str[real->len] = '\0';
+
+      return TRUE;
+    }
+
   undo_alignment (real);
   
   *data_return = (char*) real->str;
@@ -1320,10 +1415,13 @@ _dbus_string_move_len (DBusString       *source,
     }
   else if (start == 0 &&
            len == real_source->len &&
-           real_dest->len == 0)
+           real_dest->len == 0 &&
+           !real_source->borrowed &&
+           !real_dest->borrowed)
     {
       /* Short-circuit moving an entire existing string to an empty string
-       * by just swapping the buffers.
+       * by just swapping the buffers, unless one of them isn't
+       * ours to hand over.
        */
       /* we assume ->constant doesn't matter as you can't have
        * a constant string involved in a move.
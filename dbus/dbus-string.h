@@ -52,6 +52,7 @@ struct DBusString
   unsigned int dummy_bit2 : 1; /**< placeholder */
   unsigned int dummy_bit3 : 1; /**< placeholder */
   unsigned int dummy_bits : 3; /**< placeholder */
+  unsigned int dummy_bit4 : 1; /**< placeholder */
 };
 
 #ifdef DBUS_DISABLE_ASSERT
@@ -75,6 +76,9 @@ void          _dbus_string_init_const_len        (DBusString        *str,
                                                   int                len);
 dbus_bool_t   _dbus_string_init_preallocated     (DBusString        *str,
                                                   int                allocate_size);
+void          _dbus_string_init_borrowed         (DBusString        *str,
+                                                  void              *buffer,
+                                                  int                buffer_size);
 void          _dbus_string_free                  (DBusString        *str);
 void          _dbus_string_lock                  (DBusString        *str);
 dbus_bool_t   _dbus_string_compact               (DBusString        *str,
@@ -294,6 +298,9 @@ void          _dbus_string_zero                  (DBusString        *str);
  */
 #define _DBUS_STRING_ALLOCATION_PADDING 8
 
+/* if DBUS_ENABLE_STATS */
+dbus_uint32_t _dbus_string_get_n_reallocations (void);
+
 /**
  * Defines a static const variable with type #DBusString called "name"
  * containing the given string literal.
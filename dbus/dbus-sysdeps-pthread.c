@@ -262,6 +262,21 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   PTHREAD_CHECK ("pthread_cond_signal", pthread_cond_signal (&cond->cond));
 }
 
+unsigned int
+_dbus_current_thread_hash (void)
+{
+  pthread_t self = pthread_self ();
+  const unsigned char *p = (const unsigned char *) &self;
+  unsigned int hash = 0;
+  size_t i;
+
+  /* pthread_t is opaque, it might not be an integer */
+  for (i = 0; i < sizeof (self); i++)
+    hash = hash * 31 + p[i];
+
+  return hash;
+}
+
 static void
 check_monotonic_clock (void)
 {
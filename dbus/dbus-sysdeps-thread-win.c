@@ -256,6 +256,12 @@ _dbus_platform_condvar_wake_one (DBusCondVar *cond)
   LeaveCriticalSection (&cond->lock);
 }
 
+unsigned int
+_dbus_current_thread_hash (void)
+{
+  return GetCurrentThreadId ();
+}
+
 dbus_bool_t
 _dbus_threads_init_platform_specific (void)
 {
@@ -57,6 +57,16 @@
 #include <grp.h>
 #include <cutils/sockets.h>
 
+#ifdef HAVE_MEMFD_CREATE
+#include <sys/mman.h>
+#endif
+
+#if defined(HAVE_MEMFD_CREATE) && defined(MFD_ALLOW_SEALING) && defined(F_ADD_SEALS)
+#define DBUS_HAVE_SEALED_MEMFD 1
+/** The seals that make a memfd safe to map and trust */
+#define DBUS_MEMFD_SEALS (F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE)
+#endif
+
 #ifdef HAVE_ERRNO_H
 #include <errno.h>
 #endif
@@ -555,6 +565,85 @@ _dbus_write_socket_two (int               fd,
 #endif
 }
 
+/**
+ * Like _dbus_write_socket_two() but for any number of whole buffers,
+ * up to #_DBUS_MAX_WRITE_SOCKET_BUFFERS, so that several small
+ * messages can be written with one system call.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers to write, in order
+ * @param n_buffers number of buffers
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many (int                fd,
+                         const DBusString **buffers,
+                         int                n_buffers)
+{
+#if HAVE_DECL_MSG_NOSIGNAL || defined(HAVE_WRITEV)
+  struct iovec vectors[_DBUS_MAX_WRITE_SOCKET_BUFFERS];
+  int bytes_written;
+  int i;
+#if HAVE_DECL_MSG_NOSIGNAL
+  struct msghdr m;
+#endif
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_MAX_WRITE_SOCKET_BUFFERS);
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      vectors[i].iov_base = (char*) _dbus_string_get_const_data (buffers[i]);
+      vectors[i].iov_len = _dbus_string_get_length (buffers[i]);
+    }
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  _DBUS_ZERO(m);
+  m.msg_iov = vectors;
+  m.msg_iovlen = n_buffers;
+#endif
+
+ again:
+
+#if HAVE_DECL_MSG_NOSIGNAL
+  bytes_written = sendmsg (fd, &m, MSG_NOSIGNAL);
+#else
+  bytes_written = writev (fd, vectors, n_buffers);
+#endif
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+
+#else
+  int total;
+  int i;
+
+  _dbus_assert (n_buffers > 0);
+
+  total = 0;
+  for (i = 0; i < n_buffers; i++)
+    {
+      int len;
+      int bytes_written;
+
+      len = _dbus_string_get_length (buffers[i]);
+      bytes_written = _dbus_write (fd, buffers[i], 0, len);
+
+      if (bytes_written < 0)
+        return total > 0 ? total : -1;
+
+      total += bytes_written;
+
+      if (bytes_written < len)
+        break;
+    }
+
+  return total;
+#endif
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
@@ -4056,6 +4145,182 @@ _dbus_socket_can_pass_unix_fd(int fd) {
 #endif
 }
 
+/**
+ * Checks whether this build can create and map sealed memfds, as
+ * used to pass large message bodies.
+ *
+ * @returns #TRUE if sealed memfds are available
+ */
+dbus_bool_t
+_dbus_sealed_memfd_is_supported (void)
+{
+#ifdef DBUS_HAVE_SEALED_MEMFD
+  return TRUE;
+#else
+  return FALSE;
+#endif
+}
+
+#ifdef DBUS_HAVE_SEALED_MEMFD
+static dbus_bool_t
+write_all (int               fd,
+           const DBusString *buffer)
+{
+  int pos;
+  int len;
+
+  pos = 0;
+  len = _dbus_string_get_length (buffer);
+
+  while (pos < len)
+    {
+      int bytes_written;
+
+      bytes_written = _dbus_write (fd, buffer, pos, len - pos);
+      if (bytes_written < 0)
+        return FALSE;
+
+      pos += bytes_written;
+    }
+
+  return TRUE;
+}
+#endif
+
+/**
+ * Creates an anonymous memory file holding the given data, sealed
+ * so that it can't be written, grown or shrunk any more. The fd is
+ * close-on-exec.
+ *
+ * @param data1 the first part of the data
+ * @param data2 the rest of the data, or #NULL
+ * @param error return location for an error
+ * @returns the fd, or -1 with @p error set
+ */
+int
+_dbus_sealed_memfd_new (const DBusString *data1,
+                        const DBusString *data2,
+                        DBusError        *error)
+{
+#ifdef DBUS_HAVE_SEALED_MEMFD
+  int fd;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  fd = memfd_create ("dbus-message-body", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+  if (fd < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to create memfd: %s",
+                      _dbus_strerror (errno));
+      return -1;
+    }
+
+  if (!write_all (fd, data1) ||
+      (data2 != NULL && !write_all (fd, data2)) ||
+      fcntl (fd, F_ADD_SEALS, DBUS_MEMFD_SEALS | F_SEAL_SEAL) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to fill memfd: %s",
+                      _dbus_strerror (errno));
+      _dbus_close (fd, NULL);
+      return -1;
+    }
+
+  return fd;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memfds are not supported on this platform");
+  return -1;
+#endif
+}
+
+/**
+ * Maps a memfd read-only, after checking that it is sealed against
+ * modification so that what was validated can't change later.
+ * Unmap it again with _dbus_sealed_memfd_unmap().
+ *
+ * @param fd the memfd
+ * @param max_len the largest acceptable size
+ * @param data return location for the mapping
+ * @param len return location for the size, which is at least 1
+ * @param error return location for an error
+ * @returns #FALSE with @p error set if the fd can't be used
+ */
+dbus_bool_t
+_dbus_sealed_memfd_map (int          fd,
+                        int          max_len,
+                        const char **data,
+                        int         *len,
+                        DBusError   *error)
+{
+#ifdef DBUS_HAVE_SEALED_MEMFD
+  struct stat sb;
+  int seals;
+  void *map;
+
+  _DBUS_ASSERT_ERROR_IS_CLEAR (error);
+
+  seals = fcntl (fd, F_GET_SEALS);
+  if (seals < 0 || (seals & DBUS_MEMFD_SEALS) != DBUS_MEMFD_SEALS)
+    {
+      dbus_set_error (error, DBUS_ERROR_INVALID_ARGS,
+                      "File descriptor is not a sealed memfd");
+      return FALSE;
+    }
+
+  if (fstat (fd, &sb) < 0)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to stat memfd: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  if (sb.st_size <= 0 || sb.st_size > max_len)
+    {
+      dbus_set_error (error, DBUS_ERROR_LIMITS_EXCEEDED,
+                      "memfd size %ld is out of range",
+                      (long) sb.st_size);
+      return FALSE;
+    }
+
+  map = mmap (NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    {
+      dbus_set_error (error, _dbus_error_from_errno (errno),
+                      "Failed to map memfd: %s",
+                      _dbus_strerror (errno));
+      return FALSE;
+    }
+
+  *data = map;
+  *len = sb.st_size;
+  return TRUE;
+#else
+  dbus_set_error (error, DBUS_ERROR_NOT_SUPPORTED,
+                  "Sealed memfds are not supported on this platform");
+  return FALSE;
+#endif
+}
+
+/**
+ * Unmaps a memfd mapped with _dbus_sealed_memfd_map().
+ *
+ * @param data the mapping
+ * @param len its size
+ */
+void
+_dbus_sealed_memfd_unmap (const char *data,
+                          int         len)
+{
+#ifdef DBUS_HAVE_SEALED_MEMFD
+  munmap ((void *) data, len);
+#else
+  _dbus_assert_not_reached ("nothing can have been mapped");
+#endif
+}
+
 
 /*
  * replaces the term DBUS_PREFIX in configure_time_path by the
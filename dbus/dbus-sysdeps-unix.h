@@ -63,6 +63,18 @@ _dbus_write_two (int               fd,
                  int               start2,
                  int               len2);
 
+dbus_bool_t _dbus_sealed_memfd_is_supported (void);
+int         _dbus_sealed_memfd_new          (const DBusString *data1,
+                                             const DBusString *data2,
+                                             DBusError        *error);
+dbus_bool_t _dbus_sealed_memfd_map          (int               fd,
+                                             int               max_len,
+                                             const char      **data,
+                                             int              *len,
+                                             DBusError        *error);
+void        _dbus_sealed_memfd_unmap        (const char       *data,
+                                             int               len);
+
 int _dbus_connect_unix_socket (const char     *path,
                                dbus_bool_t     abstract,
                                DBusError      *error);
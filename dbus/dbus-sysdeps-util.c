@@ -29,6 +29,7 @@
 #include "dbus-test.h"
 
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef DBUS_WIN
   /* do nothing, it's in stdlib.h */
@@ -123,6 +124,62 @@ check_path_absolute (const char *path,
     }
 }
 
+static void
+check_write_socket_many (void)
+{
+  const char *expected = "Hello, socket world";
+  DBusString parts[3];
+  const DBusString *buffers[3];
+  DBusString got;
+  DBusError error;
+  int fd1, fd2;
+  int len;
+
+  dbus_error_init (&error);
+  if (!_dbus_full_duplex_pipe (&fd1, &fd2, TRUE, &error))
+    {
+      _dbus_warn ("Could not create socket pair: %s\n", error.message);
+      exit (1);
+    }
+
+  _dbus_string_init_const (&parts[0], "Hello, ");
+  _dbus_string_init_const (&parts[1], "socket");
+  _dbus_string_init_const (&parts[2], " world");
+  buffers[0] = &parts[0];
+  buffers[1] = &parts[1];
+  buffers[2] = &parts[2];
+
+  len = strlen (expected);
+  if (_dbus_write_socket_many (fd1, buffers, 3) != len)
+    {
+      _dbus_warn ("Writing several buffers at once failed\n");
+      exit (1);
+    }
+
+  if (!_dbus_string_init (&got))
+    _dbus_assert_not_reached ("no memory");
+
+  while (_dbus_string_get_length (&got) < len)
+    {
+      if (_dbus_read_socket (fd2, &got, len - _dbus_string_get_length (&got)) <= 0)
+        {
+          _dbus_warn ("Reading back the buffers failed\n");
+          exit (1);
+        }
+    }
+
+  if (!_dbus_string_equal_c_str (&got, expected))
+    {
+      _dbus_warn ("Expected \"%s\" got \"%s\"\n",
+                  expected, _dbus_string_get_const_data (&got));
+      exit (1);
+    }
+
+  _dbus_string_free (&got);
+  _dbus_close_socket (fd1, NULL);
+  _dbus_close_socket (fd2, NULL);
+}
+
 /**
  * Unit test for dbus-sysdeps.c.
  * 
@@ -193,6 +250,8 @@ _dbus_sysdeps_test (void)
   check_path_absolute ("foo", FALSE);
   check_path_absolute ("foo/bar", FALSE);
 #endif
+
+  check_write_socket_many ();
   
   return TRUE;
 }
@@ -449,6 +449,61 @@ _dbus_write_socket_two (int               fd,
   return bytes_written;
 }
 
+/**
+ * Like _dbus_write_socket_two() but for any number of whole buffers,
+ * up to #_DBUS_MAX_WRITE_SOCKET_BUFFERS, so that several small
+ * messages can be written with one system call.
+ *
+ * @param fd the file descriptor
+ * @param buffers the buffers to write, in order
+ * @param n_buffers number of buffers
+ * @returns total bytes written from all buffers, or -1 on error
+ */
+int
+_dbus_write_socket_many (int                fd,
+                         const DBusString **buffers,
+                         int                n_buffers)
+{
+  WSABUF vectors[_DBUS_MAX_WRITE_SOCKET_BUFFERS];
+  int rc;
+  int i;
+  DWORD bytes_written;
+
+  _dbus_assert (n_buffers > 0);
+  _dbus_assert (n_buffers <= _DBUS_MAX_WRITE_SOCKET_BUFFERS);
+
+  for (i = 0; i < n_buffers; i++)
+    {
+      vectors[i].buf = (char*) _dbus_string_get_const_data (buffers[i]);
+      vectors[i].len = _dbus_string_get_length (buffers[i]);
+    }
+
+ again:
+
+  _dbus_verbose ("WSASend: %d buffers fd=%d\n", n_buffers, fd);
+  rc = WSASend (fd,
+                vectors,
+                n_buffers,
+                &bytes_written,
+                0,
+                NULL,
+                NULL);
+
+  if (rc == SOCKET_ERROR)
+    {
+      DBUS_SOCKET_SET_ERRNO ();
+      _dbus_verbose ("WSASend: failed: %s\n", _dbus_strerror_from_errno ());
+      bytes_written = -1;
+    }
+  else
+    _dbus_verbose ("WSASend: = %ld\n", bytes_written);
+
+  if (bytes_written < 0 && errno == EINTR)
+    goto again;
+
+  return bytes_written;
+}
+
 dbus_bool_t
 _dbus_socket_is_invalid (int fd)
 {
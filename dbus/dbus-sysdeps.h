@@ -143,6 +143,13 @@ int         _dbus_write_socket_two (int               fd,
                                     int               start2,
                                     int               len2);
 
+/** Most buffers _dbus_write_socket_many() can write at once */
+#define _DBUS_MAX_WRITE_SOCKET_BUFFERS 64
+
+int         _dbus_write_socket_many (int                fd,
+                                     const DBusString **buffers,
+                                     int                n_buffers);
+
 int _dbus_read_socket_with_unix_fds      (int               fd,
                                           DBusString       *buffer,
                                           int               count,
@@ -69,6 +69,8 @@ void         _dbus_condvar_wake_one          (DBusCondVar       *cond);
 void         _dbus_condvar_new_at_location   (DBusCondVar      **location_p);
 void         _dbus_condvar_free_at_location  (DBusCondVar      **location_p);
 
+unsigned int _dbus_current_thread_hash       (void);
+
 /* Private to threading implementations and dbus-threads.c */
 
 DBusRMutex  *_dbus_platform_rmutex_new       (void);
@@ -498,12 +498,19 @@ init_locks (void)
     LOCK_ADDR (message_slots),
 #if !DBUS_USE_SYNC
     LOCK_ADDR (atomic),
+#endif
+#ifdef DBUS_ENABLE_STATS
+    LOCK_ADDR (stats),
 #endif
     LOCK_ADDR (bus),
     LOCK_ADDR (bus_datas),
     LOCK_ADDR (shutdown_funcs),
     LOCK_ADDR (system_users),
-    LOCK_ADDR (message_cache),
+    LOCK_ADDR (message_cache_0),
+    LOCK_ADDR (message_cache_1),
+    LOCK_ADDR (message_cache_2),
+    LOCK_ADDR (message_cache_3),
+    LOCK_ADDR (message_body_fd),
     LOCK_ADDR (shared_connections),
     LOCK_ADDR (machine_uuid)
 #undef LOCK_ADDR
@@ -29,6 +29,9 @@
 #include "dbus-transport-protected.h"
 #include "dbus-watch.h"
 #include "dbus-credentials.h"
+#ifdef HAVE_UNIX_FD_PASSING
+#include "dbus-sysdeps-unix.h"
+#endif
 
 /**
  * @defgroup DBusTransportSocket DBusTransport implementations for sockets
@@ -66,6 +69,15 @@ struct DBusTransportSocket
   DBusString encoded_incoming;          /**< Encoded version of current
                                          *   incoming data.
                                          */
+  DBusString memfd_header;              /**< Header of current outgoing
+                                         *   message if its body goes
+                                         *   in a memfd.
+                                         */
+  int *memfd_fds;                       /**< Fds to send with memfd_header,
+                                         *   or #NULL if the body is sent
+                                         *   normally.
+                                         */
+  unsigned n_memfd_fds;                 /**< Number of memfd_fds */
 };
 
 static void
@@ -109,6 +121,8 @@ socket_finalize (DBusTransport *transport)
 
   _dbus_string_free (&socket_transport->encoded_outgoing);
   _dbus_string_free (&socket_transport->encoded_incoming);
+  _dbus_string_free (&socket_transport->memfd_header);
+  dbus_free (socket_transport->memfd_fds);
   
   _dbus_transport_finalize_base (transport);
 
@@ -489,6 +503,165 @@ do_authentication (DBusTransport *transport,
     return TRUE;
 }
 
+#ifdef HAVE_UNIX_FD_PASSING
+static void
+clear_memfd_body (DBusTransportSocket *socket_transport)
+{
+  dbus_free (socket_transport->memfd_fds);
+  socket_transport->memfd_fds = NULL;
+  socket_transport->n_memfd_fds = 0;
+  _dbus_string_set_length (&socket_transport->memfd_header, 0);
+  _dbus_string_compact (&socket_transport->memfd_header, 2048);
+}
+
+/* Sets up memfd_header and memfd_fds if the message's body should go
+ * in a memfd. Failing just means the body is written normally.
+ */
+static void
+prepare_memfd_body (DBusTransportSocket *socket_transport,
+                    DBusMessage         *message)
+{
+  const int *unix_fds;
+  unsigned n;
+  int body_fd;
+  long max_unix_fds;
+
+  _dbus_assert (socket_transport->memfd_fds == NULL);
+
+  max_unix_fds =
+    _dbus_transport_get_max_message_unix_fds (&socket_transport->base);
+
+  if (!_dbus_message_get_body_fd_network_data (message, max_unix_fds,
+                                               &socket_transport->memfd_header,
+                                               &body_fd))
+    return;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+
+  socket_transport->memfd_fds = dbus_new (int, n + 1);
+  if (socket_transport->memfd_fds == NULL)
+    {
+      clear_memfd_body (socket_transport);
+      return;
+    }
+
+  if (n > 0)
+    memcpy (socket_transport->memfd_fds, unix_fds, n * sizeof (unix_fds[0]));
+  socket_transport->memfd_fds[n] = body_fd;
+  socket_transport->n_memfd_fds = n + 1;
+}
+#endif
+
+/**
+ * Messages at most this large may be written together with the ones
+ * queued after them; bigger ones gain nothing from it.
+ */
+#define MAX_COALESCED_MESSAGE_SIZE 4096
+
+/* Whether a message can be written as just its header and body, with
+ * no fds, external bytes or memfd body to take care of.
+ */
+static dbus_bool_t
+message_can_coalesce (DBusMessage *message)
+{
+  const DBusString *header;
+  const DBusString *body;
+  const DBusString *external;
+#ifdef HAVE_UNIX_FD_PASSING
+  const int *unix_fds;
+  unsigned n;
+
+  _dbus_message_get_unix_fds (message, &unix_fds, &n);
+  if (n > 0)
+    return FALSE;
+#endif
+
+  _dbus_message_get_external_data (message, &external);
+  if (external != NULL)
+    return FALSE;
+
+  _dbus_message_get_network_data (message, &header, &body);
+
+  return _dbus_string_get_length (header) +
+    _dbus_string_get_length (body) <= MAX_COALESCED_MESSAGE_SIZE;
+}
+
+/* Finds the small messages at the head of the outgoing queue that can
+ * be written together, and their buffers. Returns the number of
+ * messages, which is only worth it if more than one. The size of a
+ * coalesced write is bounded by the number of buffers, rather than
+ * by max_bytes_written_per_iteration, so that a batch of signals
+ * goes out at once.
+ */
+static int
+gather_coalesced_messages (DBusTransport     *transport,
+                           DBusMessage      **messages,
+                           const DBusString **buffers,
+                           int               *n_buffers)
+{
+  int n_messages;
+  int n_coalesced;
+  int i;
+
+  n_messages =
+    _dbus_connection_get_messages_to_send (transport->connection, messages,
+                                           _DBUS_MAX_WRITE_SOCKET_BUFFERS / 2);
+
+  n_coalesced = 0;
+  *n_buffers = 0;
+  for (i = 0; i < n_messages; i++)
+    {
+      const DBusString *header;
+      const DBusString *body;
+
+      dbus_message_lock (messages[i]);
+      if (!message_can_coalesce (messages[i]))
+        break;
+
+      _dbus_message_get_network_data (messages[i], &header, &body);
+
+      buffers[(*n_buffers)++] = header;
+      if (_dbus_string_get_length (body) > 0)
+        buffers[(*n_buffers)++] = body;
+
+      n_coalesced += 1;
+    }
+
+  return n_coalesced;
+}
+
+/* Marks the messages written by a coalesced write as sent, and records
+ * how much of the first one that wasn't fully written got out.
+ */
+static void
+coalesced_messages_written (DBusTransportSocket *socket_transport,
+                            DBusMessage        **messages,
+                            int                  n_messages,
+                            int                  bytes_written)
+{
+  int i;
+
+  for (i = 0; i < n_messages && bytes_written > 0; i++)
+    {
+      const DBusString *header;
+      const DBusString *body;
+      int len;
+
+      _dbus_message_get_network_data (messages[i], &header, &body);
+      len = _dbus_string_get_length (header) + _dbus_string_get_length (body);
+
+      if (bytes_written < len)
+        {
+          socket_transport->message_bytes_written = bytes_written;
+          break;
+        }
+
+      bytes_written -= len;
+      _dbus_connection_message_sent_unlocked (socket_transport->base.connection,
+                                              messages[i]);
+    }
+}
+
 /* returns false on oom */
 static dbus_bool_t
 do_writing (DBusTransport *transport)
@@ -526,7 +699,8 @@ do_writing (DBusTransport *transport)
       DBusMessage *message;
       const DBusString *header;
       const DBusString *body;
-      int header_len, body_len;
+      const DBusString *external;
+      int header_len, body_len, external_len;
       int total_bytes_to_write;
       
       if (total > socket_transport->max_bytes_written_per_iteration)
@@ -535,6 +709,46 @@ do_writing (DBusTransport *transport)
                          total, socket_transport->max_bytes_written_per_iteration);
           goto out;
         }
+
+      /* Write a run of small messages, such as a burst of signals,
+       * with one system call rather than one each
+       */
+      if (socket_transport->message_bytes_written <= 0 &&
+          !_dbus_auth_needs_encoding (transport->auth))
+        {
+          DBusMessage *messages[_DBUS_MAX_WRITE_SOCKET_BUFFERS / 2];
+          const DBusString *buffers[_DBUS_MAX_WRITE_SOCKET_BUFFERS];
+          int n_messages;
+          int n_buffers;
+
+          n_messages =
+            gather_coalesced_messages (transport, messages, buffers, &n_buffers);
+
+          if (n_messages > 1)
+            {
+              bytes_written = _dbus_write_socket_many (socket_transport->fd,
+                                                       buffers, n_buffers);
+
+              if (bytes_written < 0)
+                {
+                  if (_dbus_get_is_errno_eagain_or_ewouldblock () || _dbus_get_is_errno_epipe ())
+                    goto out;
+
+                  _dbus_verbose ("Error writing to remote app: %s\n",
+                                 _dbus_strerror_from_errno ());
+                  do_io_error (transport);
+                  goto out;
+                }
+
+              _dbus_verbose (" wrote %d bytes of %d coalesced messages\n",
+                             bytes_written, n_messages);
+
+              total += bytes_written;
+              coalesced_messages_written (socket_transport, messages, n_messages,
+                                          bytes_written);
+              continue;
+            }
+        }
       
       message = _dbus_connection_get_message_to_send (transport->connection);
       _dbus_assert (message != NULL);
@@ -546,9 +760,11 @@ do_writing (DBusTransport *transport)
       
       _dbus_message_get_network_data (message,
                                       &header, &body);
+      _dbus_message_get_external_data (message, &external);
 
       header_len = _dbus_string_get_length (header);
       body_len = _dbus_string_get_length (body);
+      external_len = external ? _dbus_string_get_length (external) : 0;
 
       if (_dbus_auth_needs_encoding (transport->auth))
         {
@@ -565,7 +781,10 @@ do_writing (DBusTransport *transport)
                 }
               
               if (!_dbus_auth_encode_data (transport->auth,
-                                           body, &socket_transport->encoded_outgoing))
+                                           body, &socket_transport->encoded_outgoing) ||
+                  (external != NULL &&
+                   !_dbus_auth_encode_data (transport->auth,
+                                            external, &socket_transport->encoded_outgoing)))
                 {
                   _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
                   oom = TRUE;
@@ -588,7 +807,7 @@ do_writing (DBusTransport *transport)
         }
       else
         {
-          total_bytes_to_write = header_len + body_len;
+          total_bytes_to_write = header_len + body_len + external_len;
 
 #if 0
           _dbus_verbose ("message is %d bytes\n",
@@ -596,7 +815,33 @@ do_writing (DBusTransport *transport)
 #endif
 
 #ifdef HAVE_UNIX_FD_PASSING
-          if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
+          if (socket_transport->message_bytes_written <= 0 &&
+              socket_transport->memfd_fds == NULL &&
+              DBUS_TRANSPORT_CAN_SEND_MEMFD_BODY(transport))
+            prepare_memfd_body (socket_transport, message);
+
+          if (socket_transport->memfd_fds != NULL)
+            {
+              /* The body is in a memfd, so only the header goes on the socket */
+              total_bytes_to_write =
+                _dbus_string_get_length (&socket_transport->memfd_header);
+
+              if (socket_transport->message_bytes_written <= 0)
+                bytes_written =
+                  _dbus_write_socket_with_unix_fds (socket_transport->fd,
+                                                    &socket_transport->memfd_header,
+                                                    0, total_bytes_to_write,
+                                                    socket_transport->memfd_fds,
+                                                    socket_transport->n_memfd_fds);
+              else
+                bytes_written =
+                  _dbus_write_socket (socket_transport->fd,
+                                      &socket_transport->memfd_header,
+                                      socket_transport->message_bytes_written,
+                                      total_bytes_to_write -
+                                      socket_transport->message_bytes_written);
+            }
+          else if (socket_transport->message_bytes_written <= 0 && DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
             {
               /* Send the fds along with the first byte of the message */
               const int *unix_fds;
@@ -630,14 +875,26 @@ do_writing (DBusTransport *transport)
                                             body,
                                             0, body_len);
                 }
+              else if (socket_transport->message_bytes_written < header_len + body_len)
+                {
+                  /* any external bytes go out from the caller's memory */
+                  bytes_written =
+                    _dbus_write_socket_two (socket_transport->fd,
+                                            body,
+                                            (socket_transport->message_bytes_written - header_len),
+                                            body_len -
+                                            (socket_transport->message_bytes_written - header_len),
+                                            external,
+                                            0, external_len);
+                }
               else
                 {
                   bytes_written =
                     _dbus_write_socket (socket_transport->fd,
-                                        body,
-                                        (socket_transport->message_bytes_written - header_len),
-                                        body_len -
-                                        (socket_transport->message_bytes_written - header_len));
+                                        external,
+                                        (socket_transport->message_bytes_written - header_len - body_len),
+                                        external_len -
+                                        (socket_transport->message_bytes_written - header_len - body_len));
                 }
             }
         }
@@ -676,6 +933,10 @@ do_writing (DBusTransport *transport)
               socket_transport->message_bytes_written = 0;
               _dbus_string_set_length (&socket_transport->encoded_outgoing, 0);
               _dbus_string_compact (&socket_transport->encoded_outgoing, 2048);
+#ifdef HAVE_UNIX_FD_PASSING
+              if (socket_transport->memfd_fds != NULL)
+                clear_memfd_body (socket_transport);
+#endif
 
               _dbus_connection_message_sent_unlocked (transport->connection,
                                                       message);
@@ -778,8 +1039,14 @@ do_reading (DBusTransport *transport)
     }
   else
     {
-      _dbus_message_loader_get_buffer (transport->loader,
-                                       &buffer);
+      int max_to_read;
+
+      /* For a large message, the loader may give us its body buffer,
+       * already allocated, and ask for more than we'd usually read
+       */
+      max_to_read = socket_transport->max_bytes_read_per_iteration;
+      _dbus_message_loader_get_read_buffer (transport->loader,
+                                            &buffer, &max_to_read);
 
 #ifdef HAVE_UNIX_FD_PASSING
       if (DBUS_TRANSPORT_CAN_SEND_UNIX_FD(transport))
@@ -796,7 +1063,7 @@ do_reading (DBusTransport *transport)
 
           bytes_read = _dbus_read_socket_with_unix_fds(socket_transport->fd,
                                                        buffer,
-                                                       socket_transport->max_bytes_read_per_iteration,
+                                                       max_to_read,
                                                        fds, &n_fds);
 
           if (bytes_read >= 0 && n_fds > 0)
@@ -808,7 +1075,7 @@ do_reading (DBusTransport *transport)
 #endif
         {
           bytes_read = _dbus_read_socket (socket_transport->fd,
-                                          buffer, socket_transport->max_bytes_read_per_iteration);
+                                          buffer, max_to_read);
         }
 
       _dbus_message_loader_return_buffer (transport->loader,
@@ -1244,13 +1511,16 @@ _dbus_transport_new_for_socket (int               fd,
 
   if (!_dbus_string_init (&socket_transport->encoded_incoming))
     goto failed_1;
+
+  if (!_dbus_string_init (&socket_transport->memfd_header))
+    goto failed_2;
   
   socket_transport->write_watch = _dbus_watch_new (fd,
                                                  DBUS_WATCH_WRITABLE,
                                                  FALSE,
                                                  NULL, NULL, NULL);
   if (socket_transport->write_watch == NULL)
-    goto failed_2;
+    goto failed_5;
   
   socket_transport->read_watch = _dbus_watch_new (fd,
                                                 DBUS_WATCH_READABLE,
@@ -1266,6 +1536,9 @@ _dbus_transport_new_for_socket (int               fd,
 
 #ifdef HAVE_UNIX_FD_PASSING
   _dbus_auth_set_unix_fd_possible(socket_transport->base.auth, _dbus_socket_can_pass_unix_fd(fd));
+  _dbus_auth_set_memfd_body_possible (socket_transport->base.auth,
+                                      _dbus_socket_can_pass_unix_fd (fd) &&
+                                      _dbus_sealed_memfd_is_supported ());
 #endif
 
   socket_transport->fd = fd;
@@ -1283,6 +1556,8 @@ _dbus_transport_new_for_socket (int               fd,
  failed_3:
   _dbus_watch_invalidate (socket_transport->write_watch);
   _dbus_watch_unref (socket_transport->write_watch);
+ failed_5:
+  _dbus_string_free (&socket_transport->memfd_header);
  failed_2:
   _dbus_string_free (&socket_transport->encoded_incoming);
  failed_1:
@@ -1436,3 +1711,212 @@ _dbus_transport_open_socket(DBusAddressEntry  *entry,
 
 /** @} */
 
+
+#if defined(DBUS_BUILD_TESTS) && defined(DBUS_UNIX)
+#include "dbus-test.h"
+#include <sys/socket.h>
+
+#define BATCH_TEST_SIZE 32
+#define BATCH_TEST_TEXT_LEN 1000
+
+typedef struct
+{
+  DBusConnection *client;
+  DBusConnection *server;
+  DBusTransportSocket *client_transport;
+  dbus_bool_t saw_partial_write;
+} BatchTestData;
+
+static DBusMessage *
+new_batch_test_message (int i)
+{
+  DBusMessage *message;
+  dbus_int32_t v_INT32;
+  char text[BATCH_TEST_TEXT_LEN + 1];
+  const char *v_STRING;
+
+  message = dbus_message_new_signal ("/org/freedesktop/TestPath",
+                                     "org.freedesktop.TestInterface",
+                                     "Batch");
+  if (message == NULL)
+    return NULL;
+
+  memset (text, 'a' + i % 26, BATCH_TEST_TEXT_LEN);
+  text[BATCH_TEST_TEXT_LEN] = '\0';
+
+  v_INT32 = i;
+  v_STRING = text;
+
+  if (!dbus_message_append_args (message,
+                                 DBUS_TYPE_INT32, &v_INT32,
+                                 DBUS_TYPE_STRING, &v_STRING,
+                                 DBUS_TYPE_INVALID))
+    {
+      dbus_message_unref (message);
+      return NULL;
+    }
+
+  return message;
+}
+
+/* Runs both ends until the server has received a whole batch, checking
+ * that it arrives intact and in order
+ */
+static void
+receive_batch (BatchTestData       *d,
+               const dbus_uint32_t *serials)
+{
+  DBusMessage *message;
+  DBusError error;
+  dbus_int32_t v_INT32;
+  const char *v_STRING;
+  int n_received;
+
+  n_received = 0;
+  while (n_received < BATCH_TEST_SIZE)
+    {
+      if (!dbus_connection_read_write (d->client, 0) ||
+          !dbus_connection_read_write (d->server, 0))
+        _dbus_assert_not_reached ("batch test connection closed");
+
+      if (d->client_transport->message_bytes_written > 0)
+        d->saw_partial_write = TRUE;
+
+      while ((message = dbus_connection_pop_message (d->server)) != NULL)
+        {
+          dbus_error_init (&error);
+
+          if (!dbus_message_get_args (message, &error,
+                                      DBUS_TYPE_INT32, &v_INT32,
+                                      DBUS_TYPE_STRING, &v_STRING,
+                                      DBUS_TYPE_INVALID))
+            {
+              _dbus_warn ("Could not read batch message: %s\n", error.message);
+              _dbus_assert_not_reached ("could not read batch message");
+            }
+
+          if (v_INT32 != n_received ||
+              dbus_message_get_serial (message) != serials[n_received])
+            {
+              _dbus_warn ("Got message %d with serial %u, expected %d with serial %u\n",
+                          v_INT32, dbus_message_get_serial (message),
+                          n_received, serials[n_received]);
+              _dbus_assert_not_reached ("batch arrived out of order");
+            }
+
+          if (strlen (v_STRING) != BATCH_TEST_TEXT_LEN ||
+              v_STRING[0] != 'a' + v_INT32 % 26 ||
+              v_STRING[BATCH_TEST_TEXT_LEN - 1] != 'a' + v_INT32 % 26)
+            _dbus_assert_not_reached ("batch message was corrupted");
+
+          dbus_message_unref (message);
+          n_received += 1;
+        }
+    }
+
+  _dbus_assert (!dbus_connection_has_messages_to_send (d->client));
+  _dbus_assert (d->client_transport->message_bytes_written == 0);
+}
+
+static dbus_bool_t
+check_send_batch (void *data)
+{
+  BatchTestData *d = data;
+  DBusMessage *messages[BATCH_TEST_SIZE];
+  dbus_uint32_t serials[BATCH_TEST_SIZE];
+  int i, n;
+
+  for (n = 0; n < BATCH_TEST_SIZE; n++)
+    {
+      messages[n] = new_batch_test_message (n);
+      if (messages[n] == NULL)
+        break;
+    }
+
+  if (n == BATCH_TEST_SIZE)
+    {
+      if (dbus_connection_send_batch (d->client, messages, n, serials))
+        {
+          for (i = 1; i < n; i++)
+            _dbus_assert (serials[i] == serials[i - 1] + 1);
+
+          receive_batch (d, serials);
+        }
+      else
+        {
+          /* out of memory, and nothing may have been queued */
+          _dbus_assert (!dbus_connection_has_messages_to_send (d->client));
+        }
+    }
+
+  for (i = 0; i < n; i++)
+    dbus_message_unref (messages[i]);
+
+  return TRUE;
+}
+
+/**
+ * Checks that a batch of messages sent with
+ * dbus_connection_send_batch() and written together arrives whole and
+ * in order, when the socket only takes part of it at a time and when
+ * memory runs out.
+ */
+dbus_bool_t
+_dbus_transport_socket_test (void)
+{
+  BatchTestData d;
+  DBusTransport *client_transport, *server_transport;
+  DBusString address, guid;
+  int client_fd, server_fd, sndbuf;
+
+  _dbus_string_init_const (&address, "debug-pipe:name=send-batch-test");
+  _dbus_string_init_const (&guid, "0123456789abcdef0123456789abcdef");
+
+  if (!_dbus_full_duplex_pipe (&client_fd, &server_fd, FALSE, NULL))
+    _dbus_assert_not_reached ("could not create socket pair");
+
+  /* make the socket fill up partway through the batch */
+  sndbuf = 4096;
+  if (setsockopt (client_fd, SOL_SOCKET, SO_SNDBUF,
+                  &sndbuf, sizeof (sndbuf)) < 0)
+    _dbus_assert_not_reached ("could not shrink the socket buffer");
+
+  client_transport = _dbus_transport_new_for_socket (client_fd, NULL, &address);
+  server_transport = _dbus_transport_new_for_socket (server_fd, &guid, NULL);
+  if (client_transport == NULL || server_transport == NULL)
+    _dbus_assert_not_reached ("no memory for transports");
+
+  d.client = _dbus_connection_new_for_transport (client_transport);
+  d.server = _dbus_connection_new_for_transport (server_transport);
+  if (d.client == NULL || d.server == NULL)
+    _dbus_assert_not_reached ("no memory for connections");
+
+  d.client_transport = (DBusTransportSocket *) client_transport;
+  d.saw_partial_write = FALSE;
+  _dbus_transport_unref (client_transport);
+  _dbus_transport_unref (server_transport);
+
+  while (!dbus_connection_get_is_authenticated (d.client) ||
+         !dbus_connection_get_is_authenticated (d.server))
+    {
+      if (!dbus_connection_read_write (d.client, 0) ||
+          !dbus_connection_read_write (d.server, 0))
+        _dbus_assert_not_reached ("could not authenticate");
+    }
+
+  if (!check_send_batch (&d))
+    _dbus_assert_not_reached ("sending a batch failed");
+
+  _dbus_assert (d.saw_partial_write);
+
+  if (!_dbus_test_oom_handling ("sending a batch", check_send_batch, &d))
+    _dbus_assert_not_reached ("sending a batch failed during oom");
+
+  dbus_connection_close (d.client);
+  dbus_connection_close (d.server);
+  dbus_connection_unref (d.client);
+  dbus_connection_unref (d.server);
+
+  return TRUE;
+}
+#endif /* DBUS_BUILD_TESTS && DBUS_UNIX */
@@ -781,6 +781,10 @@ _dbus_transport_get_is_authenticated (DBusTransport *transport)
 
       transport->authenticated = maybe_authenticated;
 
+      if (maybe_authenticated)
+        _dbus_message_loader_set_accept_body_memfds (transport->loader,
+                                                     _dbus_auth_get_memfd_body_negotiated (transport->auth));
+
       _dbus_connection_unref_unlocked (transport->connection);
       return maybe_authenticated;
     }
@@ -0,0 +1,29 @@
+/* This is a process that exits with a failure code unless it was
+ * started with default handling of the signals the bus daemon and
+ * its helpers ignore or catch
+ */
+#include <signal.h>
+#include <stddef.h>
+
+static int
+is_default (int signo)
+{
+  struct sigaction action;
+
+  if (sigaction (signo, NULL, &action) != 0)
+    return 0;
+
+  return action.sa_handler == SIG_DFL;
+}
+
+int
+main (int argc, char **argv)
+{
+  if (!is_default (SIGHUP) ||
+      !is_default (SIGPIPE) ||
+      !is_default (SIGCHLD) ||
+      !is_default (SIGTERM))
+    return 1;
+
+  return 0;
+}